@@ -6,450 +6,9667 @@
 #include <iostream>
 #include <cmath>
 #include <vector>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <chrono>
+#include <ctime>
+#include <algorithm>
+#include <cerrno>
+#include <cctype>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+
+#ifdef OKAMI_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 const int WIDTH = 1280;
 const int HEIGHT = 720;
 
-int currentStage = 0;
-const int MAX_STAGES = 5;
-float rotationAngle = 0.0f;
+const float FIELD_OF_VIEW = 45.0f;
+const float NEAR_PLANE = 0.1f;
+const float FAR_PLANE = 100.0f;
+
+int currentStage = 0;                   // drawn by the render loop; input goes to the update thread
+const int MAX_STAGES = 5;
+float rotationAngle = 0.0f;
+
+glm::vec3 cameraPos = glm::vec3(0.0f, 0.5f, 3.0f);
+glm::vec3 cameraTarget = glm::vec3(0.0f, 0.0f, 0.0f);
+
+// Mouse control variables
+bool mousePressed = false;
+double lastMouseX = 0.0;
+double lastMouseY = 0.0;
+
+// Outline technique for stages 2-5 (O toggles)
+enum OutlineMode {
+    OUTLINE_SCREEN,     // deferred edge detect + jump-flood ink strokes
+    OUTLINE_RIM         // original per-fragment rim test
+};
+OutlineMode outlineMode = OUTLINE_SCREEN;
+
+// Instanced crowd (C toggles); 0 draws the single egg
+int crowdSize = 0;
+int crowdOption = 1000;
+float crowdSpread = 1.0f;               // grid extent over the default, member size kept
+float crowdMoving = 0.0f;               // fraction of members that hop in stage 5
+bool crowdCulling = true;               // BVH frustum culling + multi-draw indirect (K toggles)
+
+// Lanterns lit through clustered light lists (L toggles); 0 is the key light only
+int lanternCount = 0;
+int lanternOption = 64;
+bool lightClusters = true;              // false: one cluster, every pixel walks every visible lantern
+
+// Stage 4 paper grain (P toggles)
+enum PaperMode {
+    PAPER_TEXTURE,      // precomputed tileable texture fixed to the screen
+    PAPER_HASH          // original per-fragment sin hash on FragPos
+};
+PaperMode paperMode = PAPER_TEXTURE;
+unsigned int paperSeed = 1;
+const int PAPER_SIZE = 256;
+const int PAPER_LEVELS = 9;             // 256x256 down to 1x1
+
+// Stage 3-4 tomoe markings (T toggles)
+enum TomoeMode {
+    TOMOE_ATLAS,        // baked signed distance atlas, anti-aliased
+    TOMOE_ANALYTIC      // original per-fragment pattern functions
+};
+TomoeMode tomoeMode = TOMOE_ATLAS;
+GLuint tomoeAtlasTexture = 0;           // 0 until the bake is uploaded
+
+// Main loop pacing (M toggles the mode)
+enum RenderMode {
+    RENDER_ON_DEMAND,   // redraw only when the view changed or animates
+    RENDER_CONTINUOUS   // redraw every iteration, as the swap interval allows
+};
+RenderMode renderMode = RENDER_ON_DEMAND;
+int swapInterval = 1;                   // --swap-interval; 0 = no vsync
+int targetFps = 0;                      // --target-fps for animation; 0 = swap interval only
+
+// Dynamic resolution (D toggles): the demo draws the scene at a fraction
+// of the framebuffer size that follows the GPU frame time
+bool dynamicResolution = true;
+float gpuBudgetMs = 14.0f;              // --gpu-budget
+float minRenderScale = 0.5f;            // --min-scale
+float fixedRenderScale = 1.0f;          // --render-scale: demo without adaptation, benchmark, turntable
+float sceneResolutionScale = 1.0f;      // scene pixels per output pixel of the frame being drawn
+int framebufferWidth = WIDTH;           // window framebuffer in pixels (HiDPI aware)
+int framebufferHeight = HEIGHT;
+
+// Anti-aliasing (A cycles)
+enum AntiAliasing {
+    AA_NONE,
+    AA_MSAA2,
+    AA_MSAA4,
+    AA_MSAA8,
+    AA_FXAA,            // luma edge blend over the finished frame
+    AA_ANALYTIC,        // cel, rim and tomoe thresholds widened to a pixel with fwidth
+    NUM_ANTI_ALIASING
+};
+AntiAliasing antiAliasing = AA_MSAA4;
+const struct {
+    const char* name;
+    int samples;
+} ANTI_ALIASING_MODES[NUM_ANTI_ALIASING] = {
+    { "none", 0 }, { "msaa2", 2 }, { "msaa4", 4 }, { "msaa8", 8 }, { "fxaa", 0 }, { "analytic", 0 }
+};
+
+// ─── Job system ───────────────────────────────────────────────────
+//
+// A small work-stealing pool for CPU work: mesh building, asset preparation
+// and per-frame crowd updates. Each thread owns a deque; it pushes and pops
+// at the back while idle threads steal from the front of the others. A
+// thread waiting on a JobCounter runs queued jobs meanwhile, so jobs may
+// wait on jobs they spawned. GL calls stay on the main thread: workers hand
+// finished results over through postGLUpload().
+
+struct JobCounter {
+    std::atomic<int> pending;
+    JobCounter() : pending(0) {}
+};
+
+struct Job {
+    std::function<void()> run;
+    JobCounter* counter;
+};
+
+struct WorkerQueue {
+    std::mutex mutex;
+    std::deque<Job> jobs;
+};
+
+struct JobSystem {
+    std::vector<std::thread> workers;
+    std::vector<WorkerQueue*> queues;   // queue 0 belongs to the main thread
+    std::atomic<bool> running;
+    std::atomic<int> queuedJobs;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    JobSystem() : running(false), queuedJobs(0) {}
+};
+
+JobSystem jobSystem;
+thread_local int jobQueueIndex = 0;
+int jobThreads = 0;                     // --threads; 0 = one per hardware thread
+
+bool popJob(int index, Job& job) {
+    int count = (int)jobSystem.queues.size();
+    for (int i = 0; i < count; ++i) {
+        int victim = (index + i) % count;
+        WorkerQueue& queue = *jobSystem.queues[victim];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.jobs.empty()) continue;
+        if (victim == index) {
+            job = queue.jobs.back();
+            queue.jobs.pop_back();
+        } else {
+            job = queue.jobs.front();
+            queue.jobs.pop_front();
+        }
+        --jobSystem.queuedJobs;
+        return true;
+    }
+    return false;
+}
+
+bool runOneJob() {
+    Job job;
+    if (!popJob(jobQueueIndex, job)) return false;
+    job.run();
+    job.counter->pending.fetch_sub(1, std::memory_order_release);
+    return true;
+}
+
+void workerLoop(int index) {
+    jobQueueIndex = index;
+    while (jobSystem.running) {
+        if (runOneJob()) continue;
+        std::unique_lock<std::mutex> lock(jobSystem.sleepMutex);
+        jobSystem.wake.wait(lock, [] { 
+            return !jobSystem.running || jobSystem.queuedJobs > 0; 
+        });
+    }
+}
+
+// threads counts the main thread, so 1 runs every job inline while waiting
+void startJobSystem(int threads) {
+    if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    jobSystem.running = true;
+    for (int i = 0; i < threads; ++i) {
+        jobSystem.queues.push_back(new WorkerQueue());
+    }
+    for (int i = 1; i < threads; ++i) {
+        jobSystem.workers.push_back(std::thread(workerLoop, i));
+    }
+}
+
+void stopJobSystem() {
+    {
+        std::lock_guard<std::mutex> lock(jobSystem.sleepMutex);
+        jobSystem.running = false;
+    }
+    jobSystem.wake.notify_all();
+    for (size_t i = 0; i < jobSystem.workers.size(); ++i) {
+        jobSystem.workers[i].join();
+    }
+    for (size_t i = 0; i < jobSystem.queues.size(); ++i) {
+        delete jobSystem.queues[i];
+    }
+    jobSystem.workers.clear();
+    jobSystem.queues.clear();
+}
+
+int jobThreadCount() {
+    return (int)jobSystem.queues.size();
+}
+
+void submitJob(const std::function<void()>& run, JobCounter& counter) {
+    counter.pending.fetch_add(1, std::memory_order_relaxed);
+    Job job;
+    job.run = run;
+    job.counter = &counter;
+    {
+        WorkerQueue& queue = *jobSystem.queues[jobQueueIndex];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.jobs.push_back(job);
+    }
+    ++jobSystem.queuedJobs;
+    // Taking the sleep mutex orders this against a worker checking its predicate
+    std::lock_guard<std::mutex> lock(jobSystem.sleepMutex);
+    jobSystem.wake.notify_one();
+}
+
+void waitForJobs(JobCounter& counter) {
+    while (counter.pending.load(std::memory_order_acquire) > 0) {
+        if (!runOneJob()) std::this_thread::yield();
+    }
+}
+
+int parallelChunks(int count, int grain) {
+    int chunks = (count + std::max(grain, 1) - 1) / std::max(grain, 1);
+    return std::max(1, std::min(chunks, jobThreadCount() * 4));
+}
+
+// Splits [0, count) into chunks of at least `grain` items, one job each,
+// and waits for all of them. body(chunk, begin, end) gets a dense chunk index.
+void parallelFor(int count, int grain, const std::function<void(int, int, int)>& body) {
+    int chunks = parallelChunks(count, grain);
+    if (chunks <= 1) {
+        if (count > 0) body(0, 0, count);
+        return;
+    }
+    JobCounter counter;
+    for (int c = 0; c < chunks; ++c) {
+        int begin = (int)((long long)count * c / chunks);
+        int end = (int)((long long)count * (c + 1) / chunks);
+        submitJob([&body, c, begin, end] { body(c, begin, end); }, counter);
+    }
+    waitForJobs(counter);
+}
+
+// Results bound for GL are pushed onto a lock-free list by any thread and
+// applied in submission order by the main thread, once per frame.
+struct GLUpload {
+    std::function<void()> apply;
+    GLUpload* next;
+};
+
+std::atomic<GLUpload*> glUploads(nullptr);
+bool wakeEventLoopOnUpload = false;     // set by the windowed demo before jobs start
+
+void postGLUpload(const std::function<void()>& apply) {
+    GLUpload* upload = new GLUpload;
+    upload->apply = apply;
+    upload->next = glUploads.load(std::memory_order_relaxed);
+    while (!glUploads.compare_exchange_weak(upload->next, upload, 
+                                            std::memory_order_release, std::memory_order_relaxed)) {
+    }
+    // A main loop blocked waiting for input should apply it now
+    if (wakeEventLoopOnUpload) glfwPostEmptyEvent();
+}
+
+int applyGLUploads() {
+    GLUpload* pending = glUploads.exchange(nullptr, std::memory_order_acquire);
+    GLUpload* ordered = nullptr;
+    while (pending) {
+        GLUpload* next = pending->next;
+        pending->next = ordered;
+        ordered = pending;
+        pending = next;
+    }
+    int applied = 0;
+    while (ordered) {
+        GLUpload* next = ordered->next;
+        ordered->apply();
+        delete ordered;
+        ordered = next;
+        ++applied;
+    }
+    return applied;
+}
+
+struct Vertex {
+    glm::vec3 position;
+    glm::vec3 normal;
+    glm::vec2 uv;       // body parameters: u around, v top to bottom
+};
+
+// GPU-side vertex layouts; the mesh builder always works on Vertex
+enum VertexFormat {
+    VERTEX_FLOAT,       // Vertex as is, 32 bytes
+    VERTEX_PACKED       // PackedVertex, 16 bytes
+};
+VertexFormat vertexFormat = VERTEX_FLOAT;
+
+// ─── Frame profiler ───────────────────────────────────────────────
+//
+// ProfileScope times a named CPU section on any thread and GpuProfileScope
+// times a GPU section on the main thread; with the profiler off each costs
+// one relaxed load and a branch. Finished CPU sections go into a lock-free
+// ring: a writer claims a slot with one fetch_add and publishes it with a
+// sequence number, which the reader checks before and after copying, so job
+// threads never take a lock. GPU sections write GL_TIMESTAMP queries into
+// one of two per-frame query sets. A set is read when it comes round again
+// two frames later, and if its results are still not available they are
+// dropped instead of waited on. The main thread folds the ring into
+// per-section history for the HUD and can dump it as a Chrome trace.
+
+const int PROFILE_RING_SIZE = 1 << 16;  // events; a power of two
+const int PROFILE_GPU_SCOPES = 32;      // GPU sections per frame
+const int PROFILE_GPU_FRAMES = 2;       // query sets in flight
+const int PROFILE_HISTORY = 120;        // frames kept for the HUD
+const int PROFILE_GPU_THREAD = 1000;    // trace track of GPU sections
+const int PROFILE_UPDATE_THREAD = 999;  // trace track of the update thread
+
+struct ProfileEvent {
+    std::atomic<unsigned long long> sequence;   // ring index + 1 once published
+    std::atomic<const char*> name;
+    std::atomic<long long> startNs;             // since profileEpoch
+    std::atomic<long long> durationNs;
+    std::atomic<int> thread;                    // job queue index or a PROFILE_*_THREAD track
+    std::atomic<unsigned> frame;
+};
+
+// A copy of one published event
+struct ProfileRecord {
+    const char* name;
+    long long startNs;
+    long long durationNs;
+    int thread;
+    unsigned frame;
+};
+
+std::atomic<bool> profilerEnabled(false);
+bool profilerHudVisible = false;        // H; --profile
+std::string traceOutputPath;            // --trace: written on exit
+int traceDumps = 0;
+std::chrono::steady_clock::time_point profileEpoch = std::chrono::steady_clock::now();
+ProfileEvent profileRing[PROFILE_RING_SIZE];
+std::atomic<unsigned long long> profileHead(0);
+std::atomic<unsigned> profileFrame(0);
+unsigned long long profileTail = 0;     // next event to fold into the history
+thread_local int profileTrack = -1;     // trace track of threads outside the job system
+
+long long profileNow() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - profileEpoch).count();
+}
+
+void recordProfileEvent(const char* name, long long startNs, long long durationNs, int thread,
+                        unsigned frame) {
+    unsigned long long index = profileHead.fetch_add(1, std::memory_order_relaxed);
+    ProfileEvent& event = profileRing[index & (PROFILE_RING_SIZE - 1)];
+    event.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    event.name.store(name, std::memory_order_relaxed);
+    event.startNs.store(startNs, std::memory_order_relaxed);
+    event.durationNs.store(durationNs, std::memory_order_relaxed);
+    event.thread.store(thread, std::memory_order_relaxed);
+    event.frame.store(frame, std::memory_order_relaxed);
+    event.sequence.store(index + 1, std::memory_order_release);
+}
+
+// False if the event is unpublished, being written or already overwritten
+bool readProfileEvent(unsigned long long index, ProfileRecord& record) {
+    const ProfileEvent& event = profileRing[index & (PROFILE_RING_SIZE - 1)];
+    if (event.sequence.load(std::memory_order_acquire) != index + 1) return false;
+    record.name = event.name.load(std::memory_order_relaxed);
+    record.startNs = event.startNs.load(std::memory_order_relaxed);
+    record.durationNs = event.durationNs.load(std::memory_order_relaxed);
+    record.thread = event.thread.load(std::memory_order_relaxed);
+    record.frame = event.frame.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return event.sequence.load(std::memory_order_relaxed) == index + 1;
+}
+
+struct ProfileScope {
+    const char* name;
+    long long start;
+    
+    explicit ProfileScope(const char* sectionName) : name(sectionName), start(-1) {
+        if (profilerEnabled.load(std::memory_order_relaxed)) start = profileNow();
+    }
+    ~ProfileScope() {
+        if (start < 0) return;
+        recordProfileEvent(name, start, profileNow() - start, 
+                           profileTrack >= 0 ? profileTrack : jobQueueIndex,
+                           profileFrame.load(std::memory_order_relaxed));
+    }
+};
+
+struct GpuQuerySet {
+    GLuint queries[2 * PROFILE_GPU_SCOPES];     // begin and end timestamp per section
+    const char* names[PROFILE_GPU_SCOPES];
+    int used = 0;
+    unsigned frame = 0;
+    GLint64 gpuBase = 0;                        // GL_TIMESTAMP at the start of the frame
+    long long cpuBase = 0;                      // profileNow() at the same moment
+    bool pending = false;
+};
+
+GpuQuerySet gpuQuerySets[PROFILE_GPU_FRAMES];
+int gpuQuerySet = 0;
+bool gpuFrameOpen = false;
+bool gpuQueriesCreated = false;
+unsigned long long gpuFramesDropped = 0;
+
+struct GpuProfileScope {
+    ProfileScope cpu;
+    int slot;
+    
+    explicit GpuProfileScope(const char* name) : cpu(name), slot(-1) {
+        if (!gpuFrameOpen || !profilerEnabled.load(std::memory_order_relaxed)) return;
+        GpuQuerySet& set = gpuQuerySets[gpuQuerySet];
+        if (set.used == PROFILE_GPU_SCOPES) return;
+        slot = set.used++;
+        set.names[slot] = name;
+        glQueryCounter(set.queries[2 * slot], GL_TIMESTAMP);
+    }
+    ~GpuProfileScope() {
+        if (slot >= 0) glQueryCounter(gpuQuerySets[gpuQuerySet].queries[2 * slot + 1], GL_TIMESTAMP);
+    }
+};
+
+// Timestamps finish in order, so the last one being available means all are
+void readGpuQuerySet(GpuQuerySet& set) {
+    set.pending = false;
+    if (set.used == 0) return;
+    GLint available = GL_FALSE;
+    glGetQueryObjectiv(set.queries[2 * set.used - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) {
+        ++gpuFramesDropped;
+        return;
+    }
+    for (int i = 0; i < set.used; ++i) {
+        GLint64 begin = 0, end = 0;
+        glGetQueryObjecti64v(set.queries[2 * i], GL_QUERY_RESULT, &begin);
+        glGetQueryObjecti64v(set.queries[2 * i + 1], GL_QUERY_RESULT, &end);
+        recordProfileEvent(set.names[i], set.cpuBase + (begin - set.gpuBase), end - begin,
+                           PROFILE_GPU_THREAD, set.frame);
+    }
+}
+
+// Per-section history for the HUD, in order of first appearance
+struct ProfileSection {
+    const char* name;
+    double cpuMs[PROFILE_HISTORY];
+    double gpuMs[PROFILE_HISTORY];
+    bool gpu;                           // has ever had a GPU sample
+};
+
+std::vector<ProfileSection> profileSections;
+long long profileFrameStart = 0;
+
+ProfileSection& profileSection(const char* name) {
+    for (size_t i = 0; i < profileSections.size(); ++i) {
+        if (profileSections[i].name == name || std::strcmp(profileSections[i].name, name) == 0) {
+            return profileSections[i];
+        }
+    }
+    ProfileSection section;
+    section.name = name;
+    std::fill(section.cpuMs, section.cpuMs + PROFILE_HISTORY, 0.0);
+    std::fill(section.gpuMs, section.gpuMs + PROFILE_HISTORY, 0.0);
+    section.gpu = false;
+    profileSections.push_back(section);
+    return profileSections.back();
+}
+
+// Adds every event published since the last call to its frame's history;
+// GPU sections arrive two frames late and land in their own frame
+void foldProfileEvents() {
+    unsigned long long head = profileHead.load(std::memory_order_acquire);
+    if (head - profileTail > (unsigned long long)PROFILE_RING_SIZE) {
+        profileTail = head - PROFILE_RING_SIZE;
+    }
+    unsigned frame = profileFrame.load(std::memory_order_relaxed);
+    ProfileRecord record;
+    for (; profileTail < head; ++profileTail) {
+        if (!readProfileEvent(profileTail, record)) {
+            // Still being written: try again next frame
+            const ProfileEvent& event = profileRing[profileTail & (PROFILE_RING_SIZE - 1)];
+            if (event.sequence.load(std::memory_order_acquire) <= profileTail) break;
+            continue;
+        }
+        if (frame - record.frame >= (unsigned)PROFILE_HISTORY) continue;
+        ProfileSection& section = profileSection(record.name);
+        int slot = record.frame % PROFILE_HISTORY;
+        if (record.thread == PROFILE_GPU_THREAD) {
+            section.gpuMs[slot] += record.durationNs / 1.0e6;
+            section.gpu = true;
+        } else {
+            section.cpuMs[slot] += record.durationNs / 1.0e6;
+        }
+    }
+}
+
+// Main thread, with the context current, around everything in a frame
+void beginProfileFrame() {
+    gpuFrameOpen = false;
+    if (!profilerEnabled.load(std::memory_order_relaxed)) return;
+    if (!gpuQueriesCreated) {
+        for (int i = 0; i < PROFILE_GPU_FRAMES; ++i) {
+            glGenQueries(2 * PROFILE_GPU_SCOPES, gpuQuerySets[i].queries);
+        }
+        gpuQueriesCreated = true;
+    }
+    
+    unsigned frame = profileFrame.load(std::memory_order_relaxed);
+    int slot = frame % PROFILE_HISTORY;
+    for (size_t i = 0; i < profileSections.size(); ++i) {
+        profileSections[i].cpuMs[slot] = 0.0;
+        profileSections[i].gpuMs[slot] = 0.0;
+    }
+    
+    gpuQuerySet = (gpuQuerySet + 1) % PROFILE_GPU_FRAMES;
+    GpuQuerySet& set = gpuQuerySets[gpuQuerySet];
+    if (set.pending) readGpuQuerySet(set);
+    set.used = 0;
+    set.frame = frame;
+    glGetInteger64v(GL_TIMESTAMP, &set.gpuBase);
+    set.cpuBase = profileNow();
+    set.pending = true;
+    gpuFrameOpen = true;
+    profileFrameStart = set.cpuBase;
+}
+
+void endProfileFrame() {
+    if (!gpuFrameOpen) return;
+    gpuFrameOpen = false;
+    unsigned frame = profileFrame.load(std::memory_order_relaxed);
+    recordProfileEvent("frame", profileFrameStart, profileNow() - profileFrameStart, 0, frame);
+    foldProfileEvents();
+    profileFrame.store(frame + 1, std::memory_order_relaxed);
+}
+
+// At exit: waits for the last frames' GPU sections so a trace includes them
+void flushGpuQuerySets() {
+    if (!gpuQueriesCreated || gpuFrameOpen) return;
+    glFinish();
+    for (int i = 1; i <= PROFILE_GPU_FRAMES; ++i) {
+        GpuQuerySet& set = gpuQuerySets[(gpuQuerySet + i) % PROFILE_GPU_FRAMES];
+        if (set.pending) readGpuQuerySet(set);
+    }
+}
+
+void deleteProfilerQueries() {
+    if (!gpuQueriesCreated) return;
+    for (int i = 0; i < PROFILE_GPU_FRAMES; ++i) {
+        glDeleteQueries(2 * PROFILE_GPU_SCOPES, gpuQuerySets[i].queries);
+        gpuQuerySets[i] = GpuQuerySet();
+    }
+    gpuQueriesCreated = false;
+    gpuFrameOpen = false;
+}
+
+// Mean of a section over the last `frames` completed frames; GPU samples
+// lag by PROFILE_GPU_FRAMES
+double profileAverage(const ProfileSection& section, bool gpu, int frames) {
+    long long last = (long long)profileFrame.load(std::memory_order_relaxed) - 1 - 
+                     (gpu ? PROFILE_GPU_FRAMES : 0);
+    frames = (int)std::min((long long)std::min(frames, PROFILE_HISTORY - PROFILE_GPU_FRAMES - 1), last + 1);
+    double total = 0.0;
+    for (int i = 0; i < frames; ++i) {
+        int slot = (int)((last - i) % PROFILE_HISTORY);
+        total += gpu ? section.gpuMs[slot] : section.cpuMs[slot];
+    }
+    return frames > 0 ? total / frames : 0.0;
+}
+
+void printProfileSummary(const char* label, int frames) {
+    std::fprintf(stderr, "  profile %s over %d frames:", label, frames);
+    for (size_t i = 0; i < profileSections.size(); ++i) {
+        const ProfileSection& section = profileSections[i];
+        double cpuMs = profileAverage(section, false, frames);
+        double gpuMs = section.gpu ? profileAverage(section, true, frames) : 0.0;
+        if (cpuMs == 0.0 && gpuMs == 0.0) continue;
+        std::fprintf(stderr, " %s %.3f", section.name, cpuMs);
+        if (section.gpu) std::fprintf(stderr, "/%.3f", gpuMs);
+    }
+    std::fprintf(stderr, " ms (cpu/gpu)\n");
+}
+
+// Writes the events still in the ring as Chrome trace_event JSON, for
+// chrome://tracing or ui.perfetto.dev; returns the number of events
+long long writeChromeTrace(const std::string& path) {
+    FILE* file = std::fopen(path.c_str(), "w");
+    if (!file) return -1;
+    
+    unsigned long long head = profileHead.load(std::memory_order_acquire);
+    unsigned long long first = head > (unsigned long long)PROFILE_RING_SIZE ? head - PROFILE_RING_SIZE : 0;
+    std::fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    std::vector<int> threads;
+    long long written = 0;
+    ProfileRecord record;
+    for (unsigned long long i = first; i < head; ++i) {
+        if (!readProfileEvent(i, record)) continue;
+        if (std::find(threads.begin(), threads.end(), record.thread) == threads.end()) {
+            threads.push_back(record.thread);
+        }
+        std::fprintf(file, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                     "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"frame\": %u}}",
+                     written > 0 ? ",\n" : "", record.name, record.thread, 
+                     record.startNs / 1000.0, record.durationNs / 1000.0, record.frame);
+        ++written;
+    }
+    for (size_t i = 0; i < threads.size(); ++i) {
+        char name[32];
+        if (threads[i] == PROFILE_GPU_THREAD) std::snprintf(name, sizeof(name), "GPU");
+        else if (threads[i] == PROFILE_UPDATE_THREAD) std::snprintf(name, sizeof(name), "update");
+        else if (threads[i] == 0) std::snprintf(name, sizeof(name), "main");
+        else std::snprintf(name, sizeof(name), "job %d", threads[i]);
+        std::fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                     "\"args\": {\"name\": \"%s\"}}", written + (long long)i > 0 ? ",\n" : "",
+                     threads[i], name);
+    }
+    std::fprintf(file, "\n]}\n");
+    bool ok = std::fclose(file) == 0;
+    return ok ? written : -1;
+}
+
+void reportChromeTrace(const std::string& path) {
+    long long events = writeChromeTrace(path);
+    if (events < 0) {
+        std::fprintf(stderr, "Trace: could not write %s\n", path.c_str());
+    } else {
+        std::fprintf(stderr, "Trace: %lld events written to %s (%llu GPU frames dropped)\n",
+                     events, path.c_str(), gpuFramesDropped);
+    }
+}
+
+// J in the demo
+void dumpChromeTrace() {
+    if (!profilerEnabled.load()) {
+        std::cout << "Profiler is off; press H to start it\n";
+        return;
+    }
+    char path[64];
+    std::snprintf(path, sizeof(path), "okami_trace_%03d.json", traceDumps++);
+    reportChromeTrace(path);
+}
+
+// Cost of one scope with the profiler off and on, measured on this machine.
+// Clears the ring afterwards, so call it before any real frames.
+void measureProfilerOverhead() {
+    const int SCOPES = PROFILE_RING_SIZE / 2;
+    bool enabled = profilerEnabled.load();
+    long long start = profileNow();
+    profilerEnabled.store(false);
+    for (int i = 0; i < SCOPES; ++i) {
+        ProfileScope scope("overhead");
+    }
+    long long disabledNs = profileNow() - start;
+    profilerEnabled.store(true);
+    start = profileNow();
+    for (int i = 0; i < SCOPES; ++i) {
+        ProfileScope scope("overhead");
+    }
+    long long enabledNs = profileNow() - start;
+    profilerEnabled.store(enabled);
+    
+    for (int i = 0; i < PROFILE_RING_SIZE; ++i) {
+        profileRing[i].sequence.store(0, std::memory_order_relaxed);
+    }
+    profileHead.store(0);
+    profileTail = 0;
+    std::fprintf(stderr, "Profiler: %.2f ns per scope disabled, %.1f ns enabled\n",
+                 disabledNs / (double)SCOPES, enabledNs / (double)SCOPES);
+}
+
+// ─── Parametric mesh builder ──────────────────────────────────────
+//
+// Bodies are parametric surfaces sampled on a segments x segments grid. Each
+// body is built as a chain of LODs sharing one vertex and index buffer; LOD 0
+// is the 40x40 grid the demo has always drawn. Every LOD is reordered for the
+// post-transform vertex cache (Forsyth), then in clusters for overdraw, and
+// its vertices are renumbered in first-use order. Indices are 16-bit
+// whenever every LOD fits.
+
+enum BodyShape {
+    BODY_EGG,
+    BODY_SPHERE,
+    BODY_TORUS,
+    BODY_GOURD      // swept profile: two lobes joined by a waist
+};
+BodyShape bodyShape = BODY_EGG;
+
+const int LOD_SEGMENTS[] = { 40, 24, 14, 8 };
+const int NUM_LODS = sizeof(LOD_SEGMENTS) / sizeof(LOD_SEGMENTS[0]);
+const float LOD_EDGE_PIXELS = 12.0f;    // longest grid edge allowed on screen
+int forcedLOD = -1;                     // --lod N pins one level
+
+struct MeshLOD {
+    int segments;                       // grid size; 0 for imported meshes
+    GLint baseVertex;
+    GLsizei firstIndex;
+    GLsizei indexCount;
+    float acmrBefore;
+    float acmrAfter;
+};
+
+// A read-only file mapping
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+};
+
+bool mapFile(const std::string& path, MappedFile& file) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat info;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) return false;
+    file.data = (const char*)data;
+    file.size = (size_t)info.st_size;
+    return true;
+}
+
+void unmapFile(MappedFile& file) {
+    if (file.data) munmap((void*)file.data, file.size);
+    file = MappedFile();
+}
+
+struct Mesh {
+    std::vector<Vertex> vertices;
+    std::vector<unsigned int> indices;      // relative to each LOD's baseVertex
+    // An imported mesh read from the binary cache keeps its vertices and
+    // indices in the mapped file instead of the vectors
+    MappedFile mapping;
+    const Vertex* mappedVertices = nullptr;
+    const unsigned int* mappedIndices = nullptr;
+    size_t mappedVertexCount = 0;
+    size_t mappedIndexCount = 0;
+    std::vector<MeshLOD> lods;
+    float boundingRadius = 0.0f;
+    GLenum indexType = GL_UNSIGNED_INT;
+    VertexFormat format = VERTEX_FLOAT;     // layout currently uploaded
+    glm::vec3 positionScale = glm::vec3(1.0f);
+    glm::vec3 positionBias = glm::vec3(0.0f);
+    GLuint vao = 0;
+    GLuint vbo = 0;
+    GLuint ebo = 0;
+};
+
+Mesh bodyMesh;
+
+const Vertex* meshVertices(const Mesh& mesh) {
+    return mesh.mappedVertices ? mesh.mappedVertices : mesh.vertices.data();
+}
+
+size_t meshVertexCount(const Mesh& mesh) {
+    return mesh.mappedVertices ? mesh.mappedVertexCount : mesh.vertices.size();
+}
+
+const unsigned int* meshIndices(const Mesh& mesh) {
+    return mesh.mappedIndices ? mesh.mappedIndices : mesh.indices.data();
+}
+
+size_t meshIndexCount(const Mesh& mesh) {
+    return mesh.mappedIndices ? mesh.mappedIndexCount : mesh.indices.size();
+}
+
+// Gourd radius along the profile; phi runs from the top (0) to the bottom (pi)
+float gourdProfileRadius(float phi) {
+    float upper = 0.34f * std::exp(-std::pow((phi - 0.27f * (float)M_PI) / 0.42f, 2.0f));
+    float lower = 0.62f * std::exp(-std::pow((phi - 0.70f * (float)M_PI) / 0.62f, 2.0f));
+    return std::sin(phi) * (0.12f + upper + lower) / (0.35f + 0.65f * std::sin(phi));
+}
+
+// Samples a body at (u, v) in [0,1]^2; u runs around the body, v top to bottom
+Vertex evaluateBody(BodyShape shape, float u, float v) {
+    Vertex vertex;
+    float theta = u * 2.0f * M_PI;
+    float phi = v * M_PI;
+    
+    switch (shape) {
+        case BODY_SPHERE: {
+            glm::vec3 direction(cos(theta) * sin(phi), cos(phi), sin(theta) * sin(phi));
+            vertex.position = direction * 0.85f;
+            vertex.normal = direction;
+            break;
+        }
+        case BODY_TORUS: {
+            // Ring faces the default camera; v sweeps the tube
+            float psi = v * 2.0f * M_PI;
+            glm::vec3 ring(cos(theta), sin(theta), 0.0f);
+            glm::vec3 tube = ring * (float)cos(psi) + glm::vec3(0.0f, 0.0f, 1.0f) * (float)sin(psi);
+            vertex.position = ring * 0.62f + tube * 0.28f;
+            vertex.normal = tube;
+            break;
+        }
+        case BODY_GOURD: {
+            // Surface of revolution; the normal comes from the profile slope
+            const float h = 1e-3f;
+            float r = gourdProfileRadius(phi);
+            float dr = (gourdProfileRadius(phi + h) - gourdProfileRadius(phi - h)) / (2.0f * h);
+            float dy = -sin(phi);
+            glm::vec3 around(cos(theta), 0.0f, sin(theta));
+            vertex.position = glm::vec3(around.x * r, (float)cos(phi), around.z * r);
+            vertex.normal = glm::normalize(around * -dy + glm::vec3(0.0f, dr, 0.0f));
+            break;
+        }
+        case BODY_EGG:
+        default: {
+            float radiusScale = 0.6f + 0.2f * sin(phi);
+            float x = radiusScale * cos(theta) * sin(phi);
+            float y = 1.0f * cos(phi);
+            float z = radiusScale * sin(theta) * sin(phi);
+            
+            vertex.position = glm::vec3(x, y, z);
+            
+            glm::vec3 normalDir = glm::vec3(
+                x / (radiusScale * radiusScale),
+                y / 1.0f,
+                z / (radiusScale * radiusScale)
+            );
+            vertex.normal = glm::normalize(normalDir);
+            break;
+        }
+    }
+    vertex.uv = glm::vec2(u, v);
+    return vertex;
+}
+
+// Builds one grid; zero-area triangles (pole fans) are dropped
+void buildBodyGrid(BodyShape shape, int segments, 
+                   std::vector<Vertex>& vertices, std::vector<unsigned int>& indices) {
+    int stacks = segments;
+    int slices = segments;
+    vertices.clear();
+    indices.clear();
+    vertices.reserve((stacks + 1) * (slices + 1));
+    indices.reserve(stacks * slices * 6);
+    
+    for (int i = 0; i <= stacks; ++i) {
+        float V = i / (float)stacks;
+        for (int j = 0; j <= slices; ++j) {
+            float U = j / (float)slices;
+            vertices.push_back(evaluateBody(shape, U, V));
+        }
+    }
+    
+    for (int i = 0; i < stacks; ++i) {
+        for (int j = 0; j < slices; ++j) {
+            unsigned int first = i * (slices + 1) + j;
+            unsigned int second = first + slices + 1;
+            const unsigned int quad[6] = { first, second, first + 1, 
+                                           second, second + 1, first + 1 };
+            for (int t = 0; t < 6; t += 3) {
+                glm::vec3 a = vertices[quad[t]].position;
+                glm::vec3 b = vertices[quad[t + 1]].position;
+                glm::vec3 c = vertices[quad[t + 2]].position;
+                if (glm::length(glm::cross(b - a, c - a)) < 1e-7f) continue;
+                indices.insert(indices.end(), quad + t, quad + t + 3);
+            }
+        }
+    }
+}
+
+// Average cache miss ratio: transformed vertices per triangle with a FIFO
+// post-transform cache of the given size (0.5 is ideal for a grid, 3 is worst)
+float simulateACMR(const std::vector<unsigned int>& indices, size_t vertexCount, int cacheSize) {
+    if (indices.empty()) return 0.0f;
+    std::vector<unsigned int> insertedAt(vertexCount, 0);
+    unsigned int time = cacheSize + 1;
+    size_t misses = 0;
+    for (size_t i = 0; i < indices.size(); ++i) {
+        if (time - insertedAt[indices[i]] > (unsigned int)cacheSize) {
+            insertedAt[indices[i]] = time++;
+            ++misses;
+        }
+    }
+    return misses / (float)(indices.size() / 3);
+}
+
+const int VERTEX_CACHE_SIZE = 32;
+
+float forsythVertexScore(int cachePosition, int remainingTriangles) {
+    if (remainingTriangles == 0) return -1.0f;
+    float score = 0.0f;
+    if (cachePosition >= 0) {
+        // The last triangle's vertices get a fixed score so it isn't re-picked
+        if (cachePosition < 3) {
+            score = 0.75f;
+        } else {
+            float falloff = 1.0f - (cachePosition - 3) / (float)(VERTEX_CACHE_SIZE - 3);
+            score = std::pow(falloff, 1.5f);
+        }
+    }
+    return score + 2.0f * std::pow((float)remainingTriangles, -0.5f);
+}
+
+// Tom Forsyth's linear-speed vertex cache optimisation
+void optimizeVertexCache(std::vector<unsigned int>& indices, size_t vertexCount) {
+    size_t triangleCount = indices.size() / 3;
+    if (triangleCount == 0) return;
+    
+    std::vector<int> remaining(vertexCount, 0);
+    for (size_t i = 0; i < indices.size(); ++i) ++remaining[indices[i]];
+    
+    std::vector<int> offsets(vertexCount + 1, 0);
+    for (size_t v = 0; v < vertexCount; ++v) offsets[v + 1] = offsets[v] + remaining[v];
+    std::vector<int> adjacency(indices.size());
+    std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < indices.size(); ++i) adjacency[fill[indices[i]]++] = (int)(i / 3);
+    
+    std::vector<int> cachePosition(vertexCount, -1);
+    std::vector<float> vertexScore(vertexCount);
+    for (size_t v = 0; v < vertexCount; ++v) vertexScore[v] = forsythVertexScore(-1, remaining[v]);
+    
+    std::vector<float> triangleScore(triangleCount);
+    std::vector<char> emitted(triangleCount, 0);
+    int bestTriangle = 0;
+    for (size_t t = 0; t < triangleCount; ++t) {
+        triangleScore[t] = vertexScore[indices[t * 3]] + vertexScore[indices[t * 3 + 1]] + 
+                           vertexScore[indices[t * 3 + 2]];
+        if (triangleScore[t] > triangleScore[bestTriangle]) bestTriangle = (int)t;
+    }
+    
+    std::vector<unsigned int> output;
+    output.reserve(indices.size());
+    std::vector<int> cache;
+    std::vector<int> nextCache;
+    cache.reserve(VERTEX_CACHE_SIZE + 3);
+    nextCache.reserve(VERTEX_CACHE_SIZE + 3);
+    size_t scanCursor = 0;
+    
+    while (output.size() < indices.size()) {
+        if (bestTriangle < 0) {
+            // Nothing in the cache has triangles left; continue anywhere
+            while (emitted[scanCursor]) ++scanCursor;
+            bestTriangle = (int)scanCursor;
+        }
+        
+        const unsigned int* triangle = &indices[bestTriangle * 3];
+        emitted[bestTriangle] = 1;
+        output.insert(output.end(), triangle, triangle + 3);
+        
+        nextCache.assign(triangle, triangle + 3);
+        for (int k = 0; k < 3; ++k) {
+            // Remove the emitted triangle from the vertex's active list
+            int v = triangle[k];
+            int* list = &adjacency[offsets[v]];
+            for (int a = 0; a < remaining[v]; ++a) {
+                if (list[a] == bestTriangle) {
+                    std::swap(list[a], list[remaining[v] - 1]);
+                    break;
+                }
+            }
+            --remaining[v];
+        }
+        for (size_t c = 0; c < cache.size(); ++c) {
+            int v = cache[c];
+            if (v != (int)triangle[0] && v != (int)triangle[1] && v != (int)triangle[2]) {
+                nextCache.push_back(v);
+            }
+        }
+        cache.swap(nextCache);
+        
+        for (size_t c = 0; c < cache.size(); ++c) {
+            int v = cache[c];
+            cachePosition[v] = c < (size_t)VERTEX_CACHE_SIZE ? (int)c : -1;
+            float score = forsythVertexScore(cachePosition[v], remaining[v]);
+            float delta = score - vertexScore[v];
+            vertexScore[v] = score;
+            for (int a = 0; a < remaining[v]; ++a) {
+                triangleScore[adjacency[offsets[v] + a]] += delta;
+            }
+        }
+        if (cache.size() > (size_t)VERTEX_CACHE_SIZE) cache.resize(VERTEX_CACHE_SIZE);
+        
+        bestTriangle = -1;
+        float bestScore = -1.0f;
+        for (size_t c = 0; c < cache.size(); ++c) {
+            int v = cache[c];
+            for (int a = 0; a < remaining[v]; ++a) {
+                int t = adjacency[offsets[v] + a];
+                if (triangleScore[t] > bestScore) {
+                    bestScore = triangleScore[t];
+                    bestTriangle = t;
+                }
+            }
+        }
+    }
+    indices.swap(output);
+}
+
+// Cache-ordered triangles are cut into clusters where the cache runs cold,
+// and clusters facing away from the mesh centre are drawn first, so
+// self-occluding bodies reject more fragments by depth
+void optimizeOverdraw(std::vector<unsigned int>& indices, const std::vector<Vertex>& vertices) {
+    const int CLUSTER_CACHE_SIZE = 16;
+    const size_t MIN_CLUSTER_TRIANGLES = 32;
+    size_t triangleCount = indices.size() / 3;
+    if (triangleCount == 0) return;
+    
+    std::vector<size_t> clusterStarts(1, 0);
+    std::vector<unsigned int> insertedAt(vertices.size(), 0);
+    unsigned int time = CLUSTER_CACHE_SIZE + 1;
+    for (size_t t = 0; t < triangleCount; ++t) {
+        int misses = 0;
+        for (int k = 0; k < 3; ++k) {
+            unsigned int v = indices[t * 3 + k];
+            if (time - insertedAt[v] > (unsigned int)CLUSTER_CACHE_SIZE) {
+                insertedAt[v] = time++;
+                ++misses;
+            }
+        }
+        if (misses == 3 && t - clusterStarts.back() >= MIN_CLUSTER_TRIANGLES) {
+            clusterStarts.push_back(t);
+        }
+    }
+    clusterStarts.push_back(triangleCount);
+    
+    glm::vec3 meshCenter(0.0f);
+    for (size_t v = 0; v < vertices.size(); ++v) meshCenter += vertices[v].position;
+    meshCenter = meshCenter / (float)vertices.size();
+    
+    size_t clusterCount = clusterStarts.size() - 1;
+    std::vector<std::pair<float, size_t> > order(clusterCount);
+    for (size_t c = 0; c < clusterCount; ++c) {
+        glm::vec3 center(0.0f);
+        glm::vec3 normal(0.0f);
+        for (size_t t = clusterStarts[c]; t < clusterStarts[c + 1]; ++t) {
+            glm::vec3 a = vertices[indices[t * 3]].position;
+            glm::vec3 b = vertices[indices[t * 3 + 1]].position;
+            glm::vec3 d = vertices[indices[t * 3 + 2]].position;
+            center += (a + b + d) / 3.0f;
+            normal += glm::cross(b - a, d - a);
+        }
+        center = center / (float)(clusterStarts[c + 1] - clusterStarts[c]);
+        float length = glm::length(normal);
+        float facing = length > 0.0f ? glm::dot(center - meshCenter, normal / length) : 0.0f;
+        order[c] = std::make_pair(-facing, c);
+    }
+    std::stable_sort(order.begin(), order.end());
+    
+    std::vector<unsigned int> output;
+    output.reserve(indices.size());
+    for (size_t i = 0; i < clusterCount; ++i) {
+        size_t c = order[i].second;
+        output.insert(output.end(), indices.begin() + clusterStarts[c] * 3, 
+                      indices.begin() + clusterStarts[c + 1] * 3);
+    }
+    indices.swap(output);
+}
+
+// Renumbers vertices in first-use order so vertex fetch walks memory
+// linearly; vertices no triangle uses are dropped
+void optimizeVertexFetch(std::vector<Vertex>& vertices, std::vector<unsigned int>& indices) {
+    std::vector<int> remap(vertices.size(), -1);
+    std::vector<Vertex> ordered;
+    ordered.reserve(vertices.size());
+    for (size_t i = 0; i < indices.size(); ++i) {
+        unsigned int v = indices[i];
+        if (remap[v] < 0) {
+            remap[v] = (int)ordered.size();
+            ordered.push_back(vertices[v]);
+        }
+        indices[i] = remap[v];
+    }
+    vertices.swap(ordered);
+}
+
+struct LODBuild {
+    MeshLOD lod;
+    std::vector<Vertex> vertices;
+    std::vector<unsigned int> indices;
+};
+
+// LODs are independent, so each one is built and optimized as its own job
+void buildBodyMesh(BodyShape shape, Mesh& mesh) {
+    ProfileScope scope("mesh build");
+    mesh.vertices.clear();
+    mesh.indices.clear();
+    mesh.lods.clear();
+    mesh.boundingRadius = 0.0f;
+    
+    std::vector<LODBuild> builds(NUM_LODS);
+    parallelFor(NUM_LODS, 1, [&](int, int begin, int end) {
+        for (int level = begin; level < end; ++level) {
+            LODBuild& build = builds[level];
+            buildBodyGrid(shape, LOD_SEGMENTS[level], build.vertices, build.indices);
+            
+            build.lod.segments = LOD_SEGMENTS[level];
+            build.lod.acmrBefore = simulateACMR(build.indices, build.vertices.size(), 16);
+            optimizeVertexCache(build.indices, build.vertices.size());
+            optimizeOverdraw(build.indices, build.vertices);
+            build.lod.acmrAfter = simulateACMR(build.indices, build.vertices.size(), 16);
+            optimizeVertexFetch(build.vertices, build.indices);
+        }
+    });
+    
+    size_t largestLOD = 0;
+    for (int level = 0; level < NUM_LODS; ++level) {
+        LODBuild& build = builds[level];
+        build.lod.baseVertex = (GLint)mesh.vertices.size();
+        build.lod.firstIndex = (GLsizei)mesh.indices.size();
+        build.lod.indexCount = (GLsizei)build.indices.size();
+        mesh.lods.push_back(build.lod);
+        mesh.vertices.insert(mesh.vertices.end(), build.vertices.begin(), build.vertices.end());
+        mesh.indices.insert(mesh.indices.end(), build.indices.begin(), build.indices.end());
+        largestLOD = std::max(largestLOD, build.vertices.size());
+    }
+    
+    for (size_t v = 0; v < mesh.vertices.size(); ++v) {
+        mesh.boundingRadius = std::max(mesh.boundingRadius, glm::length(mesh.vertices[v].position));
+    }
+    mesh.indexType = largestLOD <= 65536 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+}
+
+void reportMesh(const Mesh& mesh, const char* name) {
+    for (size_t i = 0; i < mesh.lods.size(); ++i) {
+        const MeshLOD& lod = mesh.lods[i];
+        size_t vertexEnd = i + 1 < mesh.lods.size() ? mesh.lods[i + 1].baseVertex : meshVertexCount(mesh);
+        char grid[24] = "imported";
+        if (lod.segments > 0) std::snprintf(grid, sizeof(grid), "%dx%d", lod.segments, lod.segments);
+        std::fprintf(stderr, "%s LOD %d (%s): %5d verts, %5d tris, ACMR %.3f -> %.3f\n",
+                     name, (int)i, grid, (int)(vertexEnd - lod.baseVertex),
+                     (int)(lod.indexCount / 3), lod.acmrBefore, lod.acmrAfter);
+    }
+    std::fprintf(stderr, "%s indices: %s\n", name, 
+                 mesh.indexType == GL_UNSIGNED_SHORT ? "16-bit" : "32-bit");
+}
+
+const char* bodyShapeName(BodyShape shape) {
+    switch (shape) {
+        case BODY_SPHERE: return "Sphere";
+        case BODY_TORUS: return "Torus";
+        case BODY_GOURD: return "Gourd";
+        default: return "Egg";
+    }
+}
+
+// Projected radius in pixels of a sphere at the given view distance
+float projectedRadius(float radius, float distance, int viewportHeight) {
+    float focal = viewportHeight / (2.0f * std::tan(glm::radians(FIELD_OF_VIEW) * 0.5f));
+    return radius * focal / std::max(distance, 1e-3f);
+}
+
+// Coarsest LOD whose grid edges stay under LOD_EDGE_PIXELS on screen
+int selectLOD(const Mesh& mesh, float radiusPixels) {
+    if (forcedLOD >= 0) return std::min(forcedLOD, (int)mesh.lods.size() - 1);
+    float wantedSegments = 2.0f * (float)M_PI * radiusPixels / LOD_EDGE_PIXELS;
+    for (int i = (int)mesh.lods.size() - 1; i > 0; --i) {
+        if (mesh.lods[i].segments >= wantedSegments) return i;
+    }
+    return 0;
+}
+
+const char* getVertexShader() {
+    return R"(
+        #version 330 core
+        layout (location = 0) in vec3 aPos;
+        layout (location = 1) in vec3 aNormal;
+        layout (location = 8) in vec2 aUV;
+        
+        out vec3 FragPos;
+        out vec3 Normal;
+        out vec3 WorldPos;
+        flat out vec3 Tint;
+        flat out float PatternSeed;
+        out vec2 PatternUV;
+        
+        layout (std140) uniform FrameData {
+            mat4 view;
+            mat4 projection;
+            vec3 lightPos;
+            float time;
+            vec3 viewPos;
+            float rimOutline;
+            float paperGrain;
+            float paperScale;
+            float tomoeBaked;
+            vec4 clusterScale;
+            ivec4 clusterSize;
+        };
+        
+        uniform mat4 model;
+        uniform mat3 normalMatrix;
+        uniform vec3 positionScale;
+        uniform vec3 positionBias;
+        uniform bool octNormals;
+        
+        vec3 decodeNormal(vec3 n) {
+            if (!octNormals) return n;
+            vec3 v = vec3(n.xy, 1.0 - abs(n.x) - abs(n.y));
+            if (v.z < 0.0) {
+                v.xy = (1.0 - abs(v.yx)) * mix(vec2(-1.0), vec2(1.0), step(0.0, v.xy));
+            }
+            return normalize(v);
+        }
+        
+        // Tomoe atlas: 2x4 tiles of 512x256 texels, one per pattern seed
+        // rounded to 1/8 of a turn; texel centers span u and v exactly
+        vec2 tomoeAtlasCoord(vec2 uv, float seed) {
+            int variant = int(floor(seed * (8.0 / 6.2831853) + 0.5)) & 7;
+            vec2 tile = vec2(variant & 1, variant >> 1);
+            vec2 texel = tile * vec2(512.0, 256.0) + 0.5 + uv * vec2(511.0, 255.0);
+            return texel / vec2(1024.0, 1024.0);
+        }
+        
+        void main() {
+            vec3 position = aPos * positionScale + positionBias;
+            FragPos = vec3(model * vec4(position, 1.0));
+            Normal = normalMatrix * decodeNormal(aNormal);
+            WorldPos = position;
+            Tint = vec3(1.0);
+            PatternSeed = 0.0;
+            PatternUV = tomoeAtlasCoord(aUV, 0.0);
+            gl_Position = projection * view * vec4(FragPos, 1.0);
+        }
+    )";
+}
+
+// Crowd path: the model matrix, tint and pattern seed come from the
+// per-instance ring buffer. Crowd transforms are rotation plus uniform scale
+// only, so mat3(aModel) is a valid normal matrix once normalized.
+const char* getInstancedVertexShader() {
+    return R"(
+        #version 330 core
+        layout (location = 0) in vec3 aPos;
+        layout (location = 1) in vec3 aNormal;
+        layout (location = 2) in mat4 aModel;
+        layout (location = 6) in vec3 aTint;
+        layout (location = 7) in float aPatternSeed;
+        layout (location = 8) in vec2 aUV;
+        
+        out vec3 FragPos;
+        out vec3 Normal;
+        out vec3 WorldPos;
+        flat out vec3 Tint;
+        flat out float PatternSeed;
+        out vec2 PatternUV;
+        
+        layout (std140) uniform FrameData {
+            mat4 view;
+            mat4 projection;
+            vec3 lightPos;
+            float time;
+            vec3 viewPos;
+            float rimOutline;
+            float paperGrain;
+            float paperScale;
+            float tomoeBaked;
+            vec4 clusterScale;
+            ivec4 clusterSize;
+        };
+        
+        uniform vec3 positionScale;
+        uniform vec3 positionBias;
+        uniform bool octNormals;
+        
+        vec3 decodeNormal(vec3 n) {
+            if (!octNormals) return n;
+            vec3 v = vec3(n.xy, 1.0 - abs(n.x) - abs(n.y));
+            if (v.z < 0.0) {
+                v.xy = (1.0 - abs(v.yx)) * mix(vec2(-1.0), vec2(1.0), step(0.0, v.xy));
+            }
+            return normalize(v);
+        }
+        
+        // Tomoe atlas: 2x4 tiles of 512x256 texels, one per pattern seed
+        // rounded to 1/8 of a turn; texel centers span u and v exactly
+        vec2 tomoeAtlasCoord(vec2 uv, float seed) {
+            int variant = int(floor(seed * (8.0 / 6.2831853) + 0.5)) & 7;
+            vec2 tile = vec2(variant & 1, variant >> 1);
+            vec2 texel = tile * vec2(512.0, 256.0) + 0.5 + uv * vec2(511.0, 255.0);
+            return texel / vec2(1024.0, 1024.0);
+        }
+        
+        void main() {
+            vec3 position = aPos * positionScale + positionBias;
+            FragPos = vec3(aModel * vec4(position, 1.0));
+            Normal = mat3(aModel) * decodeNormal(aNormal);
+            WorldPos = position;
+            Tint = aTint;
+            PatternSeed = aPatternSeed;
+            PatternUV = tomoeAtlasCoord(aUV, aPatternSeed);
+            gl_Position = projection * view * vec4(FragPos, 1.0);
+        }
+    )";
+}
+
+// ─── Fragment shader permutations ─────────────────────────────────
+//
+// Stage looks are assembled from feature modules instead of one full shader
+// copy per stage. A feature bitmask picks the modules that go into the
+// source and becomes #defines that specialize them, so a permutation only
+// pays for what its look uses. Choices that used to be uniform branches
+// (rim or screen outline, paper texture or hash, baked or analytic tomoe)
+// are feature bits as well.
+
+enum ShaderFeature {
+    FEATURE_CEL_RAMP        = 1 << 0,   // 3-tone cel ramp instead of Phong
+    FEATURE_RICH_RAMP       = 1 << 1,   // 4-tone ramp and the warmer stage 4 palette
+    FEATURE_VIEW_NORMALS    = 1 << 2,   // normals for the screen-space ink pass
+    FEATURE_RIM_OUTLINE     = 1 << 3,   // per-fragment rim outline
+    FEATURE_TOMOE           = 1 << 4,
+    FEATURE_TOMOE_ATLAS     = 1 << 5,   // baked distance atlas instead of the analytic pattern
+    FEATURE_PAPER           = 1 << 6,
+    FEATURE_PAPER_TEXTURE   = 1 << 7,   // paper grain texture instead of the sin hash
+    FEATURE_COLOR_VARIATION = 1 << 8,
+    FEATURE_ANALYTIC_AA     = 1 << 9,   // one-pixel coverage at cel, rim and tomoe thresholds
+    FEATURE_LANTERNS        = 1 << 10,  // clustered point lights on top of the key light
+    NUM_SHADER_FEATURES     = 11
+};
+
+const char* SHADER_FEATURE_NAMES[NUM_SHADER_FEATURES] = {
+    "FEATURE_CEL_RAMP", "FEATURE_RICH_RAMP", "FEATURE_VIEW_NORMALS", "FEATURE_RIM_OUTLINE",
+    "FEATURE_TOMOE", "FEATURE_TOMOE_ATLAS", "FEATURE_PAPER", "FEATURE_PAPER_TEXTURE",
+    "FEATURE_COLOR_VARIATION", "FEATURE_ANALYTIC_AA", "FEATURE_LANTERNS"
+};
+
+// The look of each stage; stage 5 is stage 4 turning
+unsigned stageFeatures(int stage) {
+    const unsigned celOutline = FEATURE_CEL_RAMP | FEATURE_VIEW_NORMALS;
+    switch (stage) {
+        case 0: return 0;                                               // Basic 3D
+        case 1: return FEATURE_CEL_RAMP;                                // Cel shading
+        case 2: return celOutline;                                      // Sumi-e outlines
+        case 3: return celOutline | FEATURE_TOMOE;                      // Red tomoe
+        default: return celOutline | FEATURE_RICH_RAMP | FEATURE_TOMOE |   // Full balanced style
+                        FEATURE_PAPER | FEATURE_COLOR_VARIATION;
+    }
+}
+
+// The stage look specialized for the current outline, paper, tomoe and
+// anti-aliasing modes.
+// The atlas variant is only used once the atlas has been uploaded.
+unsigned materialFeatures(int stage, bool tomoeReady) {
+    unsigned features = stageFeatures(stage);
+    if ((features & FEATURE_VIEW_NORMALS) && outlineMode == OUTLINE_RIM) {
+        features |= FEATURE_RIM_OUTLINE;
+    }
+    if ((features & FEATURE_TOMOE) && tomoeMode == TOMOE_ATLAS && tomoeReady) {
+        features |= FEATURE_TOMOE_ATLAS;
+    }
+    if ((features & FEATURE_PAPER) && paperMode == PAPER_TEXTURE) {
+        features |= FEATURE_PAPER_TEXTURE;
+    }
+    if ((features & FEATURE_CEL_RAMP) && antiAliasing == AA_ANALYTIC) {
+        features |= FEATURE_ANALYTIC_AA;
+    }
+    if (lanternCount > 0) {
+        features |= FEATURE_LANTERNS;
+    }
+    return features;
+}
+
+// Inputs, outputs and the frame block shared by every permutation
+const char* FRAGMENT_PRELUDE = R"(
+    in vec3 FragPos;
+    in vec3 Normal;
+    in vec3 WorldPos;
+    flat in vec3 Tint;
+    flat in float PatternSeed;
+    in vec2 PatternUV;
+    layout (location = 0) out vec4 FragColor;
+    #ifdef FEATURE_VIEW_NORMALS
+    layout (location = 1) out vec4 ViewNormal;
+    #endif
+    
+    layout (std140) uniform FrameData {
+        mat4 view;
+        mat4 projection;
+        vec3 lightPos;
+        float time;
+        vec3 viewPos;
+        float rimOutline;
+        float paperGrain;
+        float paperScale;
+        float tomoeBaked;
+        vec4 clusterScale;      // pixels and log depth to clusters, see Clustered lanterns
+        ivec4 clusterSize;
+    };
+    
+    #ifdef FEATURE_ANALYTIC_AA
+    // Share of the pixel past a threshold, from the value's screen-space
+    // slope: a one-pixel ramp instead of a hard step
+    float thresholdCoverage(float value, float threshold) {
+        return clamp((value - threshold) / max(fwidth(value), 1e-4) + 0.5, 0.0, 1.0);
+    }
+    #endif
+)";
+
+const char* CEL_RAMP_MODULE = R"(
+    #ifdef FEATURE_RICH_RAMP
+    // Warm base with subtle variation
+    const vec3 BASE_COLOR = vec3(0.97, 0.95, 0.88);
+    #else
+    // Warm cream/ivory (natural, not harsh)
+    const vec3 BASE_COLOR = vec3(0.96, 0.94, 0.87);
+    #endif
+    
+    // One ramp per material, see Cel ramps. Texel i holds the tone for diff
+    // in (i/N, (i+1)/N], so a band edge on a multiple of 1/N is exactly
+    // `diff > edge`; G holds the ramp's integral up to i/N.
+    uniform sampler1DArray celRamps;
+    uniform int celMaterial;
+    
+    #ifdef FEATURE_ANALYTIC_AA
+    float celRampIntegral(float x) {
+        float size = float(textureSize(celRamps, 0).x);
+        int i = clamp(int(floor(x * size)), 0, int(size) - 1);
+        vec2 texel = texelFetch(celRamps, ivec2(i, celMaterial), 0).rg;
+        return texel.g + (x * size - float(i)) * texel.r / size;
+    }
+    
+    // The ramp averaged over the pixel's footprint: a one-pixel ramp at
+    // every band edge
+    float celRamp(float diff) {
+        float width = max(fwidth(diff), 1e-4);
+        return (celRampIntegral(diff + 0.5 * width) - celRampIntegral(diff - 0.5 * width)) / width;
+    }
+    #else
+    float celRamp(float diff) {
+        int size = textureSize(celRamps, 0).x;
+        int i = clamp(int(ceil(diff * float(size))) - 1, 0, size - 1);
+        return texelFetch(celRamps, ivec2(i, celMaterial), 0).r;
+    }
+    #endif
+)";
+
+const char* LANTERN_MODULE = R"(
+    // Point lights listed per view-space cluster, see Clustered lanterns
+    uniform usamplerBuffer lightGrid;       // per cluster: first index, count
+    uniform usamplerBuffer lightIndices;
+    uniform samplerBuffer lightData;        // per light: position and radius, then color
+    
+    vec3 lanternLight(vec3 norm) {
+        float depth = -(view * vec4(FragPos, 1.0)).z;
+        ivec3 cell = ivec3(vec3(gl_FragCoord.xy * clusterScale.xy, log(depth) * clusterScale.z + clusterScale.w));
+        cell = clamp(cell, ivec3(0), clusterSize.xyz - 1);
+        uvec2 range = texelFetch(lightGrid, (cell.z * clusterSize.y + cell.y) * clusterSize.x + cell.x).rg;
+        vec3 light = vec3(0.0);
+        for (uint i = 0u; i < range.y; ++i) {
+            int index = int(texelFetch(lightIndices, int(range.x + i)).r);
+            vec4 sphere = texelFetch(lightData, index * 2);
+            vec3 toLight = sphere.xyz - FragPos;
+            float distance2 = dot(toLight, toLight);
+            float falloff = clamp(1.0 - distance2 / (sphere.w * sphere.w), 0.0, 1.0);
+            float diff = max(dot(norm, toLight), 0.0) * inversesqrt(max(distance2, 1e-8));
+            light += texelFetch(lightData, index * 2 + 1).rgb * (falloff * falloff * diff);
+        }
+        return light;
+    }
+)";
+
+const char* TOMOE_MODULE = R"(
+    // CONTROLLED red patterns (not too much!)
+    #ifdef FEATURE_RICH_RAMP
+    const vec3 TOMOE_RED = vec3(0.84, 0.11, 0.14);
+    const float TOMOE_AMOUNT = 0.78;
+    #else
+    const vec3 TOMOE_RED = vec3(0.82, 0.12, 0.14);
+    const float TOMOE_AMOUNT = 0.75;
+    #endif
+    
+    #ifdef FEATURE_TOMOE_ATLAS
+    uniform sampler2D tomoeAtlas;
+    
+    vec3 applyTomoe(vec3 color) {
+        // Baked signed distance in atlas texels; fwidth turns it into a
+        // one-pixel anti-aliased edge at any zoom
+        float distance = (texture(tomoeAtlas, PatternUV).r - 0.5) * 8.0;
+        float coverage = clamp(distance / max(fwidth(distance), 1e-4) + 0.5, 0.0, 1.0);
+        return mix(color, TOMOE_RED, TOMOE_AMOUNT * coverage);
+    }
+    #else
+    vec3 applyTomoe(vec3 color) {
+        float angle = atan(WorldPos.z, WorldPos.x) + PatternSeed;
+        float radius = length(vec2(WorldPos.x, WorldPos.z));
+        
+        // Main spiral (thinner, more selective)
+        float spiral = sin(angle * 3.5 - radius * 6.5);
+        
+        // Small circular accents
+        float spots = sin(WorldPos.y * 7.0 + PatternSeed * 2.0) * cos(angle * 4.0);
+        
+        // MUCH higher thresholds = less red coverage
+        #ifdef FEATURE_ANALYTIC_AA
+        float coverage = max(thresholdCoverage(spiral, 0.82), thresholdCoverage(spots, 0.88));
+        color = mix(color, TOMOE_RED, TOMOE_AMOUNT * coverage);
+        #else
+        if (spiral > 0.82 || spots > 0.88) {
+            color = mix(color, TOMOE_RED, TOMOE_AMOUNT);
+        }
+        #endif
+        return color;
+    }
+    #endif
+)";
+
+const char* PAPER_MODULE = R"(
+    // Paper texture (subtle): fibers and grain fixed to the screen, or the
+    // original hash on FragPos. The grain also varies the rim ink.
+    #ifdef FEATURE_PAPER_TEXTURE
+    uniform sampler2D paperTexture;
+    #endif
+    
+    vec3 applyPaper(vec3 color, out float grain) {
+        #ifdef FEATURE_PAPER_TEXTURE
+        vec2 paper = texture(paperTexture, gl_FragCoord.xy * paperScale).rg;
+        grain = paper.g;
+        float fibers = paper.r;
+        #else
+        grain = fract(sin(dot(FragPos.xy, vec2(12.9898, 78.233))) * 43758.5453);
+        float fibers = fract(sin(dot(FragPos.yz, vec2(93.9898, 67.345))) * 28451.3547);
+        #endif
+        return color + vec3((grain + fibers) * 0.02);
+    }
+)";
+
+const char* COLOR_VARIATION_MODULE = R"(
+    // Subtle color variation
+    vec3 applyColorVariation(vec3 color) {
+        float variation = sin(WorldPos.y * 20.0) * 0.015;
+        return color + vec3(variation, variation * 0.8, variation * 0.6);
+    }
+)";
+
+const char* RIM_OUTLINE_MODULE = R"(
+    // VERY THICK outlines (lower threshold); without this feature the
+    // screen-space ink pass draws them instead
+    vec3 applyRimOutline(vec3 color, vec3 norm, float inkVariation) {
+        vec3 viewDir = normalize(viewPos - FragPos);
+        float edge = 1.0 - abs(dot(norm, viewDir));
+        edge = pow(edge, 1.7);
+        #ifdef FEATURE_ANALYTIC_AA
+        color = mix(color, vec3(0.07 + inkVariation), thresholdCoverage(edge, 0.24));
+        #else
+        if (edge > 0.24) {
+            color = vec3(0.07 + inkVariation);
+        }
+        #endif
+        return color;
+    }
+)";
+
+const char* FRAGMENT_MAIN = R"(
+    void main() {
+        vec3 norm = normalize(Normal);
+        vec3 lightDir = normalize(lightPos - FragPos);
+        float diff = max(dot(norm, lightDir), 0.0);
+        
+        #ifdef FEATURE_CEL_RAMP
+        vec3 color = BASE_COLOR * Tint * celRamp(diff);
+        #ifdef FEATURE_LANTERNS
+        // Lanterns go through the same ramp, banded by their summed strength
+        vec3 lantern = lanternLight(norm);
+        float strength = max(lantern.r, max(lantern.g, lantern.b));
+        color += BASE_COLOR * Tint * (lantern / max(strength, 1e-4)) * (celRamp(strength) - celRamp(0.0));
+        #endif
+        #else
+        vec3 ambient = vec3(0.3);
+        vec3 diffuse = diff * vec3(0.6);
+        #ifdef FEATURE_LANTERNS
+        diffuse += lanternLight(norm) * 0.6;
+        #endif
+        vec3 color = (ambient + diffuse) * vec3(0.5, 0.5, 0.5) * Tint;
+        #endif
+        
+        #ifdef FEATURE_TOMOE
+        color = applyTomoe(color);
+        #endif
+        
+        float inkVariation = 0.0;
+        #ifdef FEATURE_PAPER
+        float grain;
+        color = applyPaper(color, grain);
+        inkVariation = grain * 0.05;
+        #endif
+        
+        #ifdef FEATURE_COLOR_VARIATION
+        color = applyColorVariation(color);
+        #endif
+        
+        #ifdef FEATURE_RIM_OUTLINE
+        color = applyRimOutline(color, norm, inkVariation);
+        #endif
+        
+        FragColor = vec4(color, 1.0);
+        #ifdef FEATURE_VIEW_NORMALS
+        ViewNormal = vec4(normalize(mat3(view) * norm) * 0.5 + 0.5, 1.0);
+        #endif
+    }
+)";
+
+// Modules in source order; each is included only when its feature is set
+const struct {
+    unsigned feature;
+    const char* source;
+} FRAGMENT_MODULES[] = {
+    { FEATURE_CEL_RAMP, CEL_RAMP_MODULE },
+    { FEATURE_LANTERNS, LANTERN_MODULE },
+    { FEATURE_TOMOE, TOMOE_MODULE },
+    { FEATURE_PAPER, PAPER_MODULE },
+    { FEATURE_COLOR_VARIATION, COLOR_VARIATION_MODULE },
+    { FEATURE_RIM_OUTLINE, RIM_OUTLINE_MODULE },
+};
+
+std::string buildFragmentShader(unsigned features) {
+    std::string source = "#version 330 core\n";
+    for (int bit = 0; bit < NUM_SHADER_FEATURES; ++bit) {
+        if (features & (1u << bit)) {
+            source += std::string("#define ") + SHADER_FEATURE_NAMES[bit] + "\n";
+        }
+    }
+    source += FRAGMENT_PRELUDE;
+    for (size_t i = 0; i < sizeof(FRAGMENT_MODULES) / sizeof(FRAGMENT_MODULES[0]); ++i) {
+        if (features & FRAGMENT_MODULES[i].feature) source += FRAGMENT_MODULES[i].source;
+    }
+    source += FRAGMENT_MAIN;
+    return source;
+}
+
+GLuint compileShader(const char* source, GLenum type) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+    
+    // Status is checked in finishStageProgram() so drivers with parallel
+    // compile can keep working in the background until the program is needed
+    return shader;
+}
+
+bool checkShaderCompiled(GLuint shader) {
+    int success;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+    if (!success) {
+        char infoLog[512];
+        glGetShaderInfoLog(shader, 512, NULL, infoLog);
+        std::cerr << "Shader compilation failed: " << infoLog << std::endl;
+    }
+    return success != 0;
+}
+
+double millisecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+// ─── Shader program cache ─────────────────────────────────────────
+//
+// Programs are cached per shader permutation: a feature mask and a vertex
+// path. The permutations the stages use are started once at startup instead
+// of on every stage switch, and any other one is compiled lazily the first
+// time it is drawn. With KHR/ARB_parallel_shader_compile the driver builds
+// them on its own threads and a program is only waited on when it is first
+// used. Linked programs are saved with glGetProgramBinary under
+// shaderCacheDir, keyed by a hash of the shader sources and the driver
+// strings, so later runs skip compilation entirely.
+
+// Locations looked up once per program instead of every frame. Camera and
+// light data live in the FrameData uniform block shared by all programs.
+struct ProgramUniforms {
+    GLint model = -1;
+    GLint normalMatrix = -1;
+    GLint positionScale = -1;
+    GLint positionBias = -1;
+    GLint octNormals = -1;
+    GLint celMaterial = -1;
+};
+
+const GLuint FRAME_DATA_BINDING = 0;
+const GLuint PAPER_TEXTURE_UNIT = 2;    // bound once; the ink pass uses units 0-1
+const GLuint TOMOE_TEXTURE_UNIT = 3;
+const GLuint CEL_RAMP_TEXTURE_UNIT = 4;  // bound once, like the paper
+const GLuint LIGHT_GRID_TEXTURE_UNIT = 5;
+const GLuint LIGHT_INDEX_TEXTURE_UNIT = 6;
+const GLuint LIGHT_DATA_TEXTURE_UNIT = 7;
+
+struct StageProgram {
+    GLuint program = 0;
+    ProgramUniforms uniforms;
+    GLuint vertexShader = 0;
+    GLuint fragmentShader = 0;
+    unsigned long long key = 0;
+    bool finished = false;
+    bool fromBinary = false;
+};
+
+// Each permutation is built once per vertex path
+enum ProgramVariant {
+    PROGRAM_SINGLE,
+    PROGRAM_INSTANCED,
+    PROGRAM_VARIANTS
+};
+
+// Keyed by permutationKey(); map nodes keep references stable
+std::map<unsigned, StageProgram> programPermutations;
+std::string shaderCacheDir;
+bool useShaderCache = true;
+bool binaryCacheEnabled = false;
+bool parallelShaderCompile = false;
+
+unsigned permutationKey(unsigned features, ProgramVariant variant) {
+    return features | (unsigned)variant << NUM_SHADER_FEATURES;
+}
+
+unsigned long long hashString(const char* text, 
+                              unsigned long long hash = 1469598103934665603ULL) {
+    // FNV-1a
+    for (; text && *text; ++text) {
+        hash ^= (unsigned char)*text;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+const char* getVertexShader(ProgramVariant variant) {
+    return variant == PROGRAM_INSTANCED ? getInstancedVertexShader() : getVertexShader();
+}
+
+unsigned long long programCacheKey(ProgramVariant variant, const std::string& fragmentSource) {
+    unsigned long long hash = hashString(getVertexShader(variant));
+    hash = hashString(fragmentSource.c_str(), hash);
+    hash = hashString((const char*)glGetString(GL_VENDOR), hash);
+    hash = hashString((const char*)glGetString(GL_RENDERER), hash);
+    hash = hashString((const char*)glGetString(GL_VERSION), hash);
+    return hash;
+}
+
+std::string defaultShaderCacheDir() {
+    const char* xdg = std::getenv("XDG_CACHE_HOME");
+    if (xdg && *xdg) return std::string(xdg) + "/okami_demo";
+    const char* home = std::getenv("HOME");
+    if (home && *home) return std::string(home) + "/.cache/okami_demo";
+    return "";
+}
+
+bool makeDirectories(const std::string& path) {
+    for (size_t pos = 1; pos <= path.size(); ++pos) {
+        if (pos == path.size() || path[pos] == '/') {
+            std::string prefix = path.substr(0, pos);
+            if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+std::string programCachePath(unsigned long long key) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "/%016llx.bin", key);
+    return shaderCacheDir + name;
+}
+
+const char PROGRAM_BINARY_MAGIC[4] = { 'O', 'K', 'P', 'B' };
+
+GLuint loadProgramBinary(unsigned long long key) {
+    FILE* file = std::fopen(programCachePath(key).c_str(), "rb");
+    if (!file) return 0;
+    
+    char magic[4];
+    GLenum format = 0;
+    GLint length = 0;
+    std::vector<char> binary;
+    bool ok = std::fread(magic, 1, 4, file) == 4 && 
+              std::memcmp(magic, PROGRAM_BINARY_MAGIC, 4) == 0 &&
+              std::fread(&format, sizeof(format), 1, file) == 1 &&
+              std::fread(&length, sizeof(length), 1, file) == 1 && length > 0;
+    if (ok) {
+        binary.resize(length);
+        ok = std::fread(&binary[0], 1, length, file) == (size_t)length;
+    }
+    std::fclose(file);
+    if (!ok) return 0;
+    
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, format, &binary[0], length);
+    
+    // Drivers reject binaries from other versions; fall back to compiling
+    int success;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success) {
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+void saveProgramBinary(GLuint program, unsigned long long key) {
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) return;
+    
+    std::vector<char> binary(length);
+    GLenum format = 0;
+    glGetProgramBinary(program, length, NULL, &format, &binary[0]);
+    
+    // Write to a temporary file first so a concurrent run never reads half a binary
+    std::string path = programCachePath(key);
+    std::string tempPath = path + ".tmp";
+    FILE* file = std::fopen(tempPath.c_str(), "wb");
+    if (!file) return;
+    bool ok = std::fwrite(PROGRAM_BINARY_MAGIC, 1, 4, file) == 4 &&
+              std::fwrite(&format, sizeof(format), 1, file) == 1 &&
+              std::fwrite(&length, sizeof(length), 1, file) == 1 &&
+              std::fwrite(&binary[0], 1, length, file) == (size_t)length;
+    ok = std::fclose(file) == 0 && ok;
+    if (!ok || std::rename(tempPath.c_str(), path.c_str()) != 0) {
+        std::remove(tempPath.c_str());
+    }
+}
+
+void reflectProgram(StageProgram& entry) {
+    entry.uniforms.model = glGetUniformLocation(entry.program, "model");
+    entry.uniforms.normalMatrix = glGetUniformLocation(entry.program, "normalMatrix");
+    entry.uniforms.positionScale = glGetUniformLocation(entry.program, "positionScale");
+    entry.uniforms.positionBias = glGetUniformLocation(entry.program, "positionBias");
+    entry.uniforms.octNormals = glGetUniformLocation(entry.program, "octNormals");
+    entry.uniforms.celMaterial = glGetUniformLocation(entry.program, "celMaterial");
+    
+    // GLSL 3.30 has no layout(binding), so blocks are bound after linking
+    GLuint frameBlock = glGetUniformBlockIndex(entry.program, "FrameData");
+    if (frameBlock != GL_INVALID_INDEX) {
+        glUniformBlockBinding(entry.program, frameBlock, FRAME_DATA_BINDING);
+    }
+    glUseProgram(entry.program);
+    glUniform1i(glGetUniformLocation(entry.program, "paperTexture"), PAPER_TEXTURE_UNIT);
+    glUniform1i(glGetUniformLocation(entry.program, "tomoeAtlas"), TOMOE_TEXTURE_UNIT);
+    glUniform1i(glGetUniformLocation(entry.program, "celRamps"), CEL_RAMP_TEXTURE_UNIT);
+    glUniform1i(glGetUniformLocation(entry.program, "lightGrid"), LIGHT_GRID_TEXTURE_UNIT);
+    glUniform1i(glGetUniformLocation(entry.program, "lightIndices"), LIGHT_INDEX_TEXTURE_UNIT);
+    glUniform1i(glGetUniformLocation(entry.program, "lightData"), LIGHT_DATA_TEXTURE_UNIT);
+    glUseProgram(0);
+}
+
+void finishStageProgram(StageProgram& entry) {
+    if (entry.finished) return;
+    ProfileScope scope("shader finish");
+    
+    bool compiled = checkShaderCompiled(entry.vertexShader);
+    compiled = checkShaderCompiled(entry.fragmentShader) && compiled;
+    
+    int success;
+    glGetProgramiv(entry.program, GL_LINK_STATUS, &success);
+    if (!success) {
+        char infoLog[512];
+        glGetProgramInfoLog(entry.program, 512, NULL, infoLog);
+        std::cerr << "Program linking failed: " << infoLog << std::endl;
+    } else {
+        reflectProgram(entry);
+        if (compiled && binaryCacheEnabled) {
+            saveProgramBinary(entry.program, entry.key);
+        }
+    }
+    
+    glDetachShader(entry.program, entry.vertexShader);
+    glDetachShader(entry.program, entry.fragmentShader);
+    glDeleteShader(entry.vertexShader);
+    glDeleteShader(entry.fragmentShader);
+    entry.vertexShader = 0;
+    entry.fragmentShader = 0;
+    entry.finished = true;
+}
+
+void finishStagePrograms() {
+    for (std::map<unsigned, StageProgram>::iterator it = programPermutations.begin();
+         it != programPermutations.end(); ++it) {
+        finishStageProgram(it->second);
+    }
+}
+
+// Starts one permutation unless it exists; it is loaded from the binary
+// cache or compiled, and in the background where the driver supports it
+StageProgram& startProgramPermutation(unsigned features, ProgramVariant variant) {
+    std::pair<std::map<unsigned, StageProgram>::iterator, bool> inserted =
+        programPermutations.insert(std::make_pair(permutationKey(features, variant), StageProgram()));
+    StageProgram& entry = inserted.first->second;
+    if (!inserted.second) return entry;
+    
+    std::string fragmentSource = buildFragmentShader(features);
+    entry.key = programCacheKey(variant, fragmentSource);
+    if (binaryCacheEnabled) {
+        entry.program = loadProgramBinary(entry.key);
+        if (entry.program) {
+            reflectProgram(entry);
+            entry.finished = true;
+            entry.fromBinary = true;
+            return entry;
+        }
+    }
+    
+    entry.vertexShader = compileShader(getVertexShader(variant), GL_VERTEX_SHADER);
+    entry.fragmentShader = compileShader(fragmentSource.c_str(), GL_FRAGMENT_SHADER);
+    entry.program = glCreateProgram();
+    if (binaryCacheEnabled) {
+        glProgramParameteri(entry.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+    glAttachShader(entry.program, entry.vertexShader);
+    glAttachShader(entry.program, entry.fragmentShader);
+    glLinkProgram(entry.program);
+    return entry;
+}
+
+// Starts the permutations of every stage in the current modes; returns the
+// number loaded from the binary cache
+int startStagePrograms() {
+    ProfileScope scope("shader startup");
+    parallelShaderCompile = GLEW_KHR_parallel_shader_compile || GLEW_ARB_parallel_shader_compile;
+    if (GLEW_KHR_parallel_shader_compile) {
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+    } else if (GLEW_ARB_parallel_shader_compile) {
+        glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+    }
+    
+    GLint binaryFormats = 0;
+    if (GLEW_ARB_get_program_binary) {
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &binaryFormats);
+    }
+    if (shaderCacheDir.empty()) {
+        shaderCacheDir = defaultShaderCacheDir();
+    }
+    binaryCacheEnabled = useShaderCache && binaryFormats > 0 && 
+                         !shaderCacheDir.empty() && makeDirectories(shaderCacheDir);
+    
+    // The tomoe atlas may still be baking; start the permutations that will
+    // draw once it is uploaded
+    for (int variant = 0; variant < PROGRAM_VARIANTS; ++variant) {
+        for (int stage = 0; stage < MAX_STAGES; ++stage) {
+            startProgramPermutation(materialFeatures(stage, true), (ProgramVariant)variant);
+        }
+    }
+    int fromCache = 0;
+    for (std::map<unsigned, StageProgram>::iterator it = programPermutations.begin();
+         it != programPermutations.end(); ++it) {
+        if (it->second.fromBinary) ++fromCache;
+    }
+    
+    // Without background compilation, pay for everything now rather than mid-frame
+    if (!parallelShaderCompile) {
+        finishStagePrograms();
+    }
+    return fromCache;
+}
+
+// Non-blocking: finishes programs the driver has completed in the background
+void pollStagePrograms() {
+    if (!parallelShaderCompile) return;
+    for (std::map<unsigned, StageProgram>::iterator it = programPermutations.begin();
+         it != programPermutations.end(); ++it) {
+        StageProgram& entry = it->second;
+        if (entry.finished) continue;
+        GLint done = GL_FALSE;
+        glGetProgramiv(entry.program, GL_COMPLETION_STATUS_KHR, &done);
+        if (done) {
+            finishStageProgram(entry);
+        }
+    }
+}
+
+// Returns the finished program for a feature mask, compiling it on first use
+const StageProgram& acquireProgramPermutation(unsigned features, ProgramVariant variant) {
+    std::map<unsigned, StageProgram>::iterator found = 
+        programPermutations.find(permutationKey(features, variant));
+    if (found != programPermutations.end()) {
+        finishStageProgram(found->second);
+        return found->second;
+    }
+    
+    ProfileScope scope("shader permutation");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    StageProgram& entry = startProgramPermutation(features, variant);
+    finishStageProgram(entry);
+    std::fprintf(stderr, "Shader permutation %03x/%d: %s in %.2f ms\n", features, (int)variant,
+                 entry.fromBinary ? "loaded from binary cache" : "compiled", millisecondsSince(start));
+    return entry;
+}
+
+const StageProgram& acquireStageProgram(int stage, ProgramVariant variant = PROGRAM_SINGLE) {
+    return acquireProgramPermutation(materialFeatures(stage, tomoeAtlasTexture != 0), variant);
+}
+
+void deleteStagePrograms() {
+    finishStagePrograms();
+    for (std::map<unsigned, StageProgram>::iterator it = programPermutations.begin();
+         it != programPermutations.end(); ++it) {
+        glDeleteProgram(it->second.program);
+    }
+    programPermutations.clear();
+}
+
+void reportShaderStartup(int fromCache, double milliseconds) {
+    std::cerr << "Shader programs: " << programPermutations.size() << " permutations started in "
+              << milliseconds << " ms ("
+              << fromCache << " from binary cache";
+    if (parallelShaderCompile) std::cerr << ", parallel compile";
+    if (binaryCacheEnabled) std::cerr << ", cache " << shaderCacheDir;
+    std::cerr << ")\n";
+}
+
+// ─── Mesh import ──────────────────────────────────────────────────
+//
+// --mesh FILE draws a Wavefront OBJ or a PLY (ASCII or binary little
+// endian) instead of the parametric body. The file is mapped and cut into
+// chunks at line breaks. One parallel pass counts each chunk's elements;
+// a second parses every chunk straight into its slice of the shared
+// arrays, so relative OBJ indices resolve without a fix-up. Corners are
+// then bucketed by position: each bucket welds the corners that share a
+// (uv, normal) pair into one Vertex, and sums the area-weighted normals of
+// its faces when the file has none, so smooth normals cross UV seams. The
+// mesh is centered, scaled to the body's unit radius and ordered like the
+// body LODs, one chunk of triangles per job. The result is written to a
+// versioned binary cache next to the shader binaries, keyed by the file's
+// path, size and modification time. Later runs map the cache and upload
+// its vertices and indices straight from the mapping.
+
+std::string importMeshPath;             // --mesh; empty draws the parametric body
+
+const unsigned int MESH_CACHE_VERSION = 1;
+const char MESH_CACHE_MAGIC[4] = { 'O', 'K', 'M', 'S' };
+const size_t MESH_CHUNK_BYTES = 1 << 20;        // parse granularity
+const int ORDER_CHUNK_TRIANGLES = 1 << 16;      // cache and overdraw ordering per job
+
+// Indexed triangles as read from a file
+struct ImportedGeometry {
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec2> uvs;
+    std::vector<glm::vec3> normals;
+    std::vector<int> corners;           // position, uv, normal per corner; -1 = none
+};
+
+struct MeshCacheHeader {
+    char magic[4];
+    unsigned int version;
+    unsigned int vertexSize;
+    unsigned int vertexCount;
+    unsigned int indexCount;            // 32-bit indices follow the vertices
+    float acmrBefore;
+    float acmrAfter;
+    float boundingRadius;
+};
+
+double powerOfTen(int exponent) {
+    static const double POWERS[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                     1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    if (exponent >= 0 && exponent <= 22) return POWERS[exponent];
+    if (exponent < 0 && exponent >= -22) return 1.0 / POWERS[-exponent];
+    return std::pow(10.0, exponent);
+}
+
+bool isDigit(char c) {
+    return (unsigned)(c - '0') < 10u;
+}
+
+// Locale-free decimal parsing; returns the position after the number
+const char* parseMeshFloat(const char* p, const char* end, float& value) {
+    while (p < end && (*p == ' ' || *p == '\t')) ++p;
+    bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) ++p;
+    double mantissa = 0.0;
+    int exponent = 0;
+    for (; p < end && isDigit(*p); ++p) mantissa = mantissa * 10.0 + (*p - '0');
+    if (p < end && *p == '.') {
+        for (++p; p < end && isDigit(*p); ++p) {
+            mantissa = mantissa * 10.0 + (*p - '0');
+            --exponent;
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        ++p;
+        bool negativeExponent = p < end && *p == '-';
+        if (p < end && (*p == '-' || *p == '+')) ++p;
+        int digits = 0;
+        for (; p < end && isDigit(*p); ++p) digits = std::min(digits * 10 + (*p - '0'), 1000);
+        exponent += negativeExponent ? -digits : digits;
+    }
+    value = (float)(mantissa * powerOfTen(exponent));
+    if (negative) value = -value;
+    return p;
+}
+
+const char* parseMeshInt(const char* p, const char* end, long long& value) {
+    while (p < end && (*p == ' ' || *p == '\t')) ++p;
+    bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) ++p;
+    value = 0;
+    for (; p < end && isDigit(*p); ++p) value = value * 10 + (*p - '0');
+    if (negative) value = -value;
+    return p;
+}
+
+bool isLineSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+const char* lineEnd(const char* p, const char* end) {
+    const char* newline = (const char*)std::memchr(p, '\n', end - p);
+    return newline ? newline : end;
+}
+
+// Chunk boundaries over [begin, end), each just after a line break
+std::vector<const char*> splitAtLines(const char* begin, const char* end) {
+    size_t chunks = std::min((size_t)(end - begin) / MESH_CHUNK_BYTES + 1, (size_t)jobThreadCount() * 4);
+    chunks = std::max(chunks, (size_t)1);
+    std::vector<const char*> bounds(1, begin);
+    for (size_t c = 1; c < chunks; ++c) {
+        const char* p = std::max(begin + (end - begin) * c / chunks, bounds.back());
+        const char* newline = lineEnd(p, end);
+        bounds.push_back(newline < end ? newline + 1 : end);
+    }
+    bounds.push_back(end);
+    return bounds;
+}
+
+// ── OBJ ──
+
+enum ObjElement { OBJ_POSITION, OBJ_UV, OBJ_NORMAL, OBJ_TRIANGLE, OBJ_ELEMENTS };
+
+// Counts the v, vt and vn lines of a chunk and the triangles its faces fan into
+void countObjChunk(const char* p, const char* end, size_t counts[OBJ_ELEMENTS]) {
+    while (p < end) {
+        const char* eol = lineEnd(p, end);
+        while (p < eol && (*p == ' ' || *p == '\t')) ++p;
+        if (eol - p >= 2 && p[0] == 'v') {
+            if (p[1] == ' ' || p[1] == '\t') ++counts[OBJ_POSITION];
+            else if (p[1] == 't') ++counts[OBJ_UV];
+            else if (p[1] == 'n') ++counts[OBJ_NORMAL];
+        } else if (eol - p >= 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+            int corners = 0;
+            const char* faceEnd = std::find(p, eol, '#');     // trailing comments are legal
+            for (const char* q = p + 1; q < faceEnd; ++q) {
+                if (!isLineSpace(*q) && isLineSpace(q[-1])) ++corners;
+            }
+            if (corners >= 3) counts[OBJ_TRIANGLE] += corners - 2;
+        }
+        p = eol < end ? eol + 1 : end;
+    }
+}
+
+// 1-based or, when negative, relative to the elements defined so far
+int resolveObjIndex(long long index, size_t defined) {
+    if (index > 0) return (int)(index - 1);
+    if (index < 0) return (int)((long long)defined + index);
+    return -1;
+}
+
+// Parses a chunk into geometry from the element offsets in next[]
+void parseObjChunk(const char* p, const char* end, size_t next[OBJ_ELEMENTS], ImportedGeometry& geometry) {
+    std::vector<int> face;
+    while (p < end) {
+        const char* eol = lineEnd(p, end);
+        while (p < eol && (*p == ' ' || *p == '\t')) ++p;
+        if (eol - p >= 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+            glm::vec3& position = geometry.positions[next[OBJ_POSITION]++];
+            const char* q = parseMeshFloat(p + 1, eol, position.x);
+            q = parseMeshFloat(q, eol, position.y);
+            parseMeshFloat(q, eol, position.z);
+        } else if (eol - p >= 2 && p[0] == 'v' && p[1] == 't') {
+            glm::vec2& uv = geometry.uvs[next[OBJ_UV]++];
+            parseMeshFloat(parseMeshFloat(p + 2, eol, uv.x), eol, uv.y);
+        } else if (eol - p >= 2 && p[0] == 'v' && p[1] == 'n') {
+            glm::vec3& normal = geometry.normals[next[OBJ_NORMAL]++];
+            const char* q = parseMeshFloat(p + 2, eol, normal.x);
+            q = parseMeshFloat(q, eol, normal.y);
+            parseMeshFloat(q, eol, normal.z);
+        } else if (eol - p >= 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+            // Corners are p, p/t, p//n or p/t/n, up to any comment
+            face.clear();
+            const char* faceEnd = std::find(p, eol, '#');
+            const char* q = p + 1;
+            while (true) {
+                while (q < faceEnd && isLineSpace(*q)) ++q;
+                if (q >= faceEnd) break;
+                long long index[3] = { 0, 0, 0 };
+                q = parseMeshInt(q, faceEnd, index[0]);
+                for (int k = 1; k < 3 && q < faceEnd && *q == '/'; ++k) {
+                    ++q;
+                    if (q < faceEnd && *q != '/') q = parseMeshInt(q, faceEnd, index[k]);
+                }
+                while (q < faceEnd && !isLineSpace(*q)) ++q;
+                face.push_back(resolveObjIndex(index[0], next[OBJ_POSITION]));
+                face.push_back(resolveObjIndex(index[1], next[OBJ_UV]));
+                face.push_back(resolveObjIndex(index[2], next[OBJ_NORMAL]));
+            }
+            for (size_t corner = 6; corner + 3 <= face.size(); corner += 3) {
+                int* triangle = &geometry.corners[next[OBJ_TRIANGLE]++ * 9];
+                std::copy(face.begin(), face.begin() + 3, triangle);
+                std::copy(face.begin() + corner - 3, face.begin() + corner + 3, triangle + 3);
+            }
+        }
+        p = eol < end ? eol + 1 : end;
+    }
+}
+
+bool parseObj(const MappedFile& file, ImportedGeometry& geometry) {
+    std::vector<const char*> bounds = splitAtLines(file.data, file.data + file.size);
+    int chunks = (int)bounds.size() - 1;
+    std::vector<size_t> offsets((chunks + 1) * OBJ_ELEMENTS, 0);
+    parallelFor(chunks, 1, [&](int, int begin, int end) {
+        for (int c = begin; c < end; ++c) countObjChunk(bounds[c], bounds[c + 1], &offsets[(c + 1) * OBJ_ELEMENTS]);
+    });
+    // Exclusive prefix sums give each chunk its first element of every kind
+    for (int c = 1; c <= chunks; ++c) {
+        for (int e = 0; e < OBJ_ELEMENTS; ++e) offsets[c * OBJ_ELEMENTS + e] += offsets[(c - 1) * OBJ_ELEMENTS + e];
+    }
+    const size_t* totals = &offsets[chunks * OBJ_ELEMENTS];
+    geometry.positions.resize(totals[OBJ_POSITION]);
+    geometry.uvs.resize(totals[OBJ_UV]);
+    geometry.normals.resize(totals[OBJ_NORMAL]);
+    geometry.corners.resize(totals[OBJ_TRIANGLE] * 9);
+    parallelFor(chunks, 1, [&](int, int begin, int end) {
+        for (int c = begin; c < end; ++c) parseObjChunk(bounds[c], bounds[c + 1], &offsets[c * OBJ_ELEMENTS], geometry);
+    });
+    return true;
+}
+
+// ── PLY ──
+
+enum PlyType { PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64,
+               PLY_INVALID };
+
+struct PlyProperty {
+    std::string name;
+    PlyType type;
+    PlyType countType;                  // PLY_INVALID for scalars
+};
+
+struct PlyElement {
+    std::string name;
+    size_t count;
+    std::vector<PlyProperty> properties;
+};
+
+PlyType plyType(const std::string& name) {
+    if (name == "char" || name == "int8") return PLY_INT8;
+    if (name == "uchar" || name == "uint8") return PLY_UINT8;
+    if (name == "short" || name == "int16") return PLY_INT16;
+    if (name == "ushort" || name == "uint16") return PLY_UINT16;
+    if (name == "int" || name == "int32") return PLY_INT32;
+    if (name == "uint" || name == "uint32") return PLY_UINT32;
+    if (name == "float" || name == "float32") return PLY_FLOAT32;
+    if (name == "double" || name == "float64") return PLY_FLOAT64;
+    return PLY_INVALID;
+}
+
+size_t plyTypeSize(PlyType type) {
+    static const size_t SIZES[] = { 1, 1, 2, 2, 4, 4, 4, 8, 0 };
+    return SIZES[type];
+}
+
+// Little-endian value at p
+double readPlyValue(const char* p, PlyType type) {
+    switch (type) {
+        case PLY_INT8: return (signed char)*p;
+        case PLY_UINT8: return (unsigned char)*p;
+        case PLY_INT16: { short v; std::memcpy(&v, p, 2); return v; }
+        case PLY_UINT16: { unsigned short v; std::memcpy(&v, p, 2); return v; }
+        case PLY_INT32: { int v; std::memcpy(&v, p, 4); return v; }
+        case PLY_UINT32: { unsigned int v; std::memcpy(&v, p, 4); return v; }
+        case PLY_FLOAT32: { float v; std::memcpy(&v, p, 4); return v; }
+        case PLY_FLOAT64: { double v; std::memcpy(&v, p, 8); return v; }
+        default: return 0.0;
+    }
+}
+
+// Index of each vertex attribute among the vertex properties, -1 if absent
+enum PlyAttribute { PLY_X, PLY_Y, PLY_Z, PLY_NX, PLY_NY, PLY_NZ, PLY_U, PLY_V, PLY_ATTRIBUTES };
+
+void findPlyAttributes(const PlyElement& vertex, int attributes[PLY_ATTRIBUTES]) {
+    static const char* NAMES[PLY_ATTRIBUTES][3] = {
+        { "x", "", "" }, { "y", "", "" }, { "z", "", "" }, { "nx", "", "" }, { "ny", "", "" }, { "nz", "", "" },
+        { "u", "s", "texture_u" }, { "v", "t", "texture_v" }
+    };
+    for (int a = 0; a < PLY_ATTRIBUTES; ++a) {
+        attributes[a] = -1;
+        for (size_t p = 0; p < vertex.properties.size() && attributes[a] < 0; ++p) {
+            for (int n = 0; n < 3; ++n) {
+                if (NAMES[a][n][0] && vertex.properties[p].name == NAMES[a][n]) attributes[a] = (int)p;
+            }
+        }
+    }
+}
+
+void storePlyVertex(const double* values, const int attributes[PLY_ATTRIBUTES], size_t index,
+                    ImportedGeometry& geometry) {
+    geometry.positions[index] = glm::vec3((float)values[attributes[PLY_X]], (float)values[attributes[PLY_Y]],
+                                          (float)values[attributes[PLY_Z]]);
+    if (!geometry.normals.empty()) {
+        geometry.normals[index] = glm::vec3((float)values[attributes[PLY_NX]], (float)values[attributes[PLY_NY]],
+                                            (float)values[attributes[PLY_NZ]]);
+    }
+    if (!geometry.uvs.empty()) {
+        geometry.uvs[index] = glm::vec2((float)values[attributes[PLY_U]], (float)values[attributes[PLY_V]]);
+    }
+}
+
+// A face's vertex index, or -1 (which the weld rejects) when it is not one
+// of the vertices; checked as a double so no value is cast out of range
+int plyVertexIndex(double value, size_t vertexCount) {
+    return value >= 0.0 && value < (double)vertexCount ? (int)value : -1;
+}
+
+// Fans a polygon into triangles whose corners share the vertex index for
+// position, uv and normal
+void addPlyFace(const std::vector<int>& face, bool hasUVs, bool hasNormals, std::vector<int>& corners) {
+    for (size_t i = 2; i < face.size(); ++i) {
+        const int triangle[3] = { face[0], face[i - 1], face[i] };
+        for (int k = 0; k < 3; ++k) {
+            corners.push_back(triangle[k]);
+            corners.push_back(hasUVs ? triangle[k] : -1);
+            corners.push_back(hasNormals ? triangle[k] : -1);
+        }
+    }
+}
+
+bool parsePly(const MappedFile& file, ImportedGeometry& geometry) {
+    const char* end = file.data + file.size;
+    const char* p = file.data;
+    std::vector<PlyElement> elements;
+    bool binary = false;
+    bool headerDone = false;
+    while (p < end && !headerDone) {
+        const char* eol = lineEnd(p, end);
+        std::string line(p, eol);
+        if (!line.empty() && line[line.size() - 1] == '\r') line.resize(line.size() - 1);
+        p = eol < end ? eol + 1 : end;
+
+        char word[5][64] = {};
+        int words = std::sscanf(line.c_str(), "%63s %63s %63s %63s %63s", word[0], word[1], word[2], word[3],
+                                word[4]);
+        std::string keyword = words > 0 ? word[0] : "";
+        if (keyword == "format") {
+            std::string format = word[1];
+            if (format == "binary_little_endian") binary = true;
+            else if (format != "ascii") {
+                std::fprintf(stderr, "PLY format %s is not supported\n", word[1]);
+                return false;
+            }
+        } else if (keyword == "element" && words >= 3) {
+            PlyElement element;
+            element.name = word[1];
+            element.count = (size_t)std::strtoull(word[2], NULL, 10);
+            elements.push_back(element);
+        } else if (keyword == "property" && !elements.empty() && words >= 3) {
+            PlyProperty property;
+            if (std::string(word[1]) == "list" && words >= 5) {
+                property.countType = plyType(word[2]);
+                property.type = plyType(word[3]);
+                property.name = word[4];
+                if (property.countType == PLY_INVALID) return false;
+            } else {
+                property.type = plyType(word[1]);
+                property.countType = PLY_INVALID;
+                property.name = word[2];
+            }
+            if (property.type == PLY_INVALID) return false;
+            elements.back().properties.push_back(property);
+        } else if (keyword == "end_header") {
+            headerDone = true;
+        }
+    }
+    if (!headerDone) return false;
+
+    const PlyElement* vertex = NULL;
+    for (size_t e = 0; e < elements.size(); ++e) {
+        if (elements[e].name == "vertex") vertex = &elements[e];
+    }
+    if (!vertex) return false;
+    int attributes[PLY_ATTRIBUTES];
+    findPlyAttributes(*vertex, attributes);
+    if (attributes[PLY_X] < 0 || attributes[PLY_Y] < 0 || attributes[PLY_Z] < 0) return false;
+    bool hasNormals = attributes[PLY_NX] >= 0 && attributes[PLY_NY] >= 0 && attributes[PLY_NZ] >= 0;
+    bool hasUVs = attributes[PLY_U] >= 0 && attributes[PLY_V] >= 0;
+    geometry.positions.resize(vertex->count);
+    if (hasNormals) geometry.normals.resize(vertex->count);
+    if (hasUVs) geometry.uvs.resize(vertex->count);
+
+    if (binary) {
+        for (size_t e = 0; e < elements.size(); ++e) {
+            const PlyElement& element = elements[e];
+            bool fixedSize = true;
+            size_t stride = 0;
+            for (size_t i = 0; i < element.properties.size(); ++i) {
+                fixedSize = fixedSize && element.properties[i].countType == PLY_INVALID;
+                stride += plyTypeSize(element.properties[i].type);
+            }
+            if (&element == vertex && fixedSize) {
+                // Fixed stride: decoded in parallel
+                if ((size_t)(end - p) < stride * element.count) return false;
+                const char* base = p;
+                parallelFor((int)element.count, 1 << 14, [&](int, int begin, int finish) {
+                    std::vector<double> values(element.properties.size());
+                    for (int v = begin; v < finish; ++v) {
+                        const char* q = base + stride * v;
+                        for (size_t i = 0; i < values.size(); ++i) {
+                            values[i] = readPlyValue(q, element.properties[i].type);
+                            q += plyTypeSize(element.properties[i].type);
+                        }
+                        storePlyVertex(&values[0], attributes, v, geometry);
+                    }
+                });
+                p += stride * element.count;
+                continue;
+            }
+            if (&element == vertex) return false;       // list properties on vertices
+
+            // Faces and unknown elements: list lengths vary, so walk them in order
+            bool faces = element.name == "face";
+            std::vector<int> face;
+            for (size_t item = 0; item < element.count; ++item) {
+                for (size_t i = 0; i < element.properties.size(); ++i) {
+                    const PlyProperty& property = element.properties[i];
+                    size_t size = plyTypeSize(property.type);
+                    if (property.countType == PLY_INVALID) {
+                        if ((size_t)(end - p) < size) return false;
+                        p += size;
+                        continue;
+                    }
+                    size_t countSize = plyTypeSize(property.countType);
+                    if ((size_t)(end - p) < countSize) return false;
+                    double length = readPlyValue(p, property.countType);
+                    p += countSize;
+                    if (length < 0.0 || length * size > (double)(end - p)) return false;
+                    size_t count = (size_t)length;
+                    if (faces && (property.name == "vertex_indices" || property.name == "vertex_index")) {
+                        face.resize(count);
+                        for (size_t k = 0; k < count; ++k) {
+                            face[k] = plyVertexIndex(readPlyValue(p + k * size, property.type), vertex->count);
+                        }
+                        addPlyFace(face, hasUVs, hasNormals, geometry.corners);
+                    }
+                    p += count * size;
+                }
+            }
+        }
+        return true;
+    }
+
+    // ASCII: every element item is one line. Chunks count their lines, then
+    // parse them knowing which element each line belongs to.
+    std::vector<const char*> bounds = splitAtLines(p, end);
+    int chunks = (int)bounds.size() - 1;
+    std::vector<size_t> firstLine(chunks + 1, 0);
+    parallelFor(chunks, 1, [&](int, int begin, int finish) {
+        for (int c = begin; c < finish; ++c) {
+            size_t lines = 0;
+            for (const char* q = bounds[c]; q < bounds[c + 1]; q = lineEnd(q, bounds[c + 1]) + 1) ++lines;
+            firstLine[c + 1] = lines;
+        }
+    });
+    for (int c = 1; c <= chunks; ++c) firstLine[c] += firstLine[c - 1];
+
+    std::vector<std::vector<int> > chunkCorners(chunks);
+    parallelFor(chunks, 1, [&](int, int begin, int finish) {
+        std::vector<double> values;
+        std::vector<int> face;
+        for (int c = begin; c < finish; ++c) {
+            size_t line = firstLine[c];
+            for (const char* q = bounds[c]; q < bounds[c + 1]; ++line) {
+                const char* eol = lineEnd(q, bounds[c + 1]);
+                // Find the line's element
+                size_t first = 0;
+                size_t e = 0;
+                while (e < elements.size() && line >= first + elements[e].count) first += elements[e++].count;
+                if (e < elements.size() && &elements[e] == vertex) {
+                    values.resize(vertex->properties.size());
+                    for (size_t i = 0; i < values.size(); ++i) {
+                        float value;
+                        q = parseMeshFloat(q, eol, value);
+                        values[i] = value;
+                    }
+                    storePlyVertex(&values[0], attributes, line - first, geometry);
+                } else if (e < elements.size() && elements[e].name == "face") {
+                    for (size_t i = 0; i < elements[e].properties.size(); ++i) {
+                        const PlyProperty& property = elements[e].properties[i];
+                        long long count = 1;
+                        if (property.countType != PLY_INVALID) q = parseMeshInt(q, eol, count);
+                        bool indices = property.name == "vertex_indices" || property.name == "vertex_index";
+                        face.clear();
+                        for (long long k = 0; k < count; ++k) {
+                            float value;
+                            q = parseMeshFloat(q, eol, value);
+                            face.push_back(plyVertexIndex(value, vertex->count));
+                        }
+                        if (indices) addPlyFace(face, hasUVs, hasNormals, chunkCorners[c]);
+                    }
+                }
+                q = eol + 1;
+            }
+        }
+    });
+    size_t total = 0;
+    for (int c = 0; c < chunks; ++c) total += chunkCorners[c].size();
+    geometry.corners.reserve(total);
+    for (int c = 0; c < chunks; ++c) {
+        geometry.corners.insert(geometry.corners.end(), chunkCorners[c].begin(), chunkCorners[c].end());
+    }
+    return true;
+}
+
+// ── Welding and normals ──
+
+// Points corners at the first of any bitwise identical positions, so
+// generated normals are smooth across seams the file split
+void mergeDuplicatePositions(ImportedGeometry& geometry) {
+    size_t count = geometry.positions.size();
+    std::vector<unsigned int> order(count);
+    for (size_t i = 0; i < count; ++i) order[i] = (unsigned int)i;
+    const glm::vec3* positions = &geometry.positions[0];
+    std::sort(order.begin(), order.end(), [positions](unsigned int a, unsigned int b) {
+        int c = std::memcmp(&positions[a], &positions[b], sizeof(glm::vec3));
+        return c != 0 ? c < 0 : a < b;
+    });
+    std::vector<int> first(count);
+    for (size_t i = 0; i < count; ++i) {
+        bool same = i > 0 && std::memcmp(&positions[order[i]], &positions[order[i - 1]], sizeof(glm::vec3)) == 0;
+        first[order[i]] = same ? first[order[i - 1]] : (int)order[i];
+    }
+    for (size_t c = 0; c < geometry.corners.size(); c += 3) geometry.corners[c] = first[geometry.corners[c]];
+}
+
+// Builds vertices and indices from the corners: one vertex per distinct
+// (position, uv, normal), with area-weighted position normals for corners
+// that have none. Returns false on out-of-range indices.
+bool weldGeometry(ImportedGeometry& geometry, std::vector<Vertex>& vertices, std::vector<unsigned int>& indices,
+                  size_t& generatedNormals) {
+    size_t positionCount = geometry.positions.size();
+    size_t cornerCount = geometry.corners.size() / 3;
+    const int* corners = geometry.corners.empty() ? NULL : &geometry.corners[0];
+
+    std::atomic<size_t> invalid(0);
+    std::atomic<size_t> missingNormals(0);
+    parallelFor((int)cornerCount, 1 << 16, [&](int, int begin, int end) {
+        size_t bad = 0;
+        size_t missing = 0;
+        for (int c = begin; c < end; ++c) {
+            const int* corner = corners + c * 3;
+            bad += corner[0] < 0 || (size_t)corner[0] >= positionCount || corner[1] >= (int)geometry.uvs.size() ||
+                   corner[2] >= (int)geometry.normals.size() || corner[1] < -1 || corner[2] < -1;
+            missing += corner[2] < 0;
+        }
+        invalid += bad;
+        missingNormals += missing;
+    });
+    if (invalid > 0) {
+        std::fprintf(stderr, "Mesh import: %zu corners index past the vertex data\n", invalid.load());
+        return false;
+    }
+    if (missingNormals > 0) mergeDuplicatePositions(geometry);
+
+    // Corners grouped by position (counting sort)
+    std::vector<unsigned int> bucketStart(positionCount + 1, 0);
+    for (size_t c = 0; c < cornerCount; ++c) ++bucketStart[corners[c * 3] + 1];
+    for (size_t p = 0; p < positionCount; ++p) bucketStart[p + 1] += bucketStart[p];
+    std::vector<unsigned int> bucketed(cornerCount);
+    {
+        std::vector<unsigned int> fill(bucketStart.begin(), bucketStart.end() - 1);
+        for (size_t c = 0; c < cornerCount; ++c) bucketed[fill[corners[c * 3]]++] = (unsigned int)c;
+    }
+
+    std::vector<glm::vec3> positionNormals;
+    if (missingNormals > 0) {
+        positionNormals.resize(positionCount);
+        parallelFor((int)positionCount, 1 << 14, [&](int, int begin, int end) {
+            for (int p = begin; p < end; ++p) {
+                glm::vec3 sum(0.0f);
+                for (unsigned int b = bucketStart[p]; b < bucketStart[p + 1]; ++b) {
+                    const int* triangle = corners + bucketed[b] / 3 * 9;
+                    glm::vec3 a = geometry.positions[triangle[0]];
+                    sum += glm::cross(geometry.positions[triangle[3]] - a, geometry.positions[triangle[6]] - a);
+                }
+                float length = glm::length(sum);
+                positionNormals[p] = length > 0.0f ? sum / length : glm::vec3(0.0f, 1.0f, 0.0f);
+            }
+        });
+    }
+
+    // Each bucket welds its corners by (uv, normal) index; slot is the
+    // corner's vertex within its bucket
+    std::vector<unsigned int> slot(cornerCount);
+    std::vector<unsigned int> vertexStart(positionCount + 1, 0);
+    parallelFor((int)positionCount, 1 << 14, [&](int, int begin, int end) {
+        std::vector<std::pair<unsigned long long, unsigned int> > keys;
+        for (int p = begin; p < end; ++p) {
+            keys.clear();
+            for (unsigned int b = bucketStart[p]; b < bucketStart[p + 1]; ++b) {
+                const int* corner = corners + bucketed[b] * 3;
+                // Unsigned, so a missing uv or normal (-1) shifts without overflow
+                unsigned long long key = ((unsigned long long)(unsigned int)corner[1] << 32) | (unsigned int)corner[2];
+                keys.push_back(std::make_pair(key, bucketed[b]));
+            }
+            std::sort(keys.begin(), keys.end());
+            unsigned int unique = 0;
+            for (size_t k = 0; k < keys.size(); ++k) {
+                if (k > 0 && keys[k].first != keys[k - 1].first) ++unique;
+                slot[keys[k].second] = unique;
+            }
+            vertexStart[p + 1] = keys.empty() ? 0 : unique + 1;
+        }
+    });
+    for (size_t p = 0; p < positionCount; ++p) vertexStart[p + 1] += vertexStart[p];
+
+    vertices.resize(vertexStart[positionCount]);
+    indices.resize(cornerCount);
+    parallelFor((int)cornerCount, 1 << 16, [&](int, int begin, int end) {
+        for (int c = begin; c < end; ++c) {
+            const int* corner = corners + c * 3;
+            unsigned int index = vertexStart[corner[0]] + slot[c];
+            indices[c] = index;
+            // Corners sharing a vertex write the same values
+            Vertex& vertex = vertices[index];
+            vertex.position = geometry.positions[corner[0]];
+            vertex.normal = corner[2] >= 0 ? glm::normalize(geometry.normals[corner[2]]) : positionNormals[corner[0]];
+            vertex.uv = corner[1] >= 0 ? geometry.uvs[corner[1]] : glm::vec2(0.0f);
+        }
+    });
+    generatedNormals = missingNormals;
+    return true;
+}
+
+// Cache and overdraw order within chunks of triangles, one job each,
+// on compacted local vertex numbers
+void orderImportedTriangles(const std::vector<Vertex>& vertices, std::vector<unsigned int>& indices) {
+    int triangles = (int)(indices.size() / 3);
+    parallelFor((triangles + ORDER_CHUNK_TRIANGLES - 1) / ORDER_CHUNK_TRIANGLES, 1, [&](int, int begin, int end) {
+        for (int chunk = begin; chunk < end; ++chunk) {
+            size_t first = (size_t)chunk * ORDER_CHUNK_TRIANGLES * 3;
+            size_t last = std::min(first + (size_t)ORDER_CHUNK_TRIANGLES * 3, indices.size());
+            std::vector<unsigned int> global(indices.begin() + first, indices.begin() + last);
+            std::sort(global.begin(), global.end());
+            global.erase(std::unique(global.begin(), global.end()), global.end());
+            std::vector<Vertex> local(global.size());
+            for (size_t v = 0; v < global.size(); ++v) local[v] = vertices[global[v]];
+            std::vector<unsigned int> chunkIndices(indices.begin() + first, indices.begin() + last);
+            for (size_t i = 0; i < chunkIndices.size(); ++i) {
+                chunkIndices[i] = (unsigned int)(std::lower_bound(global.begin(), global.end(), chunkIndices[i]) -
+                                                 global.begin());
+            }
+            optimizeVertexCache(chunkIndices, local.size());
+            optimizeOverdraw(chunkIndices, local);
+            for (size_t i = 0; i < chunkIndices.size(); ++i) indices[first + i] = global[chunkIndices[i]];
+        }
+    });
+}
+
+// ── Binary cache ──
+
+std::string meshCachePath(const std::string& path) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) return "";
+    // FNV-1a over the path, size and modification time
+    unsigned long long hash = 1469598103934665603ULL;
+    std::string key = path + "|" + std::to_string((long long)info.st_size) + "|" +
+                      std::to_string((long long)info.st_mtim.tv_sec) + "." +
+                      std::to_string((long long)info.st_mtim.tv_nsec);
+    for (size_t i = 0; i < key.size(); ++i) {
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+    }
+    char name[40];
+    std::snprintf(name, sizeof(name), "/mesh_%016llx.bin", hash);
+    return shaderCacheDir + name;
+}
+
+// Maps a cached mesh; its vertices and indices stay in the mapping
+bool loadMeshCache(const std::string& cachePath, Mesh& mesh) {
+    MappedFile file;
+    if (!mapFile(cachePath, file)) return false;
+    MeshCacheHeader header;
+    bool ok = file.size >= sizeof(header);
+    if (ok) {
+        std::memcpy(&header, file.data, sizeof(header));
+        ok = std::memcmp(header.magic, MESH_CACHE_MAGIC, 4) == 0 && header.version == MESH_CACHE_VERSION &&
+             header.vertexSize == sizeof(Vertex) && header.indexCount > 0 &&
+             file.size == sizeof(header) + (size_t)header.vertexCount * sizeof(Vertex) +
+                          (size_t)header.indexCount * sizeof(unsigned int);
+    }
+    if (!ok) {
+        unmapFile(file);
+        return false;
+    }
+    mesh.mapping = file;
+    mesh.mappedVertices = (const Vertex*)(file.data + sizeof(header));
+    mesh.mappedVertexCount = header.vertexCount;
+    mesh.mappedIndices = (const unsigned int*)(file.data + sizeof(header) +
+                                               (size_t)header.vertexCount * sizeof(Vertex));
+    mesh.mappedIndexCount = header.indexCount;
+    MeshLOD lod = { 0, 0, 0, (GLsizei)header.indexCount, header.acmrBefore, header.acmrAfter };
+    mesh.lods.assign(1, lod);
+    mesh.boundingRadius = header.boundingRadius;
+    mesh.indexType = header.vertexCount <= 65536 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+    return true;
+}
+
+void saveMeshCache(const std::string& cachePath, const Mesh& mesh) {
+    std::string tempPath = cachePath + ".tmp";
+    FILE* file = std::fopen(tempPath.c_str(), "wb");
+    if (!file) return;
+    MeshCacheHeader header;
+    std::memcpy(header.magic, MESH_CACHE_MAGIC, 4);
+    header.version = MESH_CACHE_VERSION;
+    header.vertexSize = sizeof(Vertex);
+    header.vertexCount = (unsigned int)mesh.vertices.size();
+    header.indexCount = (unsigned int)mesh.indices.size();
+    header.acmrBefore = mesh.lods[0].acmrBefore;
+    header.acmrAfter = mesh.lods[0].acmrAfter;
+    header.boundingRadius = mesh.boundingRadius;
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+              std::fwrite(&mesh.vertices[0], sizeof(Vertex), mesh.vertices.size(), file) == mesh.vertices.size() &&
+              std::fwrite(&mesh.indices[0], sizeof(unsigned int), mesh.indices.size(), file) == mesh.indices.size();
+    ok = std::fclose(file) == 0 && ok;
+    if (!ok || std::rename(tempPath.c_str(), cachePath.c_str()) != 0) {
+        std::remove(tempPath.c_str());
+    }
+}
+
+std::string meshFileName(const std::string& path) {
+    size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+// Loads an OBJ or PLY into a single-LOD mesh, from the cache when it can.
+// Runs on the job system.
+bool importMesh(const std::string& path, Mesh& mesh) {
+    ProfileScope scope("mesh import");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::string name = meshFileName(path);
+    bool caching = useShaderCache && !shaderCacheDir.empty();
+    std::string cachePath = caching ? meshCachePath(path) : "";
+    if (!cachePath.empty() && loadMeshCache(cachePath, mesh)) {
+        std::fprintf(stderr, "Mesh %s: %zu tris, %zu verts, mapped from cache in %.2f ms\n", name.c_str(),
+                     meshIndexCount(mesh) / 3, meshVertexCount(mesh), millisecondsSince(start));
+        return true;
+    }
+
+    MappedFile file;
+    if (!mapFile(path, file)) {
+        std::fprintf(stderr, "Mesh %s: cannot read %s\n", name.c_str(), path.c_str());
+        return false;
+    }
+    madvise((void*)file.data, file.size, MADV_SEQUENTIAL);
+    ImportedGeometry geometry;
+    bool ply = file.size >= 4 && std::memcmp(file.data, "ply", 3) == 0 &&
+               (file.data[3] == '\n' || file.data[3] == '\r');
+    bool parsed = ply ? parsePly(file, geometry) : parseObj(file, geometry);
+    unmapFile(file);
+    double parseMs = millisecondsSince(start);
+    if (!parsed || geometry.corners.empty()) {
+        std::fprintf(stderr, "Mesh %s: no triangles could be read\n", name.c_str());
+        return false;
+    }
+
+    std::chrono::steady_clock::time_point weldStart = std::chrono::steady_clock::now();
+    size_t generatedNormals = 0;
+    if (!weldGeometry(geometry, mesh.vertices, mesh.indices, generatedNormals)) return false;
+    size_t sourcePositions = geometry.positions.size();
+    geometry = ImportedGeometry();
+
+    // Centered on its bounds and scaled to the body's unit radius
+    glm::vec3 lo(1e30f), hi(-1e30f);
+    for (size_t v = 0; v < mesh.vertices.size(); ++v) {
+        lo = glm::min(lo, mesh.vertices[v].position);
+        hi = glm::max(hi, mesh.vertices[v].position);
+    }
+    glm::vec3 center = (lo + hi) * 0.5f;
+    float radius = 0.0f;
+    for (size_t v = 0; v < mesh.vertices.size(); ++v) {
+        radius = std::max(radius, glm::length(mesh.vertices[v].position - center));
+    }
+    float scale = radius > 0.0f ? 1.0f / radius : 1.0f;
+    for (size_t v = 0; v < mesh.vertices.size(); ++v) {
+        mesh.vertices[v].position = (mesh.vertices[v].position - center) * scale;
+    }
+    double weldMs = millisecondsSince(weldStart);
+
+    std::chrono::steady_clock::time_point orderStart = std::chrono::steady_clock::now();
+    MeshLOD lod = { 0, 0, 0, (GLsizei)mesh.indices.size(), 0.0f, 0.0f };
+    lod.acmrBefore = simulateACMR(mesh.indices, mesh.vertices.size(), 16);
+    orderImportedTriangles(mesh.vertices, mesh.indices);
+    optimizeVertexFetch(mesh.vertices, mesh.indices);
+    lod.acmrAfter = simulateACMR(mesh.indices, mesh.vertices.size(), 16);
+    mesh.lods.assign(1, lod);
+    mesh.boundingRadius = 1.0f;
+    mesh.indexType = mesh.vertices.size() <= 65536 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+    double orderMs = millisecondsSince(orderStart);
+
+    std::chrono::steady_clock::time_point cacheStart = std::chrono::steady_clock::now();
+    if (!cachePath.empty() && makeDirectories(shaderCacheDir)) saveMeshCache(cachePath, mesh);
+    double cacheMs = millisecondsSince(cacheStart);
+
+    std::fprintf(stderr, "Mesh %s: %zu tris, %zu verts welded from %zu positions%s\n", name.c_str(),
+                 mesh.indices.size() / 3, mesh.vertices.size(), sourcePositions,
+                 generatedNormals > 0 ? ", normals generated" : "");
+    std::fprintf(stderr, "Mesh %s: parsed in %.1f ms, welded in %.1f ms, ordered in %.1f ms, cached in %.1f ms;"
+                 " %.1f ms on %d threads\n", name.c_str(), parseMs, weldMs, orderMs, cacheMs,
+                 millisecondsSince(start), jobThreadCount());
+    return true;
+}
+
+// ─── Update thread ────────────────────────────────────────────────
+//
+// Input and animation run on their own thread at a fixed tick rate. GLFW
+// callbacks must stay on the main thread, so they only push input events
+// into a single-producer queue. Each tick applies the queued input, moves
+// the stage 5 rotation by one fixed step and publishes a snapshot of the
+// previous and current scene state through a lock-free triple buffer. The
+// render loop takes the newest snapshot without waiting and interpolates
+// between its two states, drawing one tick behind the update thread. A
+// slow frame therefore delays neither input nor animation. With nothing to
+// animate and no input, the thread sleeps.
+
+const float ROTATION_SPEED = 0.48f;     // stage 5, radians per second (0.008 per frame at 60 Hz)
+const int INPUT_QUEUE_SIZE = 256;       // events; a power of two
+const int MAX_CATCHUP_TICKS = 8;        // ticks replayed after a stall before dropping time
+int tickRate = 120;                     // --tick-rate, per second
+
+enum InputKind {
+    INPUT_ORBIT,        // x, y: cursor movement in radians
+    INPUT_ZOOM,         // y: scroll steps
+    INPUT_STAGE,        // x: stages to step by
+    INPUT_RESET
+};
+
+struct InputEvent {
+    InputKind kind;
+    float x, y;
+    long long timeNs;                   // profileNow() when the callback ran
+};
+
+// Everything input and animation change; the renderer only sees copies
+struct SceneState {
+    int stage = 0;
+    float rotationAngle = 0.0f;
+    float cameraAngleX = 0.0f;          // horizontal orbit
+    float cameraAngleY = 0.0f;          // vertical orbit
+    float cameraDistance = 3.0f;
+};
+
+struct SceneSnapshot {
+    SceneState previous;                // one tick before current
+    SceneState current;
+    double time = 0.0;                  // glfwGetTime() of current
+    unsigned long long tick = 0;
+    long long inputNs = 0;              // oldest input not yet drawn, 0 if none
+};
+
+// The writer fills a slot of its own and swaps it with the shared slot;
+// the reader swaps its slot for the shared one when SNAPSHOT_FRESH is set.
+// Neither side waits, and the reader always holds a whole snapshot.
+const unsigned SNAPSHOT_FRESH = 4;
+
+struct SnapshotTripleBuffer {
+    SceneSnapshot slots[3];
+    std::atomic<unsigned> shared;       // slot index | SNAPSHOT_FRESH
+    unsigned writing = 0;               // update thread only
+    unsigned reading = 1;               // main thread only
+    SnapshotTripleBuffer() : shared(2) {}
+};
+
+struct InputQueue {
+    InputEvent events[INPUT_QUEUE_SIZE];
+    std::atomic<unsigned> head;         // pushed by the main thread
+    std::atomic<unsigned> tail;         // popped by the update thread
+    std::atomic<long long> dropped;
+    InputQueue() : head(0), tail(0), dropped(0) {}
+};
+
+struct UpdateThread {
+    std::thread thread;
+    std::atomic<bool> running;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::atomic<long long> ticks;
+    UpdateThread() : running(false), ticks(0) {}
+};
+
+SnapshotTripleBuffer sceneSnapshots;
+InputQueue inputQueue;
+UpdateThread updater;
+
+void publishSnapshot(const SceneSnapshot& snapshot) {
+    SnapshotTripleBuffer& buffer = sceneSnapshots;
+    buffer.slots[buffer.writing] = snapshot;
+    unsigned previous = buffer.shared.exchange(buffer.writing | SNAPSHOT_FRESH, std::memory_order_acq_rel);
+    buffer.writing = previous & 3;
+}
+
+// True if a newer snapshot replaced the one being read
+bool acquireSnapshot() {
+    SnapshotTripleBuffer& buffer = sceneSnapshots;
+    if (!(buffer.shared.load(std::memory_order_relaxed) & SNAPSHOT_FRESH)) return false;
+    unsigned previous = buffer.shared.exchange(buffer.reading, std::memory_order_acq_rel);
+    buffer.reading = previous & 3;
+    return true;
+}
+
+// False while the last published snapshot is waiting for the reader
+bool snapshotTaken() {
+    return !(sceneSnapshots.shared.load(std::memory_order_acquire) & SNAPSHOT_FRESH);
+}
+
+const SceneSnapshot& latestSnapshot() {
+    return sceneSnapshots.slots[sceneSnapshots.reading];
+}
+
+// Main thread (GLFW callbacks) only
+void postInput(InputKind kind, float x, float y) {
+    unsigned head = inputQueue.head.load(std::memory_order_relaxed);
+    if (head - inputQueue.tail.load(std::memory_order_acquire) == (unsigned)INPUT_QUEUE_SIZE) {
+        inputQueue.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    InputEvent& event = inputQueue.events[head & (INPUT_QUEUE_SIZE - 1)];
+    event.kind = kind;
+    event.x = x;
+    event.y = y;
+    event.timeNs = profileNow();
+    inputQueue.head.store(head + 1, std::memory_order_release);
+    // Taking the sleep mutex orders this against the thread checking for input
+    std::lock_guard<std::mutex> lock(updater.sleepMutex);
+    updater.wake.notify_one();
+}
+
+bool inputPending() {
+    return inputQueue.head.load(std::memory_order_acquire) != inputQueue.tail.load(std::memory_order_relaxed);
+}
+
+void applyInput(SceneState& state, const InputEvent& event) {
+    switch (event.kind) {
+        case INPUT_ORBIT:
+            state.cameraAngleX += event.x;
+            state.cameraAngleY -= event.y;  // inverted
+            // Clamp vertical angle to prevent flipping
+            state.cameraAngleY = glm::clamp(state.cameraAngleY, -(float)M_PI / 2.0f + 0.1f, 
+                                            (float)M_PI / 2.0f - 0.1f);
+            break;
+        case INPUT_ZOOM:
+            state.cameraDistance = glm::clamp(state.cameraDistance - event.y * 0.3f, 1.5f, 10.0f);
+            break;
+        case INPUT_STAGE:
+            state.stage = (state.stage + (int)event.x + MAX_STAGES + 1) % (MAX_STAGES + 1);
+            break;
+        case INPUT_RESET:
+            state.rotationAngle = 0.0f;
+            state.cameraAngleX = 0.0f;
+            state.cameraAngleY = 0.0f;
+            state.cameraDistance = 3.0f;
+            break;
+    }
+}
+
+// Applies the queued input to the current state; returns the oldest input's
+// time, or 0 if there was none
+long long drainInput(SceneSnapshot& snapshot) {
+    unsigned tail = inputQueue.tail.load(std::memory_order_relaxed);
+    unsigned head = inputQueue.head.load(std::memory_order_acquire);
+    long long oldest = 0;
+    bool reset = false;
+    for (; tail != head; ++tail) {
+        const InputEvent& event = inputQueue.events[tail & (INPUT_QUEUE_SIZE - 1)];
+        applyInput(snapshot.current, event);
+        if (oldest == 0) oldest = event.timeNs;
+        reset = reset || event.kind == INPUT_RESET;
+    }
+    inputQueue.tail.store(tail, std::memory_order_release);
+    // Snap instead of sweeping back across the reset
+    if (reset) snapshot.previous = snapshot.current;
+    return oldest;
+}
+
+void stepScene(SceneSnapshot& snapshot, float seconds) {
+    snapshot.previous = snapshot.current;
+    SceneState& state = snapshot.current;
+    if (state.stage == MAX_STAGES) {
+        state.rotationAngle += ROTATION_SPEED * seconds;
+        // Wrap both states so interpolation never spans the wrap
+        if (state.rotationAngle >= 2.0f * (float)M_PI) {
+            state.rotationAngle -= 2.0f * (float)M_PI;
+            snapshot.previous.rotationAngle -= 2.0f * (float)M_PI;
+        }
+    }
+}
+
+void updateLoop() {
+    profileTrack = PROFILE_UPDATE_THREAD;
+    const double tickSeconds = 1.0 / tickRate;
+    SceneSnapshot snapshot;
+    double nextTick = glfwGetTime();
+    long long unseenInputNs = 0;
+    while (updater.running.load()) {
+        if (snapshot.current.stage != MAX_STAGES && !inputPending()) {
+            std::unique_lock<std::mutex> lock(updater.sleepMutex);
+            updater.wake.wait(lock, [] { return !updater.running.load() || inputPending(); });
+            // Start ticking again from now rather than replaying the idle time
+            nextTick = std::max(nextTick, glfwGetTime());
+            continue;
+        }
+        double now = glfwGetTime();
+        if (now < nextTick) {
+            std::this_thread::sleep_for(std::chrono::duration<double>(nextTick - now));
+            continue;
+        }
+        
+        ProfileScope scope("tick");
+        int steps = 0;
+        // Ticks stay on a fixed grid, so every step is the same length
+        while (nextTick <= now) {
+            if (++steps > MAX_CATCHUP_TICKS) {
+                nextTick = now;
+                break;
+            }
+            stepScene(snapshot, (float)tickSeconds);
+            ++snapshot.tick;
+            snapshot.time = nextTick;
+            nextTick += tickSeconds;
+        }
+        // Input in a snapshot the renderer skipped is carried to the next one
+        if (snapshotTaken()) unseenInputNs = 0;
+        long long inputNs = drainInput(snapshot);
+        if (unseenInputNs == 0) unseenInputNs = inputNs;
+        snapshot.inputNs = unseenInputNs;
+        publishSnapshot(snapshot);
+        updater.ticks.fetch_add(1, std::memory_order_relaxed);
+        // An on-demand main loop may be blocked waiting for events
+        if (inputNs != 0) glfwPostEmptyEvent();
+    }
+}
+
+void startUpdateThread() {
+    updater.running = true;
+    updater.thread = std::thread(updateLoop);
+}
+
+void stopUpdateThread() {
+    {
+        std::lock_guard<std::mutex> lock(updater.sleepMutex);
+        updater.running = false;
+    }
+    updater.wake.notify_all();
+    if (updater.thread.joinable()) updater.thread.join();
+}
+
+glm::vec3 orbitCameraPosition(const SceneState& state) {
+    float x = state.cameraDistance * cos(state.cameraAngleY) * sin(state.cameraAngleX);
+    float y = state.cameraDistance * sin(state.cameraAngleY) + 0.5f;
+    float z = state.cameraDistance * cos(state.cameraAngleY) * cos(state.cameraAngleX);
+    return glm::vec3(x, y, z);
+}
+
+// Sets the render globals to the snapshot as of `time`, one tick behind
+// the update thread; returns false while the view is still between ticks
+bool applySnapshot(const SceneSnapshot& snapshot, double time) {
+    float t = (float)glm::clamp((time - snapshot.time) * tickRate, 0.0, 1.0);
+    const SceneState& a = snapshot.previous;
+    const SceneState& b = snapshot.current;
+    SceneState state = b;
+    state.rotationAngle = glm::mix(a.rotationAngle, b.rotationAngle, t);
+    state.cameraAngleX = glm::mix(a.cameraAngleX, b.cameraAngleX, t);
+    state.cameraAngleY = glm::mix(a.cameraAngleY, b.cameraAngleY, t);
+    state.cameraDistance = glm::mix(a.cameraDistance, b.cameraDistance, t);
+    currentStage = state.stage;
+    rotationAngle = state.rotationAngle;
+    cameraPos = orbitCameraPosition(state);
+    return t >= 1.0f;
+}
+
+// ─── Celestial Brush ──────────────────────────────────────────────
+//
+// In brush mode (B) a left drag paints ink over the scene instead of
+// orbiting the camera. The cursor callback runs at the full input rate and
+// only appends a timestamped sample to a lock-free single-producer ring.
+// The render loop drains the ring right before it draws, so the newest
+// sample is on screen in the next frame without waiting for an update tick.
+// Each sample goes through a one-euro filter, which smooths jitter at low
+// speed and follows quickly at high speed. Catmull-Rom segments through the
+// filtered points are tessellated into ribbons whose width and dryness
+// follow the brush speed. A segment is final once the point after it is
+// known. Final vertices are only ever appended; the short tip of the open
+// stroke is rebuilt every frame. The work per frame therefore depends on the
+// new samples, not on how much ink is already on screen.
+
+const int BRUSH_QUEUE_SIZE = 4096;      // samples; a power of two, 4 s at 1 kHz
+const float BRUSH_WIDTH = 22.0f;        // ribbon width in pixels at 720p, at rest
+const float BRUSH_STEP = 2.0f;          // centerline spacing in pixels at 720p
+const int BRUSH_MAX_STEPS = 64;         // centerline points per Catmull-Rom segment
+const float BRUSH_TAPER = 28.0f;        // pixels at 720p over which a stroke swells to full width
+const float BRUSH_MIN_CUTOFF = 1.5f;    // one-euro filter, Hz at rest
+const float BRUSH_BETA = 0.01f;         // cutoff increase per pixel/s at 720p
+const float BRUSH_DERIVATIVE_CUTOFF = 1.0f;
+const float BRUSH_MIN_DT = 0.001f;      // seconds; callbacks handled in one poll share a timestamp
+
+enum BrushSampleKind {
+    BRUSH_DOWN,         // first sample of a stroke
+    BRUSH_MOVE,
+    BRUSH_UP,           // last sample of a stroke
+    BRUSH_CLEAR         // wipe the canvas
+};
+
+struct BrushSample {
+    BrushSampleKind kind;
+    float x, y;                         // framebuffer pixels from the top left
+    long long timeNs;                   // profileNow() when the callback ran
+};
+
+struct BrushQueue {
+    BrushSample samples[BRUSH_QUEUE_SIZE];
+    std::atomic<unsigned> head;         // pushed by the input callbacks
+    std::atomic<unsigned> tail;         // popped by the render loop
+    std::atomic<long long> dropped;
+    BrushQueue() : head(0), tail(0), dropped(0) {}
+};
+
+struct BrushVertex {
+    float x, y;                         // framebuffer pixels from the top left
+    float across;                       // -1 to 1 over the ribbon
+    float along;                        // pixels from the start of the stroke
+    float dryness;                      // 0 wet to 1 dry, from the brush speed
+};
+
+struct OneEuroFilter {
+    glm::vec2 value;
+    glm::vec2 derivative;               // pixels per second
+    long long timeNs = 0;
+};
+
+struct BrushStroke {
+    bool open = false;
+    OneEuroFilter filter;
+    float width = 0.0f;                 // smoothed target width at the newest point
+    glm::vec4 controls[4];              // newest last: x, y, width, dryness
+    int controlCount = 0;
+    // End of the ribbon so far
+    bool hasPoint = false;
+    bool hasNormal = false;
+    glm::vec2 last;
+    glm::vec2 lastNormal;
+    float lastWidth = 0.0f;
+    float lastDryness = 0.0f;
+    float along = 0.0f;
+};
+
+struct BrushInk {
+    BrushStroke stroke;
+    std::vector<BrushVertex> appended;  // final vertices not yet uploaded
+    std::vector<BrushVertex> tip;       // provisional end of the open stroke
+    bool cleared = false;               // a clear is waiting for the renderer
+    long long strokes = 0;
+    long long vertices = 0;             // final vertices since the last clear
+    long long samples = 0;
+};
+
+BrushQueue brushQueue;
+BrushInk brushInk;
+bool brushMode = false;                 // --brush, B toggles
+bool inkBleedEnabled = true;            // --ink-bleed, I toggles
+bool inkBleedWet = false;               // the ink bleed still has wet tiles to step
+
+// Single producer: the GLFW callbacks, or the benchmark
+void postBrushSample(BrushSampleKind kind, float x, float y, long long timeNs) {
+    unsigned head = brushQueue.head.load(std::memory_order_relaxed);
+    if (head - brushQueue.tail.load(std::memory_order_acquire) == (unsigned)BRUSH_QUEUE_SIZE) {
+        brushQueue.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    BrushSample& sample = brushQueue.samples[head & (BRUSH_QUEUE_SIZE - 1)];
+    sample.kind = kind;
+    sample.x = x;
+    sample.y = y;
+    sample.timeNs = timeNs;
+    brushQueue.head.store(head + 1, std::memory_order_release);
+}
+
+float oneEuroAlpha(float cutoff, float dt) {
+    float tau = 1.0f / (2.0f * (float)M_PI * cutoff);
+    return 1.0f / (1.0f + tau / dt);
+}
+
+glm::vec2 filterBrushSample(OneEuroFilter& filter, glm::vec2 position, long long timeNs,
+                            float pixelScale) {
+    float dt = std::max((timeNs - filter.timeNs) / 1.0e9f, BRUSH_MIN_DT);
+    filter.timeNs = timeNs;
+    glm::vec2 derivative = (position - filter.value) * (1.0f / dt);
+    filter.derivative = glm::mix(filter.derivative, derivative, oneEuroAlpha(BRUSH_DERIVATIVE_CUTOFF, dt));
+    float cutoff = BRUSH_MIN_CUTOFF + BRUSH_BETA * glm::length(filter.derivative) / pixelScale;
+    filter.value = glm::mix(filter.value, position, oneEuroAlpha(cutoff, dt));
+    return filter.value;
+}
+
+glm::vec4 catmullRom(const glm::vec4& p0, const glm::vec4& p1, const glm::vec4& p2, const glm::vec4& p3,
+                     float t) {
+    float t2 = t * t;
+    float t3 = t2 * t;
+    return (p1 * 2.0f + (p2 - p0) * t + (p0 * 2.0f - p1 * 5.0f + p2 * 4.0f - p3) * t2 +
+            (p1 * 3.0f - p0 - p2 * 3.0f + p3) * t3) * 0.5f;
+}
+
+// Extends the ribbon to `point` (x, y, width, dryness) with one quad
+void brushRibbonPoint(BrushStroke& stroke, const glm::vec4& point, float pixelScale,
+                      std::vector<BrushVertex>& out) {
+    glm::vec2 position(point.x, point.y);
+    if (!stroke.hasPoint) {
+        stroke.hasPoint = true;
+        stroke.last = position;
+        stroke.lastWidth = point.z * 0.3f;
+        stroke.lastDryness = point.w;
+        return;
+    }
+    glm::vec2 delta = position - stroke.last;
+    float length = glm::length(delta);
+    if (length < 0.01f) return;
+    glm::vec2 normal(-delta.y / length, delta.x / length);
+    // The first quad starts square; after that each quad starts on the
+    // previous one's end edge, so the ribbon has no gaps
+    if (!stroke.hasNormal) {
+        stroke.hasNormal = true;
+        stroke.lastNormal = normal;
+    }
+    float along = stroke.along + length;
+    float width = point.z * std::min(1.0f, 0.3f + 0.7f * along / (BRUSH_TAPER * pixelScale));
+
+    glm::vec2 startOffset = stroke.lastNormal * (stroke.lastWidth * 0.5f);
+    glm::vec2 endOffset = normal * (width * 0.5f);
+    BrushVertex corners[4] = {
+        { stroke.last.x - startOffset.x, stroke.last.y - startOffset.y, -1.0f, stroke.along, stroke.lastDryness },
+        { stroke.last.x + startOffset.x, stroke.last.y + startOffset.y, 1.0f, stroke.along, stroke.lastDryness },
+        { position.x - endOffset.x, position.y - endOffset.y, -1.0f, along, point.w },
+        { position.x + endOffset.x, position.y + endOffset.y, 1.0f, along, point.w }
+    };
+    static const int ORDER[6] = { 0, 1, 2, 2, 1, 3 };
+    for (int i = 0; i < 6; ++i) out.push_back(corners[ORDER[i]]);
+
+    stroke.last = position;
+    stroke.lastNormal = normal;
+    stroke.lastWidth = width;
+    stroke.lastDryness = point.w;
+    stroke.along = along;
+}
+
+// Tessellates the curve from controls[1] to controls[2]
+void brushSegment(BrushStroke& stroke, const glm::vec4* controls, float pixelScale,
+                  std::vector<BrushVertex>& out) {
+    float length = glm::length(glm::vec2(controls[2].x - controls[1].x, controls[2].y - controls[1].y));
+    float spacing = std::max(BRUSH_STEP * pixelScale, 1.0f);
+    int steps = glm::clamp((int)std::ceil(length / spacing), 1, BRUSH_MAX_STEPS);
+    for (int step = 1; step <= steps; ++step) {
+        brushRibbonPoint(stroke, catmullRom(controls[0], controls[1], controls[2], controls[3],
+                                            step / (float)steps), pixelScale, out);
+    }
+}
+
+// Filtered point for a sample; fast strokes are thinner and drier
+glm::vec4 brushControlPoint(BrushStroke& stroke, const BrushSample& sample, float pixelScale) {
+    glm::vec2 position = filterBrushSample(stroke.filter, glm::vec2(sample.x, sample.y), sample.timeNs,
+                                           pixelScale);
+    float speed = glm::length(stroke.filter.derivative) / pixelScale;
+    float width = BRUSH_WIDTH * pixelScale * glm::clamp(1.15f - speed / 2500.0f, 0.4f, 1.0f);
+    stroke.width = glm::mix(stroke.width, width, 0.35f);
+    float dryness = glm::clamp((speed - 800.0f) / 2000.0f, 0.0f, 0.8f);
+    return glm::vec4(position.x, position.y, stroke.width, dryness);
+}
+
+void pushBrushControl(BrushStroke& stroke, const glm::vec4& point, float pixelScale,
+                      std::vector<BrushVertex>& out) {
+    const glm::vec4& newest = stroke.controls[stroke.controlCount - 1];
+    if (glm::length(glm::vec2(point.x - newest.x, point.y - newest.y)) < 0.25f * pixelScale) return;
+    stroke.controls[stroke.controlCount++] = point;
+    if (stroke.controlCount == 4) {
+        brushSegment(stroke, stroke.controls, pixelScale, out);
+        for (int i = 0; i < 3; ++i) stroke.controls[i] = stroke.controls[i + 1];
+        stroke.controlCount = 3;
+    }
+}
+
+// Finishes the last segment and flicks the brush off in its direction
+void endBrushStroke(BrushStroke& stroke, float pixelScale, std::vector<BrushVertex>& out) {
+    if (stroke.controlCount == 3) {
+        glm::vec4 controls[4] = { stroke.controls[0], stroke.controls[1], stroke.controls[2], stroke.controls[2] };
+        brushSegment(stroke, controls, pixelScale, out);
+    }
+    if (stroke.hasNormal) {
+        glm::vec2 direction(stroke.lastNormal.y, -stroke.lastNormal.x);
+        float length = std::min(glm::length(stroke.filter.derivative) * 0.015f, 40.0f * pixelScale);
+        const int FLICK_POINTS = 6;
+        glm::vec2 start = stroke.last;
+        float dryness = stroke.lastDryness;
+        for (int i = 1; i <= FLICK_POINTS && length > pixelScale; ++i) {
+            float t = i / (float)FLICK_POINTS;
+            glm::vec2 position = start + direction * (length * t);
+            brushRibbonPoint(stroke, glm::vec4(position.x, position.y, stroke.width * (1.0f - t),
+                                               std::min(dryness + 0.4f * t, 1.0f)), pixelScale, out);
+        }
+    }
+    stroke.open = false;
+}
+
+// Drains the sample ring into brushInk: final vertices are appended and
+// the open stroke's tip is rebuilt. Returns the newest sample's timestamp,
+// or 0 if there was none.
+long long processBrushSamples(float pixelScale) {
+    BrushInk& ink = brushInk;
+    unsigned head = brushQueue.head.load(std::memory_order_acquire);
+    unsigned tail = brushQueue.tail.load(std::memory_order_relaxed);
+    if (head == tail) return 0;
+    ProfileScope scope("brush strokes");
+
+    long long newestNs = 0;
+    BrushStroke& stroke = ink.stroke;
+    for (; tail != head; ++tail) {
+        const BrushSample& sample = brushQueue.samples[tail & (BRUSH_QUEUE_SIZE - 1)];
+        newestNs = sample.timeNs;
+        ++ink.samples;
+        size_t before = ink.appended.size();
+        if (sample.kind == BRUSH_DOWN) {
+            stroke = BrushStroke();
+            stroke.open = true;
+            stroke.filter.value = glm::vec2(sample.x, sample.y);
+            stroke.filter.timeNs = sample.timeNs;
+            stroke.width = BRUSH_WIDTH * pixelScale;
+            glm::vec4 point(sample.x, sample.y, stroke.width, 0.0f);
+            stroke.controls[0] = stroke.controls[1] = point;
+            stroke.controlCount = 2;
+            brushRibbonPoint(stroke, point, pixelScale, ink.appended);
+            ++ink.strokes;
+        } else if (sample.kind == BRUSH_CLEAR) {
+            stroke.open = false;
+            ink.appended.clear();
+            ink.cleared = true;
+            ink.strokes = 0;
+            ink.vertices = 0;
+            before = 0;
+        } else if (stroke.open) {
+            pushBrushControl(stroke, brushControlPoint(stroke, sample, pixelScale), pixelScale, ink.appended);
+            if (sample.kind == BRUSH_UP) endBrushStroke(stroke, pixelScale, ink.appended);
+        }
+        ink.vertices += (long long)(ink.appended.size() - before);
+    }
+    brushQueue.tail.store(tail, std::memory_order_release);
+
+    // The tip runs from the last final point to the newest filtered one
+    ink.tip.clear();
+    if (stroke.open && stroke.controlCount == 3) {
+        BrushStroke tip = stroke;
+        glm::vec4 controls[4] = { stroke.controls[0], stroke.controls[1], stroke.controls[2], stroke.controls[2] };
+        brushSegment(tip, controls, pixelScale, ink.tip);
+    }
+    return newestNs;
+}
+
+// ─── Frame pacing ─────────────────────────────────────────────────
+//
+// In on-demand mode the main loop blocks in glfwWaitEventsTimeout until
+// input arrives, a background job finishes or the next animation frame is
+// due. Input callbacks, stage switches and GL uploads mark the view dirty;
+// a static view is drawn once and then left alone. Animated views (stage 5,
+// the profiler HUD, continuous mode) are paced to --target-fps on top of
+// the swap interval. The loop tracks its own CPU and GPU utilization so the
+// idle cost can be measured (--render-stats, and a summary on exit).
+
+const double IDLE_WAIT_SECONDS = 0.25;  // longest blocked wait, in case a wakeup is missed
+const double RENDER_STATS_SECONDS = 10.0;
+
+bool viewDirty = true;
+bool viewSettling = false;              // the last frame drew a snapshot between ticks
+double nextFrameTime = 0.0;
+bool printRenderStats = false;          // --render-stats
+
+struct RenderLoopStats {
+    double wallStart = 0.0;
+    std::clock_t cpuStart = 0;          // process CPU time, all threads
+    long long framesDrawn = 0;
+    long long wakeups = 0;
+    double gpuMs = 0.0;
+    long long ticksStart = 0;
+    long long inputFrames = 0;          // frames that showed new input
+    double inputLatencyMs = 0.0;        // input callback to the end of the swap, summed
+    double maxInputLatencyMs = 0.0;
+    long long brushFrames = 0;          // frames that showed new brush samples
+    double brushLatencyMs = 0.0;        // newest sample to the end of the swap, summed
+    double maxBrushLatencyMs = 0.0;
+    double brushUploadBytes = 0.0;      // brush vertex bytes written, summed over brushFrames
+    size_t maxBrushUploadBytes = 0;
+    GLuint queries[2] = { 0, 0 };       // GL_TIME_ELAPSED of drawn frames, alternating
+    bool queryPending[2] = { false, false };
+    int query = 0;
+};
+
+RenderLoopStats renderStats;
+
+void markViewDirty() {
+    viewDirty = true;
+}
+
+const char* renderModeName(RenderMode mode) {
+    return mode == RENDER_ON_DEMAND ? "on-demand" : "continuous";
+}
+
+// A minimized window has an empty framebuffer and draws nothing
+bool windowVisible() {
+    return framebufferWidth > 0 && framebufferHeight > 0;
+}
+
+bool viewAnimates() {
+    if (!windowVisible()) return false;
+    return renderMode == RENDER_CONTINUOUS || currentStage == MAX_STAGES || profilerHudVisible ||
+           viewSettling || inkBleedWet || lanternCount > 0;
+}
+
+// Returns once there may be something to do: input, background work or
+// the next animation frame
+void waitForEvents() {
+    ++renderStats.wakeups;
+    // With no worker threads, queued jobs only advance in the main loop
+    bool inlineJobs = jobThreadCount() == 1 && jobSystem.queuedJobs.load() > 0;
+    if (inlineJobs || glUploads.load() != nullptr) {
+        glfwPollEvents();
+    } else if (viewAnimates()) {
+        double timeout = nextFrameTime - glfwGetTime();
+        if (timeout > 0.0) glfwWaitEventsTimeout(timeout);
+        else glfwPollEvents();
+    } else if (viewDirty && windowVisible()) {
+        glfwPollEvents();
+    } else {
+        glfwWaitEventsTimeout(IDLE_WAIT_SECONDS);
+    }
+}
+
+bool frameDue() {
+    if (!windowVisible()) return false;
+    return viewAnimates() ? glfwGetTime() >= nextFrameTime : viewDirty;
+}
+
+// Call once per drawn frame
+void advanceFrameClock() {
+    double now = glfwGetTime();
+    viewDirty = false;
+    // Keep a steady cadence without bursting to catch up on late frames
+    nextFrameTime = targetFps > 0 ? std::max(nextFrameTime + 1.0 / targetFps, now) : now;
+    ++renderStats.framesDrawn;
+}
+
+// Call after the swap of a frame that drew a snapshot with new input
+void recordInputLatency(long long inputNs) {
+    double milliseconds = (profileNow() - inputNs) / 1.0e6;
+    ++renderStats.inputFrames;
+    renderStats.inputLatencyMs += milliseconds;
+    renderStats.maxInputLatencyMs = std::max(renderStats.maxInputLatencyMs, milliseconds);
+}
+
+// Call after the swap of a frame that drew new brush samples
+void recordBrushLatency(long long sampleNs, size_t uploadBytes) {
+    double milliseconds = (profileNow() - sampleNs) / 1.0e6;
+    ++renderStats.brushFrames;
+    renderStats.brushLatencyMs += milliseconds;
+    renderStats.maxBrushLatencyMs = std::max(renderStats.maxBrushLatencyMs, milliseconds);
+    renderStats.brushUploadBytes += uploadBytes;
+    renderStats.maxBrushUploadBytes = std::max(renderStats.maxBrushUploadBytes, uploadBytes);
+}
+
+// Returns the frame's GPU milliseconds, or -1 if they are not available
+double readFrameGpuTimer(int index) {
+    GLint available = GL_FALSE;
+    glGetQueryObjectiv(renderStats.queries[index], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) return -1.0;
+    GLuint64 ns = 0;
+    glGetQueryObjectui64v(renderStats.queries[index], GL_QUERY_RESULT, &ns);
+    renderStats.queryPending[index] = false;
+    // llvmpipe can report an absolute timestamp for a context's first query;
+    // no frame is longer than the whole run
+    if (ns / 1.0e9 > glfwGetTime()) return -1.0;
+    renderStats.gpuMs += ns / 1.0e6;
+    return ns / 1.0e6;
+}
+
+// The previous use of a query is two drawn frames old, so reading it does
+// not wait in practice. Returns that frame's GPU milliseconds, or -1.
+double beginFrameGpuTimer() {
+    if (renderStats.queries[0] == 0) glGenQueries(2, renderStats.queries);
+    int index = renderStats.query;
+    double milliseconds = -1.0;
+    if (renderStats.queryPending[index]) {
+        milliseconds = readFrameGpuTimer(index);
+        renderStats.queryPending[index] = false;
+    }
+    glBeginQuery(GL_TIME_ELAPSED, renderStats.queries[index]);
+    return milliseconds;
+}
+
+void endFrameGpuTimer() {
+    glEndQuery(GL_TIME_ELAPSED);
+    renderStats.queryPending[renderStats.query] = true;
+    renderStats.query = 1 - renderStats.query;
+}
+
+void resetRenderStats() {
+    for (int i = 0; i < 2; ++i) {
+        if (renderStats.queryPending[i]) readFrameGpuTimer(i);
+    }
+    renderStats.wallStart = glfwGetTime();
+    renderStats.cpuStart = std::clock();
+    renderStats.framesDrawn = 0;
+    renderStats.wakeups = 0;
+    renderStats.gpuMs = 0.0;
+    renderStats.ticksStart = updater.ticks.load();
+    renderStats.inputFrames = 0;
+    renderStats.inputLatencyMs = 0.0;
+    renderStats.maxInputLatencyMs = 0.0;
+    renderStats.brushFrames = 0;
+    renderStats.brushLatencyMs = 0.0;
+    renderStats.maxBrushLatencyMs = 0.0;
+    renderStats.brushUploadBytes = 0.0;
+    renderStats.maxBrushUploadBytes = 0;
+}
+
+// Prints utilization since the last reset and starts a new interval
+void reportRenderStats() {
+    for (int i = 0; i < 2; ++i) {
+        if (renderStats.queryPending[i]) readFrameGpuTimer(i);
+    }
+    double seconds = std::max(glfwGetTime() - renderStats.wallStart, 1e-9);
+    double cpuSeconds = (std::clock() - renderStats.cpuStart) / (double)CLOCKS_PER_SEC;
+    std::printf("Render loop (%s): %lld frames drawn, %lld wakeups in %.1f s (%.1f fps); "
+                "CPU %.1f%% of a core, GPU %.1f%% busy\n",
+                renderModeName(renderMode), renderStats.framesDrawn, renderStats.wakeups, seconds,
+                renderStats.framesDrawn / seconds, 100.0 * cpuSeconds / seconds,
+                100.0 * renderStats.gpuMs / 1000.0 / seconds);
+    long long ticks = updater.ticks.load() - renderStats.ticksStart;
+    std::printf("Update thread: %lld ticks at %d Hz", ticks, tickRate);
+    if (renderStats.inputFrames > 0) {
+        std::printf("; input to frame %.1f ms average, %.1f ms worst over %lld frames",
+                    renderStats.inputLatencyMs / renderStats.inputFrames, renderStats.maxInputLatencyMs,
+                    renderStats.inputFrames);
+    }
+    long long dropped = inputQueue.dropped.load();
+    if (dropped > 0) std::printf("; %lld input events dropped", dropped);
+    std::printf("\n");
+    if (renderStats.brushFrames > 0) {
+        std::printf("Celestial Brush: %lld strokes, %lld vertices; newest sample to swap %.1f ms average, "
+                    "%.1f ms worst; %.0f bytes uploaded per frame average, %zu worst over %lld frames",
+                    brushInk.strokes, brushInk.vertices,
+                    renderStats.brushLatencyMs / renderStats.brushFrames, renderStats.maxBrushLatencyMs,
+                    renderStats.brushUploadBytes / renderStats.brushFrames, renderStats.maxBrushUploadBytes,
+                    renderStats.brushFrames);
+        long long brushDropped = brushQueue.dropped.load();
+        if (brushDropped > 0) std::printf("; %lld samples dropped", brushDropped);
+        std::printf("\n");
+    }
+    std::fflush(stdout);
+    resetRenderStats();
+}
+
+void deleteRenderStats() {
+    glDeleteQueries(2, renderStats.queries);
+    renderStats = RenderLoopStats();
+}
+
+// Brush samples are in framebuffer pixels, which HiDPI windows have more of
+void postBrushCursor(GLFWwindow* window, BrushSampleKind kind, double xpos, double ypos) {
+    int windowWidth, windowHeight;
+    glfwGetWindowSize(window, &windowWidth, &windowHeight);
+    if (windowWidth <= 0 || windowHeight <= 0) return;
+    postBrushSample(kind, (float)(xpos * framebufferWidth / windowWidth),
+                    (float)(ypos * framebufferHeight / windowHeight), profileNow());
+    markViewDirty();
+}
+
+void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods) {
+    if (button == GLFW_MOUSE_BUTTON_LEFT) {
+        if (action == GLFW_PRESS) {
+            mousePressed = true;
+            glfwGetCursorPos(window, &lastMouseX, &lastMouseY);
+            if (brushMode) postBrushCursor(window, BRUSH_DOWN, lastMouseX, lastMouseY);
+        } else if (action == GLFW_RELEASE) {
+            mousePressed = false;
+            if (brushMode) {
+                double x, y;
+                glfwGetCursorPos(window, &x, &y);
+                postBrushCursor(window, BRUSH_UP, x, y);
+            }
+        }
+    }
+}
+
+void cursorPosCallback(GLFWwindow* window, double xpos, double ypos) {
+    if (mousePressed && brushMode) {
+        postBrushCursor(window, BRUSH_MOVE, xpos, ypos);
+    } else if (mousePressed) {
+        double deltaX = xpos - lastMouseX;
+        double deltaY = ypos - lastMouseY;
+        
+        // Update camera angles based on mouse movement
+        postInput(INPUT_ORBIT, (float)deltaX * 0.005f, (float)deltaY * 0.005f);
+        
+        lastMouseX = xpos;
+        lastMouseY = ypos;
+    }
+}
+
+void scrollCallback(GLFWwindow* window, double xoffset, double yoffset) {
+    // Zoom in/out with mouse wheel
+    postInput(INPUT_ZOOM, 0.0f, (float)yoffset);
+}
+
+void framebufferSizeCallback(GLFWwindow* window, int width, int height) {
+    framebufferWidth = width;
+    framebufferHeight = height;
+    markViewDirty();
+}
+
+void printStageBanner(int stage) {
+    std::cout << "\n━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━\n";
+    std::cout << "Stage " << stage << ": ";
+    switch(stage) {
+        case 0: 
+            std::cout << "Basic 3D Model";
+            std::cout << "\n→ Standard Phong lighting";
+            break;
+        case 1: 
+            std::cout << "Cel Shading (3-tone)";
+            std::cout << "\n→ Warm cream base color";
+            std::cout << "\n→ Clear light separation";
+            break;
+        case 2: 
+            std::cout << "Sumi-e Outlines (THICK)";
+            std::cout << "\n→ VERY thick black lines";
+            std::cout << "\n→ Traditional brush stroke feel";
+            break;
+        case 3: 
+            std::cout << "Tomoe Patterns (Controlled)";
+            std::cout << "\n→ Selective red markings";
+            std::cout << "\n→ Spiral + spot patterns";
+            break;
+        case 4: 
+            std::cout << "Full Ōkami Style";
+            std::cout << "\n→ Paper texture";
+            std::cout << "\n→ Balanced colors";
+            std::cout << "\n→ Complete ukiyo-e aesthetic";
+            break;
+        case 5: 
+            std::cout << "Animated (Auto-rotate)";
+            break;
+    }
+    std::cout << "\n━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━\n";
+}
+
+void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+    if (action == GLFW_PRESS) {
+        // Stage and camera changes reach the screen with the update thread's
+        // next snapshot; every other binding changes what is on screen now
+        bool sceneInput = key == GLFW_KEY_SPACE || key == GLFW_KEY_RIGHT || key == GLFW_KEY_LEFT ||
+                          key == GLFW_KEY_R;
+        if (!sceneInput) markViewDirty();
+        if (key == GLFW_KEY_SPACE || key == GLFW_KEY_RIGHT) {
+            postInput(INPUT_STAGE, 1.0f, 0.0f);
+        } else if (key == GLFW_KEY_LEFT) {
+            postInput(INPUT_STAGE, -1.0f, 0.0f);
+        } else if (key == GLFW_KEY_ESCAPE || key == GLFW_KEY_Q) {
+            glfwSetWindowShouldClose(window, true);
+        } else if (key == GLFW_KEY_O) {
+            outlineMode = outlineMode == OUTLINE_SCREEN ? OUTLINE_RIM : OUTLINE_SCREEN;
+            std::cout << "Outlines: " << (outlineMode == OUTLINE_SCREEN ? 
+                "screen-space ink strokes" : "per-fragment rim (original)") << "\n";
+        } else if (key == GLFW_KEY_P) {
+            paperMode = paperMode == PAPER_TEXTURE ? PAPER_HASH : PAPER_TEXTURE;
+            std::cout << "Paper grain: " << (paperMode == PAPER_TEXTURE ? 
+                "tileable texture" : "per-fragment hash (original)") << "\n";
+        } else if (key == GLFW_KEY_T) {
+            tomoeMode = tomoeMode == TOMOE_ATLAS ? TOMOE_ANALYTIC : TOMOE_ATLAS;
+            std::cout << "Tomoe: " << (tomoeMode == TOMOE_ATLAS ? 
+                "baked distance atlas" : "analytic (original)") << "\n";
+        } else if (key == GLFW_KEY_H) {
+            profilerHudVisible = !profilerHudVisible;
+            profilerEnabled.store(profilerHudVisible || !traceOutputPath.empty());
+            std::cout << "Profiler HUD: " << (profilerHudVisible ? "on" : "off") << "\n";
+        } else if (key == GLFW_KEY_J) {
+            dumpChromeTrace();
+        } else if (key == GLFW_KEY_M) {
+            reportRenderStats();
+            renderMode = renderMode == RENDER_ON_DEMAND ? RENDER_CONTINUOUS : RENDER_ON_DEMAND;
+            std::cout << "Render mode: " << renderModeName(renderMode) << "\n";
+        } else if (key == GLFW_KEY_V) {
+            // The mesh is re-uploaded by the main loop
+            vertexFormat = vertexFormat == VERTEX_FLOAT ? VERTEX_PACKED : VERTEX_FLOAT;
+        } else if (key == GLFW_KEY_C) {
+            crowdSize = crowdSize > 0 ? 0 : crowdOption;
+            if (crowdSize > 0) {
+                std::cout << "Instanced crowd: " << crowdSize << " eggs\n";
+            } else {
+                std::cout << "Single egg\n";
+            }
+        } else if (key == GLFW_KEY_K) {
+            crowdCulling = !crowdCulling;
+            std::cout << "Crowd culling: " << (crowdCulling ? "BVH + multi-draw indirect" : "off") << "\n";
+        } else if (key == GLFW_KEY_A) {
+            antiAliasing = (AntiAliasing)((antiAliasing + 1) % NUM_ANTI_ALIASING);
+            std::cout << "Anti-aliasing: " << ANTI_ALIASING_MODES[antiAliasing].name << "\n";
+        } else if (key == GLFW_KEY_D) {
+            dynamicResolution = !dynamicResolution;
+            std::cout << "Dynamic resolution: " << (dynamicResolution ? "on" : "off") << "\n";
+        } else if (key == GLFW_KEY_R) {
+            postInput(INPUT_RESET, 0.0f, 0.0f);
+            std::cout << "Rotation and camera reset\n";
+        } else if (key == GLFW_KEY_B) {
+            brushMode = !brushMode;
+            if (!brushMode && mousePressed) {
+                double x, y;
+                glfwGetCursorPos(window, &x, &y);
+                postBrushCursor(window, BRUSH_UP, x, y);
+            }
+            std::cout << "Celestial Brush: " << (brushMode ? "on (drag to paint, X clears)" : "off") << "\n";
+        } else if (key == GLFW_KEY_X) {
+            postBrushSample(BRUSH_CLEAR, 0.0f, 0.0f, profileNow());
+        } else if (key == GLFW_KEY_I) {
+            inkBleedEnabled = !inkBleedEnabled;
+            std::cout << "Ink bleed: " << (inkBleedEnabled ? "on" : "off") << "\n";
+        } else if (key == GLFW_KEY_L) {
+            lanternCount = lanternCount > 0 ? 0 : lanternOption;
+            if (lanternCount > 0) {
+                std::cout << "Lanterns: " << lanternCount << " (" << (lightClusters ? "clustered" : "flat") << ")\n";
+            } else {
+                std::cout << "Lanterns: off\n";
+            }
+        }
+    }
+}
+
+// ─── Packed vertex format ─────────────────────────────────────────
+//
+// Positions are quantized to snorm16 inside the mesh bounding box and
+// decoded in the vertex shader with a per-mesh scale and bias. Normals are
+// octahedral-encoded into two snorm16 values and UVs stored as unorm16.
+// The float layout is drawn by
+// the same shaders with scale 1, bias 0 and octNormals off.
+
+struct PackedVertex {
+    GLshort position[4];    // xyz snorm16, w is padding to keep 4-byte alignment
+    GLshort normal[2];      // octahedral snorm16
+    GLushort uv[2];         // unorm16
+};
+static_assert(sizeof(PackedVertex) == 16, "PackedVertex must stay 16 bytes");
+
+GLshort packSnorm16(float value) {
+    return (GLshort)std::floor(glm::clamp(value, -1.0f, 1.0f) * 32767.0f + 0.5f);
+}
+
+glm::vec2 octahedralEncode(glm::vec3 n) {
+    n = n * (1.0f / (std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z)));
+    glm::vec2 e(n.x, n.y);
+    if (n.z < 0.0f) {
+        e = glm::vec2((1.0f - std::fabs(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f),
+                      (1.0f - std::fabs(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f));
+    }
+    return e;
+}
+
+std::vector<PackedVertex> packVertices(Mesh& mesh) {
+    const Vertex* vertices = meshVertices(mesh);
+    size_t count = meshVertexCount(mesh);
+    glm::vec3 lo(1e30f), hi(-1e30f);
+    for (size_t i = 0; i < count; ++i) {
+        lo = glm::min(lo, vertices[i].position);
+        hi = glm::max(hi, vertices[i].position);
+    }
+    mesh.positionBias = (lo + hi) * 0.5f;
+    mesh.positionScale = glm::max((hi - lo) * 0.5f, glm::vec3(1e-6f));
+    
+    std::vector<PackedVertex> packed(count);
+    for (size_t i = 0; i < count; ++i) {
+        glm::vec3 p = (vertices[i].position - mesh.positionBias) / mesh.positionScale;
+        glm::vec2 n = octahedralEncode(vertices[i].normal);
+        packed[i].position[0] = packSnorm16(p.x);
+        packed[i].position[1] = packSnorm16(p.y);
+        packed[i].position[2] = packSnorm16(p.z);
+        packed[i].position[3] = 0;
+        packed[i].normal[0] = packSnorm16(n.x);
+        packed[i].normal[1] = packSnorm16(n.y);
+        glm::vec2 uv = glm::clamp(vertices[i].uv, 0.0f, 1.0f);
+        packed[i].uv[0] = (GLushort)(uv.x * 65535.0f + 0.5f);
+        packed[i].uv[1] = (GLushort)(uv.y * 65535.0f + 0.5f);
+    }
+    return packed;
+}
+
+size_t vertexStride(VertexFormat format) {
+    return format == VERTEX_PACKED ? sizeof(PackedVertex) : sizeof(Vertex);
+}
+
+const char* vertexFormatName(VertexFormat format) {
+    return format == VERTEX_PACKED ? "packed" : "float";
+}
+
+void reportVertexFormats(const Mesh& mesh, const char* name) {
+    size_t floatBytes = meshVertexCount(mesh) * sizeof(Vertex);
+    size_t packedBytes = meshVertexCount(mesh) * sizeof(PackedVertex);
+    std::fprintf(stderr, "%s vertices: %.1f KB float, %.1f KB packed (%.0f%% saved)\n", name,
+                 floatBytes / 1024.0, packedBytes / 1024.0, 100.0 * (floatBytes - packedBytes) / floatBytes);
+}
+
+// Per-mesh decode state for the vertex shaders
+void setMeshUniforms(const ProgramUniforms& uniforms, const Mesh& mesh) {
+    glUniform3fv(uniforms.positionScale, 1, glm::value_ptr(mesh.positionScale));
+    glUniform3fv(uniforms.positionBias, 1, glm::value_ptr(mesh.positionBias));
+    glUniform1i(uniforms.octNormals, mesh.format == VERTEX_PACKED);
+}
+
+void setupMeshBuffers(Mesh& mesh, VertexFormat format) {
+    glGenVertexArrays(1, &mesh.vao);
+    glGenBuffers(1, &mesh.vbo);
+    glGenBuffers(1, &mesh.ebo);
+    
+    glBindVertexArray(mesh.vao);
+    
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+    mesh.format = format;
+    if (format == VERTEX_PACKED) {
+        std::vector<PackedVertex> packed = packVertices(mesh);
+        glBufferData(GL_ARRAY_BUFFER, packed.size() * sizeof(PackedVertex), 
+                     &packed[0], GL_STATIC_DRAW);
+    } else {
+        mesh.positionScale = glm::vec3(1.0f);
+        mesh.positionBias = glm::vec3(0.0f);
+        // Straight from the mapped cache file for imported meshes
+        glBufferData(GL_ARRAY_BUFFER, meshVertexCount(mesh) * sizeof(Vertex), 
+                     meshVertices(mesh), GL_STATIC_DRAW);
+    }
+    
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ebo);
+    if (mesh.indexType == GL_UNSIGNED_SHORT) {
+        std::vector<unsigned short> shortIndices(meshIndices(mesh), meshIndices(mesh) + meshIndexCount(mesh));
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, shortIndices.size() * sizeof(unsigned short), 
+                     &shortIndices[0], GL_STATIC_DRAW);
+    } else {
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, meshIndexCount(mesh) * sizeof(unsigned int), 
+                     meshIndices(mesh), GL_STATIC_DRAW);
+    }
+    
+    if (format == VERTEX_PACKED) {
+        glVertexAttribPointer(0, 3, GL_SHORT, GL_TRUE, sizeof(PackedVertex), 
+                             (void*)offsetof(PackedVertex, position));
+        glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, sizeof(PackedVertex), 
+                             (void*)offsetof(PackedVertex, normal));
+        glVertexAttribPointer(8, 2, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(PackedVertex), 
+                             (void*)offsetof(PackedVertex, uv));
+    } else {
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), 
+                             (void*)offsetof(Vertex, normal));
+        glVertexAttribPointer(8, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), 
+                             (void*)offsetof(Vertex, uv));
+    }
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(8);
+    
+    glBindVertexArray(0);
+}
+
+void deleteMeshBuffers(Mesh& mesh) {
+    glDeleteVertexArrays(1, &mesh.vao);
+    glDeleteBuffers(1, &mesh.vbo);
+    glDeleteBuffers(1, &mesh.ebo);
+    mesh.vao = mesh.vbo = mesh.ebo = 0;
+}
+
+// Builds the body on the job system and uploads it from the main thread's
+// applyGLUploads(); until then bodyMesh.vao is 0 and the scene is empty
+JobCounter bodyMeshJob;
+
+void startBodyMeshBuild(BodyShape shape) {
+    std::string path = importMeshPath;
+    submitJob([shape, path] {
+        Mesh* mesh = new Mesh;
+        // A mesh that fails to import falls back to the parametric body
+        bool imported = !path.empty() && importMesh(path, *mesh);
+        if (!imported) buildBodyMesh(shape, *mesh);
+        std::string name = imported ? meshFileName(path) : bodyShapeName(shape);
+        postGLUpload([mesh, name, imported] {
+            reportMesh(*mesh, name.c_str());
+            reportVertexFormats(*mesh, name.c_str());
+            deleteMeshBuffers(bodyMesh);
+            unmapFile(bodyMesh.mapping);
+            bodyMesh = std::move(*mesh);
+            delete mesh;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            setupMeshBuffers(bodyMesh, vertexFormat);
+            if (imported) {
+                glFinish();
+                std::fprintf(stderr, "Mesh %s: uploaded in %.2f ms\n", name.c_str(), millisecondsSince(start));
+            }
+        });
+    }, bodyMeshJob);
+}
+
+size_t indexSize(const Mesh& mesh) {
+    return mesh.indexType == GL_UNSIGNED_SHORT ? sizeof(unsigned short) : sizeof(unsigned int);
+}
+
+// Triangles submitted this frame and the vertex bytes they fetch (estimated
+// from the post-optimization ACMR), reported by the benchmark
+unsigned long long frameTriangles = 0;
+double frameVertexBytes = 0.0;
+
+void countMeshLOD(const Mesh& mesh, int level, GLsizei instances) {
+    const MeshLOD& lod = mesh.lods[level];
+    unsigned long long triangles = (unsigned long long)(lod.indexCount / 3) * std::max(instances, 1);
+    frameTriangles += triangles;
+    frameVertexBytes += triangles * lod.acmrAfter * vertexStride(mesh.format);
+}
+
+// instances == 0 issues a plain, non-instanced draw
+void drawMeshLOD(const Mesh& mesh, int level, GLsizei instances) {
+    const MeshLOD& lod = mesh.lods[level];
+    void* offset = (void*)(lod.firstIndex * indexSize(mesh));
+    if (instances == 0) {
+        glDrawElementsBaseVertex(GL_TRIANGLES, lod.indexCount, mesh.indexType, offset, lod.baseVertex);
+    } else {
+        glDrawElementsInstancedBaseVertex(GL_TRIANGLES, lod.indexCount, mesh.indexType, offset, 
+                                          instances, lod.baseVertex);
+    }
+    countMeshLOD(mesh, level, instances);
+}
+
+// CPU mirror of the std140 FrameData block, uploaded once per frame
+struct FrameUniforms {
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::vec3 lightPos;
+    float time;
+    glm::vec3 viewPos;
+    // The next four mirror the GL permutation's features for the software renderer
+    float rimOutline;   // 1 = per-fragment rim test, 0 = screen-space ink pass
+    float paperGrain;   // 1 = paper texture, 0 = per-fragment hash
+    float paperScale;   // paper texture coordinates per framebuffer pixel
+    float tomoeBaked;   // 1 = tomoe distance atlas, 0 = analytic pattern
+    float padding;
+    glm::vec4 clusterScale;     // pixels to clusters in x and y, then log depth to slice scale and bias
+    int clusterSize[4];
+};
+static_assert(sizeof(FrameUniforms) == 208, "FrameUniforms must match the std140 FrameData block");
+
+GLuint frameUBO = 0;
+
+void setupFrameUniforms() {
+    glGenBuffers(1, &frameUBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, frameUBO);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), NULL, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_DATA_BINDING, frameUBO);
+}
+
+void deleteFrameUniforms() {
+    glDeleteBuffers(1, &frameUBO);
+}
+
+void uploadFrameUniforms(const FrameUniforms& frame) {
+    glBindBuffer(GL_UNIFORM_BUFFER, frameUBO);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &frame);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+// Per-draw state; the normal matrix is computed here once instead of per vertex
+void drawBody(const ProgramUniforms& uniforms, const glm::mat4& model, int level) {
+    glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(model)));
+    glUniformMatrix4fv(uniforms.model, 1, GL_FALSE, glm::value_ptr(model));
+    glUniformMatrix3fv(uniforms.normalMatrix, 1, GL_FALSE, glm::value_ptr(normalMatrix));
+    setMeshUniforms(uniforms, bodyMesh);
+    
+    glBindVertexArray(bodyMesh.vao);
+    drawMeshLOD(bodyMesh, level, 0);
+    glBindVertexArray(0);
+}
+
+// ─── Cel ramps ────────────────────────────────────────────────────
+//
+// Cel bands come from a 1D ramp per material instead of an if/else ladder
+// in the shader. Each material is one layer of a 1D array texture, so a
+// new look is a table entry here rather than a new shader branch. Band
+// edges sit on multiples of 1/CEL_RAMP_SIZE and match the old ladders
+// exactly. The second channel holds the ramp's running integral, so the
+// analytic anti-aliasing path averages the ramp over a pixel's footprint
+// whatever the number of bands.
+
+const int CEL_RAMP_SIZE = 100;          // texels per ramp; band edges on multiples of 0.01
+
+struct CelMaterial {
+    const char* name;
+    int bands;
+    float edges[3];                     // diff above edges[i] selects tones[i + 1]
+    float tones[4];
+};
+
+enum CelMaterialId {
+    CEL_CREAM,                          // 3 tones, stages 1-3
+    CEL_RICH,                           // 4 tones, stage 4
+    NUM_CEL_MATERIALS
+};
+
+const CelMaterial CEL_MATERIALS[NUM_CEL_MATERIALS] = {
+    { "cream", 3, { 0.3f, 0.7f }, { 0.3f, 0.58f, 1.0f } },
+    { "rich", 4, { 0.25f, 0.5f, 0.8f }, { 0.25f, 0.45f, 0.7f, 1.0f } },
+};
+
+GLuint celRampTexture = 0;
+
+CelMaterialId stageCelMaterial(int stage) {
+    return (stageFeatures(stage) & FEATURE_RICH_RAMP) ? CEL_RICH : CEL_CREAM;
+}
+
+void setupCelRamps() {
+    std::vector<float> texels(NUM_CEL_MATERIALS * CEL_RAMP_SIZE * 2);
+    for (int m = 0; m < NUM_CEL_MATERIALS; ++m) {
+        const CelMaterial& material = CEL_MATERIALS[m];
+        float* ramp = &texels[m * CEL_RAMP_SIZE * 2];
+        float integral = 0.0f;
+        for (int i = 0; i < CEL_RAMP_SIZE; ++i) {
+            int band = 0;
+            while (band + 1 < material.bands &&
+                   (int)std::floor(material.edges[band] * CEL_RAMP_SIZE + 0.5f) <= i) {
+                ++band;
+            }
+            ramp[i * 2] = material.tones[band];
+            ramp[i * 2 + 1] = integral;
+            integral += material.tones[band] / CEL_RAMP_SIZE;
+        }
+    }
+    glGenTextures(1, &celRampTexture);
+    glActiveTexture(GL_TEXTURE0 + CEL_RAMP_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_1D_ARRAY, celRampTexture);
+    glTexImage2D(GL_TEXTURE_1D_ARRAY, 0, GL_RG32F, CEL_RAMP_SIZE, NUM_CEL_MATERIALS, 0, GL_RG, GL_FLOAT,
+                 &texels[0]);
+    glTexParameteri(GL_TEXTURE_1D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_1D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_1D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+void deleteCelRamps() {
+    glDeleteTextures(1, &celRampTexture);
+    celRampTexture = 0;
+}
+
+// ─── SIMD helpers ─────────────────────────────────────────────────
+//
+// SIMD_WIDTH floats per operation: AVX2 when built with -mavx2 -mfma, SSE2
+// on other x86-64 builds, scalar elsewhere. Used by frustum culling, the
+// CPU-side texture generators and the software rasterizer.
+
+#if defined(__AVX2__) && defined(__FMA__)
+const int SIMD_WIDTH = 8;
+typedef __m256 SimdRaw;
+#define SIMD_OP(name) _mm256_##name
+#elif defined(__SSE2__)
+const int SIMD_WIDTH = 4;
+typedef __m128 SimdRaw;
+#define SIMD_OP(name) _mm_##name
+#else
+const int SIMD_WIDTH = 1;
+typedef float SimdRaw;
+#endif
+
+struct SimdFloat {
+    SimdRaw v;
+    SimdFloat() {}
+    SimdFloat(SimdRaw raw) : v(raw) {}
+#ifdef SIMD_OP
+    SimdFloat(float x) : v(SIMD_OP(set1_ps)(x)) {}
+#endif
+};
+
+#ifdef SIMD_OP
+struct SimdMask {
+    SimdRaw v;
+};
+
+inline SimdFloat operator+(SimdFloat a, SimdFloat b) { return SIMD_OP(add_ps)(a.v, b.v); }
+inline SimdFloat operator-(SimdFloat a, SimdFloat b) { return SIMD_OP(sub_ps)(a.v, b.v); }
+inline SimdFloat operator*(SimdFloat a, SimdFloat b) { return SIMD_OP(mul_ps)(a.v, b.v); }
+inline SimdFloat operator/(SimdFloat a, SimdFloat b) { return SIMD_OP(div_ps)(a.v, b.v); }
+inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { return SIMD_OP(min_ps)(a.v, b.v); }
+inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { return SIMD_OP(max_ps)(a.v, b.v); }
+inline SimdFloat simdSqrt(SimdFloat a) { return SIMD_OP(sqrt_ps)(a.v); }
+inline SimdFloat simdAbs(SimdFloat a) { return SIMD_OP(andnot_ps)(SIMD_OP(set1_ps)(-0.0f), a.v); }
+inline SimdFloat simdLoad(const float* p) { return SIMD_OP(loadu_ps)(p); }
+inline void simdStore(float* p, SimdFloat a) { SIMD_OP(storeu_ps)(p, a.v); }
+inline SimdMask operator&(SimdMask a, SimdMask b) { SimdMask m = { SIMD_OP(and_ps)(a.v, b.v) }; return m; }
+inline SimdMask operator|(SimdMask a, SimdMask b) { SimdMask m = { SIMD_OP(or_ps)(a.v, b.v) }; return m; }
+inline int simdBits(SimdMask m) { return SIMD_OP(movemask_ps)(m.v); }
+inline SimdFloat simdSelect(SimdMask m, SimdFloat a, SimdFloat b) {
+    return SIMD_OP(or_ps)(SIMD_OP(and_ps)(m.v, a.v), SIMD_OP(andnot_ps)(m.v, b.v));
+}
+#if defined(__AVX2__) && defined(__FMA__)
+inline SimdMask operator<(SimdFloat a, SimdFloat b) { SimdMask m = { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; return m; }
+inline SimdMask operator>(SimdFloat a, SimdFloat b) { SimdMask m = { _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ) }; return m; }
+inline SimdMask operator>=(SimdFloat a, SimdFloat b) { SimdMask m = { _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) }; return m; }
+inline SimdFloat simdFloor(SimdFloat a) { return _mm256_floor_ps(a.v); }
+inline SimdFloat simdRamp() { return _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7); }
+#else
+inline SimdMask operator<(SimdFloat a, SimdFloat b) { SimdMask m = { _mm_cmplt_ps(a.v, b.v) }; return m; }
+inline SimdMask operator>(SimdFloat a, SimdFloat b) { SimdMask m = { _mm_cmpgt_ps(a.v, b.v) }; return m; }
+inline SimdMask operator>=(SimdFloat a, SimdFloat b) { SimdMask m = { _mm_cmpge_ps(a.v, b.v) }; return m; }
+// SSE2 has no floor: truncate, then step down where truncation rounded up
+inline SimdFloat simdFloor(SimdFloat a) {
+    __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a.v));
+    return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, a.v), _mm_set1_ps(1.0f)));
+}
+inline SimdFloat simdRamp() { return _mm_setr_ps(0, 1, 2, 3); }
+#endif
+#else
+struct SimdMask {
+    bool v;
+};
+
+inline SimdFloat operator+(SimdFloat a, SimdFloat b) { return a.v + b.v; }
+inline SimdFloat operator-(SimdFloat a, SimdFloat b) { return a.v - b.v; }
+inline SimdFloat operator*(SimdFloat a, SimdFloat b) { return a.v * b.v; }
+inline SimdFloat operator/(SimdFloat a, SimdFloat b) { return a.v / b.v; }
+inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { return std::min(a.v, b.v); }
+inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { return std::max(a.v, b.v); }
+inline SimdFloat simdSqrt(SimdFloat a) { return std::sqrt(a.v); }
+inline SimdFloat simdAbs(SimdFloat a) { return std::fabs(a.v); }
+inline SimdFloat simdFloor(SimdFloat a) { return std::floor(a.v); }
+inline SimdFloat simdLoad(const float* p) { return *p; }
+inline void simdStore(float* p, SimdFloat a) { *p = a.v; }
+inline SimdFloat simdRamp() { return 0.0f; }
+inline SimdMask operator&(SimdMask a, SimdMask b) { SimdMask m = { a.v && b.v }; return m; }
+inline SimdMask operator|(SimdMask a, SimdMask b) { SimdMask m = { a.v || b.v }; return m; }
+inline SimdMask operator<(SimdFloat a, SimdFloat b) { SimdMask m = { a.v < b.v }; return m; }
+inline SimdMask operator>(SimdFloat a, SimdFloat b) { SimdMask m = { a.v > b.v }; return m; }
+inline SimdMask operator>=(SimdFloat a, SimdFloat b) { SimdMask m = { a.v >= b.v }; return m; }
+inline int simdBits(SimdMask m) { return m.v ? 1 : 0; }
+inline SimdFloat simdSelect(SimdMask m, SimdFloat a, SimdFloat b) { return m.v ? a : b; }
+#endif
+
+inline SimdFloat operator+(SimdFloat a, float b) { return a + SimdFloat(b); }
+inline SimdFloat operator-(SimdFloat a, float b) { return a - SimdFloat(b); }
+inline SimdFloat operator-(float a, SimdFloat b) { return SimdFloat(a) - b; }
+inline SimdFloat operator*(SimdFloat a, float b) { return a * SimdFloat(b); }
+inline SimdMask operator<(SimdFloat a, float b) { return a < SimdFloat(b); }
+inline SimdMask operator>(SimdFloat a, float b) { return a > SimdFloat(b); }
+
+inline SimdFloat simdFract(SimdFloat x) {
+    return x - simdFloor(x);
+}
+
+// Reduced to [-pi/2, pi/2], then a degree-11 Taylor polynomial (< 1e-7)
+SimdFloat simdSin(SimdFloat x) {
+    const float PI = (float)M_PI;
+    x = x - simdFloor(x * (0.5f / PI) + 0.5f) * (2.0f * PI);
+    x = simdSelect(x > 0.5f * PI, PI - x, x);
+    x = simdSelect(x < -0.5f * PI, -PI - x, x);
+    SimdFloat x2 = x * x;
+    SimdFloat p = x2 * (-1.0f / 39916800.0f) + 1.0f / 362880.0f;
+    p = p * x2 - 1.0f / 5040.0f;
+    p = p * x2 + 1.0f / 120.0f;
+    p = p * x2 - 1.0f / 6.0f;
+    p = p * x2 + 1.0f;
+    return x * p;
+}
+
+SimdFloat simdCos(SimdFloat x) {
+    return simdSin(x + 0.5f * (float)M_PI);
+}
+
+// Minimax polynomial for atan on [0, 1] (< 1e-5 rad), then octant fix-ups
+SimdFloat simdAtan2(SimdFloat y, SimdFloat x) {
+    SimdFloat ax = simdAbs(x);
+    SimdFloat ay = simdAbs(y);
+    SimdFloat a = simdMin(ax, ay) / simdMax(simdMax(ax, ay), SimdFloat(1e-30f));
+    SimdFloat s = a * a;
+    SimdFloat p = s * -0.01172120f + 0.05265332f;
+    p = p * s - 0.11643287f;
+    p = p * s + 0.19354346f;
+    p = p * s - 0.33262347f;
+    p = p * s + 0.99997726f;
+    SimdFloat r = a * p;
+    r = simdSelect(ay > ax, 0.5f * (float)M_PI - r, r);
+    r = simdSelect(x < 0.0f, (float)M_PI - r, r);
+    return simdSelect(y < 0.0f, 0.0f - r, r);
+}
+
+struct SimdVec3 {
+    SimdFloat x, y, z;
+};
+
+inline SimdFloat dot(const SimdVec3& a, const SimdVec3& b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+inline SimdVec3 normalize(const SimdVec3& a) {
+    SimdFloat scale = SimdFloat(1.0f) / simdSqrt(dot(a, a));
+    SimdVec3 n = { a.x * scale, a.y * scale, a.z * scale };
+    return n;
+}
+
+inline SimdVec3 towards(const glm::vec3& target, const SimdVec3& from) {
+    SimdVec3 d = { target.x - from.x, target.y - from.y, target.z - from.z };
+    return d;
+}
+
+// ─── Instanced crowds ─────────────────────────────────────────────
+//
+// Thousands of bodies share the body mesh VAO and are drawn with one
+// instanced draw per LOD. Per-instance data is streamed every frame into a
+// triple-buffered ring: the CPU writes region N while the GPU may still read
+// N-1 and N-2, and a fence per region makes sure a region is only reused
+// once the GPU is done with it. With ARB_buffer_storage the ring is mapped
+// persistently; otherwise each region is mapped unsynchronized per frame.
+
+struct InstanceData {
+    glm::mat4 model;
+    glm::vec3 tint;
+    float patternSeed;
+};
+
+const int INSTANCE_RING_REGIONS = 3;
+
+struct InstanceRing {
+    GLuint buffer = 0;
+    InstanceData* persistent = NULL;
+    size_t capacity = 0;        // instances per region
+    int region = 0;
+    GLsync fences[INSTANCE_RING_REGIONS] = {};
+    unsigned long long stalls = 0;
+};
+
+InstanceRing instanceRing;
+
+void waitForFence(GLsync& fence, unsigned long long& stalls) {
+    if (!fence) return;
+    GLenum status = glClientWaitSync(fence, 0, 0);
+    if (status == GL_TIMEOUT_EXPIRED) {
+        // The GPU is more than two frames behind; count it so benchmarks show it
+        ++stalls;
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) {
+        }
+    }
+    glDeleteSync(fence);
+    fence = 0;
+}
+
+void deleteInstanceRing() {
+    for (int i = 0; i < INSTANCE_RING_REGIONS; ++i) {
+        waitForFence(instanceRing.fences[i], instanceRing.stalls);
+    }
+    if (instanceRing.persistent) {
+        glBindBuffer(GL_ARRAY_BUFFER, instanceRing.buffer);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    glDeleteBuffers(1, &instanceRing.buffer);
+    unsigned long long stalls = instanceRing.stalls;
+    instanceRing = InstanceRing();
+    instanceRing.stalls = stalls;
+}
+
+void createInstanceRing(size_t capacity) {
+    deleteInstanceRing();
+    instanceRing.capacity = capacity;
+    GLsizeiptr size = capacity * INSTANCE_RING_REGIONS * sizeof(InstanceData);
+    
+    glGenBuffers(1, &instanceRing.buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, instanceRing.buffer);
+    if (GLEW_ARB_buffer_storage) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+        instanceRing.persistent = (InstanceData*)glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+    } else {
+        glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Returns storage for `count` instances in the next free ring region
+InstanceData* beginInstanceWrite(size_t count) {
+    if (count > instanceRing.capacity) {
+        createInstanceRing(std::max(count, instanceRing.capacity * 2));
+    }
+    
+    instanceRing.region = (instanceRing.region + 1) % INSTANCE_RING_REGIONS;
+    waitForFence(instanceRing.fences[instanceRing.region], instanceRing.stalls);
+    
+    size_t first = instanceRing.region * instanceRing.capacity;
+    if (instanceRing.persistent) {
+        return instanceRing.persistent + first;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, instanceRing.buffer);
+    return (InstanceData*)glMapBufferRange(GL_ARRAY_BUFFER, first * sizeof(InstanceData), 
+        count * sizeof(InstanceData), 
+        GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+}
+
+void endInstanceWrite() {
+    if (!instanceRing.persistent) {
+        glBindBuffer(GL_ARRAY_BUFFER, instanceRing.buffer);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+}
+
+// Points the per-instance attributes of the body VAO at instance `first`
+// of the written region; GL 3.3 has no base instance, so each LOD batch
+// re-points them
+void bindInstanceAttributes(size_t first) {
+    glBindBuffer(GL_ARRAY_BUFFER, instanceRing.buffer);
+    size_t base = (instanceRing.region * instanceRing.capacity + first) * sizeof(InstanceData);
+    glBindVertexArray(bodyMesh.vao);
+    for (int column = 0; column < 4; ++column) {
+        glVertexAttribPointer(2 + column, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), 
+            (void*)(base + offsetof(InstanceData, model) + column * sizeof(glm::vec4)));
+        glVertexAttribDivisor(2 + column, 1);
+        glEnableVertexAttribArray(2 + column);
+    }
+    glVertexAttribPointer(6, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData), 
+                         (void*)(base + offsetof(InstanceData, tint)));
+    glVertexAttribDivisor(6, 1);
+    glEnableVertexAttribArray(6);
+    glVertexAttribPointer(7, 1, GL_FLOAT, GL_FALSE, sizeof(InstanceData), 
+                         (void*)(base + offsetof(InstanceData, patternSeed)));
+    glVertexAttribDivisor(7, 1);
+    glEnableVertexAttribArray(7);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Marks the current region busy until the GPU has consumed this frame's draws
+void fenceInstanceWrite() {
+    instanceRing.fences[instanceRing.region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+float hashToUnit(unsigned int n) {
+    n = (n ^ 61u) ^ (n >> 16);
+    n *= 9u;
+    n ^= n >> 4;
+    n *= 0x27d4eb2du;
+    n ^= n >> 15;
+    return (n & 0xFFFFFF) / 16777216.0f;
+}
+
+// The crowd is a square grid that always fits in front of the default
+// camera, so one instance looks like the single egg
+struct CrowdLayout {
+    int side;
+    float spacing;
+    float scale;
+};
+
+CrowdLayout crowdLayout(int total) {
+    CrowdLayout layout;
+    layout.side = (int)std::ceil(std::sqrt((float)total));
+    layout.spacing = 2.4f * crowdSpread / layout.side;
+    layout.scale = 2.4f / layout.side * 0.4f;
+    return layout;
+}
+
+// Members picked by --crowd-moving hop with the stage 5 rotation
+bool crowdMemberMoves(int i) {
+    return crowdMoving > 0.0f && hashToUnit(i * 7 + 5) < crowdMoving;
+}
+
+glm::vec3 crowdPosition(const CrowdLayout& layout, int i, float angle) {
+    float x = (i % layout.side - (layout.side - 1) * 0.5f) * layout.spacing;
+    float z = (i / layout.side - (layout.side - 1) * 0.5f) * layout.spacing;
+    float y = 0.0f;
+    if (crowdMemberMoves(i)) {
+        y = std::fabs(std::sin(angle * 6.0f + hashToUnit(i * 7 + 6) * 2.0f * (float)M_PI)) * layout.scale * 2.0f;
+    }
+    return glm::vec3(x, y, z);
+}
+
+void writeCrowdInstance(const CrowdLayout& layout, int i, float angle, InstanceData& instance) {
+    float phase = hashToUnit(i * 3 + 0) * 2.0f * (float)M_PI;
+    glm::mat4 model = glm::translate(glm::mat4(1.0f), crowdPosition(layout, i, angle));
+    model = glm::rotate(model, angle + phase, glm::vec3(0.0f, 1.0f, 0.0f));
+    model = glm::scale(model, glm::vec3(layout.scale));
+    
+    instance.model = model;
+    instance.tint = glm::vec3(0.9f + 0.1f * hashToUnit(i * 3 + 1), 
+                              0.9f + 0.1f * hashToUnit(i * 3 + 2), 0.92f);
+    instance.patternSeed = phase;
+}
+
+// ─── Clustered lanterns ───────────────────────────────────────────
+//
+// Lanterns and fires are point lights with a finite reach. Every frame the
+// CPU sorts them into a grid of view-space clusters: LIGHT_CLUSTER_X x
+// LIGHT_CLUSTER_Y screen tiles, each cut into LIGHT_CLUSTER_Z depth slices
+// that grow exponentially with distance. First each light's screen
+// rectangle and depth range are found, in parallel over the lights. Then
+// every slice builds its own cluster lists, in parallel over the slices,
+// and the slices are joined into one index list. The grid, index list and
+// light data go to the GPU as texture buffers. A fragment finds its cluster
+// from its pixel and depth and walks only that cluster's list. The shading
+// cost therefore follows how many lanterns reach a pixel, not how many
+// there are. Flat lists put everything in one cluster, so every
+// pixel walks every visible lantern, for comparison (--light-culling flat).
+
+const int LIGHT_CLUSTER_X = 16;
+const int LIGHT_CLUSTER_Y = 9;
+const int LIGHT_CLUSTER_Z = 24;
+const int MAX_LANTERNS = 65535;         // indices are 16-bit
+const float LANTERN_REACH = 0.6f;       // world units
+
+struct LightBounds {
+    int x0, x1, y0, y1, z0, z1;         // inclusive cluster range; z0 > z1 is off screen
+};
+
+struct ClusteredLights {
+    int sizeX = 1;
+    int sizeY = 1;
+    int sizeZ = 1;
+    std::vector<glm::vec4> data;        // per light: position and reach, then color
+    std::vector<LightBounds> bounds;
+    std::vector<unsigned> grid;         // per cluster: first index, count
+    std::vector<std::vector<unsigned short> > sliceIndices;
+    std::vector<unsigned short> indices;
+    GLuint buffers[3] = {};             // grid, indices, data
+    GLuint textures[3] = {};
+    // Last updateClusteredLights()
+    double assignMs = 0.0;
+    size_t uploadBytes = 0;
+    double meanClusterLights = 0.0;     // over clusters with any
+    int maxClusterLights = 0;
+};
+
+ClusteredLights clusteredLights;
+
+void setupClusteredLights() {
+    ClusteredLights& lights = clusteredLights;
+    const GLenum formats[3] = { GL_RG32UI, GL_R16UI, GL_RGBA32F };
+    const GLuint units[3] = { LIGHT_GRID_TEXTURE_UNIT, LIGHT_INDEX_TEXTURE_UNIT, LIGHT_DATA_TEXTURE_UNIT };
+    glGenBuffers(3, lights.buffers);
+    glGenTextures(3, lights.textures);
+    for (int i = 0; i < 3; ++i) {
+        glBindBuffer(GL_TEXTURE_BUFFER, lights.buffers[i]);
+        glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+        glActiveTexture(GL_TEXTURE0 + units[i]);
+        glBindTexture(GL_TEXTURE_BUFFER, lights.textures[i]);
+        glTexBuffer(GL_TEXTURE_BUFFER, formats[i], lights.buffers[i]);
+    }
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+void deleteClusteredLights() {
+    glDeleteTextures(3, clusteredLights.textures);
+    glDeleteBuffers(3, clusteredLights.buffers);
+    clusteredLights = ClusteredLights();
+}
+
+// Warm paper lanterns and redder fires scattered through the scene, each
+// flickering and bobbing on its own phase
+void placeLanterns(int count, float time, std::vector<glm::vec4>& data) {
+    data.resize(count * 2);
+    float spread = crowdSize > 0 ? crowdSpread : 1.0f;
+    parallelFor(count, 256, [&](int, int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            float phase = hashToUnit(i * 5 + 3) * 2.0f * (float)M_PI;
+            glm::vec3 position((hashToUnit(i * 5) * 2.0f - 1.0f) * 2.4f * spread,
+                               hashToUnit(i * 5 + 1) * 2.0f - 0.6f + 0.05f * std::sin(time * 1.3f + phase),
+                               (hashToUnit(i * 5 + 2) * 2.0f - 1.0f) * 1.8f * spread);
+            bool fire = hashToUnit(i * 5 + 4) < 0.25f;
+            glm::vec3 color = fire ? glm::vec3(1.0f, 0.38f, 0.12f) : glm::vec3(1.0f, 0.66f, 0.32f);
+            float flicker = 0.75f + 0.25f * std::sin(time * (fire ? 11.0f : 3.0f) + phase);
+            data[i * 2] = glm::vec4(position, LANTERN_REACH);
+            data[i * 2 + 1] = glm::vec4(color * flicker, 1.0f);
+        }
+    });
+}
+
+// Clusters a light can reach: the screen rectangle of its bounding box and
+// the slices of its depth range
+LightBounds lightClusterBounds(const ClusteredLights& lights, const glm::vec4& sphere, const glm::mat4& view,
+                               const glm::mat4& projection, const glm::vec4& scale) {
+    LightBounds bounds = { 0, lights.sizeX - 1, 0, lights.sizeY - 1, 1, 0 };
+    glm::vec3 center = glm::vec3(view * glm::vec4(sphere.x, sphere.y, sphere.z, 1.0f));
+    float radius = sphere.w;
+    float nearest = -center.z - radius;
+    float farthest = -center.z + radius;
+    if (farthest < NEAR_PLANE || nearest > FAR_PLANE) return bounds;
+
+    // A box that crosses the near plane may cover any pixel
+    if (nearest > NEAR_PLANE) {
+        glm::vec2 low(1e9f), high(-1e9f);
+        for (int corner = 0; corner < 8; ++corner) {
+            glm::vec3 offset((corner & 1) ? radius : -radius, (corner & 2) ? radius : -radius,
+                             (corner & 4) ? radius : -radius);
+            glm::vec4 clip = projection * glm::vec4(center + offset, 1.0f);
+            glm::vec2 ndc(clip.x / clip.w, clip.y / clip.w);
+            low = glm::vec2(std::min(low.x, ndc.x), std::min(low.y, ndc.y));
+            high = glm::vec2(std::max(high.x, ndc.x), std::max(high.y, ndc.y));
+        }
+        if (high.x < -1.0f || low.x > 1.0f || high.y < -1.0f || low.y > 1.0f) return bounds;
+        bounds.x0 = glm::clamp((int)std::floor((low.x * 0.5f + 0.5f) * lights.sizeX), 0, lights.sizeX - 1);
+        bounds.x1 = glm::clamp((int)std::floor((high.x * 0.5f + 0.5f) * lights.sizeX), 0, lights.sizeX - 1);
+        bounds.y0 = glm::clamp((int)std::floor((low.y * 0.5f + 0.5f) * lights.sizeY), 0, lights.sizeY - 1);
+        bounds.y1 = glm::clamp((int)std::floor((high.y * 0.5f + 0.5f) * lights.sizeY), 0, lights.sizeY - 1);
+    }
+    // The same slice formula as the shader
+    bounds.z0 = glm::clamp((int)std::floor(std::log(std::max(nearest, NEAR_PLANE)) * scale.z + scale.w),
+                           0, lights.sizeZ - 1);
+    bounds.z1 = glm::clamp((int)std::floor(std::log(std::min(farthest, FAR_PLANE)) * scale.z + scale.w),
+                           0, lights.sizeZ - 1);
+    return bounds;
+}
+
+// Places the lanterns for `time`, rebuilds the cluster lists for this
+// camera and uploads them; fills in the frame's cluster parameters
+void updateClusteredLights(FrameUniforms& frame, int width, int height, float time) {
+    ProfileScope scope("lanterns");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    ClusteredLights& lights = clusteredLights;
+    lights.sizeX = lightClusters ? LIGHT_CLUSTER_X : 1;
+    lights.sizeY = lightClusters ? LIGHT_CLUSTER_Y : 1;
+    lights.sizeZ = lightClusters ? LIGHT_CLUSTER_Z : 1;
+    int count = std::min(lanternCount, MAX_LANTERNS);
+    int tiles = lights.sizeX * lights.sizeY;
+    int clusters = tiles * lights.sizeZ;
+
+    // Slice = log(depth) * scale + bias, spread from the near to the far plane
+    float sliceScale = lights.sizeZ / std::log(FAR_PLANE / NEAR_PLANE);
+    glm::vec4 scale((float)lights.sizeX / width, (float)lights.sizeY / height, sliceScale,
+                    -std::log(NEAR_PLANE) * sliceScale);
+    frame.clusterScale = scale;
+    frame.clusterSize[0] = lights.sizeX;
+    frame.clusterSize[1] = lights.sizeY;
+    frame.clusterSize[2] = lights.sizeZ;
+    frame.clusterSize[3] = 0;
+
+    placeLanterns(count, time, lights.data);
+    lights.bounds.resize(count);
+    parallelFor(count, 256, [&](int, int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            lights.bounds[i] = lightClusterBounds(lights, lights.data[i * 2], frame.view, frame.projection, scale);
+        }
+    });
+
+    // Each slice owns its clusters, so the slices fill their lists without locks
+    lights.grid.assign(clusters * 2, 0);
+    lights.sliceIndices.resize(lights.sizeZ);
+    parallelFor(lights.sizeZ, 1, [&](int, int begin, int end) {
+        for (int z = begin; z < end; ++z) {
+            unsigned* grid = &lights.grid[z * tiles * 2];
+            for (int i = 0; i < count; ++i) {
+                const LightBounds& b = lights.bounds[i];
+                if (z < b.z0 || z > b.z1) continue;
+                for (int y = b.y0; y <= b.y1; ++y) {
+                    for (int x = b.x0; x <= b.x1; ++x) ++grid[(y * lights.sizeX + x) * 2 + 1];
+                }
+            }
+            unsigned total = 0;
+            for (int tile = 0; tile < tiles; ++tile) {
+                grid[tile * 2] = total;
+                total += grid[tile * 2 + 1];
+                grid[tile * 2 + 1] = 0;
+            }
+            std::vector<unsigned short>& list = lights.sliceIndices[z];
+            list.resize(total);
+            for (int i = 0; i < count; ++i) {
+                const LightBounds& b = lights.bounds[i];
+                if (z < b.z0 || z > b.z1) continue;
+                for (int y = b.y0; y <= b.y1; ++y) {
+                    for (int x = b.x0; x <= b.x1; ++x) {
+                        unsigned* cell = &grid[(y * lights.sizeX + x) * 2];
+                        list[cell[0] + cell[1]++] = (unsigned short)i;
+                    }
+                }
+            }
+        }
+    });
+
+    lights.indices.clear();
+    long long listed = 0;
+    int filled = 0;
+    lights.maxClusterLights = 0;
+    for (int z = 0; z < lights.sizeZ; ++z) {
+        unsigned base = (unsigned)lights.indices.size();
+        unsigned* grid = &lights.grid[z * tiles * 2];
+        for (int tile = 0; tile < tiles; ++tile) {
+            grid[tile * 2] += base;
+            unsigned listedHere = grid[tile * 2 + 1];
+            listed += listedHere;
+            filled += listedHere > 0;
+            lights.maxClusterLights = std::max(lights.maxClusterLights, (int)listedHere);
+        }
+        lights.indices.insert(lights.indices.end(), lights.sliceIndices[z].begin(), lights.sliceIndices[z].end());
+    }
+    lights.meanClusterLights = filled > 0 ? (double)listed / filled : 0.0;
+
+    // Orphaned every frame; the GPU may still read last frame's lists
+    const void* sources[3] = { &lights.grid[0], lights.indices.empty() ? NULL : &lights.indices[0],
+                               lights.data.empty() ? NULL : &lights.data[0] };
+    size_t sizes[3] = { lights.grid.size() * sizeof(unsigned), lights.indices.size() * sizeof(unsigned short),
+                        lights.data.size() * sizeof(glm::vec4) };
+    lights.uploadBytes = 0;
+    for (int i = 0; i < 3; ++i) {
+        glBindBuffer(GL_TEXTURE_BUFFER, lights.buffers[i]);
+        glBufferData(GL_TEXTURE_BUFFER, std::max(sizes[i], (size_t)16), NULL, GL_STREAM_DRAW);
+        if (sizes[i] > 0) glBufferSubData(GL_TEXTURE_BUFFER, 0, sizes[i], sources[i]);
+        lights.uploadBytes += sizes[i];
+    }
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    lights.assignMs = millisecondsSince(start);
+}
+
+// ─── Scene culling ────────────────────────────────────────────────
+//
+// Crowd members are objects in a scene container with a bounding volume
+// hierarchy over their bounding spheres. Each node holds BVH_WIDTH child
+// boxes as structure-of-arrays, so one SIMD pass tests all of them against
+// a frustum plane. A child entirely inside the frustum accepts its whole
+// subtree without visiting it: objects are stored in leaf order, so every
+// subtree is one contiguous range. Moving an object queues its leaf node.
+// The refit then visits only queued nodes, deepest first, and stops
+// climbing where a node's box did not change. The visible members are
+// bucketed by LOD and drawn by one glMultiDrawElementsIndirect call with
+// one command per LOD, each bucket offset into the instance ring by its
+// base instance.
+
+const int BVH_WIDTH = SIMD_WIDTH > 1 ? SIMD_WIDTH : 4;
+const int BVH_LEAF_SIZE = 4;            // objects per leaf slot
+const float BVH_EMPTY = 1e30f;          // inverted bounds of an unused slot, outside every plane
+
+struct BvhNode {
+    float bounds[6][BVH_WIDTH];         // min x, y, z then max x, y, z per child
+    int child[BVH_WIDTH];               // node index, or -1 for a leaf
+    int first[BVH_WIDTH];               // child's objects in leaf order
+    int count[BVH_WIDTH];               // 0 = unused slot
+    int parent;                         // -1 for the root
+    int parentSlot;
+    int depth;                          // 0 for the root
+};
+
+struct Scene {
+    std::vector<glm::vec4> spheres;     // center and radius per object
+    std::vector<int> order;             // object indices in leaf order
+    std::vector<int> leafNode;          // node holding each object
+    std::vector<BvhNode> nodes;         // parents before children; 0 is the root
+    std::vector<unsigned char> queued;  // per node, waiting for a refit
+    std::vector<std::vector<int> > refitQueue;  // queued nodes per depth
+};
+
+// Frustum planes with inward normals: dot(xyz, p) + w >= 0 inside
+struct Frustum {
+    glm::vec4 planes[6];
+};
+
+// Gribb-Hartmann extraction from the combined view/projection
+Frustum frustumFromMatrix(const glm::mat4& viewProjection) {
+    glm::vec4 rows[4];
+    for (int r = 0; r < 4; ++r) {
+        rows[r] = glm::vec4(viewProjection[0][r], viewProjection[1][r], viewProjection[2][r], viewProjection[3][r]);
+    }
+    Frustum frustum;
+    for (int axis = 0; axis < 3; ++axis) {
+        frustum.planes[axis * 2] = rows[3] + rows[axis];
+        frustum.planes[axis * 2 + 1] = rows[3] - rows[axis];
+    }
+    for (int p = 0; p < 6; ++p) {
+        frustum.planes[p] = frustum.planes[p] * (1.0f / glm::length(glm::vec3(frustum.planes[p])));
+    }
+    return frustum;
+}
+
+void growBounds(float bounds[6], const float other[6]) {
+    for (int k = 0; k < 3; ++k) {
+        bounds[k] = std::min(bounds[k], other[k]);
+        bounds[k + 3] = std::max(bounds[k + 3], other[k + 3]);
+    }
+}
+
+void emptyBounds(float bounds[6]) {
+    for (int k = 0; k < 3; ++k) {
+        bounds[k] = BVH_EMPTY;
+        bounds[k + 3] = -BVH_EMPTY;
+    }
+}
+
+void nodeBounds(const BvhNode& node, float bounds[6]) {
+    emptyBounds(bounds);
+    for (int slot = 0; slot < BVH_WIDTH; ++slot) {
+        float slotBounds[6];
+        for (int k = 0; k < 6; ++k) slotBounds[k] = node.bounds[k][slot];
+        growBounds(bounds, slotBounds);
+    }
+}
+
+// Recomputes every slot of a node from its objects and child nodes
+void refitNode(Scene& scene, int index) {
+    BvhNode& node = scene.nodes[index];
+    for (int slot = 0; slot < BVH_WIDTH; ++slot) {
+        float bounds[6];
+        emptyBounds(bounds);
+        if (node.child[slot] >= 0) {
+            nodeBounds(scene.nodes[node.child[slot]], bounds);
+        } else {
+            for (int i = node.first[slot]; i < node.first[slot] + node.count[slot]; ++i) {
+                const glm::vec4& sphere = scene.spheres[scene.order[i]];
+                float objectBounds[6] = { sphere.x - sphere.w, sphere.y - sphere.w, sphere.z - sphere.w,
+                                          sphere.x + sphere.w, sphere.y + sphere.w, sphere.z + sphere.w };
+                growBounds(bounds, objectBounds);
+            }
+        }
+        for (int k = 0; k < 6; ++k) node.bounds[k][slot] = bounds[k];
+    }
+}
+
+// Orders objects [first, first + count) around the median of the longest
+// axis of their centers; returns the size of the lower half
+int splitAtMedian(Scene& scene, int first, int count) {
+    glm::vec3 lo(BVH_EMPTY), hi(-BVH_EMPTY);
+    for (int i = first; i < first + count; ++i) {
+        glm::vec3 center(scene.spheres[scene.order[i]]);
+        lo = glm::min(lo, center);
+        hi = glm::max(hi, center);
+    }
+    glm::vec3 extent = hi - lo;
+    int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+    int half = count / 2;
+    const std::vector<glm::vec4>& spheres = scene.spheres;
+    std::nth_element(scene.order.begin() + first, scene.order.begin() + first + half,
+                     scene.order.begin() + first + count, [&spheres, axis](int a, int b) {
+        return spheres[a][axis] < spheres[b][axis];
+    });
+    return half;
+}
+
+// Splits a range into up to BVH_WIDTH children, always halving the largest,
+// and recurses into those too big for a leaf. Bounds are filled in later.
+int buildBvhNode(Scene& scene, int first, int count, int parent, int parentSlot) {
+    int index = (int)scene.nodes.size();
+    scene.nodes.push_back(BvhNode());
+    int firsts[BVH_WIDTH] = { first };
+    int counts[BVH_WIDTH] = { count };
+    int parts = 1;
+    while (parts < BVH_WIDTH) {
+        int largest = 0;
+        for (int p = 1; p < parts; ++p) {
+            if (counts[p] > counts[largest]) largest = p;
+        }
+        if (counts[largest] <= BVH_LEAF_SIZE) break;
+        int half = splitAtMedian(scene, firsts[largest], counts[largest]);
+        firsts[parts] = firsts[largest] + half;
+        counts[parts] = counts[largest] - half;
+        counts[largest] = half;
+        ++parts;
+    }
+
+    // scene.nodes grows while recursing, so the node is written by index
+    scene.nodes[index].parent = parent;
+    scene.nodes[index].parentSlot = parentSlot;
+    scene.nodes[index].depth = parent < 0 ? 0 : scene.nodes[parent].depth + 1;
+    for (int slot = 0; slot < BVH_WIDTH; ++slot) {
+        int child = -1;
+        if (slot < parts && counts[slot] > BVH_LEAF_SIZE) {
+            child = buildBvhNode(scene, firsts[slot], counts[slot], index, slot);
+        } else if (slot < parts) {
+            for (int i = firsts[slot]; i < firsts[slot] + counts[slot]; ++i) scene.leafNode[scene.order[i]] = index;
+        }
+        BvhNode& node = scene.nodes[index];
+        node.child[slot] = child;
+        node.first[slot] = slot < parts ? firsts[slot] : 0;
+        node.count[slot] = slot < parts ? counts[slot] : 0;
+    }
+    return index;
+}
+
+void buildSceneBvh(Scene& scene) {
+    int count = (int)scene.spheres.size();
+    scene.order.resize(count);
+    for (int i = 0; i < count; ++i) scene.order[i] = i;
+    scene.leafNode.assign(count, 0);
+    scene.nodes.clear();
+    if (count > 0) buildBvhNode(scene, 0, count, -1, 0);
+    scene.queued.assign(scene.nodes.size(), 0);
+    int depth = 0;
+    for (size_t n = 0; n < scene.nodes.size(); ++n) depth = std::max(depth, scene.nodes[n].depth);
+    scene.refitQueue.assign(depth + 1, std::vector<int>());
+    for (int n = (int)scene.nodes.size() - 1; n >= 0; --n) refitNode(scene, n);
+}
+
+void queueRefit(Scene& scene, int node) {
+    if (scene.queued[node]) return;
+    scene.queued[node] = 1;
+    scene.refitQueue[scene.nodes[node].depth].push_back(node);
+}
+
+void moveSceneObject(Scene& scene, int object, const glm::vec3& center) {
+    glm::vec4& sphere = scene.spheres[object];
+    if (sphere.x == center.x && sphere.y == center.y && sphere.z == center.z) return;
+    sphere = glm::vec4(center, sphere.w);
+    queueRefit(scene, scene.leafNode[object]);
+}
+
+// A node's children are one level deeper, so refitting level by level
+// from the deepest refits each node once, after all of its children
+void refitScene(Scene& scene) {
+    for (int depth = (int)scene.refitQueue.size() - 1; depth >= 0; --depth) {
+        std::vector<int>& level = scene.refitQueue[depth];
+        for (size_t q = 0; q < level.size(); ++q) {
+            int index = level[q];
+            scene.queued[index] = 0;
+            refitNode(scene, index);
+
+            const BvhNode& node = scene.nodes[index];
+            if (node.parent < 0) continue;
+            float bounds[6];
+            nodeBounds(node, bounds);
+            const BvhNode& parent = scene.nodes[node.parent];
+            for (int k = 0; k < 6; ++k) {
+                if (parent.bounds[k][node.parentSlot] != bounds[k]) {
+                    queueRefit(scene, node.parent);
+                    break;
+                }
+            }
+        }
+        level.clear();
+    }
+}
+
+// Bits of the children outside some plane, and of those not inside all of
+// them. The box corner furthest along a plane's normal decides the first,
+// the nearest one the second.
+void testChildren(const BvhNode& node, const Frustum& frustum, int& outside, int& straddling) {
+    outside = 0;
+    straddling = 0;
+    for (int lane = 0; lane < BVH_WIDTH; lane += SIMD_WIDTH) {
+        SimdMask out, partial;
+        for (int p = 0; p < 6; ++p) {
+            const glm::vec4& plane = frustum.planes[p];
+            int fx = plane.x >= 0.0f ? 3 : 0;
+            int fy = plane.y >= 0.0f ? 4 : 1;
+            int fz = plane.z >= 0.0f ? 5 : 2;
+            SimdFloat farthest = simdLoad(&node.bounds[fx][lane]) * plane.x +
+                                 simdLoad(&node.bounds[fy][lane]) * plane.y +
+                                 simdLoad(&node.bounds[fz][lane]) * plane.z + plane.w;
+            SimdFloat nearest = simdLoad(&node.bounds[3 - fx][lane]) * plane.x +
+                                simdLoad(&node.bounds[5 - fy][lane]) * plane.y +
+                                simdLoad(&node.bounds[7 - fz][lane]) * plane.z + plane.w;
+            SimdMask planeOut = farthest < 0.0f;
+            SimdMask planePartial = nearest < 0.0f;
+            out = p == 0 ? planeOut : out | planeOut;
+            partial = p == 0 ? planePartial : partial | planePartial;
+        }
+        outside |= simdBits(out) << lane;
+        straddling |= simdBits(partial) << lane;
+    }
+}
+
+bool sphereVisible(const glm::vec4& sphere, const Frustum& frustum) {
+    for (int p = 0; p < 6; ++p) {
+        if (glm::dot(glm::vec3(frustum.planes[p]), glm::vec3(sphere)) + frustum.planes[p].w < -sphere.w) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void cullScene(const Scene& scene, const Frustum& frustum, std::vector<int>& visible) {
+    visible.clear();
+    if (scene.nodes.empty()) return;
+    std::vector<int> stack(1, 0);
+    while (!stack.empty()) {
+        const BvhNode& node = scene.nodes[stack.back()];
+        stack.pop_back();
+        int outside, straddling;
+        testChildren(node, frustum, outside, straddling);
+        for (int slot = 0; slot < BVH_WIDTH; ++slot) {
+            if (node.count[slot] == 0 || (outside >> slot & 1)) continue;
+            const int* objects = &scene.order[node.first[slot]];
+            if (!(straddling >> slot & 1)) {
+                visible.insert(visible.end(), objects, objects + node.count[slot]);
+            } else if (node.child[slot] >= 0) {
+                stack.push_back(node.child[slot]);
+            } else {
+                for (int i = 0; i < node.count[slot]; ++i) {
+                    if (sphereVisible(scene.spheres[objects[i]], frustum)) visible.push_back(objects[i]);
+                }
+            }
+        }
+    }
+}
+
+// The crowd's scene, rebuilt when the crowd or the body changes size and
+// refit for the members that move
+Scene crowdScene;
+std::vector<int> crowdMovers;
+int crowdSceneCount = -1;
+float crowdSceneSpacing = 0.0f;
+float crowdSceneRadius = 0.0f;
+
+void updateCrowdScene(const CrowdLayout& layout, int count, float angle, float radius) {
+    if (count != crowdSceneCount || layout.spacing != crowdSceneSpacing || radius != crowdSceneRadius) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        crowdScene.spheres.resize(count);
+        crowdMovers.clear();
+        for (int i = 0; i < count; ++i) {
+            crowdScene.spheres[i] = glm::vec4(crowdPosition(layout, i, angle), radius);
+            if (crowdMemberMoves(i)) crowdMovers.push_back(i);
+        }
+        buildSceneBvh(crowdScene);
+        crowdSceneCount = count;
+        crowdSceneSpacing = layout.spacing;
+        crowdSceneRadius = radius;
+        std::fprintf(stderr, "Crowd BVH: %d objects, %zu nodes of %d, %zu moving, built in %.2f ms\n", count,
+                     crowdScene.nodes.size(), BVH_WIDTH, crowdMovers.size(), millisecondsSince(start));
+        return;
+    }
+    for (size_t m = 0; m < crowdMovers.size(); ++m) {
+        moveSceneObject(crowdScene, crowdMovers[m], crowdPosition(layout, crowdMovers[m], angle));
+    }
+    refitScene(crowdScene);
+}
+
+struct DrawElementsIndirectCommand {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+
+// Without multi-draw indirect and base instances each LOD is its own
+// instanced draw, as with culling off
+GLuint crowdIndirectBuffer = 0;
+int multiDrawIndirect = -1;             // -1 until checked
+
+void deleteCrowdIndirect() {
+    glDeleteBuffers(1, &crowdIndirectBuffer);
+    crowdIndirectBuffer = 0;
+    multiDrawIndirect = -1;
+}
+
+const int CROWD_GRAIN = 1024;            // instances per job
+std::vector<unsigned char> crowdLODs;
+std::vector<int> crowdBuckets;          // per chunk and LOD: count, then write cursor
+std::vector<int> crowdVisible;          // culled members, in BVH order
+double crowdUpdateMs = 0.0;             // cull, LOD selection + instance writes, last frame
+double crowdCullMs = 0.0;               // refit + frustum cull, last frame
+int crowdDrawn = 0;                     // members that passed the cull, last frame
+int crowdDrawCalls = 0;                 // GL draw calls, last frame
+
+// Instances are bucketed by LOD straight into the ring, then each bucket is
+// one instanced draw or indirect command. LOD selection and matrix updates
+// run on the job system; chunk c of both passes covers the same members.
+void drawCrowd(const ProgramUniforms& uniforms, int count, float angle, const glm::mat4& viewProjection,
+               int viewportHeight) {
+    ProfileScope scope("crowd");
+    std::chrono::steady_clock::time_point updateStart = std::chrono::steady_clock::now();
+    CrowdLayout layout = crowdLayout(count);
+    float radius = bodyMesh.boundingRadius * layout.scale;
+
+    const int* members = NULL;          // NULL draws every member
+    int drawn = count;
+    crowdCullMs = 0.0;
+    if (crowdCulling) {
+        ProfileScope cullScope("cull");
+        updateCrowdScene(layout, count, angle, radius);
+        cullScene(crowdScene, frustumFromMatrix(viewProjection), crowdVisible);
+        crowdCullMs = millisecondsSince(updateStart);
+        members = crowdVisible.empty() ? NULL : &crowdVisible[0];
+        drawn = (int)crowdVisible.size();
+    }
+    crowdDrawn = drawn;
+    crowdDrawCalls = 0;
+    if (drawn == 0) {
+        crowdUpdateMs = millisecondsSince(updateStart);
+        return;
+    }
+
+    int chunks = parallelChunks(drawn, CROWD_GRAIN);
+    crowdLODs.resize(drawn);
+    crowdBuckets.assign(chunks * NUM_LODS, 0);
+    parallelFor(drawn, CROWD_GRAIN, [&](int chunk, int begin, int end) {
+        int* bucket = &crowdBuckets[chunk * NUM_LODS];
+        for (int k = begin; k < end; ++k) {
+            int i = members ? members[k] : k;
+            float distance = glm::length(crowdPosition(layout, i, angle) - cameraPos);
+            crowdLODs[k] = (unsigned char)selectLOD(bodyMesh, projectedRadius(radius, distance, viewportHeight));
+            ++bucket[crowdLODs[k]];
+        }
+    });
+
+    // LOD-major prefix sum keeps each LOD contiguous across chunks
+    int bucketStart[NUM_LODS];
+    int bucketSize[NUM_LODS] = {};
+    for (int level = 0, offset = 0; level < NUM_LODS; ++level) {
+        bucketStart[level] = offset;
+        for (int chunk = 0; chunk < chunks; ++chunk) {
+            int& slot = crowdBuckets[chunk * NUM_LODS + level];
+            int size = slot;
+            slot = offset;
+            offset += size;
+            bucketSize[level] += size;
+        }
+    }
+
+    setMeshUniforms(uniforms, bodyMesh);
+    InstanceData* instances = beginInstanceWrite(drawn);
+    parallelFor(drawn, CROWD_GRAIN, [&](int chunk, int begin, int end) {
+        int* cursor = &crowdBuckets[chunk * NUM_LODS];
+        for (int k = begin; k < end; ++k) {
+            writeCrowdInstance(layout, members ? members[k] : k, angle, instances[cursor[crowdLODs[k]]++]);
+        }
+    });
+    endInstanceWrite();
+    crowdUpdateMs = millisecondsSince(updateStart);
+
+    if (multiDrawIndirect < 0) {
+        multiDrawIndirect = GLEW_VERSION_4_3 || (GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance);
+    }
+    if (crowdCulling && multiDrawIndirect) {
+        DrawElementsIndirectCommand commands[NUM_LODS];
+        int commandCount = 0;
+        for (int level = 0; level < NUM_LODS && level < (int)bodyMesh.lods.size(); ++level) {
+            if (bucketSize[level] == 0) continue;
+            const MeshLOD& lod = bodyMesh.lods[level];
+            DrawElementsIndirectCommand command = { (GLuint)lod.indexCount, (GLuint)bucketSize[level],
+                                                    (GLuint)lod.firstIndex, lod.baseVertex,
+                                                    (GLuint)bucketStart[level] };
+            commands[commandCount++] = command;
+            countMeshLOD(bodyMesh, level, bucketSize[level]);
+        }
+        if (crowdIndirectBuffer == 0) glGenBuffers(1, &crowdIndirectBuffer);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, crowdIndirectBuffer);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(commands), NULL, GL_STREAM_DRAW);
+        glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, commandCount * sizeof(DrawElementsIndirectCommand), commands);
+        bindInstanceAttributes(0);
+        glBindVertexArray(bodyMesh.vao);
+        glMultiDrawElementsIndirect(GL_TRIANGLES, bodyMesh.indexType, NULL, commandCount, 0);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+        crowdDrawCalls = 1;
+    } else {
+        for (int level = 0; level < NUM_LODS; ++level) {
+            if (bucketSize[level] == 0) continue;
+            bindInstanceAttributes(bucketStart[level]);
+            glBindVertexArray(bodyMesh.vao);
+            drawMeshLOD(bodyMesh, level, bucketSize[level]);
+            ++crowdDrawCalls;
+        }
+    }
+    glBindVertexArray(0);
+
+    fenceInstanceWrite();
+}
+
+bool usesScreenOutline(int stage) {
+    return outlineMode == OUTLINE_SCREEN && stage >= 2;
+}
+
+const char* paperModeName(int stage) {
+    return stage < 4 ? "none" : paperMode == PAPER_TEXTURE ? "texture" : "hash";
+}
+
+const char* tomoeModeName(int stage) {
+    return stage < 3 ? "none" : tomoeMode == TOMOE_ATLAS ? "atlas" : "analytic";
+}
+
+// Camera and light for one frame, shared by the GL and software renderers
+FrameUniforms makeFrameUniforms(int stage, int width, int height, float time) {
+    FrameUniforms frame;
+    frame.view = glm::lookAt(cameraPos, cameraTarget, glm::vec3(0.0f, 1.0f, 0.0f));
+    frame.projection = glm::perspective(glm::radians(FIELD_OF_VIEW), 
+                                        (float)width / height, NEAR_PLANE, FAR_PLANE);
+    frame.lightPos = glm::vec3(3.0f, 3.0f, 3.0f);
+    frame.time = time;
+    frame.viewPos = cameraPos;
+    frame.rimOutline = usesScreenOutline(stage) ? 0.0f : 1.0f;
+    frame.paperGrain = paperMode == PAPER_TEXTURE ? 1.0f : 0.0f;
+    // Grain stays the same size on screen when the scene is drawn scaled
+    frame.paperScale = 1.0f / (PAPER_SIZE * sceneResolutionScale);
+    frame.tomoeBaked = tomoeMode == TOMOE_ATLAS && tomoeAtlasTexture != 0 ? 1.0f : 0.0f;
+    // One empty cluster until updateClusteredLights() fills them in
+    frame.clusterScale = glm::vec4(0.0f);
+    frame.clusterSize[0] = frame.clusterSize[1] = frame.clusterSize[2] = 1;
+    frame.clusterSize[3] = 0;
+    return frame;
+}
+
+// Draws one frame of the scene into the currently bound framebuffer
+void renderScene(int stage, int width, int height, float time) {
+    frameTriangles = 0;
+    frameVertexBytes = 0.0;
+    glClearColor(0.94f, 0.91f, 0.83f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    
+    FrameUniforms frame = makeFrameUniforms(stage, width, height, time);
+    if (lanternCount > 0) updateClusteredLights(frame, width, height, time);
+    {
+        ProfileScope scope("uniforms");
+        uploadFrameUniforms(frame);
+    }
+    
+    // The body is still being built on the job system
+    if (bodyMesh.vao == 0) return;
+    
+    if (crowdSize > 0) {
+        const StageProgram& crowdProgram = acquireStageProgram(stage, PROGRAM_INSTANCED);
+        glUseProgram(crowdProgram.program);
+        glUniform1i(crowdProgram.uniforms.celMaterial, stageCelMaterial(stage));
+        drawCrowd(crowdProgram.uniforms, crowdSize, rotationAngle, frame.projection * frame.view, height);
+        return;
+    }
+    
+    const StageProgram& shaderProgram = acquireStageProgram(stage);
+    glUseProgram(shaderProgram.program);
+    glUniform1i(shaderProgram.uniforms.celMaterial, stageCelMaterial(stage));
+    
+    glm::mat4 model = glm::mat4(1.0f);
+    model = glm::rotate(model, rotationAngle, glm::vec3(0.0f, 1.0f, 0.0f));
+    float radius = projectedRadius(bodyMesh.boundingRadius, glm::length(cameraPos), height);
+    drawBody(shaderProgram.uniforms, model, selectLOD(bodyMesh, radius));
+}
+
+// ─── Screen-space sumi-e outlines ─────────────────────────────────
+//
+// Stages 2-5 write color, view-space normals and depth into a G-buffer.
+// One full-screen pass marks depth and normal discontinuities as seeds
+// carrying a brush width, a few jump-flood passes spread the nearest seed
+// to every pixel, and the composite draws anti-aliased ink wherever a pixel
+// is within its seed's width. Every pass is one full-screen triangle, so
+// the cost depends on resolution only, not on overdraw or scene size.
+// Flooding only needs to reach the widest stroke, which keeps it to
+// three or four passes instead of log2(resolution).
+
+const char* getFullscreenVertexShader() {
+    return R"(
+        #version 330 core
+        void main() {
+            vec2 pos = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+            gl_Position = vec4(pos * 2.0 - 1.0, 0.0, 1.0);
+        }
+    )";
+}
+
+const char* getInkEdgeShader() {
+    return R"(
+        #version 330 core
+        uniform sampler2D depthTex;
+        uniform sampler2D normalTex;
+        uniform vec2 depthRange;
+        uniform float inkWidth;
+        uniform float edgeOffset;       // 1 moves seeds onto the pixel edge, for upscaling
+        out vec4 Seed;
+        
+        float linearDepth(ivec2 p) {
+            float z = texelFetch(depthTex, p, 0).r * 2.0 - 1.0;
+            float n = depthRange.x;
+            float f = depthRange.y;
+            return 2.0 * n * f / (f + n - z * (f - n));
+        }
+        
+        void main() {
+            ivec2 p = ivec2(gl_FragCoord.xy);
+            ivec2 size = textureSize(depthTex, 0);
+            float depth = linearDepth(p);
+            vec3 normal = texelFetch(normalTex, p, 0).xyz * 2.0 - 1.0;
+            
+            const ivec2 offsets[4] = ivec2[](ivec2(1, 0), ivec2(-1, 0), ivec2(0, 1), ivec2(0, -1));
+            float silhouette = 0.0;
+            float crease = 0.0;
+            vec2 toward = vec2(0.0);
+            for (int i = 0; i < 4; ++i) {
+                ivec2 q = clamp(p + offsets[i], ivec2(0), size - 1);
+                float neighborDepth = linearDepth(q);
+                // Only the nearer side of a depth jump seeds, so strokes hug the body
+                if (neighborDepth - depth > 0.08 * depth) {
+                    silhouette = 1.0;
+                    toward += vec2(offsets[i]);
+                } else if (neighborDepth - depth > -0.08 * depth) {
+                    vec3 neighborNormal = texelFetch(normalTex, q, 0).xyz * 2.0 - 1.0;
+                    if (dot(normal, neighborNormal) < 0.6) {
+                        crease = 1.0;
+                        toward += vec2(offsets[i]);
+                    }
+                }
+            }
+            
+            if (silhouette + crease == 0.0) {
+                Seed = vec4(-1.0, -1.0, 0.0, 0.0);
+                return;
+            }
+            
+            // Brush pressure swells and thins slowly along the stroke
+            vec2 q = gl_FragCoord.xy / float(size.y);
+            float pressure = 0.7 + 0.3 * sin(q.x * 23.0 + sin(q.y * 17.0) * 2.0) * sin(q.y * 19.0 + 1.3);
+            float width = inkWidth * pressure * (silhouette > 0.0 ? 1.0 : 0.45);
+            // Half way to the neighbors across the edge, so a staircase of
+            // seeds traces the smooth edge it came from
+            vec2 shift = toward / max(abs(toward.x) + abs(toward.y), 1.0) * 0.5 * edgeOffset;
+            Seed = vec4(gl_FragCoord.xy + shift, width, 1.0);
+        }
+    )";
+}
+
+const char* getJumpFloodShader() {
+    return R"(
+        #version 330 core
+        uniform sampler2D seedTex;
+        uniform int stepSize;
+        out vec4 Seed;
+        
+        void main() {
+            ivec2 p = ivec2(gl_FragCoord.xy);
+            ivec2 size = textureSize(seedTex, 0);
+            vec4 best = vec4(-1.0, -1.0, 0.0, 0.0);
+            float bestDistance = 1e9;
+            
+            for (int y = -1; y <= 1; ++y) {
+                for (int x = -1; x <= 1; ++x) {
+                    ivec2 q = p + ivec2(x, y) * stepSize;
+                    if (any(lessThan(q, ivec2(0))) || any(greaterThanEqual(q, size))) continue;
+                    vec4 seed = texelFetch(seedTex, q, 0);
+                    if (seed.w == 0.0) continue;
+                    // Distance to the stroke edge, so wide strokes win over thin ones
+                    float d = distance(seed.xy, gl_FragCoord.xy) - seed.z;
+                    if (d < bestDistance) {
+                        bestDistance = d;
+                        best = seed;
+                    }
+                }
+            }
+            Seed = best;
+        }
+    )";
+}
+
+const char* getInkCompositeShader() {
+    return R"(
+        #version 330 core
+        uniform sampler2D colorTex;
+        uniform sampler2D seedTex;
+        out vec4 FragColor;
+        
+        void main() {
+            ivec2 p = ivec2(gl_FragCoord.xy);
+            vec3 color = texelFetch(colorTex, p, 0).rgb;
+            vec4 seed = texelFetch(seedTex, p, 0);
+            
+            if (seed.w > 0.0) {
+                float d = distance(seed.xy, gl_FragCoord.xy);
+                float coverage = 1.0 - smoothstep(seed.z - 0.75, seed.z + 0.75, d);
+                // Ink runs slightly dry towards the edge of the stroke
+                vec3 ink = vec3(0.07) + 0.05 * smoothstep(0.4 * seed.z, seed.z, d);
+                color = mix(color, ink, coverage);
+            }
+            FragColor = vec4(color, 1.0);
+        }
+    )";
+}
+
+// The composite for a G-buffer smaller than the output. Scene color is
+// interpolated bilinearly, but stroke coverage is measured from each output
+// pixel's own position to the nearest of the four surrounding seeds, so ink
+// edges stay one output pixel wide.
+const char* getInkUpscaleShader() {
+    return R"(
+        #version 330 core
+        uniform sampler2D colorTex;
+        uniform sampler2D seedTex;
+        uniform vec2 sceneScale;        // scene pixels per output pixel
+        out vec4 FragColor;
+        
+        vec3 bilinearColor(vec2 p) {
+            vec2 base = p - 0.5;
+            ivec2 i = ivec2(floor(base));
+            vec2 f = base - vec2(i);
+            ivec2 last = textureSize(colorTex, 0) - 1;
+            vec3 c00 = texelFetch(colorTex, clamp(i, ivec2(0), last), 0).rgb;
+            vec3 c10 = texelFetch(colorTex, clamp(i + ivec2(1, 0), ivec2(0), last), 0).rgb;
+            vec3 c01 = texelFetch(colorTex, clamp(i + ivec2(0, 1), ivec2(0), last), 0).rgb;
+            vec3 c11 = texelFetch(colorTex, clamp(i + ivec2(1, 1), ivec2(0), last), 0).rgb;
+            return mix(mix(c00, c10, f.x), mix(c01, c11, f.x), f.y);
+        }
+        
+        void main() {
+            vec2 p = gl_FragCoord.xy * sceneScale;
+            vec3 color = bilinearColor(p);
+            
+            ivec2 base = ivec2(floor(p - 0.5));
+            ivec2 last = textureSize(seedTex, 0) - 1;
+            vec4 best = vec4(0.0);
+            float bestDistance = 1e9;
+            for (int y = 0; y <= 1; ++y) {
+                for (int x = 0; x <= 1; ++x) {
+                    vec4 seed = texelFetch(seedTex, clamp(base + ivec2(x, y), ivec2(0), last), 0);
+                    if (seed.w == 0.0) continue;
+                    float d = distance(seed.xy, p) - seed.z;
+                    if (d < bestDistance) {
+                        bestDistance = d;
+                        best = seed;
+                    }
+                }
+            }
+            
+            if (best.w > 0.0) {
+                float d = distance(best.xy, p);
+                float edge = 0.75 * sceneScale.y;
+                float coverage = 1.0 - smoothstep(best.z - edge, best.z + edge, d);
+                vec3 ink = vec3(0.07) + 0.05 * smoothstep(0.4 * best.z, best.z, d);
+                color = mix(color, ink, coverage);
+            }
+            FragColor = vec4(color, 1.0);
+        }
+    )";
+}
+
+struct InkOutline {
+    int width = 0;
+    int height = 0;
+    GLuint sceneFBO = 0;
+    GLuint colorTex = 0;
+    GLuint normalTex = 0;
+    GLuint depthTex = 0;
+    GLuint seedFBO[2] = {};
+    GLuint seedTex[2] = {};
+    
+    GLuint emptyVAO = 0;
+    GLuint edgeProgram = 0;
+    GLuint floodProgram = 0;
+    GLuint compositeProgram = 0;
+    GLuint upscaleProgram = 0;
+    GLint edgeDepthRange = -1;
+    GLint edgeInkWidth = -1;
+    GLint edgeOffset = -1;
+    GLint floodStepSize = -1;
+    GLint upscaleSceneScale = -1;
+};
+
+InkOutline inkOutline;
+float inkWidth = 10.0f;     // stroke width in pixels at 720p
+
+GLuint createProgram(const char* vertexSource, const char* fragmentSource) {
+    GLuint vertexShader = compileShader(vertexSource, GL_VERTEX_SHADER);
+    GLuint fragmentShader = compileShader(fragmentSource, GL_FRAGMENT_SHADER);
+    checkShaderCompiled(vertexShader);
+    checkShaderCompiled(fragmentShader);
+    
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertexShader);
+    glAttachShader(program, fragmentShader);
+    glLinkProgram(program);
+    
+    int success;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success) {
+        char infoLog[512];
+        glGetProgramInfoLog(program, 512, NULL, infoLog);
+        std::cerr << "Program linking failed: " << infoLog << std::endl;
+    }
+    
+    glDeleteShader(vertexShader);
+    glDeleteShader(fragmentShader);
+    return program;
+}
+
+GLuint createPostProgram(const char* fragmentSource) {
+    return createProgram(getFullscreenVertexShader(), fragmentSource);
+}
+
+void setSamplerUnit(GLuint program, const char* name, int unit) {
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, name), unit);
+}
+
+void setupInkOutline() {
+    glGenVertexArrays(1, &inkOutline.emptyVAO);
+    
+    inkOutline.edgeProgram = createPostProgram(getInkEdgeShader());
+    inkOutline.floodProgram = createPostProgram(getJumpFloodShader());
+    inkOutline.compositeProgram = createPostProgram(getInkCompositeShader());
+    inkOutline.upscaleProgram = createPostProgram(getInkUpscaleShader());
+    
+    setSamplerUnit(inkOutline.edgeProgram, "depthTex", 0);
+    setSamplerUnit(inkOutline.edgeProgram, "normalTex", 1);
+    setSamplerUnit(inkOutline.floodProgram, "seedTex", 0);
+    setSamplerUnit(inkOutline.compositeProgram, "colorTex", 0);
+    setSamplerUnit(inkOutline.compositeProgram, "seedTex", 1);
+    setSamplerUnit(inkOutline.upscaleProgram, "colorTex", 0);
+    setSamplerUnit(inkOutline.upscaleProgram, "seedTex", 1);
+    glUseProgram(0);
+    
+    inkOutline.edgeDepthRange = glGetUniformLocation(inkOutline.edgeProgram, "depthRange");
+    inkOutline.edgeInkWidth = glGetUniformLocation(inkOutline.edgeProgram, "inkWidth");
+    inkOutline.edgeOffset = glGetUniformLocation(inkOutline.edgeProgram, "edgeOffset");
+    inkOutline.floodStepSize = glGetUniformLocation(inkOutline.floodProgram, "stepSize");
+    inkOutline.upscaleSceneScale = glGetUniformLocation(inkOutline.upscaleProgram, "sceneScale");
+}
+
+GLuint createTargetTexture(GLenum internalFormat, GLenum format, GLenum type, int width, int height) {
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return texture;
+}
+
+void deleteInkTargets() {
+    glDeleteFramebuffers(1, &inkOutline.sceneFBO);
+    glDeleteFramebuffers(2, inkOutline.seedFBO);
+    glDeleteTextures(1, &inkOutline.colorTex);
+    glDeleteTextures(1, &inkOutline.normalTex);
+    glDeleteTextures(1, &inkOutline.depthTex);
+    glDeleteTextures(2, inkOutline.seedTex);
+    inkOutline.sceneFBO = inkOutline.colorTex = inkOutline.normalTex = inkOutline.depthTex = 0;
+    inkOutline.seedFBO[0] = inkOutline.seedFBO[1] = 0;
+    inkOutline.seedTex[0] = inkOutline.seedTex[1] = 0;
+    inkOutline.width = inkOutline.height = 0;
+}
+
+void ensureInkTargets(int width, int height) {
+    if (inkOutline.width == width && inkOutline.height == height) return;
+    deleteInkTargets();
+    inkOutline.width = width;
+    inkOutline.height = height;
+    
+    inkOutline.colorTex = createTargetTexture(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, width, height);
+    inkOutline.normalTex = createTargetTexture(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, width, height);
+    inkOutline.depthTex = createTargetTexture(GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, 
+                                              GL_UNSIGNED_INT, width, height);
+    
+    glGenFramebuffers(1, &inkOutline.sceneFBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, inkOutline.sceneFBO);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, inkOutline.colorTex, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, inkOutline.normalTex, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, inkOutline.depthTex, 0);
+    const GLenum drawBuffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    glDrawBuffers(2, drawBuffers);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cerr << "Ink G-buffer incomplete" << std::endl;
+    }
+    
+    // Seeds hold pixel coordinates, which need full float precision past 2048
+    glGenFramebuffers(2, inkOutline.seedFBO);
+    for (int i = 0; i < 2; ++i) {
+        inkOutline.seedTex[i] = createTargetTexture(GL_RGBA32F, GL_RGBA, GL_FLOAT, width, height);
+        glBindFramebuffer(GL_FRAMEBUFFER, inkOutline.seedFBO[i]);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, 
+                               inkOutline.seedTex[i], 0);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void deleteInkOutline() {
+    deleteInkTargets();
+    glDeleteProgram(inkOutline.edgeProgram);
+    glDeleteProgram(inkOutline.floodProgram);
+    glDeleteProgram(inkOutline.compositeProgram);
+    glDeleteProgram(inkOutline.upscaleProgram);
+    glDeleteVertexArrays(1, &inkOutline.emptyVAO);
+    inkOutline = InkOutline();
+}
+
+// Turns the G-buffer into ink strokes composited over the scene color. An
+// output larger than the G-buffer is composited at its own resolution.
+void drawInkOutline(GLuint targetFBO, int outputWidth, int outputHeight) {
+    float width = inkWidth * inkOutline.height / 720.0f;
+    
+    glDisable(GL_DEPTH_TEST);
+    glBindVertexArray(inkOutline.emptyVAO);
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, inkOutline.seedFBO[0]);
+    glUseProgram(inkOutline.edgeProgram);
+    glUniform2f(inkOutline.edgeDepthRange, NEAR_PLANE, FAR_PLANE);
+    glUniform1f(inkOutline.edgeInkWidth, width);
+    bool upscaling = outputWidth != inkOutline.width || outputHeight != inkOutline.height;
+    glUniform1f(inkOutline.edgeOffset, upscaling ? 1.0f : 0.0f);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, inkOutline.depthTex);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, inkOutline.normalTex);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    
+    // Smallest power-of-two step whose flood reaches past the widest stroke
+    int reach = (int)std::ceil(width + 1.0f);
+    int step = 1;
+    while (step * 2 - 1 < reach) step *= 2;
+    
+    int source = 0;
+    glUseProgram(inkOutline.floodProgram);
+    glActiveTexture(GL_TEXTURE0);
+    for (; step >= 1; step /= 2) {
+        glBindFramebuffer(GL_FRAMEBUFFER, inkOutline.seedFBO[1 - source]);
+        glBindTexture(GL_TEXTURE_2D, inkOutline.seedTex[source]);
+        glUniform1i(inkOutline.floodStepSize, step);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        source = 1 - source;
+    }
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, targetFBO);
+    if (!upscaling) {
+        glUseProgram(inkOutline.compositeProgram);
+    } else {
+        glViewport(0, 0, outputWidth, outputHeight);
+        glUseProgram(inkOutline.upscaleProgram);
+        glUniform2f(inkOutline.upscaleSceneScale, (float)inkOutline.width / outputWidth,
+                    (float)inkOutline.height / outputHeight);
+    }
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, inkOutline.colorTex);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, inkOutline.seedTex[source]);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    
+    glActiveTexture(GL_TEXTURE0);
+    glBindVertexArray(0);
+    glEnable(GL_DEPTH_TEST);
+}
+
+// ─── Anti-aliasing ────────────────────────────────────────────────
+//
+// Flat cel regions need no anti-aliasing; only silhouettes and the cel,
+// rim and tomoe thresholds do. MSAA smooths silhouettes only, and pays for
+// its samples on every pixel. The analytic mode widens each shading
+// threshold to a one-pixel ramp with fwidth() (FEATURE_ANALYTIC_AA), at a
+// few ALU ops per fragment. FXAA runs over the finished frame and blends
+// across luma edges; flat pixels leave after five fetches. The ink
+// G-buffer stays single-sampled in every mode: the ink composite already
+// covers each silhouette with an anti-aliased stroke, and MSAA cannot
+// smooth shading thresholds.
+
+// MSAA samples of a mode, within what the driver supports
+int antiAliasingSamples(AntiAliasing mode) {
+    int samples = ANTI_ALIASING_MODES[mode].samples;
+    if (samples == 0) return 0;
+    GLint maxSamples = 0;
+    glGetIntegerv(GL_MAX_SAMPLES, &maxSamples);
+    return std::min(samples, (int)maxSamples);
+}
+
+// FXAA 3.11 "console" style: one 2x2-cornered luma test, then a blend of
+// two or four taps along the edge direction
+const char* getFxaaShader() {
+    return R"(
+        #version 330 core
+        uniform sampler2D colorTex;
+        uniform vec2 texelSize;
+        out vec4 FragColor;
+        
+        const float EDGE_THRESHOLD = 0.125;     // local contrast relative to the brightest luma
+        const float EDGE_THRESHOLD_MIN = 0.0312;
+        const float REDUCE_MUL = 1.0 / 8.0;
+        const float REDUCE_MIN = 1.0 / 128.0;
+        const float SPAN_MAX = 8.0;
+        
+        float luma(vec3 color) {
+            return dot(color, vec3(0.299, 0.587, 0.114));
+        }
+        
+        void main() {
+            vec2 uv = gl_FragCoord.xy * texelSize;
+            vec3 rgbM = textureLod(colorTex, uv, 0.0).rgb;
+            float lumaM = luma(rgbM);
+            float lumaNW = luma(textureLodOffset(colorTex, uv, 0.0, ivec2(-1, 1)).rgb);
+            float lumaNE = luma(textureLodOffset(colorTex, uv, 0.0, ivec2(1, 1)).rgb);
+            float lumaSW = luma(textureLodOffset(colorTex, uv, 0.0, ivec2(-1, -1)).rgb);
+            float lumaSE = luma(textureLodOffset(colorTex, uv, 0.0, ivec2(1, -1)).rgb);
+            float lumaMin = min(lumaM, min(min(lumaNW, lumaNE), min(lumaSW, lumaSE)));
+            float lumaMax = max(lumaM, max(max(lumaNW, lumaNE), max(lumaSW, lumaSE)));
+            if (lumaMax - lumaMin < max(EDGE_THRESHOLD_MIN, lumaMax * EDGE_THRESHOLD)) {
+                FragColor = vec4(rgbM, 1.0);
+                return;
+            }
+            
+            // Edge direction from the corner gradients, scaled so the
+            // shorter axis is one texel
+            vec2 dir = vec2((lumaSW + lumaSE) - (lumaNW + lumaNE), (lumaNE + lumaSE) - (lumaNW + lumaSW));
+            float reduce = max((lumaNW + lumaNE + lumaSW + lumaSE) * 0.25 * REDUCE_MUL, REDUCE_MIN);
+            float scale = 1.0 / (min(abs(dir.x), abs(dir.y)) + reduce);
+            dir = clamp(dir * scale, -SPAN_MAX, SPAN_MAX) * texelSize;
+            
+            vec3 rgbA = 0.5 * (textureLod(colorTex, uv - dir * (1.0 / 6.0), 0.0).rgb +
+                               textureLod(colorTex, uv + dir * (1.0 / 6.0), 0.0).rgb);
+            vec3 rgbB = 0.5 * rgbA + 0.25 * (textureLod(colorTex, uv - dir * 0.5, 0.0).rgb +
+                                             textureLod(colorTex, uv + dir * 0.5, 0.0).rgb);
+            float lumaB = luma(rgbB);
+            // The wide blend crossed another edge: keep the narrow one
+            FragColor = vec4(lumaB < lumaMin || lumaB > lumaMax ? rgbA : rgbB, 1.0);
+        }
+    )";
+}
+
+// Output-sized target the frame is drawn into before the FXAA pass
+struct PostAntiAliasing {
+    int width = 0;
+    int height = 0;
+    GLuint fbo = 0;
+    GLuint colorTex = 0;
+    GLuint depth = 0;                   // for scenes drawn straight into it
+    GLuint program = 0;
+    GLint texelSize = -1;
+};
+
+PostAntiAliasing postAA;
+
+void deletePostTargets() {
+    glDeleteFramebuffers(1, &postAA.fbo);
+    glDeleteTextures(1, &postAA.colorTex);
+    glDeleteRenderbuffers(1, &postAA.depth);
+    postAA.fbo = postAA.colorTex = postAA.depth = 0;
+    postAA.width = postAA.height = 0;
+}
+
+void ensurePostTargets(int width, int height) {
+    if (postAA.width == width && postAA.height == height) return;
+    deletePostTargets();
+    if (postAA.program == 0) {
+        postAA.program = createPostProgram(getFxaaShader());
+        setSamplerUnit(postAA.program, "colorTex", 0);
+        postAA.texelSize = glGetUniformLocation(postAA.program, "texelSize");
+        glUseProgram(0);
+    }
+    postAA.width = width;
+    postAA.height = height;
+    
+    // FXAA samples between texels
+    postAA.colorTex = createTargetTexture(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, width, height);
+    glBindTexture(GL_TEXTURE_2D, postAA.colorTex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glGenRenderbuffers(1, &postAA.depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, postAA.depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    
+    glGenFramebuffers(1, &postAA.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, postAA.fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, postAA.colorTex, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, postAA.depth);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cerr << "FXAA target incomplete" << std::endl;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void deletePostAntiAliasing() {
+    deletePostTargets();
+    glDeleteProgram(postAA.program);
+    postAA = PostAntiAliasing();
+}
+
+// Filters the frame drawn into postAA.fbo into targetFBO
+void applyFxaa(GLuint targetFBO, int width, int height) {
+    glBindFramebuffer(GL_FRAMEBUFFER, targetFBO);
+    glViewport(0, 0, width, height);
+    glDisable(GL_DEPTH_TEST);
+    glUseProgram(postAA.program);
+    glUniform2f(postAA.texelSize, 1.0f / width, 1.0f / height);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, postAA.colorTex);
+    glBindVertexArray(inkOutline.emptyVAO);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glBindVertexArray(0);
+    glEnable(GL_DEPTH_TEST);
+}
+
+// ─── Dynamic resolution ───────────────────────────────────────────
+//
+// The scene can be drawn below output resolution and upscaled. In the demo
+// the scale follows the GPU frame time: the timer of each drawn frame is
+// averaged over a few frames at one scale, then the scale moves to the one
+// whose pixel count fits --gpu-budget, assuming cost proportional to
+// pixels. Stages with screen-space outlines keep their ink at output
+// resolution through the ink upscale composite. Other stages are drawn
+// with the anti-aliasing mode's MSAA, resolved, and upscaled bilinearly.
+
+const float RENDER_SCALE_STEP = 0.05f;          // scales are multiples of this
+const int RENDER_SCALE_SETTLE_FRAMES = 2;       // frame GPU times arrive this late
+const int RENDER_SCALE_WINDOW = 12;             // frames averaged per decision
+const float RENDER_SCALE_HEADROOM = 0.75f;      // scale up below this share of the budget
+const float RENDER_SCALE_MAX_RAISE = 0.15f;     // per decision, to avoid overshooting
+
+struct OffscreenTarget {
+    GLuint fbo = 0;
+    GLuint color = 0;
+    GLuint depth = 0;
+};
+
+OffscreenTarget createOffscreenTarget(int width, int height, int samples) {
+    OffscreenTarget target;
+    glGenFramebuffers(1, &target.fbo);
+    glGenRenderbuffers(1, &target.color);
+    glGenRenderbuffers(1, &target.depth);
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+    glBindRenderbuffer(GL_RENDERBUFFER, target.color);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, target.color);
+    
+    glBindRenderbuffer(GL_RENDERBUFFER, target.depth);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, target.depth);
+    
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cerr << "Offscreen framebuffer incomplete (" << width << "x" << height 
+                  << ", " << samples << " samples)" << std::endl;
+    }
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    return target;
+}
+
+void deleteOffscreenTarget(OffscreenTarget& target) {
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteRenderbuffers(1, &target.color);
+    glDeleteRenderbuffers(1, &target.depth);
+    glDeleteFramebuffers(1, &target.fbo);
+    target = OffscreenTarget();
+}
+
+const char* getUpscaleShader() {
+    return R"(
+        #version 330 core
+        uniform sampler2D colorTex;
+        uniform vec2 outputSize;
+        out vec4 FragColor;
+        
+        void main() {
+            FragColor = vec4(texture(colorTex, gl_FragCoord.xy / outputSize).rgb, 1.0);
+        }
+    )";
+}
+
+struct DynamicResolution {
+    float scale = 1.0f;
+    int framesAtScale = 0;
+    int samples = 0;                    // GPU times in the current window
+    double gpuMs = 0.0;                 // summed over the window
+    double lastAverageMs = 0.0;         // of the last full window
+    int changes = 0;
+    
+    // Scene targets for stages without screen-space outlines
+    int width = 0;
+    int height = 0;
+    int msaa = 0;
+    OffscreenTarget scene;
+    GLuint resolveFBO = 0;
+    GLuint resolveTex = 0;
+    GLuint upscaleProgram = 0;
+    GLint upscaleOutputSize = -1;
+};
+
+DynamicResolution dynamicRes;
+
+int scaledSize(int size, float scale) {
+    return std::max(1, std::min(size, (int)(size * scale + 0.5f)));
+}
+
+void deleteScaledTargets() {
+    if (dynamicRes.scene.fbo != 0) deleteOffscreenTarget(dynamicRes.scene);
+    glDeleteFramebuffers(1, &dynamicRes.resolveFBO);
+    glDeleteTextures(1, &dynamicRes.resolveTex);
+    dynamicRes.resolveFBO = dynamicRes.resolveTex = 0;
+    dynamicRes.width = dynamicRes.height = dynamicRes.msaa = 0;
+}
+
+void ensureScaledTargets(int width, int height, int msaa) {
+    if (dynamicRes.width == width && dynamicRes.height == height && dynamicRes.msaa == msaa) return;
+    deleteScaledTargets();
+    if (dynamicRes.upscaleProgram == 0) {
+        dynamicRes.upscaleProgram = createPostProgram(getUpscaleShader());
+        setSamplerUnit(dynamicRes.upscaleProgram, "colorTex", 0);
+        dynamicRes.upscaleOutputSize = glGetUniformLocation(dynamicRes.upscaleProgram, "outputSize");
+        glUseProgram(0);
+    }
+    dynamicRes.width = width;
+    dynamicRes.height = height;
+    dynamicRes.msaa = msaa;
+    dynamicRes.scene = createOffscreenTarget(width, height, msaa);
+    
+    dynamicRes.resolveTex = createTargetTexture(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, width, height);
+    glBindTexture(GL_TEXTURE_2D, dynamicRes.resolveTex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glGenFramebuffers(1, &dynamicRes.resolveFBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, dynamicRes.resolveFBO);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, dynamicRes.resolveTex, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void deleteDynamicResolution() {
+    deleteScaledTargets();
+    glDeleteProgram(dynamicRes.upscaleProgram);
+    dynamicRes = DynamicResolution();
+}
+
+// Resolves the scaled scene and stretches it over the output
+void upscaleScene(GLuint targetFBO, int outputWidth, int outputHeight) {
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, dynamicRes.scene.fbo);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, dynamicRes.resolveFBO);
+    glBlitFramebuffer(0, 0, dynamicRes.width, dynamicRes.height, 0, 0, dynamicRes.width, dynamicRes.height,
+                      GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, targetFBO);
+    glViewport(0, 0, outputWidth, outputHeight);
+    glDisable(GL_DEPTH_TEST);
+    glUseProgram(dynamicRes.upscaleProgram);
+    glUniform2f(dynamicRes.upscaleOutputSize, (float)outputWidth, (float)outputHeight);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, dynamicRes.resolveTex);
+    glBindVertexArray(inkOutline.emptyVAO);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glBindVertexArray(0);
+    glEnable(GL_DEPTH_TEST);
+}
+
+// Feeds one frame's GPU time (negative if none arrived) and picks the
+// scale for the next frame
+void adaptRenderScale(double gpuMs, int outputWidth, int outputHeight) {
+    DynamicResolution& res = dynamicRes;
+    float target = dynamicResolution ? res.scale : fixedRenderScale;
+    if (dynamicResolution && gpuBudgetMs > 0.0f) {
+        // Times of frames drawn at an earlier scale are still arriving
+        if (++res.framesAtScale > RENDER_SCALE_SETTLE_FRAMES && gpuMs >= 0.0) {
+            res.gpuMs += gpuMs;
+            ++res.samples;
+        }
+        if (res.samples < RENDER_SCALE_WINDOW) return;
+        double average = res.gpuMs / res.samples;
+        res.lastAverageMs = average;
+        res.gpuMs = 0.0;
+        res.samples = 0;
+        if (average > gpuBudgetMs) {
+            target = res.scale * (float)std::sqrt(gpuBudgetMs / average);
+            target = std::floor(target / RENDER_SCALE_STEP + 1e-3f) * RENDER_SCALE_STEP;
+        } else if (average < gpuBudgetMs * RENDER_SCALE_HEADROOM && res.scale < 1.0f) {
+            target = res.scale * (float)std::sqrt(gpuBudgetMs * RENDER_SCALE_HEADROOM / average);
+            target = std::floor(target / RENDER_SCALE_STEP + 1e-3f) * RENDER_SCALE_STEP;
+            target = std::min(target, res.scale + RENDER_SCALE_MAX_RAISE);
+        }
+        target = glm::clamp(target, minRenderScale, 1.0f);
+    }
+    if (std::fabs(target - res.scale) < 0.001f) return;
+    
+    if (dynamicResolution && gpuBudgetMs > 0.0f) {
+        std::printf("Render scale %.2f -> %.2f (%dx%d of %dx%d): GPU %.1f ms/frame at %.2f, budget %.1f ms\n",
+                    res.scale, target, scaledSize(outputWidth, target), scaledSize(outputHeight, target),
+                    outputWidth, outputHeight, res.lastAverageMs, res.scale, gpuBudgetMs);
+    } else {
+        std::printf("Render scale %.2f (%dx%d of %dx%d)\n", target, scaledSize(outputWidth, target),
+                    scaledSize(outputHeight, target), outputWidth, outputHeight);
+    }
+    std::fflush(stdout);
+    res.scale = target;
+    res.framesAtScale = 0;
+    res.gpuMs = 0.0;
+    res.samples = 0;
+    ++res.changes;
+}
+
+void reportDynamicResolution(int outputWidth, int outputHeight) {
+    const DynamicResolution& res = dynamicRes;
+    std::printf("Render scale: %.2f (%dx%d of %dx%d), %d changes", res.scale,
+                scaledSize(outputWidth, res.scale), scaledSize(outputHeight, res.scale),
+                outputWidth, outputHeight, res.changes);
+    if (res.lastAverageMs > 0.0) std::printf(", last GPU average %.1f ms/frame", res.lastAverageMs);
+    std::printf("\n");
+    std::fflush(stdout);
+}
+
+// Renders the scene into targetFBO at scale x its size, going through the
+// ink G-buffer when the stage uses screen-space outlines and through the
+// FXAA target when that is the anti-aliasing mode
+void renderFrame(int stage, int width, int height, float time, GLuint targetFBO, float scale = 1.0f) {
+    int sceneWidth = scaledSize(width, scale);
+    int sceneHeight = scaledSize(height, scale);
+    bool scaled = sceneWidth < width || sceneHeight < height;
+    GLuint outputFBO = targetFBO;
+    if (antiAliasing == AA_FXAA) {
+        ensurePostTargets(width, height);
+        outputFBO = postAA.fbo;
+    }
+    sceneResolutionScale = (float)sceneHeight / height;
+    glViewport(0, 0, sceneWidth, sceneHeight);
+    
+    if (!usesScreenOutline(stage)) {
+        // Straight into the output when it has the size and samples wanted
+        int samples = antiAliasingSamples(antiAliasing);
+        GLint outputSamples = 0;
+        glBindFramebuffer(GL_FRAMEBUFFER, outputFBO);
+        glGetIntegerv(GL_SAMPLES, &outputSamples);
+        if (!scaled && outputSamples == samples) {
+            GpuProfileScope scope("scene");
+            renderScene(stage, width, height, time);
+        } else {
+            ensureScaledTargets(sceneWidth, sceneHeight, samples);
+            glBindFramebuffer(GL_FRAMEBUFFER, dynamicRes.scene.fbo);
+            {
+                GpuProfileScope scope("scene");
+                renderScene(stage, sceneWidth, sceneHeight, time);
+            }
+            GpuProfileScope scope(scaled ? "upscale" : "resolve");
+            upscaleScene(outputFBO, width, height);
+        }
+    } else {
+        ensureInkTargets(sceneWidth, sceneHeight);
+        glBindFramebuffer(GL_FRAMEBUFFER, inkOutline.sceneFBO);
+        {
+            GpuProfileScope scope("scene");
+            renderScene(stage, sceneWidth, sceneHeight, time);
+        }
+        sceneResolutionScale = 1.0f;
+        GpuProfileScope scope("ink");
+        drawInkOutline(outputFBO, width, height);
+    }
+    sceneResolutionScale = 1.0f;
+    
+    if (antiAliasing == AA_FXAA) {
+        GpuProfileScope scope("fxaa");
+        applyFxaa(targetFBO, width, height);
+    }
+}
+
+// ─── Profiler HUD ─────────────────────────────────────────────────
+//
+// A small overlay over the demo window (H toggles it and the profiler):
+// the frame time, a table of CPU and GPU milliseconds per section averaged
+// over the last second, and a graph of recent frame times. Text uses a
+// built-in 3x5 pixel font and everything is drawn as colored quads streamed
+// into one vertex buffer. J dumps the profiler ring as a Chrome trace.
+
+struct HudVertex {
+    float x, y;                 // pixels from the top left
+    unsigned char color[4];
+};
+
+struct ProfilerHud {
+    GLuint program = 0;
+    GLuint vao = 0;
+    GLuint vbo = 0;
+    GLint screenScale = -1;
+    std::vector<HudVertex> vertices;
+};
+
+ProfilerHud profilerHud;
+
+const int HUD_PIXEL = 2;                // screen pixels per font pixel
+const int HUD_AVERAGE_FRAMES = 60;
+const int HUD_GRAPH_FRAMES = 100;
+
+const char* getHudVertexShader() {
+    return R"(
+        #version 330 core
+        layout (location = 0) in vec2 aPos;
+        layout (location = 1) in vec4 aColor;
+        uniform vec2 screenScale;
+        out vec4 Color;
+        void main() {
+            Color = aColor;
+            gl_Position = vec4(aPos * screenScale * vec2(2.0, -2.0) + vec2(-1.0, 1.0), 0.0, 1.0);
+        }
+    )";
+}
+
+const char* getHudFragmentShader() {
+    return R"(
+        #version 330 core
+        in vec4 Color;
+        out vec4 FragColor;
+        void main() {
+            FragColor = Color;
+        }
+    )";
+}
+
+// 3x5 glyphs, one octal digit per row from the top, high bit on the left
+unsigned hudGlyph(char c) {
+    static const char CHARACTERS[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ.:-/_";
+    static const unsigned short GLYPHS[] = {
+        075557, 026227, 071747, 071717, 055711, 074717, 074757, 071111, 075757, 075717,
+        025755, 065656, 034443, 065556, 074647, 074644, 034553, 055755, 072227, 011152,
+        055655, 044447, 057755, 065555, 025552, 065644, 025563, 065655, 034216, 072222,
+        055557, 055552, 055775, 055255, 055222, 071247, 000002, 002020, 000700, 011244,
+        000007
+    };
+    if (c >= 'a' && c <= 'z') c = c - 'a' + 'A';
+    const char* found = std::strchr(CHARACTERS, c);
+    return c != '\0' && found ? GLYPHS[found - CHARACTERS] : 0;
+}
+
+void hudQuad(float x, float y, float width, float height, unsigned int rgba) {
+    HudVertex corners[4];
+    for (int i = 0; i < 4; ++i) {
+        corners[i].x = x + (i & 1 ? width : 0.0f);
+        corners[i].y = y + (i & 2 ? height : 0.0f);
+        for (int c = 0; c < 4; ++c) corners[i].color[c] = (unsigned char)(rgba >> (24 - 8 * c));
+    }
+    static const int ORDER[6] = { 0, 1, 2, 2, 1, 3 };
+    for (int i = 0; i < 6; ++i) profilerHud.vertices.push_back(corners[ORDER[i]]);
+}
+
+void hudText(float x, float y, const char* text, unsigned int rgba) {
+    for (; *text; ++text, x += 4 * HUD_PIXEL) {
+        unsigned glyph = hudGlyph(*text);
+        for (int row = 0; row < 5; ++row) {
+            for (int column = 0; column < 3; ++column) {
+                if (glyph & (1u << ((4 - row) * 3 + 2 - column))) {
+                    hudQuad(x + column * HUD_PIXEL, y + row * HUD_PIXEL, HUD_PIXEL, HUD_PIXEL, rgba);
+                }
+            }
+        }
+    }
+}
+
+void setupProfilerHud() {
+    profilerHud.program = createProgram(getHudVertexShader(), getHudFragmentShader());
+    profilerHud.screenScale = glGetUniformLocation(profilerHud.program, "screenScale");
+    glGenVertexArrays(1, &profilerHud.vao);
+    glGenBuffers(1, &profilerHud.vbo);
+    glBindVertexArray(profilerHud.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, profilerHud.vbo);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(HudVertex), (void*)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(HudVertex), 
+                          (void*)offsetof(HudVertex, color));
+    glEnableVertexAttribArray(1);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void deleteProfilerHud() {
+    glDeleteProgram(profilerHud.program);
+    glDeleteVertexArrays(1, &profilerHud.vao);
+    glDeleteBuffers(1, &profilerHud.vbo);
+    profilerHud = ProfilerHud();
+}
+
+// Builds and draws the overlay into the bound framebuffer
+void drawProfilerHud(int width, int height) {
+    if (!profilerHudVisible || profilerHud.program == 0) return;
+    GpuProfileScope scope("hud");
+    
+    const unsigned int PANEL = 0x141210c0;
+    const unsigned int TEXT = 0xf2eee0ff;
+    const unsigned int DIM = 0xa09a88ff;
+    const unsigned int CPU = 0xd8413cff;     // tomoe red
+    const unsigned int GPU = 0x8a8578ff;
+    const float LINE = 7 * HUD_PIXEL;
+    const float PANEL_WIDTH = 36 * 4 * HUD_PIXEL;
+    
+    profilerHud.vertices.clear();
+    float x = 10.0f;
+    float y = 10.0f;
+    float graphHeight = 60.0f;
+    float panelHeight = (profileSections.size() + 3) * LINE + graphHeight + 14.0f;
+    hudQuad(x - 6, y - 6, PANEL_WIDTH, panelHeight, PANEL);
+    
+    double frameMs = 0.0;
+    for (size_t i = 0; i < profileSections.size(); ++i) {
+        if (std::strcmp(profileSections[i].name, "frame") == 0) {
+            frameMs = profileAverage(profileSections[i], false, HUD_AVERAGE_FRAMES);
+        }
+    }
+    char line[96];
+    std::snprintf(line, sizeof(line), "FRAME %.2f MS  %.0f FPS  DROP %llu", frameMs, 
+                  frameMs > 0.0 ? 1000.0 / frameMs : 0.0, gpuFramesDropped);
+    hudText(x, y, line, TEXT);
+    y += LINE * 1.5f;
+    hudText(x, y, "SECTION            CPU     GPU", DIM);
+    y += LINE;
+    for (size_t i = 0; i < profileSections.size(); ++i) {
+        const ProfileSection& section = profileSections[i];
+        double cpuMs = profileAverage(section, false, HUD_AVERAGE_FRAMES);
+        if (section.gpu) {
+            std::snprintf(line, sizeof(line), "%-16.16s %6.2f  %6.2f", section.name, cpuMs,
+                          profileAverage(section, true, HUD_AVERAGE_FRAMES));
+        } else {
+            std::snprintf(line, sizeof(line), "%-16.16s %6.2f       -", section.name, cpuMs);
+        }
+        hudText(x, y, line, TEXT);
+        y += LINE;
+    }
+    
+    // Frame graph: CPU frame time in red, GPU total in grey, guide at 60 Hz
+    y += 4.0f;
+    const ProfileSection* frameSection = NULL;
+    for (size_t i = 0; i < profileSections.size(); ++i) {
+        if (std::strcmp(profileSections[i].name, "frame") == 0) frameSection = &profileSections[i];
+    }
+    float scale = graphHeight / 33.3f;
+    float barWidth = (PANEL_WIDTH - 12.0f) / HUD_GRAPH_FRAMES;
+    long long newest = (long long)profileFrame.load(std::memory_order_relaxed) - 1;
+    for (int i = 0; i < HUD_GRAPH_FRAMES && frameSection && newest - i >= 0; ++i) {
+        int slot = (int)((newest - i) % PROFILE_HISTORY);
+        double gpuMs = 0.0;
+        for (size_t s = 0; s < profileSections.size(); ++s) {
+            if (&profileSections[s] != frameSection) gpuMs += profileSections[s].gpuMs[slot];
+        }
+        float bx = x + (HUD_GRAPH_FRAMES - 1 - i) * barWidth;
+        float cpuHeight = std::min((float)frameSection->cpuMs[slot] * scale, graphHeight);
+        float gpuHeight = std::min((float)gpuMs * scale, graphHeight);
+        hudQuad(bx, y + graphHeight - cpuHeight, barWidth * 0.5f, cpuHeight, CPU);
+        hudQuad(bx + barWidth * 0.5f, y + graphHeight - gpuHeight, barWidth * 0.5f, gpuHeight, GPU);
+    }
+    hudQuad(x, y + graphHeight - 16.7f * scale, PANEL_WIDTH - 12.0f, 1.0f, DIM);
+    
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glUseProgram(profilerHud.program);
+    glUniform2f(profilerHud.screenScale, 1.0f / width, 1.0f / height);
+    glBindVertexArray(profilerHud.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, profilerHud.vbo);
+    // Orphan last frame's storage instead of waiting for the GPU to finish with it
+    glBufferData(GL_ARRAY_BUFFER, profilerHud.vertices.size() * sizeof(HudVertex), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, profilerHud.vertices.size() * sizeof(HudVertex), 
+                    &profilerHud.vertices[0]);
+    glDrawArrays(GL_TRIANGLES, 0, (GLsizei)profilerHud.vertices.size());
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glDisable(GL_BLEND);
+    glEnable(GL_DEPTH_TEST);
+}
+
+// ─── Brush ink layer ──────────────────────────────────────────────
+//
+// Final brush vertices are written once into an append-only vertex buffer,
+// behind three small regions that take the open stroke's tip in turn.
+// Writes only go past what the GPU may be reading, so with ARB_buffer_storage
+// the buffer stays persistently mapped and only the tip regions need fences.
+// Without it, each write maps its range unsynchronized. When the buffer
+// fills, the GPU copies it into one twice the size. New vertices are drawn
+// once into an ink layer the size of the window. Each frame composites that
+// layer and draws the tip over it, so the GPU cost stays the same however
+// many strokes there are. Resizing redraws the layer from the buffer, with
+// nothing uploaded.
+
+const int BRUSH_TIP_REGIONS = 3;
+const int BRUSH_TIP_VERTICES = 1024;    // per region; a longer tip is cut short
+const size_t BRUSH_INITIAL_VERTICES = 1 << 16;
+
+struct BrushLayer {
+    GLuint program = 0;
+    GLuint compositeProgram = 0;
+    GLint screenScale = -1;
+    GLuint vao = 0;
+    GLuint buffer = 0;
+    BrushVertex* persistent = NULL;
+    size_t capacity = 0;                // final vertices the buffer holds
+    size_t uploaded = 0;                // final vertices in the buffer
+    size_t layered = 0;                 // final vertices drawn into the layer
+    int tipRegion = 0;
+    size_t tipCount = 0;                // vertices in the current tip region
+    GLsync tipFences[BRUSH_TIP_REGIONS] = {};
+    GLuint fbo = 0;
+    GLuint texture = 0;
+    int width = 0;
+    int height = 0;
+    size_t frameUploadBytes = 0;        // written by the last drawBrushStrokes()
+    unsigned long long stalls = 0;
+};
+
+BrushLayer brushLayer;
+
+const char* getBrushVertexShader() {
+    return R"(
+        #version 330 core
+        layout (location = 0) in vec2 aPos;
+        layout (location = 1) in vec3 aStroke;
+        uniform vec2 screenScale;
+        out vec3 Stroke;
+        void main() {
+            Stroke = aStroke;
+            gl_Position = vec4(aPos * screenScale * vec2(2.0, -2.0) + vec2(-1.0, 1.0), 0.0, 1.0);
+        }
+    )";
+}
+
+const char* getBrushFragmentShader() {
+    return R"(
+        #version 330 core
+        in vec3 Stroke;             // across, along, dryness
+        out vec4 FragColor;
+
+        float hash(vec2 p) {
+            return fract(sin(dot(p, vec2(127.1, 311.7))) * 43758.5453);
+        }
+
+        void main() {
+            float across = Stroke.x;
+            float coverage = clamp((1.0 - abs(across)) / max(fwidth(across), 1e-4), 0.0, 1.0);
+            // Bristle lanes run dry where the brush moved fast
+            float lane = floor((across * 0.5 + 0.5) * 14.0);
+            float t = Stroke.y * 0.02;
+            float bristle = mix(hash(vec2(lane, floor(t))), hash(vec2(lane, floor(t) + 1.0)), fract(t));
+            float ink = coverage * mix(1.0, smoothstep(0.2, 0.6, bristle), Stroke.z) * 0.94;
+            FragColor = vec4(vec3(0.08, 0.07, 0.06) * ink, ink);
+        }
+    )";
+}
+
+const char* getBrushCompositeShader() {
+    return R"(
+        #version 330 core
+        uniform sampler2D layer;
+        out vec4 FragColor;
+        void main() {
+            FragColor = texelFetch(layer, ivec2(gl_FragCoord.xy), 0);
+        }
+    )";
+}
+
+size_t brushTipVertices() {
+    return (size_t)BRUSH_TIP_REGIONS * BRUSH_TIP_VERTICES;
+}
+
+// (Re)creates the vertex buffer; the GPU copies over `keep` final vertices
+void createBrushBuffer(size_t capacity, size_t keep) {
+    BrushLayer& layer = brushLayer;
+    GLsizeiptr size = (brushTipVertices() + capacity) * sizeof(BrushVertex);
+    GLuint buffer;
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    BrushVertex* persistent = NULL;
+    if (GLEW_ARB_buffer_storage) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+        persistent = (BrushVertex*)glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+    } else {
+        glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+    }
+    if (layer.buffer != 0) {
+        if (keep > 0) {
+            glBindBuffer(GL_COPY_READ_BUFFER, layer.buffer);
+            GLintptr offset = brushTipVertices() * sizeof(BrushVertex);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_ARRAY_BUFFER, offset, offset, keep * sizeof(BrushVertex));
+            glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        }
+        if (layer.persistent) {
+            glBindBuffer(GL_ARRAY_BUFFER, layer.buffer);
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+        }
+        // GL keeps the old storage alive for draws still in flight
+        glDeleteBuffers(1, &layer.buffer);
+    }
+    for (int i = 0; i < BRUSH_TIP_REGIONS; ++i) {
+        if (layer.tipFences[i]) glDeleteSync(layer.tipFences[i]);
+        layer.tipFences[i] = 0;
+    }
+    layer.buffer = buffer;
+    layer.persistent = persistent;
+    layer.capacity = capacity;
+    layer.uploaded = keep;
+    layer.tipCount = 0;
+
+    glBindVertexArray(layer.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(BrushVertex), (void*)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(BrushVertex),
+                          (void*)offsetof(BrushVertex, across));
+    glEnableVertexAttribArray(1);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void setupBrushLayer() {
+    brushLayer.program = createProgram(getBrushVertexShader(), getBrushFragmentShader());
+    brushLayer.screenScale = glGetUniformLocation(brushLayer.program, "screenScale");
+    brushLayer.compositeProgram = createPostProgram(getBrushCompositeShader());
+    setSamplerUnit(brushLayer.compositeProgram, "layer", 0);
+    glGenVertexArrays(1, &brushLayer.vao);
+    createBrushBuffer(BRUSH_INITIAL_VERTICES, 0);
+    glGenFramebuffers(1, &brushLayer.fbo);
+    glGenTextures(1, &brushLayer.texture);
+}
+
+void deleteBrushLayer() {
+    BrushLayer& layer = brushLayer;
+    for (int i = 0; i < BRUSH_TIP_REGIONS; ++i) {
+        if (layer.tipFences[i]) glDeleteSync(layer.tipFences[i]);
+    }
+    if (layer.persistent) {
+        glBindBuffer(GL_ARRAY_BUFFER, layer.buffer);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    glDeleteBuffers(1, &layer.buffer);
+    glDeleteVertexArrays(1, &layer.vao);
+    glDeleteProgram(layer.program);
+    glDeleteProgram(layer.compositeProgram);
+    glDeleteFramebuffers(1, &layer.fbo);
+    glDeleteTextures(1, &layer.texture);
+    brushLayer = BrushLayer();
+}
+
+// Copies `count` vertices to vertex `first` of the buffer, which the GPU
+// is not reading
+void writeBrushVertices(size_t first, const BrushVertex* vertices, size_t count) {
+    BrushLayer& layer = brushLayer;
+    size_t bytes = count * sizeof(BrushVertex);
+    if (layer.persistent) {
+        std::memcpy(layer.persistent + first, vertices, bytes);
+    } else {
+        glBindBuffer(GL_ARRAY_BUFFER, layer.buffer);
+        void* target = glMapBufferRange(GL_ARRAY_BUFFER, first * sizeof(BrushVertex), bytes,
+            GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+        std::memcpy(target, vertices, bytes);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    layer.frameUploadBytes += bytes;
+}
+
+// Moves brushInk's new vertices and tip into the buffer
+void uploadBrushVertices() {
+    BrushLayer& layer = brushLayer;
+    BrushInk& ink = brushInk;
+    layer.frameUploadBytes = 0;
+    if (ink.cleared) {
+        // Fresh storage, so the new strokes never overwrite what the GPU still reads
+        createBrushBuffer(layer.capacity, 0);
+        layer.layered = 0;
+        layer.width = 0;
+        ink.cleared = false;
+    }
+    size_t count = ink.appended.size();
+    if (count > 0) {
+        if (layer.uploaded + count > layer.capacity) {
+            createBrushBuffer(std::max(layer.capacity * 2, layer.uploaded + count), layer.uploaded);
+        }
+        writeBrushVertices(brushTipVertices() + layer.uploaded, &ink.appended[0], count);
+        layer.uploaded += count;
+        ink.appended.clear();
+    }
+
+    layer.tipCount = std::min(ink.tip.size(), (size_t)BRUSH_TIP_VERTICES);
+    if (layer.tipCount > 0) {
+        layer.tipRegion = (layer.tipRegion + 1) % BRUSH_TIP_REGIONS;
+        waitForFence(layer.tipFences[layer.tipRegion], layer.stalls);
+        writeBrushVertices((size_t)layer.tipRegion * BRUSH_TIP_VERTICES, &ink.tip[0], layer.tipCount);
+    }
+}
+
+bool brushInkVisible() {
+    return brushLayer.uploaded > 0 || !brushInk.tip.empty() || !brushInk.appended.empty();
+}
+
+// Uploads new brush vertices and draws the ink over the bound scene in
+// `targetFBO`; draws nothing until something is painted
+void drawBrushStrokes(GLuint targetFBO, int width, int height) {
+    BrushLayer& layer = brushLayer;
+    if (layer.program == 0 || (!brushInkVisible() && !brushInk.cleared)) return;
+    GpuProfileScope scope("brush");
+    uploadBrushVertices();
+    if (!brushInkVisible()) return;
+
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_BLEND);
+    // Premultiplied ink, so the layer composites like the strokes drawn directly
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    glUseProgram(layer.program);
+    glUniform2f(layer.screenScale, 1.0f / width, 1.0f / height);
+    glBindVertexArray(layer.vao);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, layer.fbo);
+    glViewport(0, 0, width, height);
+    if (layer.width != width || layer.height != height) {
+        glBindTexture(GL_TEXTURE_2D, layer.texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, layer.texture, 0);
+        const GLfloat CLEAR[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        glClearBufferfv(GL_COLOR, 0, CLEAR);
+        layer.width = width;
+        layer.height = height;
+        layer.layered = 0;
+    }
+    if (layer.layered < layer.uploaded) {
+        glDrawArrays(GL_TRIANGLES, (GLint)(brushTipVertices() + layer.layered),
+                     (GLsizei)(layer.uploaded - layer.layered));
+        layer.layered = layer.uploaded;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, targetFBO);
+    glViewport(0, 0, width, height);
+    glUseProgram(layer.compositeProgram);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, layer.texture);
+    glBindVertexArray(inkOutline.emptyVAO);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+
+    if (layer.tipCount > 0) {
+        glUseProgram(layer.program);
+        glBindVertexArray(layer.vao);
+        glDrawArrays(GL_TRIANGLES, layer.tipRegion * BRUSH_TIP_VERTICES, (GLsizei)layer.tipCount);
+        layer.tipFences[layer.tipRegion] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    glBindVertexArray(0);
+    glDisable(GL_BLEND);
+    glEnable(GL_DEPTH_TEST);
+}
+
+// ─── Paper grain texture ──────────────────────────────────────────
+//
+// Stage 4's paper fibers and ink grain come from a tileable RG8 texture
+// (fibers in red, grain in green) sampled in screen space, so the grain
+// stays on the sheet instead of swimming over the body. It is built on
+// the CPU from octaves of periodic value noise whose lattices wrap at the
+// tile edge. Rows are split across the job system and interpolated
+// SIMD_WIDTH texels at a time. The finished mip chain is cached next to
+// the program binaries, keyed by seed.
+
+const unsigned int PAPER_CACHE_VERSION = 1;
+const char PAPER_CACHE_MAGIC[4] = { 'O', 'K', 'P', 'G' };
+
+struct PaperGrain {
+    std::vector<unsigned char> texels;  // RG8, all levels back to back
+    size_t levelOffset[PAPER_LEVELS];
+    GLuint texture = 0;
+};
+
+PaperGrain paperGrain;
+
+// One octave: lattice cells per tile on each axis. Unequal periods stretch
+// the noise into fibers; ridged octaves fold it into thin bright strands.
+struct PaperOctave {
+    int periodX;
+    int periodY;
+    float amplitude;
+    bool ridged;
+};
+
+const PaperOctave PAPER_FIBER_OCTAVES[] = {
+    { 8, 8, 0.20f, false },
+    { 32, 32, 0.15f, false },
+    { 4, 64, 0.30f, true },             // long vertical fibers
+    { 64, 4, 0.20f, true },             // and horizontal ones
+    { 16, 128, 0.15f, true },
+};
+const PaperOctave PAPER_GRAIN_OCTAVES[] = {
+    { 16, 16, 0.10f, false },
+    { 32, 32, 0.15f, false },
+    { 64, 64, 0.20f, false },
+    { 128, 128, 0.25f, false },
+    { 256, 256, 0.30f, false },
+};
+
+// Lattice values of one octave with its per-texel cell indices and weights
+struct PaperLattice {
+    PaperOctave octave;
+    std::vector<float> values;          // periodY rows of periodX values
+    int cell[PAPER_SIZE];
+    int nextCell[PAPER_SIZE];
+    float weight[PAPER_SIZE];           // smoothstep of the position in the cell
+};
+
+float latticeValue(unsigned int seed, int layer, int i, int j) {
+    unsigned int h = seed * 0x9e3779b9u ^ (unsigned int)layer * 0x85ebca6bu;
+    h ^= (unsigned int)i * 0xc2b2ae35u;
+    h = (h ^ (h >> 15)) * 0x2c1b3c6du;
+    h ^= (unsigned int)j * 0x27d4eb2fu;
+    h = (h ^ (h >> 12)) * 0x297a2d39u;
+    h ^= h >> 15;
+    return (h & 0xffffff) / 16777216.0f;
+}
+
+PaperLattice makePaperLattice(unsigned int seed, int layer, const PaperOctave& octave) {
+    PaperLattice lattice;
+    lattice.octave = octave;
+    lattice.values.resize(octave.periodX * octave.periodY);
+    for (int j = 0; j < octave.periodY; ++j) {
+        for (int i = 0; i < octave.periodX; ++i) {
+            lattice.values[j * octave.periodX + i] = latticeValue(seed, layer, i, j);
+        }
+    }
+    float cellSize = (float)PAPER_SIZE / octave.periodX;
+    for (int x = 0; x < PAPER_SIZE; ++x) {
+        float position = x / cellSize;
+        int cell = (int)position;
+        float t = position - cell;
+        lattice.cell[x] = cell;
+        lattice.nextCell[x] = (cell + 1) % octave.periodX;
+        lattice.weight[x] = t * t * (3.0f - 2.0f * t);
+    }
+    return lattice;
+}
+
+// Adds one octave to a row of texels
+void addPaperOctave(const PaperLattice& lattice, int y, float* row) {
+    const PaperOctave& octave = lattice.octave;
+    float position = y * (float)octave.periodY / PAPER_SIZE;
+    int j0 = (int)position;
+    int j1 = (j0 + 1) % octave.periodY;
+    float t = position - j0;
+    SimdFloat ty = t * t * (3.0f - 2.0f * t);
+    const float* top = &lattice.values[j0 * octave.periodX];
+    const float* bottom = &lattice.values[j1 * octave.periodX];
+
+    alignas(32) float corners[4][PAPER_SIZE];
+    for (int x = 0; x < PAPER_SIZE; ++x) {
+        corners[0][x] = top[lattice.cell[x]];
+        corners[1][x] = top[lattice.nextCell[x]];
+        corners[2][x] = bottom[lattice.cell[x]];
+        corners[3][x] = bottom[lattice.nextCell[x]];
+    }
+    for (int x = 0; x < PAPER_SIZE; x += SIMD_WIDTH) {
+        SimdFloat tx = simdLoad(lattice.weight + x);
+        SimdFloat a = simdLoad(corners[0] + x);
+        SimdFloat b = simdLoad(corners[2] + x);
+        a = a + (simdLoad(corners[1] + x) - a) * tx;
+        b = b + (simdLoad(corners[3] + x) - b) * tx;
+        SimdFloat value = a + (b - a) * ty;
+        if (octave.ridged) {
+            value = 1.0f - simdAbs(value * 2.0f - 1.0f);
+            value = value * value;
+        }
+        simdStore(row + x, simdLoad(row + x) + value * octave.amplitude);
+    }
+}
+
+void buildPaperChannel(unsigned int seed, int layer, const PaperOctave* octaves, int count,
+                       std::vector<float>& texels) {
+    std::vector<PaperLattice> lattices;
+    for (int o = 0; o < count; ++o) {
+        lattices.push_back(makePaperLattice(seed, layer * 16 + o, octaves[o]));
+    }
+    texels.assign(PAPER_SIZE * PAPER_SIZE, 0.0f);
+    std::vector<double> rowSums(PAPER_SIZE);
+    parallelFor(PAPER_SIZE, 8, [&](int, int begin, int end) {
+        for (int y = begin; y < end; ++y) {
+            float* row = &texels[y * PAPER_SIZE];
+            for (size_t o = 0; o < lattices.size(); ++o) addPaperOctave(lattices[o], y, row);
+            double sum = 0.0;
+            for (int x = 0; x < PAPER_SIZE; ++x) sum += row[x];
+            rowSums[y] = sum;
+        }
+    });
+
+    // Center each channel on 0.5 so the average shade matches the hash it replaces
+    double mean = 0.0;
+    for (int y = 0; y < PAPER_SIZE; ++y) mean += rowSums[y];
+    SimdFloat offset = 0.5f - (float)(mean / (PAPER_SIZE * PAPER_SIZE));
+    parallelFor(PAPER_SIZE, 32, [&](int, int begin, int end) {
+        for (int i = begin * PAPER_SIZE; i < end * PAPER_SIZE; i += SIMD_WIDTH) {
+            SimdFloat value = simdLoad(&texels[i]) + offset;
+            simdStore(&texels[i], simdMin(simdMax(value, 0.0f), 1.0f));
+        }
+    });
+}
+
+void generatePaperGrain(unsigned int seed, PaperGrain& paper) {
+    ProfileScope scope("paper grain");
+    std::vector<float> fibers, grain;
+    buildPaperChannel(seed, 0, PAPER_FIBER_OCTAVES,
+                      sizeof(PAPER_FIBER_OCTAVES) / sizeof(PAPER_FIBER_OCTAVES[0]), fibers);
+    buildPaperChannel(seed, 1, PAPER_GRAIN_OCTAVES,
+                      sizeof(PAPER_GRAIN_OCTAVES) / sizeof(PAPER_GRAIN_OCTAVES[0]), grain);
+
+    size_t total = 0;
+    for (int level = 0; level < PAPER_LEVELS; ++level) {
+        int size = PAPER_SIZE >> level;
+        paper.levelOffset[level] = total;
+        total += (size_t)size * size * 2;
+    }
+    paper.texels.resize(total);
+    for (int i = 0; i < PAPER_SIZE * PAPER_SIZE; ++i) {
+        paper.texels[i * 2] = (unsigned char)(fibers[i] * 255.0f + 0.5f);
+        paper.texels[i * 2 + 1] = (unsigned char)(grain[i] * 255.0f + 0.5f);
+    }
+
+    // Box-filtered mips; every level is a power of two, so no texel wraps
+    for (int level = 1; level < PAPER_LEVELS; ++level) {
+        int size = PAPER_SIZE >> level;
+        const unsigned char* source = &paper.texels[paper.levelOffset[level - 1]];
+        unsigned char* target = &paper.texels[paper.levelOffset[level]];
+        parallelFor(size, 16, [=](int, int begin, int end) {
+            for (int y = begin; y < end; ++y) {
+                const unsigned char* upper = source + (size_t)(y * 2) * size * 4;
+                const unsigned char* lower = upper + size * 4;
+                for (int x = 0; x < size * 2; ++x) {
+                    int c = x & 1;
+                    int sx = (x >> 1) * 4 + c;
+                    target[((size_t)y * size) * 2 + x] =
+                        (unsigned char)((upper[sx] + upper[sx + 2] + lower[sx] + lower[sx + 2] + 2) / 4);
+                }
+            }
+        });
+    }
+}
+
+std::string paperCachePath(unsigned int seed) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "/paper_%08x.bin", seed);
+    return shaderCacheDir + name;
+}
+
+bool loadPaperGrain(unsigned int seed, PaperGrain& paper) {
+    FILE* file = std::fopen(paperCachePath(seed).c_str(), "rb");
+    if (!file) return false;
+
+    char magic[4];
+    unsigned int header[3];
+    bool ok = std::fread(magic, 1, 4, file) == 4 &&
+              std::memcmp(magic, PAPER_CACHE_MAGIC, 4) == 0 &&
+              std::fread(header, sizeof(header), 1, file) == 1 &&
+              header[0] == PAPER_CACHE_VERSION && header[1] == (unsigned int)PAPER_SIZE &&
+              header[2] == (unsigned int)PAPER_LEVELS;
+    if (ok) {
+        size_t total = 0;
+        for (int level = 0; level < PAPER_LEVELS; ++level) {
+            int size = PAPER_SIZE >> level;
+            paper.levelOffset[level] = total;
+            total += (size_t)size * size * 2;
+        }
+        paper.texels.resize(total);
+        ok = std::fread(&paper.texels[0], 1, total, file) == total;
+    }
+    std::fclose(file);
+    return ok;
+}
+
+void savePaperGrain(unsigned int seed, const PaperGrain& paper) {
+    std::string path = paperCachePath(seed);
+    std::string tempPath = path + ".tmp";
+    FILE* file = std::fopen(tempPath.c_str(), "wb");
+    if (!file) return;
+    unsigned int header[3] = { PAPER_CACHE_VERSION, (unsigned int)PAPER_SIZE, (unsigned int)PAPER_LEVELS };
+    bool ok = std::fwrite(PAPER_CACHE_MAGIC, 1, 4, file) == 4 &&
+              std::fwrite(header, sizeof(header), 1, file) == 1 &&
+              std::fwrite(&paper.texels[0], 1, paper.texels.size(), file) == paper.texels.size();
+    ok = std::fclose(file) == 0 && ok;
+    if (!ok || std::rename(tempPath.c_str(), path.c_str()) != 0) {
+        std::remove(tempPath.c_str());
+    }
+}
+
+// Loads or generates the paper for paperSeed and binds it to its texture
+// unit for the rest of the run. Needs the job system.
+void setupPaperGrain() {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bool cached = useShaderCache && !shaderCacheDir.empty() && loadPaperGrain(paperSeed, paperGrain);
+    if (!cached) {
+        generatePaperGrain(paperSeed, paperGrain);
+        if (useShaderCache && !shaderCacheDir.empty() && makeDirectories(shaderCacheDir)) {
+            savePaperGrain(paperSeed, paperGrain);
+        }
+    }
+    std::fprintf(stderr, "Paper grain: seed %u, %dx%d, %d levels, %s in %.2f ms\n", paperSeed,
+                 PAPER_SIZE, PAPER_SIZE, PAPER_LEVELS, cached ? "loaded from cache" : "generated",
+                 millisecondsSince(start));
+
+    glGenTextures(1, &paperGrain.texture);
+    glActiveTexture(GL_TEXTURE0 + PAPER_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_2D, paperGrain.texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (int level = 0; level < PAPER_LEVELS; ++level) {
+        int size = PAPER_SIZE >> level;
+        glTexImage2D(GL_TEXTURE_2D, level, GL_RG8, size, size, 0, GL_RG, GL_UNSIGNED_BYTE,
+                     &paperGrain.texels[paperGrain.levelOffset[level]]);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, PAPER_LEVELS - 1);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+void deletePaperGrain() {
+    glDeleteTextures(1, &paperGrain.texture);
+    paperGrain.texture = 0;
+}
+
+// Level 0 fibers and grain for SIMD_WIDTH pixels of a row, matching the
+// GL path, which samples texel centers at native resolution
+void samplePaper(int x, int y, SimdFloat& fibers, SimdFloat& grain) {
+    alignas(32) float lanes[2][SIMD_WIDTH];
+    const unsigned char* row = &paperGrain.texels[(size_t)(y & (PAPER_SIZE - 1)) * PAPER_SIZE * 2];
+    for (int lane = 0; lane < SIMD_WIDTH; ++lane) {
+        const unsigned char* texel = row + ((x + lane) & (PAPER_SIZE - 1)) * 2;
+        lanes[0][lane] = texel[0] * (1.0f / 255.0f);
+        lanes[1][lane] = texel[1] * (1.0f / 255.0f);
+    }
+    fibers = simdLoad(lanes[0]);
+    grain = simdLoad(lanes[1]);
+}
+
+// ─── Ink bleed ────────────────────────────────────────────────────
+//
+// Wet brush ink soaks into the paper. Each final brush segment drops water
+// and pigment onto a grid with one cell per BLEED_CELL pixels. Every
+// simulation step the water diffuses into the neighbouring cells through
+// the paper fibers and is absorbed. Suspended pigment travels with the water
+// and settles into the paper, fastest where the water is running out, so
+// dried blots get dark edges. The grid is cut into BLEED_TILE tiles, and a
+// step only visits tiles that are still wet, on the job system, SIMD_WIDTH
+// cells at a time. A wet tile edge wakes its neighbour for the next step.
+// Tiles whose ink changed are packed into a pixel buffer and copied into the
+// bleed texture with one glTexSubImage2D each, and one instanced quad per
+// tile that holds any ink composites them under the brush strokes. The
+// simulation follows the wet area and the composite the inked area; neither
+// depends on the canvas size.
+
+const int BLEED_CELL = 2;               // pixels per cell
+const int BLEED_TILE = 32;              // cells per tile side; a multiple of SIMD_WIDTH
+const double BLEED_STEPS_PER_SECOND = 60.0;
+const int BLEED_MAX_STEPS = 4;          // per frame; a longer stall slows the bleed down
+const float BLEED_WATER = 1.0f;         // dropped by a wet brush
+const float BLEED_PIGMENT = 0.6f;
+const float BLEED_FLOW = 0.22f;         // water diffusion per step at full permeability
+const float BLEED_PIGMENT_FLOW = 0.18f;
+const float BLEED_ABSORB = 0.01f;       // fraction of the water the paper takes per step
+const float BLEED_DRY = 0.001f;         // and a constant amount, so it dries in finite time
+const float BLEED_SETTLE = 0.02f;       // pigment fraction that settles per step in full water
+const float BLEED_EDGE = 6.0f;          // extra settling as the water runs out
+const float BLEED_WET = 1e-3f;          // less water than this is dry
+
+struct InkBleed {
+    int cols = 0;                       // cells; multiples of BLEED_TILE
+    int rows = 0;
+    int stride = 0;                     // cols plus a dry border cell on each side
+    int tilesX = 0;
+    int tilesY = 0;
+    std::vector<float> water[2];        // indexed by current: this step and the next
+    std::vector<float> pigment[2];      // suspended in the water
+    std::vector<float> deposit;         // settled into the paper
+    std::vector<float> permeability;    // 0.15 to 1, from the paper fibers
+    int current = 0;
+    std::vector<unsigned char> density; // cols x rows, what the texture shows
+    std::vector<unsigned char> active;  // per tile: step it next
+    std::vector<unsigned char> dirty;   // per tile: density changed since the upload
+    std::vector<unsigned char> wet;     // per tile, from its last step: bit 0 wet, bits 1-4 edges
+    std::vector<unsigned char> stained; // per tile: may hold ink, so it is composited
+    std::vector<int> stepTiles;
+    bool checkWater = false;            // sum the stepped tiles' water around each step
+    std::vector<double> driedWater;     // per tile: water dried away in its last checked step
+    double waterBefore = 0.0;           // last step, when checked
+    double waterAfter = 0.0;
+    double waterDried = 0.0;
+    std::vector<float> stainedTiles;    // pixel origins of the stained tiles
+    bool stainsChanged = false;
+    double lastTime = -1.0;
+    double pendingSeconds = 0.0;
+    // Last advanceInkBleed() and uploadInkBleed()
+    double frameMs = 0.0;
+    int frameSteps = 0;
+    long long frameTileSteps = 0;
+    size_t frameUploadBytes = 0;
+    // GL side
+    GLuint program = 0;
+    GLint screenScale = -1;
+    GLint canvasScale = -1;
+    GLint tileSize = -1;
+    GLuint vao = 0;
+    GLuint tileBuffer = 0;              // stainedTiles, one instance each
+    GLuint texture = 0;
+    GLuint pixelBuffer = 0;
+    int textureCols = 0;
+    int textureRows = 0;
+};
+
+InkBleed inkBleed;
+
+int bleedIndex(const InkBleed& bleed, int col, int row) {
+    return (row + 1) * bleed.stride + col + 1;
+}
+
+// Grows the grid to cover width x height pixels, keeping the ink; a grid
+// never shrinks, so making the window smaller loses nothing
+void resizeInkBleed(InkBleed& bleed, int width, int height) {
+    int tilesX = std::max((width + BLEED_CELL * BLEED_TILE - 1) / (BLEED_CELL * BLEED_TILE), bleed.tilesX);
+    int tilesY = std::max((height + BLEED_CELL * BLEED_TILE - 1) / (BLEED_CELL * BLEED_TILE), bleed.tilesY);
+    if (tilesX == bleed.tilesX && tilesY == bleed.tilesY) return;
+
+    InkBleed grown;
+    grown.tilesX = tilesX;
+    grown.tilesY = tilesY;
+    grown.cols = tilesX * BLEED_TILE;
+    grown.rows = tilesY * BLEED_TILE;
+    grown.stride = grown.cols + 2;
+    size_t cells = (size_t)grown.stride * (grown.rows + 2);
+    for (int i = 0; i < 2; ++i) {
+        grown.water[i].assign(cells, 0.0f);
+        grown.pigment[i].assign(cells, 0.0f);
+    }
+    grown.deposit.assign(cells, 0.0f);
+    grown.permeability.assign(cells, 0.0f);       // the border holds water in
+    grown.density.assign((size_t)grown.cols * grown.rows, 0);
+    grown.active.assign(tilesX * tilesY, 0);
+    grown.dirty.assign(tilesX * tilesY, 1);
+    grown.wet.assign(tilesX * tilesY, 0);
+    grown.stained.assign(tilesX * tilesY, 0);
+    grown.driedWater.assign(tilesX * tilesY, 0.0);
+
+    // Fibers are the paper texture's red channel at the cell's top-left pixel
+    for (int row = 0; row < grown.rows; ++row) {
+        for (int col = 0; col < grown.cols; ++col) {
+            float fibers = 0.5f;
+            if (!paperGrain.texels.empty()) {
+                int x = (col * BLEED_CELL) & (PAPER_SIZE - 1);
+                int y = (row * BLEED_CELL) & (PAPER_SIZE - 1);
+                fibers = paperGrain.texels[((size_t)y * PAPER_SIZE + x) * 2] / 255.0f;
+            }
+            grown.permeability[bleedIndex(grown, col, row)] = 0.15f + 0.85f * fibers * fibers * fibers;
+        }
+    }
+    for (int row = 0; row < bleed.rows; ++row) {
+        for (int i = 0; i < bleed.cols; ++i) {
+            int from = bleedIndex(bleed, i, row);
+            int to = bleedIndex(grown, i, row);
+            grown.water[0][to] = bleed.water[bleed.current][from];
+            grown.pigment[0][to] = bleed.pigment[bleed.current][from];
+            grown.deposit[to] = bleed.deposit[from];
+            grown.density[(size_t)row * grown.cols + i] = bleed.density[(size_t)row * bleed.cols + i];
+        }
+    }
+    grown.water[1] = grown.water[0];
+    grown.pigment[1] = grown.pigment[0];
+    for (int ty = 0; ty < bleed.tilesY; ++ty) {
+        for (int tx = 0; tx < bleed.tilesX; ++tx) {
+            grown.active[ty * tilesX + tx] = bleed.active[ty * bleed.tilesX + tx];
+            grown.stained[ty * tilesX + tx] = bleed.stained[ty * bleed.tilesX + tx];
+        }
+    }
+    std::swap(grown.water, bleed.water);
+    std::swap(grown.pigment, bleed.pigment);
+    bleed.deposit.swap(grown.deposit);
+    bleed.permeability.swap(grown.permeability);
+    bleed.density.swap(grown.density);
+    bleed.active.swap(grown.active);
+    bleed.dirty.swap(grown.dirty);
+    bleed.wet.swap(grown.wet);
+    bleed.stained.swap(grown.stained);
+    bleed.driedWater.swap(grown.driedWater);
+    bleed.cols = grown.cols;
+    bleed.rows = grown.rows;
+    bleed.stride = grown.stride;
+    bleed.tilesX = tilesX;
+    bleed.tilesY = tilesY;
+    bleed.current = 0;
+    bleed.stainsChanged = true;
+}
+
+void stainBleedTile(InkBleed& bleed, int tile) {
+    if (bleed.stained[tile]) return;
+    bleed.stained[tile] = 1;
+    bleed.stainsChanged = true;
+}
+
+void clearInkBleed(InkBleed& bleed) {
+    for (int i = 0; i < 2; ++i) {
+        std::fill(bleed.water[i].begin(), bleed.water[i].end(), 0.0f);
+        std::fill(bleed.pigment[i].begin(), bleed.pigment[i].end(), 0.0f);
+    }
+    std::fill(bleed.deposit.begin(), bleed.deposit.end(), 0.0f);
+    std::fill(bleed.density.begin(), bleed.density.end(), 0);
+    std::fill(bleed.active.begin(), bleed.active.end(), 0);
+    std::fill(bleed.dirty.begin(), bleed.dirty.end(), 1);
+    std::fill(bleed.stained.begin(), bleed.stained.end(), 0);
+    bleed.stainsChanged = true;
+}
+
+// Wets a disc of cells around (x, y) in pixels. Drops take the maximum,
+// so overlapping segments do not pile up water.
+void dropInk(InkBleed& bleed, float x, float y, float radius, float water, float pigment) {
+    float cx = x / BLEED_CELL;
+    float cy = y / BLEED_CELL;
+    float r = std::max(radius / BLEED_CELL, 0.5f);
+    int col0 = std::max((int)std::floor(cx - r), 0);
+    int col1 = std::min((int)std::ceil(cx + r), bleed.cols - 1);
+    int row0 = std::max((int)std::floor(cy - r), 0);
+    int row1 = std::min((int)std::ceil(cy + r), bleed.rows - 1);
+    std::vector<float>& waterNow = bleed.water[bleed.current];
+    std::vector<float>& pigmentNow = bleed.pigment[bleed.current];
+    for (int row = row0; row <= row1; ++row) {
+        for (int col = col0; col <= col1; ++col) {
+            float dx = col + 0.5f - cx;
+            float dy = row + 0.5f - cy;
+            if (dx * dx + dy * dy > r * r) continue;
+            int i = bleedIndex(bleed, col, row);
+            waterNow[i] = std::max(waterNow[i], water);
+            pigmentNow[i] = std::max(pigmentNow[i], pigment);
+            int tile = (row / BLEED_TILE) * bleed.tilesX + col / BLEED_TILE;
+            bleed.active[tile] = 1;
+            bleed.dirty[tile] = 1;
+            stainBleedTile(bleed, tile);
+        }
+    }
+}
+
+// Drops ink along final brush quads (six vertices each, see brushRibbonPoint)
+void dropBrushInk(InkBleed& bleed, const std::vector<BrushVertex>& vertices) {
+    for (size_t q = 0; q + 6 <= vertices.size(); q += 6) {
+        const BrushVertex& a = vertices[q + 2];     // end edge of the quad
+        const BrushVertex& b = vertices[q + 5];
+        float x = (a.x + b.x) * 0.5f;
+        float y = (a.y + b.y) * 0.5f;
+        float radius = 0.5f * std::sqrt((a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y));
+        float wetness = 1.0f - a.dryness;
+        dropInk(bleed, x, y, radius, BLEED_WATER * wetness, BLEED_PIGMENT * (0.5f + 0.5f * wetness));
+    }
+}
+
+// 0 for dry paper, 1 from 1/8 of a full brush load of water up
+inline SimdFloat bleedWetness(SimdFloat water) {
+    return simdMin(water * 8.0f, 1.0f);
+}
+
+// Most water along one edge of a tile: 0 left, 1 right, 2 top, 3 bottom
+float bleedEdgeWater(const InkBleed& bleed, const float* water, int tile, int edge) {
+    int tileX = (tile % bleed.tilesX) * BLEED_TILE;
+    int tileY = (tile / bleed.tilesX) * BLEED_TILE;
+    int x = edge == 1 ? tileX + BLEED_TILE - 1 : tileX;
+    int y = edge == 3 ? tileY + BLEED_TILE - 1 : tileY;
+    int step = edge < 2 ? bleed.stride : 1;
+    int first = bleedIndex(bleed, x, y);
+    float most = 0.0f;
+    for (int j = 0; j < BLEED_TILE; ++j) most = std::max(most, water[first + j * step]);
+    return most;
+}
+
+// Steps one tile from the current buffers into the next ones and returns
+// its wet bits
+unsigned char stepBleedTile(InkBleed& bleed, int tile) {
+    int tileX = (tile % bleed.tilesX) * BLEED_TILE;
+    int tileY = (tile / bleed.tilesX) * BLEED_TILE;
+    const float* water = &bleed.water[bleed.current][0];
+    const float* pigment = &bleed.pigment[bleed.current][0];
+    float* nextWater = &bleed.water[1 - bleed.current][0];
+    float* nextPigment = &bleed.pigment[1 - bleed.current][0];
+    float* deposit = &bleed.deposit[0];
+    const float* permeability = &bleed.permeability[0];
+    int stride = bleed.stride;
+    const int neighbours[4] = { -1, 1, -stride, stride };
+
+    SimdFloat wettest = 0.0f;
+    double driedWater = 0.0;
+    alignas(32) float shade[BLEED_TILE];
+    alignas(32) float lanes[SIMD_WIDTH];
+    for (int row = tileY; row < tileY + BLEED_TILE; ++row) {
+        int first = bleedIndex(bleed, tileX, row);
+        SimdFloat rowDried = 0.0f;
+        for (int x = 0; x < BLEED_TILE; x += SIMD_WIDTH) {
+            int i = first + x;
+            SimdFloat w = simdLoad(water + i);
+            SimdFloat k = simdLoad(permeability + i);
+            SimdFloat p = simdLoad(pigment + i);
+            SimdFloat wet = bleedWetness(w);
+
+            // Both move between two cells the same amount each way: water
+            // through the less permeable of the two, pigment as far as both
+            // are wet, so none is made or lost at fiber edges and the wet front
+            SimdFloat flowed = 0.0f;
+            SimdFloat moved = 0.0f;
+            for (int n = 0; n < 4; ++n) {
+                int j = i + neighbours[n];
+                SimdFloat wj = simdLoad(water + j);
+                flowed = flowed + (wj - w) * simdMin(k, simdLoad(permeability + j));
+                moved = moved + (simdLoad(pigment + j) - p) * simdMin(wet, bleedWetness(wj));
+            }
+            SimdFloat soaked = (w + flowed * BLEED_FLOW) * (1.0f - BLEED_ABSORB);
+            SimdFloat dried = simdMin(soaked, BLEED_DRY);
+            SimdFloat w1 = soaked - dried;
+            rowDried = rowDried + dried;
+            SimdFloat wetness = bleedWetness(w1);
+            SimdFloat p1 = simdMax(p + moved * BLEED_PIGMENT_FLOW, 0.0f);
+            // Dry cells settle everything they still hold
+            SimdFloat rate = simdMin((1.0f - wetness) * BLEED_EDGE + 1.0f, 1.0f / BLEED_SETTLE) * BLEED_SETTLE;
+            SimdFloat settled = simdSelect(w1 > 0.0f, p1 * rate, p1);
+            p1 = p1 - settled;
+            SimdFloat d = simdLoad(deposit + i) + settled;
+
+            simdStore(nextWater + i, w1);
+            simdStore(nextPigment + i, p1);
+            simdStore(deposit + i, d);
+            simdStore(shade + x, simdMin(d + p1 * 0.6f, 1.0f) * 255.0f);
+            wettest = simdMax(wettest, w1 + p1);
+        }
+        unsigned char* out = &bleed.density[(size_t)row * bleed.cols + tileX];
+        for (int x = 0; x < BLEED_TILE; ++x) out[x] = (unsigned char)(shade[x] + 0.5f);
+        if (bleed.checkWater) {
+            simdStore(lanes, rowDried);
+            for (int lane = 0; lane < SIMD_WIDTH; ++lane) driedWater += lanes[lane];
+        }
+    }
+    if (bleed.checkWater) bleed.driedWater[tile] = driedWater;
+
+    simdStore(lanes, wettest);
+    float maximum = 0.0f;
+    for (int lane = 0; lane < SIMD_WIDTH; ++lane) maximum = std::max(maximum, lanes[lane]);
+    if (maximum <= BLEED_WET) return 0;
+
+    // Which edges are wet enough to spread into the neighbouring tile
+    unsigned char bits = 1;
+    for (int e = 0; e < 4; ++e) {
+        if (bleedEdgeWater(bleed, nextWater, tile, e) > BLEED_WET) bits |= 2 << e;
+    }
+    return bits;
+}
+
+double bleedTileWater(const InkBleed& bleed, const float* water, int tile) {
+    int tileX = (tile % bleed.tilesX) * BLEED_TILE;
+    int tileY = (tile / bleed.tilesX) * BLEED_TILE;
+    double total = 0.0;
+    for (int row = tileY; row < tileY + BLEED_TILE; ++row) {
+        int first = bleedIndex(bleed, tileX, row);
+        for (int x = 0; x < BLEED_TILE; ++x) total += water[first + x];
+    }
+    return total;
+}
+
+// Copies a tile of the current buffers into the other ones, so a tile that
+// stops being stepped reads the same from both
+void settleBleedTile(InkBleed& bleed, int tile) {
+    int tileX = (tile % bleed.tilesX) * BLEED_TILE;
+    int tileY = (tile / bleed.tilesX) * BLEED_TILE;
+    int now = bleed.current;
+    for (int row = tileY; row < tileY + BLEED_TILE; ++row) {
+        int i = bleedIndex(bleed, tileX, row);
+        std::memcpy(&bleed.water[1 - now][i], &bleed.water[now][i], BLEED_TILE * sizeof(float));
+        std::memcpy(&bleed.pigment[1 - now][i], &bleed.pigment[now][i], BLEED_TILE * sizeof(float));
+    }
+}
+
+// One simulation step over the wet tiles; returns how many were stepped
+int stepInkBleed(InkBleed& bleed) {
+    bleed.stepTiles.clear();
+    for (int tile = 0; tile < (int)bleed.active.size(); ++tile) {
+        if (bleed.active[tile]) bleed.stepTiles.push_back(tile);
+    }
+    if (bleed.stepTiles.empty()) return 0;
+
+    // Water crosses tile edges both ways, so a resting neighbour that
+    // touches any water on a shared edge is stepped too, and so on from
+    // there; otherwise what flows into it would be lost. Resting tiles hold
+    // less than BLEED_WET, which dries in one step, so this stays local.
+    const float* water = &bleed.water[bleed.current][0];
+    for (size_t t = 0; t < bleed.stepTiles.size(); ++t) {
+        int tile = bleed.stepTiles[t];
+        int tx = tile % bleed.tilesX;
+        int ty = tile / bleed.tilesX;
+        const int neighbours[4] = { tx > 0 ? tile - 1 : -1, tx + 1 < bleed.tilesX ? tile + 1 : -1,
+                                    ty > 0 ? tile - bleed.tilesX : -1,
+                                    ty + 1 < bleed.tilesY ? tile + bleed.tilesX : -1 };
+        for (int e = 0; e < 4; ++e) {
+            int next = neighbours[e];
+            if (next < 0 || bleed.active[next]) continue;
+            if (bleedEdgeWater(bleed, water, tile, e) > 0.0f || bleedEdgeWater(bleed, water, next, e ^ 1) > 0.0f) {
+                bleed.active[next] = 1;
+                bleed.stepTiles.push_back(next);
+            }
+        }
+    }
+    if (bleed.checkWater) {
+        bleed.waterBefore = 0.0;
+        for (size_t t = 0; t < bleed.stepTiles.size(); ++t) {
+            bleed.waterBefore += bleedTileWater(bleed, water, bleed.stepTiles[t]);
+        }
+    }
+    parallelFor((int)bleed.stepTiles.size(), 2, [&](int, int begin, int end) {
+        for (int t = begin; t < end; ++t) {
+            int tile = bleed.stepTiles[t];
+            bleed.wet[tile] = stepBleedTile(bleed, tile);
+        }
+    });
+    bleed.current = 1 - bleed.current;
+    if (bleed.checkWater) {
+        bleed.waterAfter = 0.0;
+        bleed.waterDried = 0.0;
+        for (size_t t = 0; t < bleed.stepTiles.size(); ++t) {
+            bleed.waterAfter += bleedTileWater(bleed, &bleed.water[bleed.current][0], bleed.stepTiles[t]);
+            bleed.waterDried += bleed.driedWater[bleed.stepTiles[t]];
+        }
+    }
+
+    for (size_t t = 0; t < bleed.stepTiles.size(); ++t) bleed.active[bleed.stepTiles[t]] = 0;
+    for (size_t t = 0; t < bleed.stepTiles.size(); ++t) {
+        int tile = bleed.stepTiles[t];
+        int tx = tile % bleed.tilesX;
+        int ty = tile / bleed.tilesX;
+        unsigned char bits = bleed.wet[tile];
+        bleed.dirty[tile] = 1;
+        stainBleedTile(bleed, tile);
+        if (bits & 1) bleed.active[tile] = 1;
+        if ((bits & 2) && tx > 0) bleed.active[tile - 1] = 1;
+        if ((bits & 4) && tx + 1 < bleed.tilesX) bleed.active[tile + 1] = 1;
+        if ((bits & 8) && ty > 0) bleed.active[tile - bleed.tilesX] = 1;
+        if ((bits & 16) && ty + 1 < bleed.tilesY) bleed.active[tile + bleed.tilesX] = 1;
+    }
+    for (size_t t = 0; t < bleed.stepTiles.size(); ++t) {
+        int tile = bleed.stepTiles[t];
+        if (!bleed.active[tile]) settleBleedTile(bleed, tile);
+    }
+    return (int)bleed.stepTiles.size();
+}
+
+bool inkBleedActive(const InkBleed& bleed) {
+    for (size_t tile = 0; tile < bleed.active.size(); ++tile) {
+        if (bleed.active[tile]) return true;
+    }
+    return false;
+}
+
+// Drops the brush's new final vertices and advances the simulation to
+// `time` seconds. Call after processBrushSamples() and before
+// drawBrushStrokes(), which uploads and clears those vertices.
+void advanceInkBleed(int width, int height, double time) {
+    InkBleed& bleed = inkBleed;
+    bleed.frameSteps = 0;
+    bleed.frameTileSteps = 0;
+    bleed.frameMs = 0.0;
+    if (!inkBleedEnabled) {
+        bleed.lastTime = -1.0;
+        return;
+    }
+    if (bleed.cols == 0 && brushInk.appended.empty()) return;
+    ProfileScope scope("ink bleed");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    resizeInkBleed(bleed, width, height);
+    if (brushInk.cleared) clearInkBleed(bleed);
+    dropBrushInk(bleed, brushInk.appended);
+
+    // A wet canvas steps at a fixed rate whatever the frame rate
+    if (bleed.lastTime >= 0.0) bleed.pendingSeconds += time - bleed.lastTime;
+    bleed.lastTime = time;
+    int steps = (int)(bleed.pendingSeconds * BLEED_STEPS_PER_SECOND + 1e-6);
+    bleed.pendingSeconds -= steps / BLEED_STEPS_PER_SECOND;
+    if (steps > BLEED_MAX_STEPS) {
+        steps = BLEED_MAX_STEPS;
+        bleed.pendingSeconds = 0.0;
+    }
+    for (int step = 0; step < steps; ++step) {
+        int tiles = stepInkBleed(bleed);
+        if (tiles == 0) break;
+        ++bleed.frameSteps;
+        bleed.frameTileSteps += tiles;
+    }
+    inkBleedWet = inkBleedActive(bleed);
+    if (!inkBleedWet) bleed.pendingSeconds = 0.0;
+    bleed.frameMs = millisecondsSince(start);
+}
+
+const char* getInkBleedVertexShader() {
+    return R"(
+        #version 330 core
+        layout (location = 0) in vec2 aTile;    // top-left corner in pixels
+        uniform vec2 screenScale;
+        uniform vec2 canvasScale;               // pixels to bleed texture coordinates
+        uniform float tileSize;                 // pixels
+        out vec2 Canvas;
+        out vec2 Pixel;                         // top-down, like the bleed grid
+        void main() {
+            const vec2 corners[6] = vec2[6](vec2(0, 0), vec2(1, 0), vec2(0, 1),
+                                            vec2(0, 1), vec2(1, 0), vec2(1, 1));
+            vec2 pixel = aTile + corners[gl_VertexID] * tileSize;
+            Canvas = pixel * canvasScale;
+            Pixel = pixel;
+            gl_Position = vec4(pixel * screenScale * vec2(2.0, -2.0) + vec2(-1.0, 1.0), 0.0, 1.0);
+        }
+    )";
+}
+
+const char* getInkBleedFragmentShader() {
+    return R"(
+        #version 330 core
+        in vec2 Canvas;
+        in vec2 Pixel;
+        uniform sampler2D bleed;
+        uniform sampler2D paperTexture;
+        out vec4 FragColor;
+        void main() {
+            float density = texture(bleed, Canvas).r;
+            // Pigment gathers in the fibers the water spread along, read in
+            // the grid's top-down pixels rather than gl_FragCoord's
+            float fibers = texture(paperTexture, Pixel / vec2(textureSize(paperTexture, 0))).r;
+            float ink = clamp(density * (0.75 + 0.5 * fibers), 0.0, 1.0) * 0.85;
+            FragColor = vec4(vec3(0.10, 0.09, 0.08) * ink, ink);
+        }
+    )";
+}
+
+void setupInkBleed() {
+    InkBleed& bleed = inkBleed;
+    bleed.program = createProgram(getInkBleedVertexShader(), getInkBleedFragmentShader());
+    setSamplerUnit(bleed.program, "bleed", 0);
+    setSamplerUnit(bleed.program, "paperTexture", PAPER_TEXTURE_UNIT);
+    bleed.screenScale = glGetUniformLocation(bleed.program, "screenScale");
+    bleed.canvasScale = glGetUniformLocation(bleed.program, "canvasScale");
+    bleed.tileSize = glGetUniformLocation(bleed.program, "tileSize");
+    glGenTextures(1, &bleed.texture);
+    glGenBuffers(1, &bleed.pixelBuffer);
+
+    glGenVertexArrays(1, &bleed.vao);
+    glGenBuffers(1, &bleed.tileBuffer);
+    glBindVertexArray(bleed.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, bleed.tileBuffer);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribDivisor(0, 1);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void deleteInkBleed() {
+    glDeleteProgram(inkBleed.program);
+    glDeleteTextures(1, &inkBleed.texture);
+    glDeleteBuffers(1, &inkBleed.pixelBuffer);
+    glDeleteVertexArrays(1, &inkBleed.vao);
+    glDeleteBuffers(1, &inkBleed.tileBuffer);
+    inkBleed = InkBleed();
+    inkBleedWet = false;
+}
+
+// Copies the dirty tiles into the texture through the pixel buffer
+void uploadInkBleed() {
+    InkBleed& bleed = inkBleed;
+    bleed.frameUploadBytes = 0;
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, bleed.texture);
+    if (bleed.textureCols != bleed.cols || bleed.textureRows != bleed.rows) {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, bleed.cols, bleed.rows, 0, GL_RED, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        bleed.textureCols = bleed.cols;
+        bleed.textureRows = bleed.rows;
+        std::fill(bleed.dirty.begin(), bleed.dirty.end(), 1);
+    }
+
+    size_t count = 0;
+    for (size_t tile = 0; tile < bleed.dirty.size(); ++tile) count += bleed.dirty[tile];
+    if (count == 0) return;
+    const size_t TILE_BYTES = BLEED_TILE * BLEED_TILE;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, bleed.pixelBuffer);
+    // The last step's texture copies may still be reading the buffer, so
+    // mapping fresh storage keeps the map from stalling on them
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, count * TILE_BYTES, NULL, GL_STREAM_DRAW);
+    unsigned char* packed = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, count * TILE_BYTES,
+        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    size_t slot = 0;
+    for (size_t tile = 0; tile < bleed.dirty.size(); ++tile) {
+        if (!bleed.dirty[tile]) continue;
+        int tileX = (int)(tile % bleed.tilesX) * BLEED_TILE;
+        int tileY = (int)(tile / bleed.tilesX) * BLEED_TILE;
+        for (int row = 0; row < BLEED_TILE; ++row) {
+            std::memcpy(packed + slot * TILE_BYTES + row * BLEED_TILE,
+                        &bleed.density[(size_t)(tileY + row) * bleed.cols + tileX], BLEED_TILE);
+        }
+        ++slot;
+    }
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    slot = 0;
+    for (size_t tile = 0; tile < bleed.dirty.size(); ++tile) {
+        if (!bleed.dirty[tile]) continue;
+        int tileX = (int)(tile % bleed.tilesX) * BLEED_TILE;
+        int tileY = (int)(tile / bleed.tilesX) * BLEED_TILE;
+        glTexSubImage2D(GL_TEXTURE_2D, 0, tileX, tileY, BLEED_TILE, BLEED_TILE, GL_RED, GL_UNSIGNED_BYTE,
+                        (void*)(slot * TILE_BYTES));
+        bleed.dirty[tile] = 0;
+        ++slot;
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    bleed.frameUploadBytes = count * TILE_BYTES;
+}
+
+// Uploads the changed tiles and composites the stained ones over
+// `targetFBO`; call before drawBrushStrokes() so the strokes stay on top
+void drawInkBleed(GLuint targetFBO, int width, int height) {
+    InkBleed& bleed = inkBleed;
+    bleed.frameUploadBytes = 0;
+    if (!inkBleedEnabled || bleed.cols == 0 || bleed.program == 0) return;
+    GpuProfileScope scope("ink bleed");
+    uploadInkBleed();
+    if (bleed.stainsChanged) {
+        bleed.stainedTiles.clear();
+        for (int tile = 0; tile < (int)bleed.stained.size(); ++tile) {
+            if (!bleed.stained[tile]) continue;
+            bleed.stainedTiles.push_back((float)(tile % bleed.tilesX * BLEED_TILE * BLEED_CELL));
+            bleed.stainedTiles.push_back((float)(tile / bleed.tilesX * BLEED_TILE * BLEED_CELL));
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, bleed.tileBuffer);
+        glBufferData(GL_ARRAY_BUFFER, bleed.stainedTiles.size() * sizeof(float),
+                     bleed.stainedTiles.empty() ? NULL : &bleed.stainedTiles[0], GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        bleed.stainsChanged = false;
+    }
+    if (bleed.stainedTiles.empty()) return;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, targetFBO);
+    glViewport(0, 0, width, height);
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    glUseProgram(bleed.program);
+    glUniform2f(bleed.screenScale, 1.0f / width, 1.0f / height);
+    glUniform2f(bleed.canvasScale, 1.0f / (BLEED_CELL * bleed.cols), 1.0f / (BLEED_CELL * bleed.rows));
+    glUniform1f(bleed.tileSize, (float)(BLEED_TILE * BLEED_CELL));
+    glBindVertexArray(bleed.vao);
+    glDrawArraysInstanced(GL_TRIANGLES, 0, 6, (GLsizei)(bleed.stainedTiles.size() / 2));
+    glBindVertexArray(0);
+    glDisable(GL_BLEND);
+    glEnable(GL_DEPTH_TEST);
+}
+
+// ─── Tomoe decal atlas ────────────────────────────────────────────
+//
+// The stage 3-4 tomoe markings are baked into a signed distance atlas in
+// the body's UV space. The fragment shader then does one fetch and
+// anti-aliases the edge with fwidth() at any zoom, instead of evaluating
+// atan, sin and cos and cutting hard thresholds. Crowd pattern seeds are
+// rounded to one of TOMOE_VARIANTS tiles. Each tile evaluates the pattern
+// on the body surface, takes an exact Euclidean distance transform of the
+// inside and outside texels, and refines texels near the edge from the
+// field gradient for sub-texel precision. Tiles are baked as separate jobs
+// while the mesh builds; the analytic pattern is drawn until the upload.
+
+const int TOMOE_TILE_WIDTH = 512;       // around the body (u)
+const int TOMOE_TILE_HEIGHT = 256;      // top to bottom (v)
+const int TOMOE_TILES_X = 2;
+const int TOMOE_VARIANTS = 8;           // tiles, one per 1/8 turn of pattern seed
+const int TOMOE_ATLAS_WIDTH = TOMOE_TILE_WIDTH * TOMOE_TILES_X;
+const int TOMOE_ATLAS_HEIGHT = TOMOE_TILE_HEIGHT * (TOMOE_VARIANTS / TOMOE_TILES_X);
+const float TOMOE_RANGE = 4.0f;         // texels of distance stored each side of the edge
+
+// The analytic pattern as a field that is positive inside the markings
+SimdFloat tomoeField(const SimdVec3& p, float seed) {
+    SimdFloat angle = simdAtan2(p.z, p.x) + seed;
+    SimdFloat radius = simdSqrt(p.x * p.x + p.z * p.z);
+    SimdFloat spiral = simdSin(angle * 3.5f - radius * 6.5f);
+    SimdFloat spots = simdSin(p.y * 7.0f + seed * 2.0f) * simdCos(angle * 4.0f);
+    return simdMax(spiral - 0.82f, spots - 0.88f);
+}
+
+// Exact 1D squared distance transform (Felzenszwalb and Huttenlocher) of
+// count samples spaced stride apart, in place. The lower envelope of the
+// parabolas rooted at each sample is kept in hull/bounds.
+void squaredDistance1D(float* f, int count, int stride, std::vector<double>& values,
+                       std::vector<int>& hull, std::vector<double>& bounds) {
+    values.resize(count);
+    hull.resize(count);
+    bounds.resize(count + 1);
+    for (int i = 0; i < count; ++i) values[i] = f[i * stride];
+
+    int k = 0;
+    hull[0] = 0;
+    bounds[0] = -1e30;
+    bounds[1] = 1e30;
+    for (int q = 1; q < count; ++q) {
+        double s;
+        while (true) {
+            int p = hull[k];
+            s = ((values[q] + (double)q * q) - (values[p] + (double)p * p)) / (2.0 * (q - p));
+            if (s > bounds[k]) break;
+            --k;
+        }
+        ++k;
+        hull[k] = q;
+        bounds[k] = s;
+        bounds[k + 1] = 1e30;
+    }
+
+    k = 0;
+    for (int q = 0; q < count; ++q) {
+        while (bounds[k + 1] < q) ++k;
+        int p = hull[k];
+        f[q * stride] = (float)((q - p) * (q - p) + values[p]);
+    }
+}
+
+// Squared distance from every texel to the nearest texel where seeds is set
+void squaredDistance2D(const std::vector<unsigned char>& seeds, int width, int height,
+                       std::vector<float>& distance) {
+    // Far beyond any real squared distance, small enough for exact sums
+    const float FAR = 1e10f;
+    distance.resize(width * height);
+    for (int i = 0; i < width * height; ++i) distance[i] = seeds[i] ? 0.0f : FAR;
+    std::vector<double> values, bounds;
+    std::vector<int> hull;
+    for (int y = 0; y < height; ++y) squaredDistance1D(&distance[y * width], width, 1, values, hull, bounds);
+    for (int x = 0; x < width; ++x) squaredDistance1D(&distance[x], height, width, values, hull, bounds);
+}
+
+// Bakes one variant into its tile of the R8 atlas
+void bakeTomoeTile(int variant, const std::vector<float>& positions, std::vector<unsigned char>& atlas) {
+    const int W = TOMOE_TILE_WIDTH;
+    const int H = TOMOE_TILE_HEIGHT;
+    float seed = variant * 2.0f * (float)M_PI / TOMOE_VARIANTS;
+
+    std::vector<float> field(W * H);
+    const float* px = &positions[0];
+    const float* py = px + W * H;
+    const float* pz = py + W * H;
+    for (int i = 0; i < W * H; i += SIMD_WIDTH) {
+        SimdVec3 p = { simdLoad(px + i), simdLoad(py + i), simdLoad(pz + i) };
+        simdStore(&field[i], tomoeField(p, seed));
+    }
+
+    std::vector<unsigned char> inside(W * H), outside(W * H);
+    for (int i = 0; i < W * H; ++i) {
+        inside[i] = field[i] > 0.0f;
+        outside[i] = !inside[i];
+    }
+    std::vector<float> toOutside, toInside;
+    squaredDistance2D(outside, W, H, toOutside);
+    squaredDistance2D(inside, W, H, toInside);
+
+    int tileX = (variant % TOMOE_TILES_X) * W;
+    int tileY = (variant / TOMOE_TILES_X) * H;
+    for (int y = 0; y < H; ++y) {
+        for (int x = 0; x < W; ++x) {
+            int i = y * W + x;
+            // Texel centers run from u = 0 to u = 1, which are the same column
+            int left = x > 0 ? x - 1 : W - 2;
+            int right = x < W - 1 ? x + 1 : 1;
+            float gx = (field[y * W + right] - field[y * W + left]) * 0.5f;
+            float gy = (field[std::min(y + 1, H - 1) * W + x] - field[std::max(y - 1, 0) * W + x]) * 0.5f;
+            float linear = field[i] / std::max(std::sqrt(gx * gx + gy * gy), 1e-6f);
+
+            // Edge texels use the first-order distance, the rest the transform
+            float distance;
+            if (std::fabs(linear) < 1.5f) {
+                distance = linear;
+            } else if (inside[i]) {
+                distance = std::sqrt(toOutside[i]) - 0.5f;
+            } else {
+                distance = 0.5f - std::sqrt(toInside[i]);
+            }
+            float encoded = glm::clamp(0.5f + distance / (2.0f * TOMOE_RANGE), 0.0f, 1.0f);
+            atlas[(size_t)(tileY + y) * TOMOE_ATLAS_WIDTH + tileX + x] = (unsigned char)(encoded * 255.0f + 0.5f);
+        }
+    }
+}
+
+void bakeTomoeAtlas(BodyShape shape, std::vector<unsigned char>& atlas) {
+    ProfileScope scope("tomoe bake");
+    const int W = TOMOE_TILE_WIDTH;
+    const int H = TOMOE_TILE_HEIGHT;
+    // Body surface at every texel center, as x, y and z planes
+    std::vector<float> positions(3 * W * H);
+    parallelFor(H, 16, [&](int, int begin, int end) {
+        for (int y = begin; y < end; ++y) {
+            for (int x = 0; x < W; ++x) {
+                glm::vec3 p = evaluateBody(shape, x / (float)(W - 1), y / (float)(H - 1)).position;
+                positions[y * W + x] = p.x;
+                positions[W * H + y * W + x] = p.y;
+                positions[2 * W * H + y * W + x] = p.z;
+            }
+        }
+    });
+
+    atlas.resize((size_t)TOMOE_ATLAS_WIDTH * TOMOE_ATLAS_HEIGHT);
+    parallelFor(TOMOE_VARIANTS, 1, [&](int, int begin, int end) {
+        for (int variant = begin; variant < end; ++variant) bakeTomoeTile(variant, positions, atlas);
+    });
+}
+
+// Bakes on the job system and uploads from applyGLUploads(), replacing
+// any previous atlas
+JobCounter tomoeBakeJob;
+
+void startTomoeBake(BodyShape shape) {
+    // The atlas is laid out in the body's UVs; imported meshes keep the
+    // analytic pattern
+    if (!importMeshPath.empty()) return;
+    submitJob([shape] {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::vector<unsigned char>* atlas = new std::vector<unsigned char>;
+        bakeTomoeAtlas(shape, *atlas);
+        double milliseconds = millisecondsSince(start);
+        postGLUpload([atlas, milliseconds] {
+            std::fprintf(stderr, "Tomoe atlas: %dx%d, %d variants, baked in %.2f ms on %d threads\n",
+                         TOMOE_ATLAS_WIDTH, TOMOE_ATLAS_HEIGHT, TOMOE_VARIANTS, milliseconds,
+                         jobThreadCount());
+            if (tomoeAtlasTexture == 0) glGenTextures(1, &tomoeAtlasTexture);
+            glActiveTexture(GL_TEXTURE0 + TOMOE_TEXTURE_UNIT);
+            glBindTexture(GL_TEXTURE_2D, tomoeAtlasTexture);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, TOMOE_ATLAS_WIDTH, TOMOE_ATLAS_HEIGHT, 0,
+                         GL_RED, GL_UNSIGNED_BYTE, &(*atlas)[0]);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+            // No mips: they would blend neighbouring tiles
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glActiveTexture(GL_TEXTURE0);
+            delete atlas;
+        });
+    }, tomoeBakeJob);
+}
+
+void deleteTomoeAtlas() {
+    glDeleteTextures(1, &tomoeAtlasTexture);
+    tomoeAtlasTexture = 0;
+}
+
+// ─── Software rasterizer ──────────────────────────────────────────
+//
+// A CPU backend for render nodes without a GPU. It draws the same scene
+// and stage looks as the GL path, always with rim outlines and the
+// analytic tomoe pattern. Draws are
+// transformed and their triangles binned into 64x64 tiles on the job
+// system, then each tile is rasterized and shaded by one job. Edge tests,
+// depth test and stage shading run SIMD_WIDTH pixels at a time. Images
+// are stored bottom-up in RGBA8 like glReadPixels, so they can be diffed
+// against the GL path directly.
+
+// Interpolated quantities, each a plane in screen space: value at the
+// triangle origin plus gradients. Attributes are stored divided by w and
+// divided back per pixel for perspective correction.
+enum SoftPlane {
+    PLANE_Z,
+    PLANE_INV_W,
+    PLANE_FRAG_POS,
+    PLANE_NORMAL = PLANE_FRAG_POS + 3,
+    PLANE_WORLD_POS = PLANE_NORMAL + 3,
+    PLANE_BARY = PLANE_WORLD_POS + 3,   // barycentrics of vertices 0-2 for the edge test
+    SOFT_PLANES = PLANE_BARY + 3
+};
+
+struct SoftTriangle {
+    float originX, originY;
+    float dx[SOFT_PLANES];
+    float dy[SOFT_PLANES];
+    float value[SOFT_PLANES];
+    int minX, minY, maxX, maxY;         // inclusive pixel bounds
+    glm::vec3 tint;
+    float patternSeed;
+};
+
+struct SoftVertex {
+    glm::vec3 screen;                   // window x, y and NDC depth
+    float invW;
+    bool behindNear;
+    glm::vec3 fragPos;
+    glm::vec3 normal;
+    glm::vec3 worldPos;
+};
+
+// Triangles and tile bins produced by one geometry job
+struct SoftBinChunk {
+    std::vector<SoftVertex> vertices;
+    std::vector<SoftTriangle> triangles;
+    std::vector<std::vector<int> > bins;
+    unsigned long long submitted;
+};
+
+const int SOFT_TILE_SIZE = 64;
+const int SOFT_DRAW_GRAIN = 16;         // crowd members per geometry job
+
+struct SoftwareTarget {
+    int width = 0;
+    int height = 0;
+    std::vector<unsigned int> color;    // RGBA8, bottom row first
+};
+
+std::vector<SoftBinChunk> softChunks;
+
+unsigned int packColor(float r, float g, float b) {
+    unsigned int ri = (unsigned int)(glm::clamp(r, 0.0f, 1.0f) * 255.0f + 0.5f);
+    unsigned int gi = (unsigned int)(glm::clamp(g, 0.0f, 1.0f) * 255.0f + 0.5f);
+    unsigned int bi = (unsigned int)(glm::clamp(b, 0.0f, 1.0f) * 255.0f + 0.5f);
+    return ri | (gi << 8) | (bi << 16) | 0xff000000u;
+}
+
+void setupSoftTriangle(const SoftVertex& v0, const SoftVertex& v1, const SoftVertex& v2,
+                       int width, int height, SoftTriangle& tri, bool& visible) {
+    visible = false;
+    if (v0.behindNear || v1.behindNear || v2.behindNear) return;
+
+    float x0 = v0.screen.x, y0 = v0.screen.y;
+    float x1 = v1.screen.x, y1 = v1.screen.y;
+    float x2 = v2.screen.x, y2 = v2.screen.y;
+    // The body grids wind clockwise on screen when facing the camera. Back
+    // faces and slivers are dropped; the bodies are closed, so GL's depth
+    // test hides the same faces.
+    float area = (x1 - x0) * (y2 - y0) - (x2 - x0) * (y1 - y0);
+    if (area >= -1e-8f) return;
+
+    tri.minX = std::max(0, (int)std::ceil(std::min(x0, std::min(x1, x2)) - 0.5f));
+    tri.minY = std::max(0, (int)std::ceil(std::min(y0, std::min(y1, y2)) - 0.5f));
+    tri.maxX = std::min(width - 1, (int)std::floor(std::max(x0, std::max(x1, x2)) - 0.5f));
+    tri.maxY = std::min(height - 1, (int)std::floor(std::max(y0, std::max(y1, y2)) - 0.5f));
+    if (tri.minX > tri.maxX || tri.minY > tri.maxY) return;
+
+    // Barycentric gradients relative to vertex 0
+    float invArea = 1.0f / area;
+    float gx[3] = { (y1 - y2) * invArea, (y2 - y0) * invArea, (y0 - y1) * invArea };
+    float gy[3] = { (x2 - x1) * invArea, (x0 - x2) * invArea, (x1 - x0) * invArea };
+    tri.originX = x0;
+    tri.originY = y0;
+
+    const SoftVertex* v[3] = { &v0, &v1, &v2 };
+    float q[3][SOFT_PLANES];
+    for (int i = 0; i < 3; ++i) {
+        q[i][PLANE_Z] = v[i]->screen.z;
+        q[i][PLANE_INV_W] = v[i]->invW;
+        for (int c = 0; c < 3; ++c) {
+            q[i][PLANE_FRAG_POS + c] = v[i]->fragPos[c] * v[i]->invW;
+            q[i][PLANE_NORMAL + c] = v[i]->normal[c] * v[i]->invW;
+            q[i][PLANE_WORLD_POS + c] = v[i]->worldPos[c] * v[i]->invW;
+            q[i][PLANE_BARY + c] = i == c ? 1.0f : 0.0f;
+        }
+    }
+    for (int p = 0; p < SOFT_PLANES; ++p) {
+        tri.dx[p] = q[0][p] * gx[0] + q[1][p] * gx[1] + q[2][p] * gx[2];
+        tri.dy[p] = q[0][p] * gy[0] + q[1][p] * gy[1] + q[2][p] * gy[2];
+        tri.value[p] = q[0][p];
+    }
+    visible = true;
+}
+
+// Transforms one draw's LOD and bins its visible triangles
+void softwareDraw(const glm::mat4& viewProjection, const glm::mat4& model, const glm::mat3& normalMatrix,
+                  const glm::vec3& tint, float patternSeed, int level,
+                  int width, int height, int tilesX, SoftBinChunk& chunk) {
+    const MeshLOD& lod = bodyMesh.lods[level];
+    size_t vertexEnd = level + 1 < (int)bodyMesh.lods.size() ?
+                       bodyMesh.lods[level + 1].baseVertex : meshVertexCount(bodyMesh);
+    size_t vertexCount = vertexEnd - lod.baseVertex;
+
+    glm::mat4 clipFromObject = viewProjection * model;
+    chunk.vertices.resize(vertexCount);
+    for (size_t i = 0; i < vertexCount; ++i) {
+        const Vertex& in = meshVertices(bodyMesh)[lod.baseVertex + i];
+        SoftVertex& out = chunk.vertices[i];
+        glm::vec4 clip = clipFromObject * glm::vec4(in.position, 1.0f);
+        out.behindNear = clip.w < NEAR_PLANE;
+        out.invW = 1.0f / clip.w;
+        out.screen = glm::vec3((clip.x * out.invW * 0.5f + 0.5f) * width,
+                               (clip.y * out.invW * 0.5f + 0.5f) * height, clip.z * out.invW);
+        out.fragPos = glm::vec3(model * glm::vec4(in.position, 1.0f));
+        out.normal = normalMatrix * in.normal;
+        out.worldPos = in.position;
+    }
+
+    chunk.submitted += lod.indexCount / 3;
+    const unsigned int* indices = meshIndices(bodyMesh) + lod.firstIndex;
+    for (GLsizei i = 0; i < lod.indexCount; i += 3) {
+        SoftTriangle tri;
+        bool visible;
+        setupSoftTriangle(chunk.vertices[indices[i]], chunk.vertices[indices[i + 1]],
+                          chunk.vertices[indices[i + 2]], width, height, tri, visible);
+        if (!visible) continue;
+        tri.tint = tint;
+        tri.patternSeed = patternSeed;
+
+        int index = (int)chunk.triangles.size();
+        chunk.triangles.push_back(tri);
+        for (int ty = tri.minY / SOFT_TILE_SIZE; ty <= tri.maxY / SOFT_TILE_SIZE; ++ty) {
+            for (int tx = tri.minX / SOFT_TILE_SIZE; tx <= tri.maxX / SOFT_TILE_SIZE; ++tx) {
+                chunk.bins[ty * tilesX + tx].push_back(index);
+            }
+        }
+    }
+}
+
+// The stage fragment shaders, SIMD_WIDTH pixels at a time
+void shadeSoftware(int stage, const FrameUniforms& frame, const SoftTriangle& tri,
+                   const SimdVec3& fragPos, const SimdVec3& normal, const SimdVec3& worldPos,
+                   int pixelX, int pixelY, SimdVec3& color) {
+    SimdVec3 norm = normalize(normal);
+    SimdVec3 lightDir = normalize(towards(frame.lightPos, fragPos));
+    SimdFloat diff = simdMax(dot(norm, lightDir), 0.0f);
+
+    if (stage == 0) {
+        SimdFloat shade = (diff * 0.6f + 0.3f) * 0.5f;
+        color.x = shade * tri.tint.x;
+        color.y = shade * tri.tint.y;
+        color.z = shade * tri.tint.z;
+        return;
+    }
+
+    glm::vec3 base;
+    if (stage >= 4) {
+        diff = simdSelect(diff > 0.8f, 1.0f,
+               simdSelect(diff > 0.5f, 0.7f, simdSelect(diff > 0.25f, 0.45f, 0.25f)));
+        base = glm::vec3(0.97f, 0.95f, 0.88f) * tri.tint;
+    } else {
+        diff = simdSelect(diff > 0.7f, 1.0f, simdSelect(diff > 0.3f, 0.58f, 0.3f));
+        base = glm::vec3(0.96f, 0.94f, 0.87f) * tri.tint;
+    }
+    color.x = diff * base.x;
+    color.y = diff * base.y;
+    color.z = diff * base.z;
+    if (stage == 1) return;
+
+    if (stage >= 3) {
+        SimdFloat angle = simdAtan2(worldPos.z, worldPos.x) + tri.patternSeed;
+        SimdFloat radius = simdSqrt(worldPos.x * worldPos.x + worldPos.z * worldPos.z);
+        SimdFloat spiral = simdSin(angle * 3.5f - radius * 6.5f);
+        SimdFloat spots = simdSin(worldPos.y * 7.0f + tri.patternSeed * 2.0f) * simdCos(angle * 4.0f);
+        SimdMask red = (spiral > 0.82f) | (spots > 0.88f);
+        glm::vec3 redPattern = stage >= 4 ? glm::vec3(0.84f, 0.11f, 0.14f) : glm::vec3(0.82f, 0.12f, 0.14f);
+        float amount = stage >= 4 ? 0.78f : 0.75f;
+        color.x = simdSelect(red, color.x * (1.0f - amount) + redPattern.x * amount, color.x);
+        color.y = simdSelect(red, color.y * (1.0f - amount) + redPattern.y * amount, color.y);
+        color.z = simdSelect(red, color.z * (1.0f - amount) + redPattern.z * amount, color.z);
+    }
+
+    SimdFloat ink = 0.07f;
+    if (stage >= 4) {
+        SimdFloat noise1, noise2;
+        if (frame.paperGrain > 0.5f) {
+            samplePaper(pixelX, pixelY, noise2, noise1);
+        } else {
+            noise1 = simdFract(simdSin(fragPos.x * 12.9898f + fragPos.y * 78.233f) * 43758.5453f);
+            noise2 = simdFract(simdSin(fragPos.y * 93.9898f + fragPos.z * 67.345f) * 28451.3547f);
+        }
+        SimdFloat grain = (noise1 + noise2) * 0.02f;
+        SimdFloat variation = simdSin(worldPos.y * 20.0f) * 0.015f;
+        color.x = color.x + grain + variation;
+        color.y = color.y + grain + variation * 0.8f;
+        color.z = color.z + grain + variation * 0.6f;
+        ink = noise1 * 0.05f + 0.07f;
+    }
+
+    // pow(edge, 1.7) > 0.24 without the pow
+    const float RIM_EDGE = 0.4314f;     // 0.24^(1/1.7)
+    SimdVec3 viewDir = normalize(towards(frame.viewPos, fragPos));
+    SimdMask rim = (1.0f - simdAbs(dot(norm, viewDir))) > RIM_EDGE;
+    color.x = simdSelect(rim, ink, color.x);
+    color.y = simdSelect(rim, ink, color.y);
+    color.z = simdSelect(rim, ink, color.z);
+}
+
+inline SimdFloat evaluatePlane(const SoftTriangle& tri, int plane, SimdFloat px, float py) {
+    return px * tri.dx[plane] + (py * tri.dy[plane] + tri.value[plane]);
+}
+
+void rasterizeTile(int stage, const FrameUniforms& frame, int tileX, int tileY,
+                   int tilesX, SoftwareTarget& target) {
+    alignas(32) float depth[SOFT_TILE_SIZE * SOFT_TILE_SIZE];
+    alignas(32) unsigned int color[SOFT_TILE_SIZE * SOFT_TILE_SIZE];
+    const unsigned int paper = packColor(0.94f, 0.91f, 0.83f);
+    std::fill(depth, depth + SOFT_TILE_SIZE * SOFT_TILE_SIZE, 1.0f);
+    std::fill(color, color + SOFT_TILE_SIZE * SOFT_TILE_SIZE, paper);
+
+    int x0 = tileX * SOFT_TILE_SIZE;
+    int y0 = tileY * SOFT_TILE_SIZE;
+    int tile = tileY * tilesX + tileX;
+
+    for (size_t c = 0; c < softChunks.size(); ++c) {
+        const SoftBinChunk& chunk = softChunks[c];
+        const std::vector<int>& bin = chunk.bins[tile];
+        for (size_t b = 0; b < bin.size(); ++b) {
+            const SoftTriangle& tri = chunk.triangles[bin[b]];
+            int minX = std::max(tri.minX, x0) - x0;
+            int maxX = std::min(tri.maxX, x0 + SOFT_TILE_SIZE - 1) - x0;
+            int minY = std::max(tri.minY, y0) - y0;
+            int maxY = std::min(tri.maxY, y0 + SOFT_TILE_SIZE - 1) - y0;
+            minX -= minX % SIMD_WIDTH;
+
+            for (int y = minY; y <= maxY; ++y) {
+                float py = y0 + y + 0.5f - tri.originY;
+                for (int x = minX; x <= maxX; x += SIMD_WIDTH) {
+                    SimdFloat px = simdRamp() + (x0 + x + 0.5f - tri.originX);
+                    SimdMask inside = (evaluatePlane(tri, PLANE_BARY, px, py) >= 0.0f) &
+                                      (evaluatePlane(tri, PLANE_BARY + 1, px, py) >= 0.0f) &
+                                      (evaluatePlane(tri, PLANE_BARY + 2, px, py) >= 0.0f);
+                    if (!simdBits(inside)) continue;
+
+                    float* depthRow = depth + y * SOFT_TILE_SIZE + x;
+                    SimdFloat z = evaluatePlane(tri, PLANE_Z, px, py);
+                    SimdFloat stored = simdLoad(depthRow);
+                    SimdMask pass = inside & (z < stored);
+                    int bits = simdBits(pass);
+                    if (!bits) continue;
+                    simdStore(depthRow, simdSelect(pass, z, stored));
+
+                    SimdFloat w = SimdFloat(1.0f) / evaluatePlane(tri, PLANE_INV_W, px, py);
+                    SimdVec3 attributes[3];
+                    for (int a = 0; a < 3; ++a) {
+                        int plane = PLANE_FRAG_POS + a * 3;
+                        attributes[a].x = evaluatePlane(tri, plane, px, py) * w;
+                        attributes[a].y = evaluatePlane(tri, plane + 1, px, py) * w;
+                        attributes[a].z = evaluatePlane(tri, plane + 2, px, py) * w;
+                    }
+                    SimdVec3 shaded;
+                    shadeSoftware(stage, frame, tri, attributes[0], attributes[1], attributes[2],
+                                  x0 + x, y0 + y, shaded);
+
+                    alignas(32) float r[SIMD_WIDTH], g[SIMD_WIDTH], bl[SIMD_WIDTH];
+                    simdStore(r, shaded.x);
+                    simdStore(g, shaded.y);
+                    simdStore(bl, shaded.z);
+                    unsigned int* colorRow = color + y * SOFT_TILE_SIZE + x;
+                    for (int lane = 0; lane < SIMD_WIDTH; ++lane) {
+                        if (bits & (1 << lane)) colorRow[lane] = packColor(r[lane], g[lane], bl[lane]);
+                    }
+                }
+            }
+        }
+    }
+
+    int rows = std::min(SOFT_TILE_SIZE, target.height - y0);
+    int columns = std::min(SOFT_TILE_SIZE, target.width - x0);
+    for (int y = 0; y < rows; ++y) {
+        std::memcpy(&target.color[(size_t)(y0 + y) * target.width + x0],
+                    color + y * SOFT_TILE_SIZE, columns * sizeof(unsigned int));
+    }
+}
+
+// Renders the current scene (single body or crowd) on the job system
+void renderSoftware(int stage, int width, int height, SoftwareTarget& target) {
+    ProfileScope scope("software");
+    frameTriangles = 0;
+    target.width = width;
+    target.height = height;
+    target.color.resize((size_t)width * height);
+    if (bodyMesh.lods.empty()) return;
+
+    FrameUniforms frame = makeFrameUniforms(stage, width, height, 0.0f);
+    glm::mat4 viewProjection = frame.projection * frame.view;
+    int tilesX = (width + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+    int tilesY = (height + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+
+    int draws = crowdSize > 0 ? crowdSize : 1;
+    int chunks = parallelChunks(draws, SOFT_DRAW_GRAIN);
+    softChunks.resize(chunks);
+    for (int c = 0; c < chunks; ++c) {
+        SoftBinChunk& chunk = softChunks[c];
+        chunk.triangles.clear();
+        chunk.bins.resize(tilesX * tilesY);
+        for (size_t t = 0; t < chunk.bins.size(); ++t) chunk.bins[t].clear();
+        chunk.submitted = 0;
+    }
+
+    CrowdLayout layout = crowdLayout(draws);
+    parallelFor(draws, SOFT_DRAW_GRAIN, [&](int c, int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            if (crowdSize > 0) {
+                InstanceData instance;
+                writeCrowdInstance(layout, i, rotationAngle, instance);
+                float distance = glm::length(crowdPosition(layout, i, rotationAngle) - cameraPos);
+                int level = selectLOD(bodyMesh, projectedRadius(bodyMesh.boundingRadius * layout.scale,
+                                                                 distance, height));
+                softwareDraw(viewProjection, instance.model, glm::mat3(instance.model), instance.tint,
+                             instance.patternSeed, level, width, height, tilesX, softChunks[c]);
+            } else {
+                glm::mat4 model = glm::rotate(glm::mat4(1.0f), rotationAngle, glm::vec3(0.0f, 1.0f, 0.0f));
+                glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(model)));
+                int level = selectLOD(bodyMesh, projectedRadius(bodyMesh.boundingRadius,
+                                                                 glm::length(cameraPos), height));
+                softwareDraw(viewProjection, model, normalMatrix, glm::vec3(1.0f), 0.0f,
+                             level, width, height, tilesX, softChunks[c]);
+            }
+        }
+    });
+    for (int c = 0; c < chunks; ++c) {
+        frameTriangles += softChunks[c].submitted;
+    }
+
+    parallelFor(tilesX * tilesY, 1, [&](int, int begin, int end) {
+        for (int tile = begin; tile < end; ++tile) {
+            rasterizeTile(stage, frame, tile % tilesX, tile / tilesX, tilesX, target);
+        }
+    });
+}
+
+// Per-channel comparison of two RGBA8 images of the same size
+struct ImageDiff {
+    int maxDifference;
+    double meanDifference;
+    double mismatchPercent;             // pixels with any channel over the tolerance
+};
+
+ImageDiff diffImages(const unsigned char* a, const unsigned char* b, int pixels, int tolerance) {
+    ImageDiff diff = { 0, 0.0, 0.0 };
+    long long total = 0;
+    int mismatched = 0;
+    for (int i = 0; i < pixels; ++i) {
+        int worst = 0;
+        for (int c = 0; c < 3; ++c) {
+            int d = std::abs((int)a[i * 4 + c] - (int)b[i * 4 + c]);
+            worst = std::max(worst, d);
+            total += d;
+        }
+        diff.maxDifference = std::max(diff.maxDifference, worst);
+        if (worst > tolerance) ++mismatched;
+    }
+    diff.meanDifference = pixels > 0 ? total / (3.0 * pixels) : 0.0;
+    diff.mismatchPercent = pixels > 0 ? 100.0 * mismatched / pixels : 0.0;
+    return diff;
+}
+
+// ─── Headless benchmark ───────────────────────────────────────────
+//
+// Renders every stage into an offscreen FBO for a fixed number of frames
+// per resolution and prints CPU submit time, GPU time (GL_TIME_ELAPSED)
+// and p50/p99 frame time. Build with -DOKAMI_EGL -lEGL to get a
+// surfaceless EGL context (llvmpipe on machines without a GPU); otherwise
+// a hidden GLFW window is used, which still needs a display.
+
+enum RenderBackend {
+    BACKEND_GL,
+    BACKEND_CPU         // software rasterizer
+};
+
+struct BenchOptions {
+    bool enabled = false;
+    int frames = 200;
+    int warmup = 20;
+    std::vector<AntiAliasing> antiAliasing;
+    std::vector<bool> culling;          // crowd culling modes to sweep
+    std::string format = "csv";
+    std::vector<glm::vec2> resolutions;
+    std::vector<int> stages;
+    std::vector<int> instanceCounts;    // 0 = single egg, >0 = instanced crowd
+    std::vector<VertexFormat> vertexFormats;
+    std::vector<int> threadCounts;      // job system sizes to sweep
+    std::vector<RenderBackend> backends;
+    std::vector<int> brushStrokes;      // >0 entries benchmark the brush instead of the stages
+    std::vector<int> wetStrokes;        // still bleeding while the brush is benchmarked
+    std::vector<int> lights;            // lantern counts to sweep
+    std::vector<bool> lightClusters;    // clustered or flat light lists
+    bool compare = false;               // diff the software renderer against GL
+    int tolerance = 16;                 // per-channel difference allowed by --compare
+    int turntableFrames = 0;            // >0 renders a turntable instead of benchmarking
+    std::string outputPath = "turntable/okami_%04d.png";
+    int fps = 30;
+};
+
+struct BenchResult {
+    int stage;
+    const char* outline;
+    int instances;
+    int width;
+    int height;
+    int frames;
+    double cpuMs;
+    double gpuMs;
+    double frameP50Ms;
+    double frameP99Ms;
+    unsigned long long triangles;       // per frame, after LOD selection
+    const char* vertexFormat;
+    double vertexKB;                    // vertex buffer size of the mesh
+    double vertexFetchMB;               // estimated vertex bytes fetched per frame
+    int threads;                        // job system threads, main included
+    double updateMs;                    // per-frame crowd update on the job system
+    double meshMs;                      // body mesh build + upload with that many threads
+    const char* backend;
+    double megapixelsPerSecond;         // from the mean frame time
+    double megapixelsPerCore;           // per job thread (cpu) or hardware thread (gl)
+    const char* paper;                  // stage 4+ paper grain source
+    double paperMs;                     // paper texture generation with that many threads
+    const char* tomoe;                  // stage 3+ tomoe markings: atlas or analytic
+    unsigned features;                  // fragment shader permutation (ShaderFeature bits)
+    float scale;                        // scene resolution per output pixel
+    const char* antiAliasing;
+    const char* culling;                // crowd culling: bvh, off, or none without a crowd
+    double visible;                     // crowd members drawn per frame
+    double cullMs;                      // per-frame BVH refit + frustum cull
+    int drawCalls;                      // GL draw calls per frame
+    int lights;                         // lanterns in the scene
+    const char* lightCulling;           // clustered, flat, or none without lanterns
+    double lightMs;                     // per-frame light placement, clustering and upload
+    double clusterLights;               // mean lights per cluster with any
+    int maxClusterLights;
+    double lightUploadKB;               // per frame
+};
+
+double percentile(std::vector<double> values, double p) {
+    if (values.empty()) return 0.0;
+    std::sort(values.begin(), values.end());
+    size_t rank = (size_t)std::ceil(p / 100.0 * values.size());
+    if (rank < 1) rank = 1;
+    return values[rank - 1];
+}
+
+void setThroughput(BenchResult& result, const std::vector<double>& frameTimes, int cores) {
+    double total = 0.0;
+    for (size_t i = 0; i < frameTimes.size(); ++i) total += frameTimes[i];
+    double meanMs = frameTimes.empty() ? 0.0 : total / frameTimes.size();
+    result.megapixelsPerSecond = meanMs > 0.0 ? 
+        result.width * (double)result.height / 1.0e6 / (meanMs / 1000.0) : 0.0;
+    result.megapixelsPerCore = result.megapixelsPerSecond / std::max(cores, 1);
+}
+
+BenchResult benchmarkStage(int stage, int instances, int width, int height, 
+                           GLuint targetFBO, const BenchOptions& options) {
+    crowdSize = instances;
+    GLuint query;
+    glGenQueries(1, &query);
+    
+    rotationAngle = 0.0f;
+    std::vector<double> frameTimes;
+    double cpuTotal = 0.0;
+    double gpuTotal = 0.0;
+    double updateTotal = 0.0;
+    double visibleTotal = 0.0;
+    double cullTotal = 0.0;
+    double lightTotal = 0.0;
+    double clusterLightTotal = 0.0;
+    int maxClusterLights = 0;
+    
+    for (int frame = 0; frame < options.warmup + options.frames; ++frame) {
+        bool measured = frame >= options.warmup;
+        beginProfileFrame();
+        std::chrono::steady_clock::time_point frameStart = std::chrono::steady_clock::now();
+        
+        if (stage == MAX_STAGES) {
+            rotationAngle += 0.008f;
+        }
+        
+        glBeginQuery(GL_TIME_ELAPSED, query);
+        renderFrame(stage, width, height, frame / 60.0f, targetFBO, fixedRenderScale);
+        glEndQuery(GL_TIME_ELAPSED);
+        double cpuMs = millisecondsSince(frameStart);
+        
+        // No swap chain to pace us, so finish the frame to get a real frame time
+        glFinish();
+        double frameMs = millisecondsSince(frameStart);
+        
+        GLuint64 gpuNs = 0;
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &gpuNs);
+        endProfileFrame();
+        
+        if (measured) {
+            cpuTotal += cpuMs;
+            updateTotal += crowdSize > 0 ? crowdUpdateMs : 0.0;
+            visibleTotal += crowdSize > 0 ? crowdDrawn : 1;
+            cullTotal += crowdSize > 0 ? crowdCullMs : 0.0;
+            if (lanternCount > 0) {
+                lightTotal += clusteredLights.assignMs;
+                clusterLightTotal += clusteredLights.meanClusterLights;
+                maxClusterLights = std::max(maxClusterLights, clusteredLights.maxClusterLights);
+            }
+            gpuTotal += gpuNs / 1.0e6;
+            frameTimes.push_back(frameMs);
+        }
+    }
+    
+    glDeleteQueries(1, &query);
+    crowdSize = 0;
+    
+    BenchResult result;
+    result.stage = stage;
+    result.outline = stage < 2 ? "none" : usesScreenOutline(stage) ? "screen" : "rim";
+    result.paper = paperModeName(stage);
+    result.tomoe = tomoeModeName(stage);
+    result.features = materialFeatures(stage, tomoeAtlasTexture != 0);
+    result.scale = (float)scaledSize(height, fixedRenderScale) / height;
+    result.antiAliasing = ANTI_ALIASING_MODES[antiAliasing].name;
+    result.culling = instances == 0 ? "none" : crowdCulling ? "bvh" : "off";
+    result.visible = options.frames > 0 ? visibleTotal / options.frames : 0.0;
+    result.cullMs = options.frames > 0 ? cullTotal / options.frames : 0.0;
+    result.drawCalls = instances == 0 ? 1 : crowdDrawCalls;
+    result.lights = lanternCount;
+    result.lightCulling = lanternCount == 0 ? "none" : lightClusters ? "clustered" : "flat";
+    result.lightMs = options.frames > 0 ? lightTotal / options.frames : 0.0;
+    result.clusterLights = options.frames > 0 ? clusterLightTotal / options.frames : 0.0;
+    result.maxClusterLights = maxClusterLights;
+    result.lightUploadKB = lanternCount > 0 ? clusteredLights.uploadBytes / 1024.0 : 0.0;
+    result.instances = std::max(instances, 1);
+    result.width = width;
+    result.height = height;
+    result.frames = options.frames;
+    result.cpuMs = options.frames > 0 ? cpuTotal / options.frames : 0.0;
+    result.gpuMs = options.frames > 0 ? gpuTotal / options.frames : 0.0;
+    result.frameP50Ms = percentile(frameTimes, 50.0);
+    result.frameP99Ms = percentile(frameTimes, 99.0);
+    result.triangles = frameTriangles;
+    result.vertexFormat = vertexFormatName(bodyMesh.format);
+    result.vertexKB = meshVertexCount(bodyMesh) * vertexStride(bodyMesh.format) / 1024.0;
+    result.vertexFetchMB = frameVertexBytes / (1024.0 * 1024.0);
+    result.threads = jobThreadCount();
+    result.updateMs = options.frames > 0 ? updateTotal / options.frames : 0.0;
+    result.meshMs = 0.0;
+    result.backend = "gl";
+    // llvmpipe spreads over every hardware thread; on a GPU this is only nominal
+    setThroughput(result, frameTimes, (int)std::thread::hardware_concurrency());
+    return result;
+}
+
+SoftwareTarget softwareTarget;
+
+BenchResult benchmarkSoftwareStage(int stage, int instances, int width, int height, 
+                                   const BenchOptions& options) {
+    crowdSize = instances;
+    rotationAngle = 0.0f;
+    std::vector<double> frameTimes;
+    
+    for (int frame = 0; frame < options.warmup + options.frames; ++frame) {
+        std::chrono::steady_clock::time_point frameStart = std::chrono::steady_clock::now();
+        if (stage == MAX_STAGES) {
+            rotationAngle += 0.008f;
+        }
+        beginProfileFrame();
+        renderSoftware(stage, width, height, softwareTarget);
+        endProfileFrame();
+        if (frame >= options.warmup) {
+            frameTimes.push_back(millisecondsSince(frameStart));
+        }
+    }
+    crowdSize = 0;
+    
+    BenchResult result;
+    result.stage = stage;
+    result.outline = stage < 2 ? "none" : "rim";
+    result.paper = paperModeName(stage);
+    result.tomoe = stage < 3 ? "none" : "analytic";     // shadeSoftware has no atlas
+    result.features = materialFeatures(stage, false);
+    result.scale = 1.0f;
+    result.antiAliasing = "none";
+    result.culling = instances == 0 ? "none" : "off";
+    result.visible = std::max(instances, 1);
+    result.cullMs = 0.0;
+    result.drawCalls = 0;
+    result.lights = 0;
+    result.lightCulling = "none";
+    result.lightMs = 0.0;
+    result.clusterLights = 0.0;
+    result.maxClusterLights = 0;
+    result.lightUploadKB = 0.0;
+    result.instances = std::max(instances, 1);
+    result.width = width;
+    result.height = height;
+    result.frames = options.frames;
+    double total = 0.0;
+    for (size_t i = 0; i < frameTimes.size(); ++i) total += frameTimes[i];
+    result.cpuMs = frameTimes.empty() ? 0.0 : total / frameTimes.size();
+    result.gpuMs = 0.0;
+    result.frameP50Ms = percentile(frameTimes, 50.0);
+    result.frameP99Ms = percentile(frameTimes, 99.0);
+    result.triangles = frameTriangles;
+    result.vertexFormat = vertexFormatName(VERTEX_FLOAT);
+    result.vertexKB = meshVertexCount(bodyMesh) * sizeof(Vertex) / 1024.0;
+    result.vertexFetchMB = 0.0;
+    result.threads = jobThreadCount();
+    result.updateMs = 0.0;
+    result.meshMs = 0.0;
+    result.backend = "cpu";
+    setThroughput(result, frameTimes, jobThreadCount());
+    return result;
+}
+
+// Renders one frame of a stage with both backends, GL with rim outlines,
+// the analytic tomoe and no anti-aliasing, and reports how far the software image
+// is from the GL one
+const double COMPARE_MAX_MISMATCH_PERCENT = 1.0;
+
+bool compareBackends(int stage, int instances, int width, int height, 
+                     GLuint readbackFBO, const BenchOptions& options) {
+    OutlineMode savedOutline = outlineMode;
+    TomoeMode savedTomoe = tomoeMode;
+    AntiAliasing savedAntiAliasing = antiAliasing;
+    int savedLanterns = lanternCount;
+    outlineMode = OUTLINE_RIM;
+    tomoeMode = TOMOE_ANALYTIC;
+    antiAliasing = AA_NONE;
+    lanternCount = 0;                   // the software renderer has only the key light
+    crowdSize = instances;
+    rotationAngle = stage == MAX_STAGES ? 0.008f : 0.0f;
+    
+    renderFrame(stage, width, height, 0.0f, readbackFBO);
+    std::vector<unsigned char> glImage((size_t)width * height * 4);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, readbackFBO);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, &glImage[0]);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    
+    renderSoftware(stage, width, height, softwareTarget);
+    ImageDiff diff = diffImages(&glImage[0], (const unsigned char*)&softwareTarget.color[0], 
+                                width * height, options.tolerance);
+    
+    crowdSize = 0;
+    rotationAngle = 0.0f;
+    outlineMode = savedOutline;
+    tomoeMode = savedTomoe;
+    antiAliasing = savedAntiAliasing;
+    lanternCount = savedLanterns;
+    
+    bool passed = diff.mismatchPercent <= COMPARE_MAX_MISMATCH_PERCENT;
+    std::fprintf(stderr, "  compare stage %d x%d @ %dx%d: max %d, mean %.3f, %.3f%% over %d -> %s\n",
+                 stage, std::max(instances, 1), width, height, diff.maxDifference, 
+                 diff.meanDifference, diff.mismatchPercent, options.tolerance, 
+                 passed ? "ok" : "MISMATCH");
+    return passed;
+}
+
+void printBenchResults(const std::vector<BenchResult>& results, const std::string& format) {
+    if (format == "json") {
+        std::printf("[\n");
+        for (size_t i = 0; i < results.size(); ++i) {
+            const BenchResult& r = results[i];
+            std::printf("  {\"stage\": %d, \"outline\": \"%s\", \"instances\": %d, \"width\": %d, \"height\": %d, "
+                        "\"frames\": %d, \"cpu_ms\": %.4f, \"gpu_ms\": %.4f, "
+                        "\"frame_p50_ms\": %.4f, \"frame_p99_ms\": %.4f, \"triangles\": %llu, "
+                        "\"vertex_format\": \"%s\", \"vertex_kb\": %.2f, \"vertex_fetch_mb\": %.3f, "
+                        "\"threads\": %d, \"update_ms\": %.4f, \"mesh_ms\": %.3f, "
+                        "\"backend\": \"%s\", \"mpix_s\": %.3f, \"mpix_s_core\": %.3f, "
+                        "\"paper\": \"%s\", \"paper_ms\": %.3f, \"tomoe\": \"%s\", \"features\": \"%03x\", "
+                        "\"scale\": %.2f, \"aa\": \"%s\", \"cull\": \"%s\", \"visible\": %.1f, "
+                        "\"cull_ms\": %.4f, \"draws\": %d, \"lights\": %d, \"light_culling\": \"%s\", "
+                        "\"light_ms\": %.4f, \"cluster_lights\": %.2f, \"cluster_lights_max\": %d, "
+                        "\"light_upload_kb\": %.2f}%s\n",
+                        r.stage, r.outline, r.instances, r.width, r.height, r.frames, 
+                        r.cpuMs, r.gpuMs, r.frameP50Ms, r.frameP99Ms, r.triangles, 
+                        r.vertexFormat, r.vertexKB, r.vertexFetchMB, r.threads, r.updateMs, r.meshMs, 
+                        r.backend, r.megapixelsPerSecond, r.megapixelsPerCore, r.paper, r.paperMs, r.tomoe,
+                        r.features, r.scale, r.antiAliasing, r.culling, r.visible, r.cullMs, r.drawCalls,
+                        r.lights, r.lightCulling, r.lightMs, r.clusterLights, r.maxClusterLights,
+                        r.lightUploadKB, i + 1 < results.size() ? "," : "");
+        }
+        std::printf("]\n");
+    } else {
+        std::printf("stage,outline,instances,width,height,frames,cpu_ms,gpu_ms,frame_p50_ms,frame_p99_ms,triangles,"
+                    "vertex_format,vertex_kb,vertex_fetch_mb,threads,update_ms,mesh_ms,"
+                    "backend,mpix_s,mpix_s_core,paper,paper_ms,tomoe,features,scale,aa,cull,visible,cull_ms,draws,"
+                    "lights,light_culling,light_ms,cluster_lights,cluster_lights_max,light_upload_kb\n");
+        for (size_t i = 0; i < results.size(); ++i) {
+            const BenchResult& r = results[i];
+            std::printf("%d,%s,%d,%d,%d,%d,%.4f,%.4f,%.4f,%.4f,%llu,%s,%.2f,%.3f,%d,%.4f,%.3f,%s,%.3f,%.3f,%s,%.3f,%s,%03x,%.2f,%s,%s,%.1f,%.4f,%d,"
+                        "%d,%s,%.4f,%.2f,%d,%.2f\n",
+                        r.stage, r.outline, r.instances, r.width, r.height, r.frames, 
+                        r.cpuMs, r.gpuMs,
+                        r.frameP50Ms, r.frameP99Ms, r.triangles, 
+                        r.vertexFormat, r.vertexKB, r.vertexFetchMB, r.threads, r.updateMs, r.meshMs, 
+                        r.backend, r.megapixelsPerSecond, r.megapixelsPerCore, r.paper, r.paperMs, r.tomoe, r.features,
+                        r.scale, r.antiAliasing, r.culling, r.visible, r.cullMs, r.drawCalls,
+                        r.lights, r.lightCulling, r.lightMs, r.clusterLights, r.maxClusterLights,
+                        r.lightUploadKB);
+        }
+    }
+    std::fflush(stdout);
+}
+
+// Paints a synthetic stroke over the first stage with a number of finished
+// strokes already on the canvas, at each resolution. Each frame feeds the
+// sample ring like a 1 kHz pointer at 125 Hz and measures the brush work,
+// the bytes uploaded and the time from the newest sample to the finished
+// frame. The finished strokes have soaked in and dried before the frames
+// are measured; wet strokes are repainted once a second, so that much ink
+// keeps bleeding.
+const int BRUSH_BENCH_SAMPLES_PER_FRAME = 8;
+const int BRUSH_BENCH_STROKE_SAMPLES = 40;      // preloaded strokes
+const int BRUSH_BENCH_LIVE_SAMPLES = 240;       // the painted stroke restarts after this many
+const int BRUSH_BENCH_BATCH_STROKES = 64;       // preloaded per ring drain
+const int BRUSH_BENCH_REWET_FRAMES = 60;        // wet strokes are repainted this often, staggered
+
+struct BrushBenchResult {
+    int strokes;
+    int wetStrokes;
+    long long vertices;
+    int width;
+    int height;
+    int frames;
+    double samplesPerFrame;
+    double uploadBytes;                 // per frame
+    size_t maxUploadBytes;
+    double brushCpuMs;                  // sample processing + upload + draw submit
+    double brushGpuMs;                  // ink bleed composite + strokes
+    double bleedMs;                     // ink bleed simulation
+    double wetTiles;                    // bleed tiles stepped per frame
+    int canvasTiles;
+    double bleedUploadBytes;            // per frame
+    double latencyMs;                   // newest sample to glFinish
+    double maxLatencyMs;
+    double frameP50Ms;
+    double frameP99Ms;
+};
+
+// Short waves scattered over the canvas
+glm::vec2 brushBenchPoint(int stroke, int sample, int width, int height) {
+    float angle = stroke * 2.4f;
+    glm::vec2 direction(std::cos(angle), std::sin(angle));
+    glm::vec2 normal(-direction.y, direction.x);
+    float along = sample * 3.0f;
+    glm::vec2 start(std::fmod(stroke * 197.3f, (float)width), std::fmod(stroke * 83.7f, (float)height));
+    return start + direction * along + normal * (std::sin(along * 0.05f) * 12.0f);
+}
+
+void postBrushBenchStroke(int stroke, int width, int height) {
+    for (int sample = 0; sample < BRUSH_BENCH_STROKE_SAMPLES; ++sample) {
+        BrushSampleKind kind = sample == 0 ? BRUSH_DOWN :
+                               sample + 1 == BRUSH_BENCH_STROKE_SAMPLES ? BRUSH_UP : BRUSH_MOVE;
+        glm::vec2 p = brushBenchPoint(stroke, sample, width, height);
+        postBrushSample(kind, p.x, p.y, sample * 1000000LL);
+    }
+}
+
+BrushBenchResult benchmarkBrushStrokes(int stage, int strokes, int wetStrokes, int width, int height,
+                                       GLuint targetFBO, const BenchOptions& options) {
+    float pixelScale = height / (float)HEIGHT;
+    // A fresh canvas the size of this resolution
+    deleteInkBleed();
+    setupInkBleed();
+    postBrushSample(BRUSH_CLEAR, 0.0f, 0.0f, profileNow());
+    processBrushSamples(pixelScale);
+    for (int first = 0; first < strokes; first += BRUSH_BENCH_BATCH_STROKES) {
+        int last = std::min(first + BRUSH_BENCH_BATCH_STROKES, strokes);
+        for (int stroke = first; stroke < last; ++stroke) postBrushBenchStroke(stroke, width, height);
+        processBrushSamples(pixelScale);
+        advanceInkBleed(width, height, 0.0);
+        drawBrushStrokes(targetFBO, width, height);
+    }
+    // Drying them also checks that water only leaves by soaking in and drying
+    inkBleed.checkWater = true;
+    int leaks = 0;
+    while (stepInkBleed(inkBleed) > 0) {
+        double expected = inkBleed.waterBefore * (1.0 - BLEED_ABSORB) - inkBleed.waterDried;
+        if (std::fabs(inkBleed.waterAfter - expected) > 1e-5 * inkBleed.waterBefore + 1e-6) ++leaks;
+    }
+    inkBleed.checkWater = false;
+    if (leaks > 0) std::fprintf(stderr, "  ink bleed: water made or lost in %d steps\n", leaks);
+    for (int stroke = 0; stroke < wetStrokes; ++stroke) postBrushBenchStroke(strokes + stroke, width, height);
+    processBrushSamples(pixelScale);
+    advanceInkBleed(width, height, 0.0);
+    drawInkBleed(targetFBO, width, height);
+    drawBrushStrokes(targetFBO, width, height);
+    glFinish();
+
+    GLuint query;
+    glGenQueries(1, &query);
+    std::vector<double> frameTimes;
+    double uploadTotal = 0.0, cpuTotal = 0.0, gpuTotal = 0.0, latencyTotal = 0.0, maxLatency = 0.0;
+    double bleedTotal = 0.0, wetTotal = 0.0, bleedUploadTotal = 0.0;
+    size_t maxUpload = 0;
+    int live = 0;
+    for (int frame = 0; frame < options.warmup + options.frames; ++frame) {
+        bool measured = frame >= options.warmup;
+        beginProfileFrame();
+        int rewet = frame % BRUSH_BENCH_REWET_FRAMES;
+        for (int stroke = rewet; stroke < wetStrokes; stroke += BRUSH_BENCH_REWET_FRAMES) {
+            postBrushBenchStroke(strokes + stroke, width, height);
+        }
+        long long now = profileNow();
+        for (int i = 0; i < BRUSH_BENCH_SAMPLES_PER_FRAME; ++i, ++live) {
+            int sample = live % BRUSH_BENCH_LIVE_SAMPLES;
+            BrushSampleKind kind = sample == 0 ? BRUSH_DOWN :
+                                   sample + 1 == BRUSH_BENCH_LIVE_SAMPLES ? BRUSH_UP : BRUSH_MOVE;
+            float x = width * (0.1f + 0.8f * sample / BRUSH_BENCH_LIVE_SAMPLES);
+            float y = height * (0.5f + 0.2f * std::sin(live * 0.05f));
+            postBrushSample(kind, x, y, now - (BRUSH_BENCH_SAMPLES_PER_FRAME - 1 - i) * 1000000LL);
+        }
+        std::chrono::steady_clock::time_point frameStart = std::chrono::steady_clock::now();
+        long long newestNs = processBrushSamples(pixelScale);
+        double cpuMs = millisecondsSince(frameStart);
+        advanceInkBleed(width, height, (frame + 1) / BLEED_STEPS_PER_SECOND);
+        renderFrame(stage, width, height, frame / 60.0f, targetFBO, fixedRenderScale);
+        glFinish();
+
+        std::chrono::steady_clock::time_point brushStart = std::chrono::steady_clock::now();
+        glBeginQuery(GL_TIME_ELAPSED, query);
+        drawInkBleed(targetFBO, width, height);
+        drawBrushStrokes(targetFBO, width, height);
+        glEndQuery(GL_TIME_ELAPSED);
+        cpuMs += millisecondsSince(brushStart);
+
+        glFinish();
+        double frameMs = millisecondsSince(frameStart);
+        double latencyMs = (profileNow() - newestNs) / 1.0e6;
+        GLuint64 gpuNs = 0;
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &gpuNs);
+        endProfileFrame();
+
+        if (measured) {
+            uploadTotal += brushLayer.frameUploadBytes;
+            maxUpload = std::max(maxUpload, brushLayer.frameUploadBytes);
+            cpuTotal += cpuMs;
+            gpuTotal += gpuNs / 1.0e6;
+            bleedTotal += inkBleed.frameMs;
+            wetTotal += inkBleed.frameTileSteps;
+            bleedUploadTotal += inkBleed.frameUploadBytes;
+            latencyTotal += latencyMs;
+            maxLatency = std::max(maxLatency, latencyMs);
+            frameTimes.push_back(frameMs);
+        }
+    }
+    glDeleteQueries(1, &query);
+
+    BrushBenchResult result;
+    result.strokes = strokes;
+    result.wetStrokes = wetStrokes;
+    result.vertices = brushInk.vertices;
+    result.width = width;
+    result.height = height;
+    result.frames = options.frames;
+    result.samplesPerFrame = BRUSH_BENCH_SAMPLES_PER_FRAME;
+    result.uploadBytes = uploadTotal / options.frames;
+    result.maxUploadBytes = maxUpload;
+    result.brushCpuMs = cpuTotal / options.frames;
+    result.brushGpuMs = gpuTotal / options.frames;
+    result.bleedMs = bleedTotal / options.frames;
+    result.wetTiles = wetTotal / options.frames;
+    result.canvasTiles = inkBleed.tilesX * inkBleed.tilesY;
+    result.bleedUploadBytes = bleedUploadTotal / options.frames;
+    result.latencyMs = latencyTotal / options.frames;
+    result.maxLatencyMs = maxLatency;
+    result.frameP50Ms = percentile(frameTimes, 50.0);
+    result.frameP99Ms = percentile(frameTimes, 99.0);
+
+    postBrushSample(BRUSH_CLEAR, 0.0f, 0.0f, profileNow());
+    processBrushSamples(pixelScale);
+    advanceInkBleed(width, height, 0.0);
+    drawBrushStrokes(targetFBO, width, height);
+    return result;
+}
+
+void benchmarkBrush(const BenchOptions& options, std::vector<BrushBenchResult>& results) {
+    int stage = options.stages[0];
+    std::vector<int> wetStrokes = options.wetStrokes;
+    if (wetStrokes.empty()) wetStrokes.push_back(0);
+    for (size_t r = 0; r < options.resolutions.size(); ++r) {
+        int width = (int)options.resolutions[r].x;
+        int height = (int)options.resolutions[r].y;
+        OffscreenTarget target = createOffscreenTarget(width, height, antiAliasingSamples(antiAliasing));
+        for (size_t i = 0; i < options.brushStrokes.size(); ++i) {
+            for (size_t w = 0; w < wetStrokes.size(); ++w) {
+                std::cerr << "  brush over stage " << stage << " with " << options.brushStrokes[i]
+                          << " strokes, " << wetStrokes[w] << " wet @ " << width << "x" << height << "...\n";
+                results.push_back(benchmarkBrushStrokes(stage, options.brushStrokes[i], wetStrokes[w],
+                                                        width, height, target.fbo, options));
+            }
+        }
+        deleteOffscreenTarget(target);
+    }
+}
+
+void printBrushResults(const std::vector<BrushBenchResult>& results, const std::string& format) {
+    if (format == "json") {
+        std::printf("[\n");
+        for (size_t i = 0; i < results.size(); ++i) {
+            const BrushBenchResult& r = results[i];
+            std::printf("  {\"strokes\": %d, \"wet_strokes\": %d, \"vertices\": %lld, \"width\": %d, "
+                        "\"height\": %d, \"frames\": %d, \"samples_per_frame\": %.1f, \"upload_bytes\": %.1f, "
+                        "\"upload_bytes_max\": %zu, \"brush_cpu_ms\": %.4f, \"brush_gpu_ms\": %.4f, "
+                        "\"bleed_ms\": %.4f, \"wet_tiles\": %.1f, \"canvas_tiles\": %d, "
+                        "\"bleed_upload_bytes\": %.1f, \"latency_ms\": %.4f, \"latency_max_ms\": %.4f, "
+                        "\"frame_p50_ms\": %.4f, \"frame_p99_ms\": %.4f}%s\n",
+                        r.strokes, r.wetStrokes, r.vertices, r.width, r.height, r.frames, r.samplesPerFrame,
+                        r.uploadBytes, r.maxUploadBytes, r.brushCpuMs, r.brushGpuMs, r.bleedMs, r.wetTiles,
+                        r.canvasTiles, r.bleedUploadBytes, r.latencyMs, r.maxLatencyMs, r.frameP50Ms,
+                        r.frameP99Ms, i + 1 < results.size() ? "," : "");
+        }
+        std::printf("]\n");
+    } else {
+        std::printf("strokes,wet_strokes,vertices,width,height,frames,samples_per_frame,upload_bytes,"
+                    "upload_bytes_max,brush_cpu_ms,brush_gpu_ms,bleed_ms,wet_tiles,canvas_tiles,"
+                    "bleed_upload_bytes,latency_ms,latency_max_ms,frame_p50_ms,frame_p99_ms\n");
+        for (size_t i = 0; i < results.size(); ++i) {
+            const BrushBenchResult& r = results[i];
+            std::printf("%d,%d,%lld,%d,%d,%d,%.1f,%.1f,%zu,%.4f,%.4f,%.4f,%.1f,%d,%.1f,%.4f,%.4f,%.4f,%.4f\n",
+                        r.strokes, r.wetStrokes, r.vertices, r.width, r.height, r.frames, r.samplesPerFrame,
+                        r.uploadBytes, r.maxUploadBytes, r.brushCpuMs, r.brushGpuMs, r.bleedMs, r.wetTiles,
+                        r.canvasTiles, r.bleedUploadBytes, r.latencyMs, r.maxLatencyMs, r.frameP50Ms,
+                        r.frameP99Ms);
+        }
+    }
+    std::fflush(stdout);
+}
+
+#ifdef OKAMI_EGL
+EGLDisplay eglDisplay = EGL_NO_DISPLAY;
+EGLContext eglContext = EGL_NO_CONTEXT;
+
+bool createHeadlessContext() {
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = 
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay) {
+        eglDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    if (eglDisplay == EGL_NO_DISPLAY) {
+        eglDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+    EGLint major, minor;
+    if (eglDisplay == EGL_NO_DISPLAY || !eglInitialize(eglDisplay, &major, &minor)) {
+        std::cerr << "Failed to initialize EGL display" << std::endl;
+        return false;
+    }
+    
+    eglBindAPI(EGL_OPENGL_API);
+    const EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    // Surfaceless: no config and no surface, everything goes through FBOs
+    eglContext = eglCreateContext(eglDisplay, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, contextAttribs);
+    if (eglContext == EGL_NO_CONTEXT || 
+        !eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, eglContext)) {
+        std::cerr << "Failed to create surfaceless EGL context" << std::endl;
+        eglTerminate(eglDisplay);
+        return false;
+    }
+    
+    // GLX lookups fail without a display, so only load the GL entry points
+    glewExperimental = GL_TRUE;
+    if (glewContextInit() != GLEW_OK) {
+        std::cerr << "Failed to initialize GLEW" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void destroyHeadlessContext() {
+    eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(eglDisplay, eglContext);
+    eglTerminate(eglDisplay);
+}
+#else
+GLFWwindow* headlessWindow = NULL;
+
+bool createHeadlessContext() {
+    if (!glfwInit()) {
+        std::cerr << "Failed to initialize GLFW" << std::endl;
+        return false;
+    }
+    
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    
+    headlessWindow = glfwCreateWindow(64, 64, "Ōkami_Style_Bench", NULL, NULL);
+    if (!headlessWindow) {
+        std::cerr << "Failed to create hidden GLFW window "
+                  << "(rebuild with -DOKAMI_EGL -lEGL for display-less machines)" << std::endl;
+        glfwTerminate();
+        return false;
+    }
+    glfwMakeContextCurrent(headlessWindow);
+    
+    glewExperimental = GL_TRUE;
+    if (glewInit() != GLEW_OK) {
+        std::cerr << "Failed to initialize GLEW" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void destroyHeadlessContext() {
+    glfwDestroyWindow(headlessWindow);
+    glfwTerminate();
+}
+#endif
+
+// Every resolution x anti-aliasing mode x vertex format x crowd size x
+// stage x culling mode x lantern count, with the job system already
+// running. The software renderer only reads float vertices, does not
+// anti-alias, does not cull and has no lanterns, so it and --compare run
+// with the first vertex format and mode only. Returns the number of failed
+// comparisons.
+int benchmarkResolutions(const BenchOptions& options, double meshMs, double paperMs,
+                         std::vector<BenchResult>& results) {
+    int failures = 0;
+    AntiAliasing savedAntiAliasing = antiAliasing;
+    bool savedCulling = crowdCulling;
+    int savedLanterns = lanternCount;
+    bool savedClusters = lightClusters;
+    size_t lightModes = options.lights.size() * options.lightClusters.size();
+    for (size_t r = 0; r < options.resolutions.size(); ++r) {
+        int width = (int)options.resolutions[r].x;
+        int height = (int)options.resolutions[r].y;
+        
+        OffscreenTarget readback;
+        if (options.compare) {
+            readback = createOffscreenTarget(width, height, 0);
+        }
+        
+        for (size_t a = 0; a < options.antiAliasing.size(); ++a) {
+            antiAliasing = options.antiAliasing[a];
+            int samples = antiAliasingSamples(antiAliasing);
+            if (samples < ANTI_ALIASING_MODES[antiAliasing].samples) {
+                std::cerr << "  " << ANTI_ALIASING_MODES[antiAliasing].name << ": only " << samples 
+                          << " samples supported, skipped\n";
+                continue;
+            }
+            OffscreenTarget target = createOffscreenTarget(width, height, samples);
+            
+            for (size_t f = 0; f < options.vertexFormats.size(); ++f) {
+                if (options.vertexFormats[f] != bodyMesh.format) {
+                    deleteMeshBuffers(bodyMesh);
+                    setupMeshBuffers(bodyMesh, options.vertexFormats[f]);
+                }
+                for (size_t n = 0; n < options.instanceCounts.size(); ++n) {
+                    int instances = options.instanceCounts[n];
+                    for (size_t st = 0; st < options.stages.size(); ++st) {
+                        int stage = options.stages[st];
+                        if (options.compare && f == 0 && a == 0 &&
+                            !compareBackends(stage, instances, width, height, readback.fbo, options)) {
+                            ++failures;
+                        }
+                        size_t modes = options.culling.size() * lightModes;
+                        for (size_t b = 0; b < options.backends.size() * modes; ++b) {
+                            bool software = options.backends[b / modes] == BACKEND_CPU;
+                            size_t c = b % modes / lightModes;
+                            size_t l = b % lightModes;
+                            if (software && (f > 0 || a > 0)) continue;
+                            if ((software || instances == 0) && c > 0) continue;
+                            crowdCulling = options.culling[c];
+                            lanternCount = options.lights[l / options.lightClusters.size()];
+                            lightClusters = options.lightClusters[l % options.lightClusters.size()];
+                            if (software && lanternCount > 0) continue;
+                            if (lanternCount == 0 && l % options.lightClusters.size() > 0) continue;
+                            std::cerr << "  stage " << stage << " x" << std::max(instances, 1) 
+                                      << " @ " << width << "x" << height << " (" << (software ? 
+                                      "software" : vertexFormatName(bodyMesh.format)) << ", " 
+                                      << (software ? "none" : ANTI_ALIASING_MODES[antiAliasing].name)
+                                      << (software || instances == 0 ? "" : crowdCulling ? ", bvh" : ", no cull");
+                            if (lanternCount > 0) {
+                                std::cerr << ", " << lanternCount << (lightClusters ? " clustered" : " flat")
+                                          << " lanterns";
+                            }
+                            std::cerr << ")...\n";
+                            if (software) {
+                                results.push_back(benchmarkSoftwareStage(stage, instances, width, height, 
+                                                                         options));
+                            } else {
+                                results.push_back(benchmarkStage(stage, instances, width, height, 
+                                                                 target.fbo, options));
+                            }
+                            results.back().meshMs = meshMs;
+                            results.back().paperMs = paperMs;
+                            if (profilerHudVisible) {
+                                char label[48];
+                                std::snprintf(label, sizeof(label), "stage %d (%s)", stage, 
+                                              software ? "cpu" : "gl");
+                                printProfileSummary(label, options.frames);
+                            }
+                        }
+                    }
+                }
+            }
+            deleteOffscreenTarget(target);
+        }
+        
+        if (options.compare) {
+            deleteOffscreenTarget(readback);
+        }
+    }
+    antiAliasing = savedAntiAliasing;
+    crowdCulling = savedCulling;
+    lanternCount = savedLanterns;
+    lightClusters = savedClusters;
+    return failures;
+}
+
+int runBenchmark(const BenchOptions& options) {
+    if (!createHeadlessContext()) {
+        return -1;
+    }
+    
+    std::cerr << "Benchmark renderer: " << glGetString(GL_RENDERER) 
+              << " (" << glGetString(GL_VERSION) << ")\n";
+    
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_MULTISAMPLE);
+    
+    setupFrameUniforms();
+    
+    std::chrono::steady_clock::time_point shaderStart = std::chrono::steady_clock::now();
+    int fromCache = startStagePrograms();
+    finishStagePrograms();
+    reportShaderStartup(fromCache, millisecondsSince(shaderStart));
+    setupInkOutline();
+    setupBrushLayer();
+    setupInkBleed();
+    setupCelRamps();
+    setupClusteredLights();
+    measureProfilerOverhead();
+    
+    std::vector<BenchResult> results;
+    std::vector<BrushBenchResult> brushResults;
+    int failures = 0;
+    for (size_t t = 0; t < options.threadCounts.size(); ++t) {
+        startJobSystem(options.threadCounts[t]);
+        std::chrono::steady_clock::time_point meshStart = std::chrono::steady_clock::now();
+        startBodyMeshBuild(bodyShape);
+        waitForJobs(bodyMeshJob);
+        applyGLUploads();
+        double meshMs = millisecondsSince(meshStart);
+        std::cerr << "Job system: " << jobThreadCount() << " threads, body mesh in " 
+                  << meshMs << " ms\n";
+        startTomoeBake(bodyShape);
+        waitForJobs(tomoeBakeJob);
+        applyGLUploads();
+        
+        // Cold generation with this many threads; the texture itself comes
+        // from the cache when it can
+        if (paperGrain.texture == 0) {
+            setupPaperGrain();
+        }
+        PaperGrain scratch;
+        std::chrono::steady_clock::time_point paperStart = std::chrono::steady_clock::now();
+        generatePaperGrain(paperSeed, scratch);
+        double paperMs = millisecondsSince(paperStart);
+        std::cerr << "Paper grain: generated in " << paperMs << " ms on " << jobThreadCount() 
+                  << " threads\n";
+        
+        if (options.brushStrokes.empty()) {
+            failures += benchmarkResolutions(options, meshMs, paperMs, results);
+        } else {
+            benchmarkBrush(options, brushResults);
+        }
+        stopJobSystem();
+    }
+    
+    if (options.brushStrokes.empty()) {
+        printBenchResults(results, options.format);
+    } else {
+        printBrushResults(brushResults, options.format);
+    }
+    if (!traceOutputPath.empty()) {
+        flushGpuQuerySets();
+        reportChromeTrace(traceOutputPath);
+    }
+    
+    deleteStagePrograms();
+    deleteProfilerQueries();
+    deleteInkOutline();
+    deleteBrushLayer();
+    deleteInkBleed();
+    deleteCelRamps();
+    deleteClusteredLights();
+    deleteDynamicResolution();
+    deletePostAntiAliasing();
+    deletePaperGrain();
+    deleteTomoeAtlas();
+    deleteInstanceRing();
+    deleteCrowdIndirect();
+    deleteFrameUniforms();
+    deleteMeshBuffers(bodyMesh);
+    unmapFile(bodyMesh.mapping);
+    destroyHeadlessContext();
+    if (failures > 0) {
+        std::cerr << failures << " software/GL comparisons over tolerance\n";
+        return 1;
+    }
+    return 0;
+}
+
+// ─── Image encoders ───────────────────────────────────────────────
+//
+// Frames arrive as bottom-up RGBA8 (glReadPixels order) and are written
+// top-down. PNG uses the Up filter and a self-contained deflate with
+// fixed Huffman codes and greedy LZ77, which is enough for the flat paper
+// background; raw is packed RGB8; Y4M is 4:2:0 BT.601 for piping into
+// encoders.
+
+unsigned int crc32Table[256];
+
+void initCrc32Table() {
+    for (unsigned int n = 0; n < 256; ++n) {
+        unsigned int c = n;
+        for (int k = 0; k < 8; ++k) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        crc32Table[n] = c;
+    }
+}
+
+unsigned int crc32(const unsigned char* data, size_t size, unsigned int crc) {
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) crc = crc32Table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+void appendBigEndian(std::vector<unsigned char>& out, unsigned int value) {
+    out.push_back((unsigned char)(value >> 24));
+    out.push_back((unsigned char)(value >> 16));
+    out.push_back((unsigned char)(value >> 8));
+    out.push_back((unsigned char)value);
+}
+
+// Deflate writes bits LSB first; Huffman codes go in MSB first
+struct BitWriter {
+    std::vector<unsigned char>& out;
+    unsigned int buffer;
+    int count;
+    explicit BitWriter(std::vector<unsigned char>& target) : out(target), buffer(0), count(0) {}
+
+    void put(unsigned int bits, int n) {
+        buffer |= bits << count;
+        count += n;
+        while (count >= 8) {
+            out.push_back((unsigned char)buffer);
+            buffer >>= 8;
+            count -= 8;
+        }
+    }
+
+    void putCode(unsigned int code, int n) {
+        unsigned int reversed = 0;
+        for (int i = 0; i < n; ++i) reversed |= ((code >> i) & 1) << (n - 1 - i);
+        put(reversed, n);
+    }
+
+    void flush() {
+        if (count > 0) out.push_back((unsigned char)buffer);
+        buffer = 0;
+        count = 0;
+    }
+};
+
+void putFixedLiteral(BitWriter& bits, int symbol) {
+    if (symbol < 144) bits.putCode(0x30 + symbol, 8);
+    else if (symbol < 256) bits.putCode(0x190 + symbol - 144, 9);
+    else if (symbol < 280) bits.putCode(symbol - 256, 7);
+    else bits.putCode(0xc0 + symbol - 280, 8);
+}
 
-glm::vec3 cameraPos = glm::vec3(0.0f, 0.5f, 3.0f);
-glm::vec3 cameraTarget = glm::vec3(0.0f, 0.0f, 0.0f);
+const int LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                              35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+const int LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                               3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+const int DISTANCE_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+                                8193, 12289, 16385, 24577 };
+const int DISTANCE_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
 
-// Mouse control variables
-bool mousePressed = false;
-double lastMouseX = 0.0;
-double lastMouseY = 0.0;
-float cameraAngleX = 0.0f;  // Horizontal rotation
-float cameraAngleY = 0.0f;  // Vertical rotation
-float cameraDistance = 3.0f;
+void putMatch(BitWriter& bits, int length, int distance) {
+    int l = 28;
+    while (LENGTH_BASE[l] > length) --l;
+    putFixedLiteral(bits, 257 + l);
+    bits.put(length - LENGTH_BASE[l], LENGTH_EXTRA[l]);
+    int d = 29;
+    while (DISTANCE_BASE[d] > distance) --d;
+    bits.putCode(d, 5);
+    bits.put(distance - DISTANCE_BASE[d], DISTANCE_EXTRA[d]);
+}
 
-struct Vertex {
-    glm::vec3 position;
-    glm::vec3 normal;
-};
+// zlib stream with a single fixed-Huffman block
+void deflateFixed(const unsigned char* data, size_t size, std::vector<unsigned char>& out) {
+    const int WINDOW = 32768;
+    const int HASH_SIZE = 1 << 15;
+    const int MAX_CHAIN = 16;
+    const int MIN_MATCH = 3;
+    const int MAX_MATCH = 258;
 
-std::vector<Vertex> eggVertices;
-std::vector<unsigned int> eggIndices;
+    out.push_back(0x78);
+    out.push_back(0x01);
+    BitWriter bits(out);
+    bits.put(1, 1);                     // final block
+    bits.put(1, 2);                     // fixed Huffman
 
-void createEgg() {
-    int stacks = 40;
-    int slices = 40;
+    std::vector<int> head(HASH_SIZE, -1);
+    std::vector<int> previous(WINDOW, -1);
+    size_t pos = 0;
+    while (pos < size) {
+        int bestLength = 0;
+        int bestDistance = 0;
+        if (pos + MIN_MATCH <= size) {
+            unsigned int hash = ((data[pos] << 10) ^ (data[pos + 1] << 5) ^ data[pos + 2]) & (HASH_SIZE - 1);
+            int candidate = head[hash];
+            int limit = (int)std::min((size_t)MAX_MATCH, size - pos);
+            for (int chain = 0; candidate >= 0 && chain < MAX_CHAIN; ++chain) {
+                int distance = (int)pos - candidate;
+                if (distance > WINDOW - 1) break;
+                int length = 0;
+                while (length < limit && data[candidate + length] == data[pos + length]) ++length;
+                if (length > bestLength) {
+                    bestLength = length;
+                    bestDistance = distance;
+                    if (length == limit) break;
+                }
+                candidate = previous[candidate & (WINDOW - 1)];
+            }
+        }
 
-    for (int i = 0; i <= stacks; ++i) {
-        float V = i / (float)stacks;
-        float phi = V * M_PI;
+        int advance = bestLength >= MIN_MATCH ? bestLength : 1;
+        if (bestLength >= MIN_MATCH) {
+            putMatch(bits, bestLength, bestDistance);
+        } else {
+            putFixedLiteral(bits, data[pos]);
+        }
+        for (int i = 0; i < advance; ++i, ++pos) {
+            if (pos + MIN_MATCH > size) continue;
+            unsigned int hash = ((data[pos] << 10) ^ (data[pos + 1] << 5) ^ data[pos + 2]) & (HASH_SIZE - 1);
+            previous[pos & (WINDOW - 1)] = head[hash];
+            head[hash] = (int)pos;
+        }
+    }
+    putFixedLiteral(bits, 256);
+    bits.flush();
 
-        for (int j = 0; j <= slices; ++j) {
-            float U = j / (float)slices;
-            float theta = U * 2.0f * M_PI;
+    unsigned int a = 1, b = 0;
+    for (size_t i = 0; i < size; ++i) {
+        a = (a + data[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    appendBigEndian(out, (b << 16) | a);
+}
 
-            float radiusScale = 0.6f + 0.2f * sin(phi);
-            float x = radiusScale * cos(theta) * sin(phi);
-            float y = 1.0f * cos(phi);
-            float z = radiusScale * sin(theta) * sin(phi);
+void appendPngChunk(std::vector<unsigned char>& png, const char* type,
+                    const std::vector<unsigned char>& data) {
+    appendBigEndian(png, (unsigned int)data.size());
+    size_t start = png.size();
+    png.insert(png.end(), type, type + 4);
+    png.insert(png.end(), data.begin(), data.end());
+    appendBigEndian(png, crc32(&png[start], png.size() - start, 0));
+}
 
-            Vertex vertex;
-            vertex.position = glm::vec3(x, y, z);
+void encodePng(const unsigned char* rgba, int width, int height, std::vector<unsigned char>& png) {
+    size_t stride = (size_t)width * 3 + 1;
+    std::vector<unsigned char> filtered(stride * height);
+    for (int y = 0; y < height; ++y) {
+        const unsigned char* row = rgba + (size_t)(height - 1 - y) * width * 4;
+        const unsigned char* above = rgba + (size_t)(height - y) * width * 4;
+        unsigned char* out = &filtered[y * stride];
+        out[0] = y == 0 ? 0 : 2;        // None, then Up
+        for (int x = 0; x < width; ++x) {
+            for (int c = 0; c < 3; ++c) {
+                unsigned char up = y == 0 ? 0 : above[x * 4 + c];
+                out[1 + x * 3 + c] = (unsigned char)(row[x * 4 + c] - up);
+            }
+        }
+    }
 
-            glm::vec3 normalDir = glm::vec3(
-                x / (radiusScale * radiusScale),
-                y / 1.0f,
-                z / (radiusScale * radiusScale)
-            );
-            vertex.normal = glm::normalize(normalDir);
-            eggVertices.push_back(vertex);
+    static const unsigned char SIGNATURE[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    png.assign(SIGNATURE, SIGNATURE + 8);
+    std::vector<unsigned char> header;
+    appendBigEndian(header, width);
+    appendBigEndian(header, height);
+    const unsigned char format[5] = { 8, 2, 0, 0, 0 };     // 8-bit RGB, no interlace
+    header.insert(header.end(), format, format + 5);
+    appendPngChunk(png, "IHDR", header);
+
+    std::vector<unsigned char> compressed;
+    deflateFixed(&filtered[0], filtered.size(), compressed);
+    appendPngChunk(png, "IDAT", compressed);
+    appendPngChunk(png, "IEND", std::vector<unsigned char>());
+}
+
+void encodeRaw(const unsigned char* rgba, int width, int height, std::vector<unsigned char>& raw) {
+    raw.resize((size_t)width * height * 3);
+    for (int y = 0; y < height; ++y) {
+        const unsigned char* row = rgba + (size_t)(height - 1 - y) * width * 4;
+        unsigned char* out = &raw[(size_t)y * width * 3];
+        for (int x = 0; x < width; ++x) {
+            out[x * 3] = row[x * 4];
+            out[x * 3 + 1] = row[x * 4 + 1];
+            out[x * 3 + 2] = row[x * 4 + 2];
         }
     }
+}
 
-    for (int i = 0; i < stacks; ++i) {
-        for (int j = 0; j < slices; ++j) {
-            int first = i * (slices + 1) + j;
-            int second = first + slices + 1;
+// One Y4M FRAME: limited-range BT.601, chroma averaged over 2x2 blocks
+void encodeY4mFrame(const unsigned char* rgba, int width, int height, std::vector<unsigned char>& frame) {
+    int chromaWidth = (width + 1) / 2;
+    int chromaHeight = (height + 1) / 2;
+    const char* tag = "FRAME\n";
+    frame.assign(tag, tag + 6);
+    size_t lumaStart = frame.size();
+    frame.resize(lumaStart + (size_t)width * height + 2 * (size_t)chromaWidth * chromaHeight);
+    unsigned char* luma = &frame[lumaStart];
+    unsigned char* cb = luma + (size_t)width * height;
+    unsigned char* cr = cb + (size_t)chromaWidth * chromaHeight;
+
+    for (int y = 0; y < height; ++y) {
+        const unsigned char* row = rgba + (size_t)(height - 1 - y) * width * 4;
+        for (int x = 0; x < width; ++x) {
+            int r = row[x * 4], g = row[x * 4 + 1], b = row[x * 4 + 2];
+            luma[(size_t)y * width + x] = (unsigned char)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+        }
+    }
+    for (int cy = 0; cy < chromaHeight; ++cy) {
+        for (int cx = 0; cx < chromaWidth; ++cx) {
+            int r = 0, g = 0, b = 0;
+            for (int i = 0; i < 4; ++i) {
+                int x = std::min(cx * 2 + (i & 1), width - 1);
+                int y = std::min(cy * 2 + (i >> 1), height - 1);
+                const unsigned char* p = rgba + ((size_t)(height - 1 - y) * width + x) * 4;
+                r += p[0];
+                g += p[1];
+                b += p[2];
+            }
+            r /= 4;
+            g /= 4;
+            b /= 4;
+            cb[(size_t)cy * chromaWidth + cx] = (unsigned char)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+            cr[(size_t)cy * chromaWidth + cx] = (unsigned char)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+        }
+    }
+}
+
+// ─── Turntable batch render ───────────────────────────────────────
+//
+// --turntable N renders N frames of one full stage 5 revolution headless
+// and writes them to disk or streams them to stdout. Each frame is read back
+// into one slot of a ring of pixel pack buffers, persistently mapped when
+// ARB_buffer_storage is available, and fenced. The main thread keeps
+// rendering while earlier slots complete. A signaled slot is handed to a
+// job that encodes and writes it, and the slot is reused once that job is
+// done. Y4M frames finish out of order and are written in order.
+
+enum OutputFormat {
+    OUTPUT_PNG,
+    OUTPUT_RAW,
+    OUTPUT_Y4M
+};
+
+struct ReadbackSlot {
+    GLuint buffer = 0;
+    const unsigned char* persistent = nullptr;
+    std::vector<unsigned char> staging;     // copy when not persistent, or software frames
+    GLsync fence = 0;
+    int frame = -1;                         // frame waiting for its fence, -1 when dispatched
+    JobCounter encoding;
+};
+
+struct TurntableOutput {
+    OutputFormat format;
+    std::string path;                       // printf pattern for PNG/raw
+    FILE* stream = nullptr;                 // Y4M
+    int width = 0;
+    int height = 0;
+    std::mutex orderMutex;
+    std::map<int, std::vector<unsigned char> > pending;
+    int nextFrame = 0;
+    std::atomic<int> errors;
+    std::atomic<unsigned long long> bytesWritten;
+    TurntableOutput() : errors(0), bytesWritten(0) {}
+};
+
+std::vector<ReadbackSlot*> readbackSlots;
+unsigned long long readbackStalls = 0;      // fence not yet signaled when a slot was needed
+unsigned long long encoderWaits = 0;        // slot still being encoded when it was needed
 
-            eggIndices.push_back(first);
-            eggIndices.push_back(second);
-            eggIndices.push_back(first + 1);
+bool outputFormatFor(const std::string& path, OutputFormat& format) {
+    if (path == "-") {
+        format = OUTPUT_Y4M;
+        return true;
+    }
+    size_t dot = path.rfind('.');
+    std::string extension = dot == std::string::npos ? "" : path.substr(dot);
+    if (extension == ".png") format = OUTPUT_PNG;
+    else if (extension == ".raw") format = OUTPUT_RAW;
+    else if (extension == ".y4m") format = OUTPUT_Y4M;
+    else return false;
+    return true;
+}
+
+// PNG/raw paths are printf patterns for the frame number: exactly one
+// %d or %i conversion (flags and width allowed) and no other % but %%
+bool isFramePattern(const std::string& path) {
+    int conversions = 0;
+    for (size_t i = 0; i < path.size(); ++i) {
+        if (path[i] != '%') continue;
+        if (++i < path.size() && path[i] == '%') continue;
+        while (i < path.size() && std::strchr("0-+ #", path[i])) ++i;
+        while (i < path.size() && std::isdigit((unsigned char)path[i])) ++i;
+        if (i >= path.size() || (path[i] != 'd' && path[i] != 'i')) return false;
+        ++conversions;
+    }
+    return conversions == 1;
+}
 
-            eggIndices.push_back(second);
-            eggIndices.push_back(second + 1);
-            eggIndices.push_back(first + 1);
+void writeTurntableFrame(TurntableOutput& output, int frame, const unsigned char* rgba) {
+    ProfileScope scope("encode");
+    std::vector<unsigned char> encoded;
+    if (output.format == OUTPUT_Y4M) {
+        encodeY4mFrame(rgba, output.width, output.height, encoded);
+        std::lock_guard<std::mutex> lock(output.orderMutex);
+        output.pending[frame].swap(encoded);
+        while (!output.pending.empty() && output.pending.begin()->first == output.nextFrame) {
+            std::vector<unsigned char>& next = output.pending.begin()->second;
+            if (std::fwrite(&next[0], 1, next.size(), output.stream) != next.size()) ++output.errors;
+            output.bytesWritten += next.size();
+            output.pending.erase(output.pending.begin());
+            ++output.nextFrame;
         }
+        return;
+    }
+
+    if (output.format == OUTPUT_PNG) {
+        encodePng(rgba, output.width, output.height, encoded);
+    } else {
+        encodeRaw(rgba, output.width, output.height, encoded);
+    }
+    char name[4096];
+    std::snprintf(name, sizeof(name), output.path.c_str(), frame);
+    FILE* file = std::fopen(name, "wb");
+    if (!file || std::fwrite(&encoded[0], 1, encoded.size(), file) != encoded.size()) {
+        ++output.errors;
     }
+    if (file) std::fclose(file);
+    output.bytesWritten += encoded.size();
 }
 
-const char* getVertexShader() {
-    return R"(
-        #version 330 core
-        layout (location = 0) in vec3 aPos;
-        layout (location = 1) in vec3 aNormal;
-        
-        out vec3 FragPos;
-        out vec3 Normal;
-        out vec3 WorldPos;
-        
-        uniform mat4 model;
-        uniform mat4 view;
-        uniform mat4 projection;
-        
-        void main() {
-            FragPos = vec3(model * vec4(aPos, 1.0));
-            Normal = mat3(transpose(inverse(model))) * aNormal;
-            WorldPos = aPos;
-            gl_Position = projection * view * vec4(FragPos, 1.0);
+void createReadbackSlots(int count, size_t frameBytes) {
+    for (int i = 0; i < count; ++i) {
+        ReadbackSlot* slot = new ReadbackSlot;
+        glGenBuffers(1, &slot->buffer);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->buffer);
+        if (GLEW_ARB_buffer_storage) {
+            GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_PIXEL_PACK_BUFFER, frameBytes, NULL, flags);
+            slot->persistent = (const unsigned char*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+                                                                      frameBytes, flags);
+        } else {
+            glBufferData(GL_PIXEL_PACK_BUFFER, frameBytes, NULL, GL_STREAM_READ);
         }
-    )";
+        readbackSlots.push_back(slot);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
 }
 
-const char* getFragmentShader(int stage) {
-    switch(stage) {
-        case 0: // Basic 3D
-            return R"(
-                #version 330 core
-                in vec3 FragPos;
-                in vec3 Normal;
-                out vec4 FragColor;
-                
-                uniform vec3 lightPos;
-                
-                void main() {
-                    vec3 norm = normalize(Normal);
-                    vec3 lightDir = normalize(lightPos - FragPos);
-                    float diff = max(dot(norm, lightDir), 0.0);
-                    
-                    vec3 ambient = vec3(0.3);
-                    vec3 diffuse = diff * vec3(0.6);
-                    vec3 result = (ambient + diffuse) * vec3(0.5, 0.5, 0.5);
-                    
-                    FragColor = vec4(result, 1.0);
-                }
-            )";
-            
-        case 1: // Cel shading - warm natural tones
-            return R"(
-                #version 330 core
-                in vec3 FragPos;
-                in vec3 Normal;
-                out vec4 FragColor;
-                
-                uniform vec3 lightPos;
-                
-                void main() {
-                    vec3 norm = normalize(Normal);
-                    vec3 lightDir = normalize(lightPos - FragPos);
-                    float diff = max(dot(norm, lightDir), 0.0);
-                    
-                    // Clear 3-tone cel shading
-                    if (diff > 0.7) diff = 1.0;
-                    else if (diff > 0.3) diff = 0.58;
-                    else diff = 0.3;
-                    
-                    // Warm cream/ivory (natural, not harsh)
-                    vec3 baseColor = vec3(0.96, 0.94, 0.87);
-                    vec3 color = baseColor * diff;
-                    
-                    FragColor = vec4(color, 1.0);
-                }
-            )";
-            
-        case 2: // Sumi-e outlines - THICK and dramatic
-            return R"(
-                #version 330 core
-                in vec3 FragPos;
-                in vec3 Normal;
-                out vec4 FragColor;
-                
-                uniform vec3 lightPos;
-                uniform vec3 viewPos;
-                
-                void main() {
-                    vec3 norm = normalize(Normal);
-                    vec3 viewDir = normalize(viewPos - FragPos);
-                    
-                    // THICK edge detection
-                    float edge = 1.0 - abs(dot(norm, viewDir));
-                    edge = pow(edge, 1.7);
-                    
-                    // Cel shading
-                    vec3 lightDir = normalize(lightPos - FragPos);
-                    float diff = max(dot(norm, lightDir), 0.0);
-                    if (diff > 0.7) diff = 1.0;
-                    else if (diff > 0.3) diff = 0.58;
-                    else diff = 0.3;
-                    
-                    vec3 baseColor = vec3(0.96, 0.94, 0.87);
-                    vec3 color = baseColor * diff;
-                    
-                    // VERY THICK outlines (lower threshold)
-                    if (edge > 0.24) {
-                        color = vec3(0.07, 0.07, 0.07);
-                    }
-                    
-                    FragColor = vec4(color, 1.0);
-                }
-            )";
-            
-        case 3: // Red tomoe - CONTROLLED patterns
-            return R"(
-                #version 330 core
-                in vec3 FragPos;
-                in vec3 Normal;
-                in vec3 WorldPos;
-                out vec4 FragColor;
-                
-                uniform vec3 lightPos;
-                uniform vec3 viewPos;
-                
-                void main() {
-                    vec3 norm = normalize(Normal);
-                    vec3 viewDir = normalize(viewPos - FragPos);
-                    
-                    float edge = 1.0 - abs(dot(norm, viewDir));
-                    edge = pow(edge, 1.7);
-                    
-                    vec3 lightDir = normalize(lightPos - FragPos);
-                    float diff = max(dot(norm, lightDir), 0.0);
-                    if (diff > 0.7) diff = 1.0;
-                    else if (diff > 0.3) diff = 0.58;
-                    else diff = 0.3;
-                    
-                    vec3 baseColor = vec3(0.96, 0.94, 0.87);
-                    vec3 color = baseColor * diff;
-                    
-                    // CONTROLLED red patterns (not too much!)
-                    float angle = atan(WorldPos.z, WorldPos.x);
-                    float radius = length(vec2(WorldPos.x, WorldPos.z));
-                    
-                    // Main spiral (thinner, more selective)
-                    float spiral = sin(angle * 3.5 - radius * 6.5);
-                    
-                    // Small circular accents
-                    float spots = sin(WorldPos.y * 7.0) * cos(angle * 4.0);
-                    
-                    // MUCH higher thresholds = less red coverage
-                    if (spiral > 0.82 || spots > 0.88) {
-                        // Deeper red (not too bright)
-                        vec3 redPattern = vec3(0.82, 0.12, 0.14);
-                        color = mix(color, redPattern, 0.75);
-                    }
-                    
-                    if (edge > 0.24) {
-                        color = vec3(0.07, 0.07, 0.07);
-                    }
-                    
-                    FragColor = vec4(color, 1.0);
-                }
-            )";
-            
-        case 4: // Full balanced style
-            return R"(
-                #version 330 core
-                in vec3 FragPos;
-                in vec3 Normal;
-                in vec3 WorldPos;
-                out vec4 FragColor;
-                
-                uniform vec3 lightPos;
-                uniform vec3 viewPos;
-                
-                void main() {
-                    vec3 norm = normalize(Normal);
-                    vec3 viewDir = normalize(viewPos - FragPos);
-                    
-                    float edge = 1.0 - abs(dot(norm, viewDir));
-                    edge = pow(edge, 1.7);
-                    
-                    // Richer cel shading (4 tones)
-                    vec3 lightDir = normalize(lightPos - FragPos);
-                    float diff = max(dot(norm, lightDir), 0.0);
-                    if (diff > 0.8) diff = 1.0;
-                    else if (diff > 0.5) diff = 0.7;
-                    else if (diff > 0.25) diff = 0.45;
-                    else diff = 0.25;
-                    
-                    // Warm base with subtle variation
-                    vec3 baseColor = vec3(0.97, 0.95, 0.88);
-                    vec3 color = baseColor * diff;
-                    
-                    // CONTROLLED red patterns
-                    float angle = atan(WorldPos.z, WorldPos.x);
-                    float radius = length(vec2(WorldPos.x, WorldPos.z));
-                    float spiral = sin(angle * 3.5 - radius * 6.5);
-                    float spots = sin(WorldPos.y * 7.0) * cos(angle * 4.0);
-                    
-                    if (spiral > 0.82 || spots > 0.88) {
-                        vec3 redPattern = vec3(0.84, 0.11, 0.14);
-                        color = mix(color, redPattern, 0.78);
-                    }
-                    
-                    // Paper texture (subtle)
-                    float noise1 = fract(sin(dot(FragPos.xy, vec2(12.9898, 78.233))) * 43758.5453);
-                    float noise2 = fract(sin(dot(FragPos.yz, vec2(93.9898, 67.345))) * 28451.3547);
-                    color += vec3((noise1 + noise2) * 0.02);
-                    
-                    // Subtle color variation
-                    float variation = sin(WorldPos.y * 20.0) * 0.015;
-                    color += vec3(variation, variation * 0.8, variation * 0.6);
-                    
-                    // Thick outlines with variation
-                    if (edge > 0.24) {
-                        float inkVar = noise1 * 0.05;
-                        color = vec3(0.07 + inkVar);
-                    }
-                    
-                    FragColor = vec4(color, 1.0);
-                }
-            )";
-            
-        default:
-            return getFragmentShader(4);
+void deleteReadbackSlots() {
+    for (size_t i = 0; i < readbackSlots.size(); ++i) {
+        ReadbackSlot* slot = readbackSlots[i];
+        waitForJobs(slot->encoding);
+        if (slot->fence) glDeleteSync(slot->fence);
+        if (slot->persistent) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->buffer);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glDeleteBuffers(1, &slot->buffer);
+        delete slot;
     }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    readbackSlots.clear();
 }
 
-GLuint compileShader(const char* source, GLenum type) {
-    GLuint shader = glCreateShader(type);
-    glShaderSource(shader, 1, &source, NULL);
-    glCompileShader(shader);
-    
-    int success;
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
-    if (!success) {
-        char infoLog[512];
-        glGetShaderInfoLog(shader, 512, NULL, infoLog);
-        std::cerr << "Shader compilation failed: " << infoLog << std::endl;
+// Hands a slot whose readback has landed to an encoder job
+void dispatchReadback(ReadbackSlot& slot, TurntableOutput& output) {
+    glDeleteSync(slot.fence);
+    slot.fence = 0;
+    const unsigned char* pixels = slot.persistent;
+    if (!pixels) {
+        size_t bytes = (size_t)output.width * output.height * 4;
+        slot.staging.resize(bytes);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+        const void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT);
+        std::memcpy(&slot.staging[0], mapped, bytes);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        pixels = &slot.staging[0];
     }
-    
-    return shader;
+    int frame = slot.frame;
+    slot.frame = -1;
+    TurntableOutput* target = &output;
+    submitJob([target, frame, pixels] { writeTurntableFrame(*target, frame, pixels); }, slot.encoding);
 }
 
-GLuint createShaderProgram(int stage) {
-    GLuint vertexShader = compileShader(getVertexShader(), GL_VERTEX_SHADER);
-    GLuint fragmentShader = compileShader(getFragmentShader(stage), GL_FRAGMENT_SHADER);
-    
-    GLuint program = glCreateProgram();
-    glAttachShader(program, vertexShader);
-    glAttachShader(program, fragmentShader);
-    glLinkProgram(program);
-    
-    int success;
-    glGetProgramiv(program, GL_LINK_STATUS, &success);
-    if (!success) {
-        char infoLog[512];
-        glGetProgramInfoLog(program, 512, NULL, infoLog);
-        std::cerr << "Program linking failed: " << infoLog << std::endl;
+// Dispatches every slot whose fence has already signaled, without blocking
+void pollReadbacks(TurntableOutput& output) {
+    for (size_t i = 0; i < readbackSlots.size(); ++i) {
+        ReadbackSlot& slot = *readbackSlots[i];
+        if (slot.frame >= 0 && glClientWaitSync(slot.fence, 0, 0) != GL_TIMEOUT_EXPIRED) {
+            dispatchReadback(slot, output);
+        }
     }
-    
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
-    
-    return program;
 }
 
-void updateCameraPosition() {
-    // Calculate camera position based on angles
-    float x = cameraDistance * cos(cameraAngleY) * sin(cameraAngleX);
-    float y = cameraDistance * sin(cameraAngleY) + 0.5f;
-    float z = cameraDistance * cos(cameraAngleY) * cos(cameraAngleX);
-    
-    cameraPos = glm::vec3(x, y, z);
+// Makes a slot free for a new frame, waiting only if it is still in flight
+void reclaimReadback(ReadbackSlot& slot, TurntableOutput& output) {
+    if (slot.frame >= 0) {
+        if (glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED) {
+            ++readbackStalls;
+            glClientWaitSync(slot.fence, 0, GL_TIMEOUT_IGNORED);
+        }
+        dispatchReadback(slot, output);
+    }
+    if (slot.encoding.pending.load() > 0) {
+        ++encoderWaits;
+        waitForJobs(slot.encoding);
+    }
 }
 
-void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods) {
-    if (button == GLFW_MOUSE_BUTTON_LEFT) {
-        if (action == GLFW_PRESS) {
-            mousePressed = true;
-            glfwGetCursorPos(window, &lastMouseX, &lastMouseY);
-        } else if (action == GLFW_RELEASE) {
-            mousePressed = false;
+int runTurntable(const BenchOptions& options) {
+    TurntableOutput output;
+    if (!outputFormatFor(options.outputPath, output.format)) {
+        std::cerr << "Unknown output format for " << options.outputPath
+                  << " (use .png, .raw, .y4m or - for Y4M on stdout)" << std::endl;
+        return -1;
+    }
+    if (output.format != OUTPUT_Y4M && !isFramePattern(options.outputPath)) {
+        std::cerr << "Output path " << options.outputPath << " needs exactly one frame number conversion "
+                  << "such as %04d (write a literal % as %%)" << std::endl;
+        return -1;
+    }
+    output.path = options.outputPath;
+    output.width = (int)options.resolutions[0].x;
+    output.height = (int)options.resolutions[0].y;
+    int stage = options.stages.back();      // stage 5 unless --stages picks one
+    bool software = options.backends[0] == BACKEND_CPU;
+
+    size_t slash = output.path.rfind('/');
+    if (output.path != "-" && slash != std::string::npos && !makeDirectories(output.path.substr(0, slash))) {
+        std::cerr << "Cannot create " << output.path.substr(0, slash) << std::endl;
+        return -1;
+    }
+    if (output.format == OUTPUT_Y4M) {
+        output.stream = output.path == "-" ? stdout : std::fopen(output.path.c_str(), "wb");
+        if (!output.stream) {
+            std::cerr << "Cannot open " << output.path << std::endl;
+            return -1;
+        }
+        std::fprintf(output.stream, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n",
+                     output.width, output.height, options.fps);
+    }
+    initCrc32Table();
+
+    if (!createHeadlessContext()) {
+        return -1;
+    }
+    std::cerr << "Turntable renderer: " << (software ? "software" : (const char*)glGetString(GL_RENDERER))
+              << ", stage " << stage << ", " << options.turntableFrames << " frames @ "
+              << output.width << "x" << output.height << "\n";
+
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_MULTISAMPLE);
+    setupFrameUniforms();
+    startStagePrograms();
+    finishStagePrograms();
+    setupInkOutline();
+    setupCelRamps();
+    setupClusteredLights();
+    startJobSystem(options.threadCounts[0]);
+    startBodyMeshBuild(bodyShape);
+    startTomoeBake(bodyShape);
+    waitForJobs(bodyMeshJob);
+    waitForJobs(tomoeBakeJob);
+    applyGLUploads();
+    setupPaperGrain();
+
+    OffscreenTarget target = createOffscreenTarget(output.width, output.height, 
+                                                   antiAliasingSamples(antiAliasing));
+    OffscreenTarget resolve = createOffscreenTarget(output.width, output.height, 0);
+    size_t frameBytes = (size_t)output.width * output.height * 4;
+    // Enough slots to keep every encoder busy plus frames in flight on the GPU
+    createReadbackSlots(jobThreadCount() + 2, frameBytes);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < options.turntableFrames; ++frame) {
+        beginProfileFrame();
+        ReadbackSlot& slot = *readbackSlots[frame % readbackSlots.size()];
+        reclaimReadback(slot, output);
+        rotationAngle = 2.0f * (float)M_PI * frame / options.turntableFrames;
+
+        if (software) {
+            renderSoftware(stage, output.width, output.height, softwareTarget);
+            slot.staging.resize(frameBytes);
+            std::memcpy(&slot.staging[0], &softwareTarget.color[0], frameBytes);
+            const unsigned char* pixels = &slot.staging[0];
+            TurntableOutput* out = &output;
+            submitJob([out, frame, pixels] { writeTurntableFrame(*out, frame, pixels); }, slot.encoding);
+            endProfileFrame();
+            continue;
+        }
+
+        renderFrame(stage, output.width, output.height, frame / (float)options.fps, target.fbo,
+                    fixedRenderScale);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, target.fbo);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, resolve.fbo);
+        glBlitFramebuffer(0, 0, output.width, output.height, 0, 0, output.width, output.height,
+                          GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, resolve.fbo);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, output.width, output.height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        slot.frame = frame;
+        glFlush();
+
+        pollReadbacks(output);
+        endProfileFrame();
+    }
+    for (size_t i = 0; i < readbackSlots.size(); ++i) {
+        ReadbackSlot& slot = *readbackSlots[i];
+        if (slot.frame >= 0) {
+            glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+            dispatchReadback(slot, output);
         }
     }
+    deleteReadbackSlots();      // waits for the remaining encoders
+    double seconds = millisecondsSince(start) / 1000.0;
+
+    if (output.stream && output.stream != stdout) std::fclose(output.stream);
+    else if (output.stream) std::fflush(output.stream);
+
+    std::fprintf(stderr, "Turntable: %d frames in %.2f s (%.1f fps), %.1f MB written, "
+                 "%llu readback stalls, %llu encoder waits\n",
+                 options.turntableFrames, seconds, options.turntableFrames / std::max(seconds, 1e-9),
+                 output.bytesWritten / (1024.0 * 1024.0), readbackStalls, encoderWaits);
+    if (!traceOutputPath.empty()) {
+        flushGpuQuerySets();
+        reportChromeTrace(traceOutputPath);
+    }
+
+    deleteOffscreenTarget(target);
+    deleteOffscreenTarget(resolve);
+    stopJobSystem();
+    deleteStagePrograms();
+    deleteProfilerQueries();
+    deleteInkOutline();
+    deleteCelRamps();
+    deleteClusteredLights();
+    deleteDynamicResolution();
+    deletePostAntiAliasing();
+    deletePaperGrain();
+    deleteTomoeAtlas();
+    deleteInstanceRing();
+    deleteCrowdIndirect();
+    deleteFrameUniforms();
+    deleteMeshBuffers(bodyMesh);
+    unmapFile(bodyMesh.mapping);
+    destroyHeadlessContext();
+    if (output.errors > 0) {
+        std::cerr << output.errors << " frames could not be written" << std::endl;
+        return 1;
+    }
+    return 0;
 }
 
-void cursorPosCallback(GLFWwindow* window, double xpos, double ypos) {
-    if (mousePressed) {
-        double deltaX = xpos - lastMouseX;
-        double deltaY = ypos - lastMouseY;
-        
-        // Update camera angles based on mouse movement
-        cameraAngleX += deltaX * 0.005f;  // Horizontal rotation
-        cameraAngleY -= deltaY * 0.005f;  // Vertical rotation (inverted)
-        
-        // Clamp vertical angle to prevent flipping
-        if (cameraAngleY > M_PI / 2.0f - 0.1f) cameraAngleY = M_PI / 2.0f - 0.1f;
-        if (cameraAngleY < -M_PI / 2.0f + 0.1f) cameraAngleY = -M_PI / 2.0f + 0.1f;
-        
-        updateCameraPosition();
-        
-        lastMouseX = xpos;
-        lastMouseY = ypos;
+bool parseResolutions(const char* text, std::vector<glm::vec2>& out) {
+    std::string list(text);
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) end = list.size();
+        int w = 0, h = 0;
+        if (std::sscanf(list.substr(start, end - start).c_str(), "%dx%d", &w, &h) != 2 || 
+            w <= 0 || h <= 0) {
+            return false;
+        }
+        out.push_back(glm::vec2((float)w, (float)h));
+        start = end + 1;
     }
+    return true;
 }
 
-void scrollCallback(GLFWwindow* window, double xoffset, double yoffset) {
-    // Zoom in/out with mouse wheel
-    cameraDistance -= yoffset * 0.3f;
-    
-    // Clamp zoom distance
-    if (cameraDistance < 1.5f) cameraDistance = 1.5f;
-    if (cameraDistance > 10.0f) cameraDistance = 10.0f;
-    
-    updateCameraPosition();
+bool parseIntList(const char* text, int minimum, std::vector<int>& out) {
+    std::string list(text);
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) end = list.size();
+        std::string item = list.substr(start, end - start);
+        char* parsedEnd = NULL;
+        long value = std::strtol(item.c_str(), &parsedEnd, 10);
+        if (item.empty() || *parsedEnd != '\0' || value < minimum) {
+            return false;
+        }
+        out.push_back((int)value);
+        start = end + 1;
+    }
+    return true;
 }
 
-void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
-    if (action == GLFW_PRESS) {
-        if (key == GLFW_KEY_SPACE || key == GLFW_KEY_RIGHT) {
-            currentStage = (currentStage + 1) % (MAX_STAGES + 1);
-            std::cout << "\n━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━\n";
-            std::cout << "Stage " << currentStage << ": ";
-            switch(currentStage) {
-                case 0: 
-                    std::cout << "Basic 3D Model";
-                    std::cout << "\n→ Standard Phong lighting";
-                    break;
-                case 1: 
-                    std::cout << "Cel Shading (3-tone)";
-                    std::cout << "\n→ Warm cream base color";
-                    std::cout << "\n→ Clear light separation";
-                    break;
-                case 2: 
-                    std::cout << "Sumi-e Outlines (THICK)";
-                    std::cout << "\n→ VERY thick black lines";
-                    std::cout << "\n→ Traditional brush stroke feel";
-                    break;
-                case 3: 
-                    std::cout << "Tomoe Patterns (Controlled)";
-                    std::cout << "\n→ Selective red markings";
-                    std::cout << "\n→ Spiral + spot patterns";
-                    break;
-                case 4: 
-                    std::cout << "Full Ōkami Style";
-                    std::cout << "\n→ Paper texture";
-                    std::cout << "\n→ Balanced colors";
-                    std::cout << "\n→ Complete ukiyo-e aesthetic";
-                    break;
-                case 5: 
-                    std::cout << "Animated (Auto-rotate)";
-                    break;
+void printUsage(const char* program) {
+    std::cout << "Usage: " << program << " [--shader-cache DIR | --no-shader-cache] [--crowd N] [--bench [options]]\n\n";
+    std::cout << "  --crowd N           Start with an instanced crowd of N eggs (C toggles)\n";
+    std::cout << "  --crowd-spread S    Spread the crowd S times wider, member size kept (default 1)\n";
+    std::cout << "  --crowd-moving F    Fraction of crowd members that hop in stage 5 (default 0)\n";
+    std::cout << "  --cull on|off       BVH frustum culling and multi-draw indirect for crowds; on,off\n";
+    std::cout << "                      benchmarks both (K toggles)\n";
+    std::cout << "  --lights N[,N...]   Light the scene with N lanterns (L toggles); a list sweeps\n";
+    std::cout << "                      lantern counts in the benchmark\n";
+    std::cout << "  --light-culling M   clustered (default) or flat light lists; clustered,flat\n";
+    std::cout << "                      benchmarks both\n";
+    std::cout << "  --outline MODE      screen (ink pass, default) or rim (original look)\n";
+    std::cout << "  --paper MODE        texture (tileable paper grain, default) or hash (original)\n";
+    std::cout << "  --paper-seed N      Seed of the paper grain texture (default 1)\n";
+    std::cout << "  --tomoe MODE        atlas (baked, anti-aliased, default) or analytic (original)\n";
+    std::cout << "  --aa MODE[,MODE...] none, msaa2, msaa4 (default), msaa8, fxaa or analytic;\n";
+    std::cout << "                      a list sweeps them in the benchmark (A cycles)\n";
+    std::cout << "  --body SHAPE        egg (default), sphere, torus or gourd\n";
+    std::cout << "  --mesh FILE         Draw an OBJ or PLY mesh instead of the body (cached as binary)\n";
+    std::cout << "  --lod N             Pin the mesh LOD (0 = finest, default automatic)\n";
+    std::cout << "  --vertex-format F   float (default) or packed; a list such as float,packed\n";
+    std::cout << "                      sweeps both in the benchmark (V toggles)\n";
+    std::cout << "  --renderer R[,R...] gl (default), cpu (software rasterizer) or both\n";
+    std::cout << "  --compare           Diff one software frame per stage against GL (rim outlines)\n";
+    std::cout << "  --tolerance N       Per-channel difference allowed by --compare (default 16)\n";
+    std::cout << "  --threads N[,N...]  Job system threads incl. the main thread (default: all\n";
+    std::cout << "                      cores); a list sweeps core counts in the benchmark\n";
+    std::cout << "  --shader-cache DIR  Program binary cache (default ~/.cache/okami_demo)\n";
+    std::cout << "  --no-shader-cache   Always compile shaders and generate the paper texture\n";
+    std::cout << "  --render MODE       on-demand (redraw only on change, default) or continuous (M)\n";
+    std::cout << "  --swap-interval N   Buffer swap interval, 0 = no vsync (default 1)\n";
+    std::cout << "  --target-fps N      Frame rate cap for animation (default 0 = swap interval)\n";
+    std::cout << "  --tick-rate N       Input and animation updates per second (default 120)\n";
+    std::cout << "  --gpu-budget MS     GPU time per frame that dynamic resolution aims for\n";
+    std::cout << "                      (default 14, 0 = always full resolution)\n";
+    std::cout << "  --min-scale S       Lowest dynamic resolution scale (default 0.5)\n";
+    std::cout << "  --render-scale S    Fixed scene resolution scale; turns off dynamic resolution\n";
+    std::cout << "                      and also applies to the benchmark and turntable\n";
+    std::cout << "  --render-stats      Print frames drawn, CPU/GPU utilization and input latency\n";
+    std::cout << "                      every 10 s\n";
+    std::cout << "  --profile           Start with the profiler HUD (H); in the benchmark, print\n";
+    std::cout << "                      per-section CPU/GPU times for every run\n";
+    std::cout << "  --trace FILE        Profile and write a Chrome trace of the last frames on exit\n";
+    std::cout << "  --brush             Start in Celestial Brush mode (B toggles)\n";
+    std::cout << "  --ink-bleed on|off  Simulate brush ink soaking into the paper (default on, I)\n\n";
+    std::cout << "Benchmark options:\n";
+    std::cout << "  --frames N          Measured frames per stage (default 200)\n";
+    std::cout << "  --warmup N          Unmeasured frames per stage (default 20)\n";
+    std::cout << "  --res WxH[,WxH...]  Resolutions to sweep (default 1280x720)\n";
+    std::cout << "  --samples N         Same as --aa msaaN (0 = none)\n";
+    std::cout << "  --stages N[,N...]   Stages to run (default 0-5)\n";
+    std::cout << "  --instances N[,N...] Sweep instanced crowd sizes, e.g. 1,100,10000,100000\n";
+    std::cout << "  --brush-strokes N[,N...] Instead of the stages, paint a stroke over the first\n";
+    std::cout << "                      stage with N strokes already on screen\n";
+    std::cout << "  --wet-strokes N[,N...] With --brush-strokes, lay down N more strokes that are\n";
+    std::cout << "                      still bleeding while the frames are measured (default 0)\n";
+    std::cout << "  --format csv|json   Output format (default csv)\n\n";
+    std::cout << "Turntable render (uses the first --res, --aa, --threads and --renderer):\n";
+    std::cout << "  --turntable N       Render N frames of one revolution of the last --stages entry\n";
+    std::cout << "  --out PATH          .png or .raw frame pattern (default turntable/okami_%04d.png),\n";
+    std::cout << "                      a .y4m file, or - for Y4M on stdout\n";
+    std::cout << "  --fps N             Frame rate for the Y4M header and animation (default 30)\n";
+}
+
+bool parseArguments(int argc, char** argv, BenchOptions& bench) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--bench") {
+            bench.enabled = true;
+        } else if (arg == "--frames" && hasValue) {
+            bench.frames = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--warmup" && hasValue) {
+            bench.warmup = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--aa" && hasValue) {
+            std::string list = std::string(argv[++i]) + ",";
+            for (size_t start = 0, end; (end = list.find(',', start)) != std::string::npos; start = end + 1) {
+                std::string name = list.substr(start, end - start);
+                int mode = 0;
+                while (mode < NUM_ANTI_ALIASING && name != ANTI_ALIASING_MODES[mode].name) ++mode;
+                if (mode == NUM_ANTI_ALIASING) return false;
+                bench.antiAliasing.push_back((AntiAliasing)mode);
             }
-            std::cout << "\n━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━\n";
-        } else if (key == GLFW_KEY_LEFT) {
-            currentStage = (currentStage - 1 + MAX_STAGES + 1) % (MAX_STAGES + 1);
-        } else if (key == GLFW_KEY_ESCAPE || key == GLFW_KEY_Q) {
-            glfwSetWindowShouldClose(window, true);
-        } else if (key == GLFW_KEY_R) {
-            rotationAngle = 0.0f;
-            cameraAngleX = 0.0f;
-            cameraAngleY = 0.0f;
-            cameraDistance = 3.0f;
-            updateCameraPosition();
-            std::cout << "Rotation and camera reset\n";
+            antiAliasing = bench.antiAliasing[0];
+        } else if (arg == "--samples" && hasValue) {
+            int samples = std::atoi(argv[++i]);
+            if (samples == 0) antiAliasing = AA_NONE;
+            else if (samples == 2) antiAliasing = AA_MSAA2;
+            else if (samples == 4) antiAliasing = AA_MSAA4;
+            else if (samples == 8) antiAliasing = AA_MSAA8;
+            else return false;
+            bench.antiAliasing.assign(1, antiAliasing);
+        } else if (arg == "--format" && hasValue) {
+            bench.format = argv[++i];
+            if (bench.format != "csv" && bench.format != "json") return false;
+        } else if (arg == "--res" && hasValue) {
+            if (!parseResolutions(argv[++i], bench.resolutions)) return false;
+        } else if (arg == "--stages" && hasValue) {
+            if (!parseIntList(argv[++i], 0, bench.stages)) return false;
+            for (size_t s = 0; s < bench.stages.size(); ++s) {
+                if (bench.stages[s] > MAX_STAGES) return false;
+            }
+        } else if (arg == "--instances" && hasValue) {
+            if (!parseIntList(argv[++i], 1, bench.instanceCounts)) return false;
+        } else if (arg == "--brush-strokes" && hasValue) {
+            if (!parseIntList(argv[++i], 0, bench.brushStrokes)) return false;
+        } else if (arg == "--wet-strokes" && hasValue) {
+            if (!parseIntList(argv[++i], 0, bench.wetStrokes)) return false;
+        } else if (arg == "--brush") {
+            brushMode = true;
+        } else if (arg == "--ink-bleed" && hasValue) {
+            std::string mode = argv[++i];
+            if (mode == "on") inkBleedEnabled = true;
+            else if (mode == "off") inkBleedEnabled = false;
+            else return false;
+        } else if (arg == "--outline" && hasValue) {
+            std::string mode = argv[++i];
+            if (mode == "screen") outlineMode = OUTLINE_SCREEN;
+            else if (mode == "rim") outlineMode = OUTLINE_RIM;
+            else return false;
+        } else if (arg == "--paper" && hasValue) {
+            std::string mode = argv[++i];
+            if (mode == "texture") paperMode = PAPER_TEXTURE;
+            else if (mode == "hash") paperMode = PAPER_HASH;
+            else return false;
+        } else if (arg == "--tomoe" && hasValue) {
+            std::string mode = argv[++i];
+            if (mode == "atlas") tomoeMode = TOMOE_ATLAS;
+            else if (mode == "analytic") tomoeMode = TOMOE_ANALYTIC;
+            else return false;
+        } else if (arg == "--paper-seed" && hasValue) {
+            paperSeed = (unsigned int)std::strtoul(argv[++i], NULL, 10);
+        } else if (arg == "--body" && hasValue) {
+            std::string shape = argv[++i];
+            if (shape == "egg") bodyShape = BODY_EGG;
+            else if (shape == "sphere") bodyShape = BODY_SPHERE;
+            else if (shape == "torus") bodyShape = BODY_TORUS;
+            else if (shape == "gourd") bodyShape = BODY_GOURD;
+            else return false;
+        } else if (arg == "--mesh" && hasValue) {
+            importMeshPath = argv[++i];
+        } else if (arg == "--lod" && hasValue) {
+            forcedLOD = std::max(0, std::min(std::atoi(argv[++i]), NUM_LODS - 1));
+        } else if (arg == "--vertex-format" && hasValue) {
+            std::string list = std::string(argv[++i]) + ",";
+            for (size_t start = 0, end; (end = list.find(',', start)) != std::string::npos; start = end + 1) {
+                std::string name = list.substr(start, end - start);
+                if (name == "float") bench.vertexFormats.push_back(VERTEX_FLOAT);
+                else if (name == "packed") bench.vertexFormats.push_back(VERTEX_PACKED);
+                else return false;
+            }
+            vertexFormat = bench.vertexFormats[0];
+        } else if (arg == "--renderer" && hasValue) {
+            std::string list = std::string(argv[++i]) + ",";
+            for (size_t start = 0, end; (end = list.find(',', start)) != std::string::npos; start = end + 1) {
+                std::string name = list.substr(start, end - start);
+                if (name == "gl") bench.backends.push_back(BACKEND_GL);
+                else if (name == "cpu") bench.backends.push_back(BACKEND_CPU);
+                else return false;
+            }
+        } else if (arg == "--turntable" && hasValue) {
+            bench.turntableFrames = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--out" && hasValue) {
+            bench.outputPath = argv[++i];
+        } else if (arg == "--fps" && hasValue) {
+            bench.fps = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--compare") {
+            bench.compare = true;
+        } else if (arg == "--tolerance" && hasValue) {
+            bench.tolerance = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--threads" && hasValue) {
+            if (!parseIntList(argv[++i], 1, bench.threadCounts)) return false;
+            jobThreads = bench.threadCounts[0];
+        } else if (arg == "--crowd" && hasValue) {
+            crowdOption = std::max(1, std::atoi(argv[++i]));
+            crowdSize = crowdOption;
+        } else if (arg == "--crowd-spread" && hasValue) {
+            crowdSpread = std::max(0.1f, (float)std::atof(argv[++i]));
+        } else if (arg == "--crowd-moving" && hasValue) {
+            crowdMoving = glm::clamp((float)std::atof(argv[++i]), 0.0f, 1.0f);
+        } else if (arg == "--cull" && hasValue) {
+            std::string list = std::string(argv[++i]) + ",";
+            for (size_t start = 0, end; (end = list.find(',', start)) != std::string::npos; start = end + 1) {
+                std::string mode = list.substr(start, end - start);
+                if (mode != "on" && mode != "off") return false;
+                bench.culling.push_back(mode == "on");
+            }
+            crowdCulling = bench.culling[0];
+        } else if (arg == "--lights" && hasValue) {
+            if (!parseIntList(argv[++i], 0, bench.lights)) return false;
+            lanternCount = std::min(bench.lights[0], MAX_LANTERNS);
+            lanternOption = std::max(lanternCount, 1);
+        } else if (arg == "--light-culling" && hasValue) {
+            std::string list = std::string(argv[++i]) + ",";
+            for (size_t start = 0, end; (end = list.find(',', start)) != std::string::npos; start = end + 1) {
+                std::string mode = list.substr(start, end - start);
+                if (mode != "clustered" && mode != "flat") return false;
+                bench.lightClusters.push_back(mode == "clustered");
+            }
+            lightClusters = bench.lightClusters[0];
+        } else if (arg == "--shader-cache" && hasValue) {
+            shaderCacheDir = argv[++i];
+        } else if (arg == "--no-shader-cache") {
+            useShaderCache = false;
+        } else if (arg == "--render" && hasValue) {
+            std::string mode = argv[++i];
+            if (mode == "on-demand") renderMode = RENDER_ON_DEMAND;
+            else if (mode == "continuous") renderMode = RENDER_CONTINUOUS;
+            else return false;
+        } else if (arg == "--swap-interval" && hasValue) {
+            swapInterval = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--target-fps" && hasValue) {
+            targetFps = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--gpu-budget" && hasValue) {
+            gpuBudgetMs = std::max(0.0f, (float)std::atof(argv[++i]));
+        } else if (arg == "--min-scale" && hasValue) {
+            minRenderScale = glm::clamp((float)std::atof(argv[++i]), 0.1f, 1.0f);
+        } else if (arg == "--render-scale" && hasValue) {
+            fixedRenderScale = glm::clamp((float)std::atof(argv[++i]), 0.1f, 1.0f);
+            dynamicResolution = false;
+        } else if (arg == "--tick-rate" && hasValue) {
+            tickRate = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--render-stats") {
+            printRenderStats = true;
+        } else if (arg == "--profile") {
+            profilerEnabled.store(true);
+            profilerHudVisible = true;
+        } else if (arg == "--trace" && hasValue) {
+            traceOutputPath = argv[++i];
+            profilerEnabled.store(true);
+        } else {
+            return false;
         }
     }
+    if (bench.resolutions.empty()) {
+        bench.resolutions.push_back(glm::vec2((float)WIDTH, (float)HEIGHT));
+    }
+    if (bench.stages.empty()) {
+        for (int stage = 0; stage <= MAX_STAGES; ++stage) bench.stages.push_back(stage);
+    }
+    if (bench.instanceCounts.empty()) {
+        bench.instanceCounts.push_back(0);
+    }
+    if (bench.vertexFormats.empty()) {
+        bench.vertexFormats.push_back(vertexFormat);
+    }
+    if (bench.threadCounts.empty()) {
+        bench.threadCounts.push_back(jobThreads);
+    }
+    if (bench.backends.empty()) {
+        bench.backends.push_back(BACKEND_GL);
+    }
+    if (bench.antiAliasing.empty()) {
+        bench.antiAliasing.push_back(antiAliasing);
+    }
+    if (bench.culling.empty()) {
+        bench.culling.push_back(crowdCulling);
+    }
+    if (bench.lights.empty()) {
+        bench.lights.push_back(lanternCount);
+    }
+    if (bench.lightClusters.empty()) {
+        bench.lightClusters.push_back(lightClusters);
+    }
+    return true;
 }
 
-int main() {
+int main(int argc, char** argv) {
+    BenchOptions bench;
+    if (!parseArguments(argc, argv, bench)) {
+        printUsage(argv[0]);
+        return -1;
+    }
+    if (bench.turntableFrames > 0) {
+        return runTurntable(bench);
+    }
+    if (bench.enabled) {
+        return runBenchmark(bench);
+    }
+    
     if (!glfwInit()) {
         std::cerr << "Failed to initialize GLFW" << std::endl;
         return -1;
@@ -458,7 +9675,8 @@ int main() {
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-    glfwWindowHint(GLFW_SAMPLES, 4);
+    // Other modes draw through an offscreen target instead of the window's samples
+    glfwWindowHint(GLFW_SAMPLES, ANTI_ALIASING_MODES[antiAliasing].samples);
     
     GLFWwindow* window = glfwCreateWindow(WIDTH, HEIGHT, 
         "Ōkami_Style_Demo", NULL, NULL);
@@ -469,10 +9687,15 @@ int main() {
     }
     
     glfwMakeContextCurrent(window);
+    glfwSwapInterval(swapInterval);
     glfwSetKeyCallback(window, keyCallback);
     glfwSetMouseButtonCallback(window, mouseButtonCallback);
     glfwSetCursorPosCallback(window, cursorPosCallback);
     glfwSetScrollCallback(window, scrollCallback);
+    glfwSetWindowRefreshCallback(window, [](GLFWwindow*) { markViewDirty(); });
+    glfwSetFramebufferSizeCallback(window, framebufferSizeCallback);
+    // On HiDPI displays the framebuffer has more pixels than the window
+    glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
     
     glewExperimental = GL_TRUE;
     if (glewInit() != GLEW_OK) {
@@ -480,35 +9703,26 @@ int main() {
         return -1;
     }
     
-    glViewport(0, 0, WIDTH, HEIGHT);
+    glViewport(0, 0, framebufferWidth, framebufferHeight);
     glEnable(GL_DEPTH_TEST);
     glEnable(GL_MULTISAMPLE);
     
-    createEgg();
-    
-    GLuint VAO, VBO, EBO;
-    glGenVertexArrays(1, &VAO);
-    glGenBuffers(1, &VBO);
-    glGenBuffers(1, &EBO);
-    
-    glBindVertexArray(VAO);
-    
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, eggVertices.size() * sizeof(Vertex), 
-                 &eggVertices[0], GL_STATIC_DRAW);
-    
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, eggIndices.size() * sizeof(unsigned int), 
-                 &eggIndices[0], GL_STATIC_DRAW);
+    wakeEventLoopOnUpload = true;
+    startJobSystem(jobThreads);
+    startBodyMeshBuild(bodyShape);
+    startTomoeBake(bodyShape);
+    setupFrameUniforms();
     
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
-    glEnableVertexAttribArray(0);
-    
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), 
-                         (void*)offsetof(Vertex, normal));
-    glEnableVertexAttribArray(1);
-    
-    glBindVertexArray(0);
+    std::chrono::steady_clock::time_point shaderStart = std::chrono::steady_clock::now();
+    int fromCache = startStagePrograms();
+    reportShaderStartup(fromCache, millisecondsSince(shaderStart));
+    setupInkOutline();
+    setupPaperGrain();
+    setupProfilerHud();
+    setupBrushLayer();
+    setupInkBleed();
+    setupCelRamps();
+    setupClusteredLights();
     
     std::cout << "\n╔══════════════════════════════════════════════════════════════╗\n";
     std::cout << "║   Ōkami - Balanced Amaterasu Style Demo                    ║\n";
@@ -517,66 +9731,137 @@ int main() {
     std::cout << "  SPACE / →     : Next stage\n";
     std::cout << "  ←             : Previous stage\n";
     std::cout << "  R             : Reset rotation and camera\n";
+    std::cout << "  C             : Toggle instanced crowd\n";
+    std::cout << "  K             : Toggle crowd frustum culling\n";
+    std::cout << "  O             : Toggle screen-space / rim outlines\n";
+    std::cout << "  P             : Toggle paper texture / hash grain\n";
+    std::cout << "  T             : Toggle baked / analytic tomoe\n";
+    std::cout << "  V             : Toggle float / packed vertex format\n";
+    std::cout << "  H             : Toggle profiler HUD\n";
+    std::cout << "  J             : Write a Chrome trace of recent frames\n";
+    std::cout << "  M             : Toggle on-demand / continuous rendering\n";
+    std::cout << "  D             : Toggle dynamic resolution\n";
+    std::cout << "  B             : Toggle the Celestial Brush (drag paints)\n";
+    std::cout << "  X             : Clear brush strokes\n";
+    std::cout << "  I             : Toggle ink bleed\n";
+    std::cout << "  L             : Toggle lanterns\n";
     std::cout << "  ESC / Q       : Quit\n";
-    std::cout << "  Mouse Drag    : Rotate camera view\n";
+    std::cout << "  Mouse Drag    : Rotate camera view, or paint in brush mode\n";
     std::cout << "  Mouse Wheel   : Zoom in/out\n\n";
     std::cout << "━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━\n";
     std::cout << "Stage 0: Basic 3D Model\n";
     std::cout << "━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━\n\n";
     
+    startUpdateThread();
+    resetRenderStats();
     while (!glfwWindowShouldClose(window)) {
-        glfwPollEvents();
+        {
+            ProfileScope scope("wait");
+            waitForEvents();
+        }
+        if (printRenderStats && glfwGetTime() - renderStats.wallStart >= RENDER_STATS_SECONDS) {
+            reportRenderStats();
+            reportDynamicResolution(framebufferWidth, framebufferHeight);
+        }
         
-        glClearColor(0.94f, 0.91f, 0.83f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        {
+            ProfileScope scope("update");
+            pollStagePrograms();
+            
+            // Without workers, background jobs only advance here
+            if (jobThreadCount() == 1) runOneJob();
+            if (applyGLUploads() > 0) markViewDirty();
+            // The frame that draws a new snapshot takes it
+            if (!snapshotTaken()) markViewDirty();
+            
+            if (bodyMesh.vao != 0 && bodyMesh.format != vertexFormat) {
+                deleteMeshBuffers(bodyMesh);
+                setupMeshBuffers(bodyMesh, vertexFormat);
+                std::cout << "Vertex format: " << vertexFormatName(vertexFormat) << " (" 
+                          << vertexStride(vertexFormat) << " bytes/vertex)\n";
+            }
+        }
+        if (!frameDue()) continue;
+        
+        beginProfileFrame();
+        advanceFrameClock();
+        acquireSnapshot();
+        const SceneSnapshot& snapshot = latestSnapshot();
+        viewSettling = !applySnapshot(snapshot, glfwGetTime());
         
         static int lastStage = -1;
-        static GLuint shaderProgram = 0;
         if (currentStage != lastStage) {
-            if (shaderProgram != 0) {
-                glDeleteProgram(shaderProgram);
+            if (lastStage != -1) printStageBanner(currentStage);
+            std::chrono::steady_clock::time_point switchStart = std::chrono::steady_clock::now();
+            acquireStageProgram(currentStage, crowdSize > 0 ? PROGRAM_INSTANCED : PROGRAM_SINGLE);
+            if (lastStage != -1) {
+                std::cout << "Stage switch: " << millisecondsSince(switchStart) << " ms\n";
             }
-            shaderProgram = createShaderProgram(currentStage < MAX_STAGES ? currentStage : 4);
             lastStage = currentStage;
         }
+        // Latency is measured once per snapshot, from its first frame
+        static unsigned long long latencyTick = 0;
+        long long inputNs = snapshot.tick != latencyTick ? snapshot.inputNs : 0;
+        latencyTick = snapshot.tick;
         
-        glUseProgram(shaderProgram);
+        // Brush samples skip the update thread; the newest is drawn this frame
+        long long brushNs = processBrushSamples(framebufferHeight / (float)HEIGHT);
+        advanceInkBleed(framebufferWidth, framebufferHeight, glfwGetTime());
         
-        if (currentStage == MAX_STAGES) {
-            rotationAngle += 0.008f;
+        adaptRenderScale(beginFrameGpuTimer(), framebufferWidth, framebufferHeight);
+        {
+            ProfileScope scope("draw");
+            renderFrame(currentStage, framebufferWidth, framebufferHeight, (float)glfwGetTime(), 0, 
+                        dynamicRes.scale);
         }
+        drawInkBleed(0, framebufferWidth, framebufferHeight);
+        drawBrushStrokes(0, framebufferWidth, framebufferHeight);
+        drawProfilerHud(framebufferWidth, framebufferHeight);
+        endFrameGpuTimer();
         
-        glm::mat4 model = glm::mat4(1.0f);
-        model = glm::rotate(model, rotationAngle, glm::vec3(0.0f, 1.0f, 0.0f));
-        
-        glm::mat4 view = glm::lookAt(cameraPos, cameraTarget, glm::vec3(0.0f, 1.0f, 0.0f));
-        glm::mat4 projection = glm::perspective(glm::radians(45.0f), 
-                                               (float)WIDTH / HEIGHT, 0.1f, 100.0f);
-        
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 
-                          1, GL_FALSE, glm::value_ptr(model));
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "view"), 
-                          1, GL_FALSE, glm::value_ptr(view));
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "projection"), 
-                          1, GL_FALSE, glm::value_ptr(projection));
-        
-        glUniform3fv(glGetUniformLocation(shaderProgram, "lightPos"), 
-                    1, glm::value_ptr(glm::vec3(3.0f, 3.0f, 3.0f)));
-        glUniform3fv(glGetUniformLocation(shaderProgram, "viewPos"), 
-                    1, glm::value_ptr(cameraPos));
-        glUniform1f(glGetUniformLocation(shaderProgram, "time"), 
-                   (float)glfwGetTime());
-        
-        glBindVertexArray(VAO);
-        glDrawElements(GL_TRIANGLES, eggIndices.size(), GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
-        
-        glfwSwapBuffers(window);
+        {
+            ProfileScope scope("swap");
+            glfwSwapBuffers(window);
+        }
+        if (inputNs != 0) recordInputLatency(inputNs);
+        if (brushNs != 0) recordBrushLatency(brushNs, brushLayer.frameUploadBytes);
+        endProfileFrame();
+    }
+    stopUpdateThread();
+    reportRenderStats();
+    reportDynamicResolution(framebufferWidth, framebufferHeight);
+    
+    if (!traceOutputPath.empty()) {
+        flushGpuQuerySets();
+        reportChromeTrace(traceOutputPath);
+    }
+    
+    if (instanceRing.stalls > 0) {
+        std::cout << "Instance ring waited on the GPU " << instanceRing.stalls << " times\n";
     }
     
-    glDeleteVertexArrays(1, &VAO);
-    glDeleteBuffers(1, &VBO);
-    glDeleteBuffers(1, &EBO);
+    deleteStagePrograms();
+    deleteInkOutline();
+    deleteDynamicResolution();
+    deletePostAntiAliasing();
+    deletePaperGrain();
+    deleteProfilerHud();
+    deleteBrushLayer();
+    deleteInkBleed();
+    deleteCelRamps();
+    deleteClusteredLights();
+    deleteProfilerQueries();
+    deleteRenderStats();
+    deleteInstanceRing();
+    deleteCrowdIndirect();
+    deleteFrameUniforms();
+    waitForJobs(bodyMeshJob);
+    waitForJobs(tomoeBakeJob);
+    stopJobSystem();
+    applyGLUploads();
+    deleteMeshBuffers(bodyMesh);
+    unmapFile(bodyMesh.mapping);
+    deleteTomoeAtlas();
     
     glfwTerminate();
     